@@ -1,5 +1,9 @@
+#include <new>
+#include <vector>
+
 #include <benchmark/benchmark.h>
 
+#include "heap.h"
 #include "vm.h"
 
 static void DoSetup(const benchmark::State&) {}
@@ -362,6 +366,78 @@ static void BM_compile_and_run_empty_file(benchmark::State& state)
   }
 }
 
+// Allocates a million objects of state.range(0) bytes, keeps every fourth
+// one and frees the others, from the pages of the heap of the collector.
+// They hold nothing to destroy.
+static void BM_heap_allocate_and_sweep(benchmark::State& state)
+{
+  constexpr size_t COUNT = 1000000;
+  const size_t size = static_cast<size_t>(state.range(0));
+  std::vector<void*> slots(COUNT);
+
+  for (auto _ : state) {
+    Heap heap([](void*, void*) {}, nullptr);
+    for (size_t i = 0; i < COUNT; i++) {
+      slots[i] = heap.allocate(size);
+    }
+    for (size_t i = 0; i < COUNT; i += 4) {
+      Page::of(slots[i])->setMarked(slots[i], true);
+    }
+    heap.startSweeping();
+    heap.finishSweeping();
+  }
+}
+
+// the same with new and delete
+static void BM_new_delete(benchmark::State& state)
+{
+  constexpr size_t COUNT = 1000000;
+  const size_t size = static_cast<size_t>(state.range(0));
+  std::vector<void*> slots(COUNT);
+
+  for (auto _ : state) {
+    for (size_t i = 0; i < COUNT; i++) {
+      slots[i] = ::operator new(size);
+    }
+    for (size_t i = 0; i < COUNT; i++) {
+      if (i % 4 != 0) {
+        ::operator delete(slots[i]);
+      }
+    }
+    for (size_t i = 0; i < COUNT; i += 4) {
+      ::operator delete(slots[i]);
+    }
+  }
+}
+
+// Moves the objects that were left on every tenth slot of a million, of
+// state.range(0) bytes, onto as few pages as they fit.
+static void BM_heap_evacuate(benchmark::State& state)
+{
+  constexpr size_t COUNT = 1000000;
+  const size_t size = static_cast<size_t>(state.range(0));
+
+  for (auto _ : state) {
+    state.PauseTiming();
+    Heap heap([](void*, void*) {}, nullptr);
+    for (size_t i = 0; i < COUNT; i++) {
+      void* slot = heap.allocate(size);
+      if (i % 10 == 0) {
+        Page::of(slot)->setMarked(slot, true);
+      }
+    }
+    heap.startSweeping();
+    heap.finishSweeping();
+    state.ResumeTiming();
+
+    heap.evacuate([](const void*) { return true; },
+                  [](void* from, void* to, void*) {
+                    *static_cast<void**>(to) = *static_cast<void**>(from);
+                  });
+    heap.finishEvacuation();
+  }
+}
+
 BENCHMARK(BM_fibonacci);
 BENCHMARK(BM_instantiation);
 BENCHMARK(BM_instantiation_single);
@@ -370,6 +446,9 @@ BENCHMARK(BM_invocation);
 BENCHMARK(BM_method_call);
 BENCHMARK(BM_equality);
 BENCHMARK(BM_compile_and_run_empty_file);
+BENCHMARK(BM_heap_allocate_and_sweep)->Arg(32)->Arg(88);
+BENCHMARK(BM_new_delete)->Arg(32)->Arg(88);
+BENCHMARK(BM_heap_evacuate)->Arg(32)->Arg(88);
 
 // Run the benchmark
 BENCHMARK_MAIN();
\ No newline at end of file
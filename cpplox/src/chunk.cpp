@@ -3,6 +3,7 @@
 
 #include "chunk.h"
 
+#include "objfunction.h"
 #include "value.h"
 
 size_t Chunk::count() const
@@ -13,7 +14,7 @@ size_t Chunk::count() const
 void Chunk::write(uint8_t byte, size_t line)
 {
   _code.push_back(byte);
-  _lines.push_back(line);
+  _lines.add(line);
 }
 
 size_t Chunk::addConstant(Value value)
@@ -24,7 +25,7 @@ size_t Chunk::addConstant(Value value)
 
 size_t Chunk::linesAt(size_t idx) const
 {
-  return _lines.at(idx);
+  return _lines.lineAt(idx);
 }
 
 Value Chunk::constantsAt(size_t idx) const
@@ -32,6 +33,29 @@ Value Chunk::constantsAt(size_t idx) const
   return _constants.at(idx);
 }
 
+size_t Chunk::constantCount() const
+{
+  return _constants.size();
+}
+
+const Value* Chunk::constantsBegin() const
+{
+  return _constants.data();
+}
+
+size_t Chunk::ownedBytes() const
+{
+  return _code.capacity() + _constants.capacity() * sizeof(Value)
+      + _caches.capacity() * sizeof(InlineCache) + _lines.ownedBytes();
+}
+
+void Chunk::updateReferences()
+{
+  for (Value& constant : _constants) {
+    constant = forwarded(constant);
+  }
+}
+
 std::vector<Value> Chunk::constants() const
 {
   return _constants;
@@ -43,12 +67,199 @@ void Chunk::writeAt(size_t idx, uint8_t byte)
   _code[idx] = byte;
 }
 
+void Chunk::truncate(size_t count)
+{
+  assert(count <= this->count());
+  _code.resize(count);
+  _lines.truncate(count);
+}
+
+size_t Chunk::addCache()
+{
+  _caches.emplace_back();
+  return _caches.size() - 1;
+}
+
+size_t Chunk::cacheCount() const
+{
+  return _caches.size();
+}
+
+InlineCache* Chunk::cachesBegin()
+{
+  return _caches.data();
+}
+
 uint8_t Chunk::codeAt(size_t idx) const
 {
   return _code.at(idx);
 }
 
+uint16_t Chunk::shortAt(size_t idx) const
+{
+  return static_cast<uint16_t>((codeAt(idx) << 8) | codeAt(idx + 1));
+}
+
 const uint8_t* Chunk::codeBegin() const
 {
   return _code.data();
 }
+
+size_t instructionLength(const Chunk& chunk, size_t offset)
+{
+  switch (static_cast<OpCode>(chunk.codeAt(offset))) {
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_NEGATE:
+    case OP_NOT:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_RETURN:
+    case OP_PRINT:
+    case OP_POP:
+    case OP_CLOSE_UPVALUE:
+    case OP_INHERIT:
+    case OP_ADD_NUMBER:
+    case OP_ADD_STRING:
+    case OP_ADD_GENERIC:
+      return 1;
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_CALL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_POP_N:
+    case OP_TAIL_CALL:
+      return 2;
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP:
+    case OP_LOOP:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_GET_SUPER:
+    case OP_CONSTANT_LONG:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_ADD_LOCAL_LOCAL:
+    case OP_ADD_LOCAL_CONSTANT:
+    case OP_SUBTRACT_LOCAL_CONSTANT:
+    case OP_INCREMENT_LOCAL:
+      return 3;
+    case OP_SUPER_INVOKE:
+      return 4;
+    case OP_SET_PROPERTY:
+    case OP_GET_PROPERTY:
+    case OP_GET_FIELD:
+      return 5;
+    case OP_INVOKE:
+      return 6;
+    case OP_CLOSURE: {
+      auto* function =
+          AS_FUNCTION(chunk.constantsAt(chunk.shortAt(offset + 1)));
+      return 3 + 2 * static_cast<size_t>(function->upvalueCount());
+    }
+    case OP_COUNT:
+      break;
+  }
+
+  assert(false);
+  return 1;
+}
+
+int stackEffect(const Chunk& chunk, size_t offset)
+{
+  switch (static_cast<OpCode>(chunk.codeAt(offset))) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_GLOBAL:
+    case OP_GET_LOCAL:
+    case OP_CLOSURE:
+    case OP_GET_UPVALUE:
+    case OP_CLASS:
+    case OP_ADD_LOCAL_LOCAL:
+    case OP_ADD_LOCAL_CONSTANT:
+    case OP_SUBTRACT_LOCAL_CONSTANT:
+      return 1;
+    case OP_NEGATE:
+    case OP_NOT:
+    case OP_SET_GLOBAL:
+    case OP_SET_LOCAL:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP:
+    case OP_LOOP:
+    case OP_SET_UPVALUE:
+    case OP_GET_PROPERTY:
+    case OP_INCREMENT_LOCAL:
+    case OP_GET_FIELD:
+      return 0;
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_RETURN:
+    case OP_PRINT:
+    case OP_POP:
+    case OP_DEFINE_GLOBAL:
+    case OP_CLOSE_UPVALUE:
+    case OP_SET_PROPERTY:
+    case OP_METHOD:
+    case OP_INHERIT:
+    case OP_GET_SUPER:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_ADD_NUMBER:
+    case OP_ADD_STRING:
+    case OP_ADD_GENERIC:
+      return -1;
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_EQUAL:
+      return -2;
+    // the arguments are popped, the result takes the place of the callee
+    case OP_CALL:
+    case OP_TAIL_CALL:
+      return -chunk.codeAt(offset + 1);
+    case OP_INVOKE:
+      return -chunk.codeAt(offset + 3);
+    case OP_SUPER_INVOKE:
+      return -chunk.codeAt(offset + 3) - 1;
+    case OP_POP_N:
+      return -chunk.codeAt(offset + 1);
+    case OP_COUNT:
+      break;
+  }
+
+  assert(false);
+  return 0;
+}
+
+OpCode baseOpcode(uint8_t op)
+{
+  switch (op) {
+    case OP_ADD_NUMBER:
+    case OP_ADD_STRING:
+    case OP_ADD_GENERIC:
+      return OP_ADD;
+    case OP_GET_FIELD:
+      return OP_GET_PROPERTY;
+    default:
+      return static_cast<OpCode>(op);
+  }
+}
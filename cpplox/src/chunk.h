@@ -4,6 +4,8 @@
 #include <vector>
 
 #include "common.h"
+#include "inlinecache.h"
+#include "linetable.h"
 #include "value.h"
 
 enum OpCode : uint8_t
@@ -37,27 +39,52 @@ enum OpCode : uint8_t
   OP_PRINT,
 
   OP_POP,
-  OP_DEFINE_GLOBAL,
-  OP_GET_GLOBAL,
-  OP_SET_GLOBAL,
+  OP_DEFINE_GLOBAL,  // 16 bit global slot
+  OP_GET_GLOBAL,  // 16 bit global slot
+  OP_SET_GLOBAL,  // 16 bit global slot
   OP_GET_LOCAL,
   OP_SET_LOCAL,
   OP_JUMP_IF_FALSE,
   OP_JUMP,
   OP_LOOP,
   OP_CALL,
-  OP_CLOSURE,
+  OP_CLOSURE,  // 16 bit constant, an (isLocal, index) pair per upvalue
   OP_GET_UPVALUE,
   OP_SET_UPVALUE,
   OP_CLOSE_UPVALUE,
-  OP_CLASS,
-  OP_SET_PROPERTY,
-  OP_GET_PROPERTY,
-  OP_METHOD,
-  OP_INVOKE,
+  OP_CLASS,  // 16 bit name
+  OP_SET_PROPERTY,  // 16 bit name, 16 bit inline cache
+  OP_GET_PROPERTY,  // 16 bit name, 16 bit inline cache
+  OP_METHOD,  // 16 bit name
+  OP_INVOKE,  // 16 bit name, argument count, 16 bit inline cache
   OP_INHERIT,
-  OP_GET_SUPER,
-  OP_SUPER_INVOKE,
+  OP_GET_SUPER,  // 16 bit name
+  OP_SUPER_INVOKE,  // 16 bit name, argument count
+  OP_TAIL_CALL,  // OP_CALL of a `return f(...)`, the OP_RETURN follows it
+  OP_CONSTANT_LONG,  // OP_CONSTANT with a 16 bit constant
+
+  // Superinstructions, fused by the compiler from common instruction
+  // sequences
+  OP_POP_N,  // OP_POP, ... OP_POP
+  OP_POP_JUMP_IF_FALSE,  // OP_JUMP_IF_FALSE, OP_POP on both paths
+  OP_JUMP_IF_NOT_LESS,  // OP_LESS, OP_POP_JUMP_IF_FALSE
+  OP_JUMP_IF_NOT_GREATER,  // OP_GREATER, OP_POP_JUMP_IF_FALSE
+  OP_JUMP_IF_NOT_EQUAL,  // OP_EQUAL, OP_POP_JUMP_IF_FALSE
+  OP_ADD_LOCAL_LOCAL,  // OP_GET_LOCAL, OP_GET_LOCAL, OP_ADD
+  OP_ADD_LOCAL_CONSTANT,  // OP_GET_LOCAL, OP_CONSTANT, OP_ADD
+  OP_SUBTRACT_LOCAL_CONSTANT,  // OP_GET_LOCAL, OP_CONSTANT, OP_SUBTRACT
+  OP_INCREMENT_LOCAL,  // OP_ADD_LOCAL_CONSTANT, OP_SET_LOCAL, OP_POP
+
+  // Quickened instructions, rewritten in place by the interpreter once an
+  // instruction saw one kind of operands. They check that the operands are
+  // still of that kind and rewrite themselves back otherwise, an OP_ADD to
+  // OP_ADD_GENERIC, which is never quickened again.
+  OP_ADD_NUMBER,  // OP_ADD of two numbers
+  OP_ADD_STRING,  // OP_ADD of two strings
+  OP_GET_FIELD,  // OP_GET_PROPERTY of a field, with a monomorphic cache
+  OP_ADD_GENERIC,  // OP_ADD that saw more than one kind of operands
+
+  OP_COUNT,  // number of opcodes, not an instruction
 };
 
 class Chunk
@@ -67,19 +94,46 @@ public:
   size_t count() const;
   void write(uint8_t byte, size_t line);
   void writeAt(size_t idx, uint8_t byte);
+  void truncate(size_t count);
   uint8_t codeAt(size_t idx) const;
+  // the 16-bit operand at idx, high byte first
+  uint16_t shortAt(size_t idx) const;
   const uint8_t* codeBegin() const;
 
   // constants
   size_t addConstant(Value value);
   std::vector<Value> constants() const;
   Value constantsAt(size_t idx) const;
+  size_t constantCount() const;
+  const Value* constantsBegin() const;
+  // points the constants at the objects that moved
+  void updateReferences();
+
+  // bytes of the code, constants, caches and lines
+  size_t ownedBytes() const;
 
   // lines
   size_t linesAt(size_t idx) const;
 
+  // inline caches
+  size_t addCache();
+  size_t cacheCount() const;
+  InlineCache* cachesBegin();
+
 private:
   std::vector<uint8_t> _code;
   std::vector<Value> _constants;
-  std::vector<size_t> _lines;
+  std::vector<InlineCache> _caches;
+  LineTable _lines;
 };
+
+// number of bytes of the instruction starting at offset, including operands
+size_t instructionLength(const Chunk& chunk, size_t offset);
+
+// values the instruction starting at offset pushes minus the values it pops
+int stackEffect(const Chunk& chunk, size_t offset);
+
+// The instruction that op was quickened from, op itself if it was not. Only
+// the interpreter runs quickened instructions, everything else that reads
+// code at runtime goes through this.
+OpCode baseOpcode(uint8_t op);
@@ -7,5 +7,6 @@
 // #define DEBUG_TRACE_EXECUTION
 // #define DEBUG_PRINT_CODE
 // #define DEBUG_LOG_GC
+// #define DEBUG_PROFILE_OPCODES
 
 constexpr auto UINT8_COUNT = (255 + 1);  // 255 == UINT8_T_MAX
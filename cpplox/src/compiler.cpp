@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <cstring>
+#include <iostream>
 #include <optional>
 #include <string>
 #include <string_view>
@@ -9,7 +12,9 @@
 #include "common.h"
 #include "debug.h"
 #include "memory.h"
+#include "optimizer.h"
 #include "parser.h"
+#include "registercompiler.h"
 #include "scanner.h"
 #include "value.h"
 
@@ -29,26 +34,73 @@ Token syntheticToken(std::string_view text)
   return Token {TokenType::ERROR, text, 0};
 }
 
+// The stack depth of a function, see ObjFunction::maxStackDepth. The code is
+// scanned in order, each jump passes its depth on to its target. Where paths
+// meet the deeper one counts, so the result may be too large but never too
+// small.
+size_t maxStackDepth(const Chunk& chunk, int arity)
+{
+  std::vector<int> targetDepths(chunk.count() + 1, 0);
+  int depth = arity + 1;
+  int max = depth;
+  for (size_t offset = 0; offset < chunk.count();
+       offset += instructionLength(chunk, offset))
+  {
+    depth = std::max(depth, targetDepths[offset]) + stackEffect(chunk, offset);
+    max = std::max(max, depth);
+
+    switch (chunk.codeAt(offset)) {
+      case OP_JUMP:
+      case OP_JUMP_IF_FALSE:
+      case OP_POP_JUMP_IF_FALSE:
+      case OP_JUMP_IF_NOT_LESS:
+      case OP_JUMP_IF_NOT_GREATER:
+      case OP_JUMP_IF_NOT_EQUAL: {
+        const size_t jump = chunk.shortAt(offset + 1);
+        int& target = targetDepths[offset + 3 + jump];
+        target = std::max(target, depth);
+        break;
+      }
+      // the slow path pushes both operands before adding them
+      case OP_ADD_LOCAL_LOCAL:
+      case OP_ADD_LOCAL_CONSTANT:
+        max = std::max(max, depth + 1);
+        break;
+      default:
+        break;
+    }
+  }
+
+  return static_cast<size_t>(max);
+}
+
 }  // namespace
 
 Compiler::Compiler(Compiler* enclosing,
                    MemoryManager* memory_manager,
+                   Globals* globals,
                    std::shared_ptr<Parser> p,
-                   FunctionType t)
+                   FunctionType t,
+                   Engine engine,
+                   OptimizeMode optimize)
     : _enclosing(enclosing)
     , _function(nullptr)
     , scopeDepth(0)
     , localCount(0)
     , type(t)
+    , _engine(engine)
+    , _optimize(optimize)
     , _mm(memory_manager)
+    , _globals(globals)
     , parser(p)
 {
   memoryManager()->setCurrentCompiler(this);
   _function = memoryManager()->newFunction();
 
   if (type != FunctionType::SCRIPT) {
-    function()->setName(
-        memoryManager()->copyString(parser->previous().string()));
+    ObjString* name = memoryManager()->copyString(parser->previous().string());
+    memoryManager()->writeBarrier(function(), name);
+    function()->setName(name);
   }
 
   if (type != FunctionType::FUNCTION) {
@@ -83,9 +135,9 @@ void Compiler::endScope()
 
   while (localCount > 0 && locals[localCount - 1].depth > scopeDepth) {
     if (locals[localCount - 1].isCaptured) {
-      emitByte(OP_CLOSE_UPVALUE);
+      emitOp(OP_CLOSE_UPVALUE);
     } else {
-      emitByte(OP_POP);
+      emitPop();
     }
     localCount--;
   }
@@ -106,11 +158,22 @@ int Compiler::resolveLocal(Token name)
   return -1;
 }
 
-uint8_t Compiler::identifierConstant(Token name)
+uint16_t Compiler::identifierConstant(Token name)
 {
   return makeConstant(Value(memoryManager()->copyString(name.string())));
 }
 
+uint16_t Compiler::globalSlot(Token name)
+{
+  auto slot = _globals->resolve(memoryManager()->copyString(name.string()));
+  if (slot > UINT16_MAX) {
+    parser->error("Too many global variables.");
+    return 0;
+  }
+
+  return static_cast<uint16_t>(slot);
+}
+
 int Compiler::addUpvalue(uint8_t index, bool isLocal)
 {
   int upvalueCount = function()->upvalueCount();
@@ -190,17 +253,18 @@ void Compiler::declareVariable()
   addLocal(name);
 }
 
-void Compiler::defineVariable(uint8_t global)
+void Compiler::defineVariable(uint16_t global)
 {
   if (scopeDepth > 0) {
     markInitialized();
     return;
   }
 
-  emitBytes(OP_DEFINE_GLOBAL, global);
+  emitOp(OP_DEFINE_GLOBAL);
+  emitShort(global);
 }
 
-uint8_t Compiler::parseVariable(const char* errorMessage)
+uint16_t Compiler::parseVariable(const char* errorMessage)
 {
   parser->consume(TokenType::IDENTIFIER, errorMessage);
 
@@ -209,7 +273,7 @@ uint8_t Compiler::parseVariable(const char* errorMessage)
     return 0;
   }
 
-  return identifierConstant(parser->previous());
+  return globalSlot(parser->previous());
 }
 
 void Compiler::parsePrecedence(Precedence precedence)
@@ -252,7 +316,7 @@ void Compiler::patchJump(size_t offset)
 {
   assert(currentChunk()->count() >= (offset - 2));
   // -2 to adjust for the bytecode for the jump offset itself.
-  size_t jump = currentChunk()->count() - offset - 2;
+  size_t jump = markJumpTarget() - offset - 2;
 
   if (jump > UINT16_MAX) {
     parser->error("Too much code to jump over.");
@@ -264,23 +328,63 @@ void Compiler::patchJump(size_t offset)
 
 void Compiler::emitConstant(Value value)
 {
-  emitBytes(OP_CONSTANT, makeConstant(value));
+  const uint16_t constant = makeConstant(value);
+  if (constant <= UINT8_MAX) {
+    emitBytes(OP_CONSTANT, static_cast<uint8_t>(constant));
+  } else {
+    emitOp(OP_CONSTANT_LONG);
+    emitShort(constant);
+  }
 }
 
-uint8_t Compiler::makeConstant(Value value)
+uint16_t Compiler::makeConstant(Value value)
 {
+  // numbers and strings already in the table are reused, numbers by their
+  // bits so that 0 and -0 stay apart, strings by their interned object
+  uint16_t* existing = nullptr;
+  if (IS_NUMBER(value)) {
+    const double number = AS_NUMBER(value);
+    uint64_t bits;
+    std::memcpy(&bits, &number, sizeof(double));
+    auto [entry, added] = _numberConstants.try_emplace(bits, 0);
+    if (!added) {
+      return entry->second;
+    }
+    existing = &entry->second;
+  } else if (IS_STRING(value)) {
+    auto [entry, added] = _stringConstants.try_emplace(AS_STRING(value), 0);
+    if (!added) {
+      return entry->second;
+    }
+    existing = &entry->second;
+  }
+
+  memoryManager()->writeBarrier(function(), value);
   auto constant = currentChunk()->addConstant(value);
-  if (constant > UINT8_MAX) {
+  if (constant > UINT16_MAX) {
     parser->error("Too many constants in one chunk.");
     return 0;
   }
 
-  return static_cast<uint8_t>(constant);
+  if (existing != nullptr) {
+    *existing = static_cast<uint16_t>(constant);
+  }
+  return static_cast<uint16_t>(constant);
+}
+
+void Compiler::emitCache()
+{
+  auto cache = currentChunk()->addCache();
+  if (cache > UINT16_MAX) {
+    parser->error("Too many property accesses in one chunk.");
+  }
+
+  emitShort(static_cast<uint16_t>(cache));
 }
 
 void Compiler::emitLoop(size_t loopStart)
 {
-  emitByte(OP_LOOP);
+  emitOp(OP_LOOP);
 
   auto offset = currentChunk()->count() - loopStart + 2;
   if (offset > UINT16_MAX) {
@@ -296,31 +400,190 @@ void Compiler::emitReturn()
   if (type == FunctionType::INITIALIZER) {
     emitBytes(OP_GET_LOCAL, 0);
   } else {
-    emitByte(OP_NIL);  // functions without a return value implicitely return
-                       // nil, except for initializers
+    emitOp(OP_NIL);  // functions without a return value implicitely return
+                     // nil, except for initializers
   }
 
-  emitByte(OP_RETURN);
+  emitOp(OP_RETURN);
 }
 
 size_t Compiler::emitJump(uint8_t instruction)
 {
-  emitByte(instruction);
+  if (instruction == OP_POP_JUMP_IF_FALSE) {
+    // compare-and-branch: the comparison result only feeds the jump
+    switch (lastInstruction(0)) {
+      case OP_LESS:
+        instruction = OP_JUMP_IF_NOT_LESS;
+        break;
+      case OP_GREATER:
+        instruction = OP_JUMP_IF_NOT_GREATER;
+        break;
+      case OP_EQUAL:
+        instruction = OP_JUMP_IF_NOT_EQUAL;
+        break;
+      default:
+        break;
+    }
+
+    if (instruction != OP_POP_JUMP_IF_FALSE) {
+      // keep the line of the comparison for runtime errors
+      const size_t line = dropInstructions(1);
+      emitOp(instruction, line);
+      emitByte(0xff, line);
+      emitByte(0xff, line);
+      return currentChunk()->count() - 2;
+    }
+  }
+
+  emitOp(instruction);
   emitByte(0xff);
   emitByte(0xff);
   assert(currentChunk()->count() >= 2);
   return currentChunk()->count() - 2;
 }
 
-void Compiler::emitBytes(uint8_t byte1, uint8_t byte2)
+void Compiler::emitBytes(uint8_t op, uint8_t operand)
+{
+  emitOp(op);
+  emitByte(operand);
+}
+
+void Compiler::emitShort(uint16_t operand)
+{
+  emitByte((operand >> 8) & 0xff);
+  emitByte(operand & 0xff);
+}
+
+void Compiler::emitOp(uint8_t op)
+{
+  emitOp(op, parser->previous().line());
+}
+
+void Compiler::emitOp(uint8_t op, size_t line)
+{
+  _instructionStarts.push_back(currentChunk()->count());
+  emitByte(op, line);
+}
+
+void Compiler::emitByte(uint8_t byte, size_t line)
+{
+  currentChunk()->write(byte, line);
+}
+
+void Compiler::emitPop()
+{
+  switch (lastInstruction(0)) {
+    case OP_POP: {
+      const size_t line = dropInstructions(1);
+      emitOp(OP_POP_N, line);
+      emitByte(2, line);
+      return;
+    }
+    case OP_POP_N: {
+      const size_t start = _instructionStarts.back();
+      const uint8_t n = currentChunk()->codeAt(start + 1);
+      if (n < UINT8_MAX) {
+        currentChunk()->writeAt(start + 1, n + 1);
+        return;
+      }
+      break;
+    }
+    case OP_SET_LOCAL: {
+      // x = x + <number>; as a statement
+      const size_t set = _instructionStarts.back();
+      if (lastInstruction(1) != OP_ADD_LOCAL_CONSTANT) {
+        break;
+      }
+
+      const size_t add = _instructionStarts[_instructionStarts.size() - 2];
+      const uint8_t slot = currentChunk()->codeAt(add + 1);
+      const uint8_t constant = currentChunk()->codeAt(add + 2);
+      if (currentChunk()->codeAt(set + 1) != slot
+          || !IS_NUMBER(currentChunk()->constantsAt(constant)))
+      {
+        break;
+      }
+
+      const size_t line = currentChunk()->linesAt(add);
+      dropInstructions(2);
+      emitOp(OP_INCREMENT_LOCAL, line);
+      emitByte(slot, line);
+      emitByte(constant, line);
+      return;
+    }
+    default:
+      break;
+  }
+
+  emitOp(OP_POP);
+}
+
+void Compiler::emitArithmetic(uint8_t op)
 {
-  emitByte(byte1);
-  emitByte(byte2);
+  assert(op == OP_ADD || op == OP_SUBTRACT);
+
+  // both operands read straight from local slots or the constant table
+  if (lastInstruction(1) == OP_GET_LOCAL) {
+    uint8_t fused = OP_COUNT;
+    if (lastInstruction(0) == OP_CONSTANT) {
+      fused = op == OP_ADD ? OP_ADD_LOCAL_CONSTANT : OP_SUBTRACT_LOCAL_CONSTANT;
+    } else if (lastInstruction(0) == OP_GET_LOCAL && op == OP_ADD) {
+      fused = OP_ADD_LOCAL_LOCAL;
+    }
+
+    if (fused != OP_COUNT) {
+      const size_t first = _instructionStarts[_instructionStarts.size() - 2];
+      const size_t second = _instructionStarts.back();
+      const uint8_t slot = currentChunk()->codeAt(first + 1);
+      const uint8_t operand = currentChunk()->codeAt(second + 1);
+      const size_t line = parser->previous().line();
+      dropInstructions(2);
+      emitOp(fused, line);
+      emitByte(slot, line);
+      emitByte(operand, line);
+      return;
+    }
+  }
+
+  emitOp(op);
+}
+
+uint8_t Compiler::lastInstruction(size_t n) const
+{
+  if (_instructionStarts.size() <= n) {
+    return OP_COUNT;
+  }
+
+  const size_t start = _instructionStarts[_instructionStarts.size() - 1 - n];
+  if (start < _lastJumpTarget) {
+    // something jumps into the middle of the instructions following it, they
+    // can't be fused
+    return OP_COUNT;
+  }
+
+  return _function->chunk()->codeAt(start);
+}
+
+size_t Compiler::dropInstructions(size_t n)
+{
+  assert(_instructionStarts.size() >= n);
+  const size_t start = _instructionStarts[_instructionStarts.size() - n];
+  const size_t line = currentChunk()->linesAt(start);
+
+  _instructionStarts.resize(_instructionStarts.size() - n);
+  currentChunk()->truncate(start);
+  return line;
+}
+
+size_t Compiler::markJumpTarget()
+{
+  _lastJumpTarget = currentChunk()->count();
+  return _lastJumpTarget;
 }
 
 void Compiler::emitByte(uint8_t byte)
 {
-  currentChunk()->write(byte, parser->previous().line());
+  emitByte(byte, parser->previous().line());
 }
 
 Chunk* Compiler::currentChunk()
@@ -333,10 +596,38 @@ ObjFunction* Compiler::endCompiler()
   emitReturn();
   ObjFunction* f = function();
 
+  if (_optimize != OptimizeMode::OFF && !parser->hadError()) {
+    const size_t before = currentChunk()->count();
+    const size_t saved = ChunkOptimizer(currentChunk()).optimize();
+    if (_optimize == OptimizeMode::REPORT) {
+      std::cerr << (f->name() != nullptr ? f->name()->toString() : "<script>")
+                << ": " << before << " -> " << before - saved << " bytes, "
+                << saved << " saved\n";
+    }
+  }
+
+  if (!parser->hadError()) {
+    f->setMaxStackDepth(maxStackDepth(*currentChunk(), f->arity()));
+  }
+
+  if (_engine == Engine::REGISTER && !parser->hadError()) {
+    if (!RegisterCompiler(f).compile()) {
+      parser->error("Function too large for the register engine.");
+    }
+  }
+
+  // the chunks are done growing
+  memoryManager()->account(f);
+
 #ifdef DEBUG_PRINT_CODE
   if (!parser->hadError()) {
     disassembleChunk(currentChunk(),
                      f->name() != nullptr ? f->name()->toString() : "<script>");
+    if (_engine == Engine::REGISTER) {
+      disassembleRegisterChunk(
+          f->registerChunk(),
+          f->name() != nullptr ? f->name()->toString() : "<script>");
+    }
   }
 #endif
 
@@ -356,7 +647,7 @@ ObjFunction* Compiler::compileFunction()
         parser->errorAtCurrent("Can't have more than 255 parameters.");
       }
 
-      uint8_t constant = parseVariable("Expect parameter name.");
+      uint16_t constant = parseVariable("Expect parameter name.");
       defineVariable(constant);
     } while (parser->match(TokenType::COMMA));
   }
@@ -470,16 +761,23 @@ void Compiler::namedVariable(Token name, bool canAssign)
     getOp = OP_GET_UPVALUE;
     setOp = OP_SET_UPVALUE;
   } else {
-    arg = identifierConstant(name);
+    arg = globalSlot(name);
     getOp = OP_GET_GLOBAL;
     setOp = OP_SET_GLOBAL;
   }
 
   if (canAssign && parser->match(TokenType::EQUAL)) {
     expression();
-    emitBytes(setOp, static_cast<uint8_t>(arg));
+    emitOp(setOp);
   } else {
-    emitBytes(getOp, static_cast<uint8_t>(arg));
+    emitOp(getOp);
+  }
+
+  // globals have 16 bit slots
+  if (getOp == OP_GET_GLOBAL) {
+    emitShort(static_cast<uint16_t>(arg));
+  } else {
+    emitByte(static_cast<uint8_t>(arg));
   }
 }
 
@@ -501,11 +799,13 @@ void Compiler::block()
 
 void Compiler::function_(FunctionType t)
 {
-  Compiler functionCompiler {this, memoryManager(), parser, t};
+  Compiler functionCompiler {
+      this, memoryManager(), _globals, parser, t, _engine, _optimize};
 
   auto f = functionCompiler.compileFunction();
 
-  emitBytes(OP_CLOSURE, makeConstant(Value(f)));
+  emitOp(OP_CLOSURE);
+  emitShort(makeConstant(Value(f)));
 
   for (int i = 0; i < f->upvalueCount(); i++) {
     emitByte(functionCompiler.upvalues[i].isLocal ? 1 : 0);
@@ -516,7 +816,7 @@ void Compiler::function_(FunctionType t)
 void Compiler::method()
 {
   parser->consume(TokenType::IDENTIFIER, "Expect method name.");
-  uint8_t constant = identifierConstant(parser->previous());
+  uint16_t constant = identifierConstant(parser->previous());
 
   FunctionType t = FunctionType::METHOD;
 
@@ -526,18 +826,20 @@ void Compiler::method()
 
   function_(t);
 
-  emitBytes(OP_METHOD, constant);
+  emitOp(OP_METHOD);
+  emitShort(constant);
 }
 
 void Compiler::classDeclaration()
 {
   parser->consume(TokenType::IDENTIFIER, "Expect class name.");
   Token className = parser->previous();
-  uint8_t nameconstant = identifierConstant(parser->previous());
+  uint16_t nameconstant = identifierConstant(parser->previous());
   declareVariable();
 
-  emitBytes(OP_CLASS, nameconstant);
-  defineVariable(nameconstant);
+  emitOp(OP_CLASS);
+  emitShort(nameconstant);
+  defineVariable(scopeDepth > 0 ? 0 : globalSlot(className));
 
   ClassCompiler classCompiler;
   classCompiler.enclosing = _currentClass;
@@ -556,7 +858,7 @@ void Compiler::classDeclaration()
     defineVariable(0);
 
     namedVariable(className, false);
-    emitByte(OP_INHERIT);
+    emitOp(OP_INHERIT);
     classCompiler.hasSuperclass = true;
   }
 
@@ -571,7 +873,7 @@ void Compiler::classDeclaration()
   }
 
   parser->consume(TokenType::RIGHT_BRACE, "Expect '}' after class body.");
-  emitByte(OP_POP);
+  emitPop();
 
   if (classCompiler.hasSuperclass) {
     endScope();
@@ -590,34 +892,37 @@ void Compiler::binary(bool)
 
   switch (opType) {
     case TokenType::BANG_EQUAL:
-      emitBytes(OP_EQUAL, OP_NOT);
+      emitOp(OP_EQUAL);
+      emitOp(OP_NOT);
       break;
     case TokenType::EQUAL_EQUAL:
-      emitByte(OP_EQUAL);
+      emitOp(OP_EQUAL);
       break;
     case TokenType::GREATER:
-      emitByte(OP_GREATER);
+      emitOp(OP_GREATER);
       break;
     case TokenType::GREATER_EQUAL:
-      emitBytes(OP_LESS, OP_NOT);
+      emitOp(OP_LESS);
+      emitOp(OP_NOT);
       break;
     case TokenType::LESS:
-      emitByte(OP_LESS);
+      emitOp(OP_LESS);
       break;
     case TokenType::LESS_EQUAL:
-      emitBytes(OP_GREATER, OP_NOT);
+      emitOp(OP_GREATER);
+      emitOp(OP_NOT);
       break;
     case TokenType::PLUS:
-      emitByte(OP_ADD);
+      emitArithmetic(OP_ADD);
       break;
     case TokenType::MINUS:
-      emitByte(OP_SUBTRACT);
+      emitArithmetic(OP_SUBTRACT);
       break;
     case TokenType::STAR:
-      emitByte(OP_MULTIPLY);
+      emitOp(OP_MULTIPLY);
       break;
     case TokenType::SLASH:
-      emitByte(OP_DIVIDE);
+      emitOp(OP_DIVIDE);
       break;
     default:
       return;  // Unreachable
@@ -633,10 +938,10 @@ void Compiler::unary(bool)
 
   switch (operatorType) {
     case TokenType::BANG:
-      emitByte(OP_NOT);
+      emitOp(OP_NOT);
       break;
     case TokenType::MINUS:
-      emitByte(OP_NEGATE);
+      emitOp(OP_NEGATE);
       break;
     default:
       return;  // Unreachable
@@ -672,17 +977,23 @@ void Compiler::call(bool)
 void Compiler::dot(bool canAssign)
 {
   parser->consume(TokenType::IDENTIFIER, "Expect property name after '.'.");
-  uint8_t name = identifierConstant(parser->previous());
+  uint16_t name = identifierConstant(parser->previous());
 
   if (canAssign && parser->match(TokenType::EQUAL)) {
     expression();
-    emitBytes(OP_SET_PROPERTY, name);
+    emitOp(OP_SET_PROPERTY);
+    emitShort(name);
+    emitCache();
   } else if (parser->match(TokenType::LEFT_PAREN)) {
     uint8_t argCount = argumentList();
-    emitBytes(OP_INVOKE, name);
+    emitOp(OP_INVOKE);
+    emitShort(name);
     emitByte(argCount);
+    emitCache();
   } else {
-    emitBytes(OP_GET_PROPERTY, name);
+    emitOp(OP_GET_PROPERTY);
+    emitShort(name);
+    emitCache();
   }
 }
 
@@ -690,13 +1001,13 @@ void Compiler::literal(bool)
 {
   switch (parser->previous().type()) {
     case TokenType::FALSE:
-      emitByte(OP_FALSE);
+      emitOp(OP_FALSE);
       break;
     case TokenType::NIL:
-      emitByte(OP_NIL);
+      emitOp(OP_NIL);
       break;
     case TokenType::TRUE:
-      emitByte(OP_TRUE);
+      emitOp(OP_TRUE);
       break;
     default:
       return;  // Unreachable
@@ -705,7 +1016,7 @@ void Compiler::literal(bool)
 
 void Compiler::funDeclaration()
 {
-  uint8_t global = parseVariable("Expect function name.");
+  uint16_t global = parseVariable("Expect function name.");
   markInitialized();
   function_(FunctionType::FUNCTION);
   defineVariable(global);
@@ -721,17 +1032,19 @@ void Compiler::super_(bool)
 
   parser->consume(TokenType::DOT, "Expect '.' after 'super'.");
   parser->consume(TokenType::IDENTIFIER, "Expect superclass method name.");
-  uint8_t name = identifierConstant(parser->previous());
+  uint16_t name = identifierConstant(parser->previous());
 
   namedVariable(syntheticToken("this"), false);
   if (parser->match(TokenType::LEFT_PAREN)) {
     uint8_t argCount = argumentList();
     namedVariable(syntheticToken("super"), false);
-    emitBytes(OP_SUPER_INVOKE, name);
+    emitOp(OP_SUPER_INVOKE);
+    emitShort(name);
     emitByte(argCount);
   } else {
     namedVariable(syntheticToken("super"), false);
-    emitBytes(OP_GET_SUPER, name);
+    emitOp(OP_GET_SUPER);
+    emitShort(name);
   }
 }
 
@@ -766,7 +1079,7 @@ void Compiler::or_(bool)
   auto endJump = emitJump(OP_JUMP);
 
   patchJump(elseJump);
-  emitByte(OP_POP);
+  emitPop();
 
   parsePrecedence(Precedence::OR);
   patchJump(endJump);
@@ -776,19 +1089,19 @@ void Compiler::and_(bool)
 {
   auto endJump = emitJump(OP_JUMP_IF_FALSE);
 
-  emitByte(OP_POP);
+  emitPop();
   parsePrecedence(Precedence::AND);
   patchJump(endJump);
 }
 
 void Compiler::varDeclaration()
 {
-  uint8_t global = parseVariable("Expect variable name.");
+  uint16_t global = parseVariable("Expect variable name.");
 
   if (parser->match(TokenType::EQUAL)) {
     expression();
   } else {
-    emitByte(OP_NIL);
+    emitOp(OP_NIL);
   }
 
   parser->consume(TokenType::SEMICOLON,
@@ -800,7 +1113,7 @@ void Compiler::expressionStatement()
 {
   expression();
   parser->consume(TokenType::SEMICOLON, "Expect ';' after expression.");
-  emitByte(OP_POP);
+  emitPop();
 }
 
 void Compiler::forStatement()
@@ -816,16 +1129,16 @@ void Compiler::forStatement()
     expressionStatement();
   }
 
-  auto loopStart = currentChunk()->count();
+  auto loopStart = markJumpTarget();
   std::optional<size_t> exitJump;
 
   if (!parser->match(TokenType::SEMICOLON)) {
     expression();
     parser->consume(TokenType::SEMICOLON, "Expect ';' after loop condition.");
 
-    // Jump out of the loop if the condition is false
-    exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
+    // Jump out of the loop if the condition is false, the condition is
+    // popped either way
+    exitJump = emitJump(OP_POP_JUMP_IF_FALSE);
   }
 
   // Explanation of the code for the increment part of the for loop, taken
@@ -858,9 +1171,7 @@ void Compiler::forStatement()
        │Condition expression│  │
        └────────────────────┘  │
                                │
-    ┌───OP_JUMP_IF_FALSE       │
-    │                          │
-    │   OP_POP                 │
+    ┌───OP_POP_JUMP_IF_FALSE   │
     │                          │
   ┌─┼───OP_JUMP                │
   │ │                          │
@@ -878,16 +1189,15 @@ void Compiler::forStatement()
     │                            │
     │   OP_LOOP ─────────────────┘
     └──►
-        OP_POP
 */
 
   if (!parser->match(TokenType::RIGHT_PAREN)) {
     auto bodyJump =
         emitJump(OP_JUMP);  // unconditionally jump over increment clause
-    auto incrementStart = currentChunk()->count();
+    auto incrementStart = markJumpTarget();
     expression();  // compile increment clause
-    emitByte(OP_POP);  // expression only executed for sideeffect,
-                       // pop value off stack
+    emitPop();  // expression only executed for sideeffect,
+                // pop value off stack
 
     parser->consume(TokenType::RIGHT_PAREN, "Expect ')' after for clauses.");
 
@@ -901,7 +1211,6 @@ void Compiler::forStatement()
 
   if (exitJump.has_value()) {
     patchJump(*exitJump);
-    emitByte(OP_POP);
   }
 
   endScope();
@@ -913,16 +1222,13 @@ void Compiler::ifStatement()
   expression();
   parser->consume(TokenType::RIGHT_PAREN, "Expect ')' after condition.");
 
-  const auto thenJump = emitJump(OP_JUMP_IF_FALSE);
-  emitByte(OP_POP);
+  const auto thenJump = emitJump(OP_POP_JUMP_IF_FALSE);
   statement();
 
   const auto elseJump = emitJump(OP_JUMP);
 
   patchJump(thenJump);
 
-  emitByte(OP_POP);
-
   if (parser->match(TokenType::ELSE)) {
     statement();
   }
@@ -932,26 +1238,24 @@ void Compiler::ifStatement()
 
 void Compiler::whileStatement()
 {
-  auto loopStart = currentChunk()->count();
+  auto loopStart = markJumpTarget();
 
   parser->consume(TokenType::LEFT_PAREN, "Expect '(' after 'while'.");
   expression();
   parser->consume(TokenType::RIGHT_PAREN, "Expect ')' after condition.");
-  auto exitJump = emitJump(OP_JUMP_IF_FALSE);
-  emitByte(OP_POP);
+  auto exitJump = emitJump(OP_POP_JUMP_IF_FALSE);
   statement();
 
   emitLoop(loopStart);
 
   patchJump(exitJump);
-  emitByte(OP_POP);
 }
 
 void Compiler::printStatement()
 {
   expression();
   parser->consume(TokenType::SEMICOLON, "Expect ';' after value.");
-  emitByte(OP_PRINT);
+  emitOp(OP_PRINT);
 }
 
 void Compiler::returnStatement()
@@ -969,7 +1273,12 @@ void Compiler::returnStatement()
 
     expression();
     parser->consume(TokenType::SEMICOLON, "Expect ';' after return value.");
-    emitByte(OP_RETURN);
+    if (lastInstruction(0) == OP_CALL) {
+      // the callee takes over the frame, the return is only left for callees
+      // that are not closures
+      currentChunk()->writeAt(_instructionStarts.back(), OP_TAIL_CALL);
+    }
+    emitOp(OP_RETURN);
   }
 }
 
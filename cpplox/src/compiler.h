@@ -1,8 +1,12 @@
 #pragma once
 
+#include <cstdint>
 #include <functional>
+#include <unordered_map>
+#include <vector>
 
 #include "objfunction.h"
+#include "optimizer.h"
 #include "parser.h"
 #include "scanner.h"
 #include "vm.h"
@@ -65,8 +69,11 @@ class Compiler
 public:
   explicit Compiler(Compiler* enclosing,
                     MemoryManager* memory_manager,
+                    Globals* globals,
                     std::shared_ptr<Parser> parser,
-                    FunctionType type);
+                    FunctionType type,
+                    Engine engine = Engine::STACK,
+                    OptimizeMode optimize = OptimizeMode::ON);
 
   ~Compiler();
 
@@ -77,20 +84,41 @@ public:
   ObjFunction* function();
 
 private:
+  // operands go through emitByte, every instruction starts with emitOp
   void emitByte(uint8_t byte);
-  void emitBytes(uint8_t byte1, uint8_t byte2);
+  void emitByte(uint8_t byte, size_t line);
+  void emitOp(uint8_t op);
+  void emitOp(uint8_t op, size_t line);
+  void emitBytes(uint8_t op, uint8_t operand);
+  void emitShort(uint16_t operand);
   void emitReturn();
   void emitLoop(size_t loopStart);
   void emitConstant(Value value);
+  // adds an inline cache to the chunk and emits its index
+  void emitCache();
   size_t emitJump(uint8_t instruction);
   void patchJump(size_t offset);
 
-  uint8_t identifierConstant(Token name);
-  uint8_t makeConstant(Value value);
+  // Superinstructions: these emit a fused instruction in place of the last
+  // few ones whenever possible.
+  void emitPop();
+  void emitArithmetic(uint8_t op);
+
+  // opcode of the n-th last instruction, OP_COUNT if it does not exist or
+  // may not be fused because a jump lands after it
+  uint8_t lastInstruction(size_t n) const;
+  // removes the last n instructions, returns the line of the first one
+  size_t dropInstructions(size_t n);
+  // the current offset becomes a jump target, returns it
+  size_t markJumpTarget();
+
+  uint16_t identifierConstant(Token name);
+  uint16_t makeConstant(Value value);
+  uint16_t globalSlot(Token name);
 
   void declareVariable();
-  void defineVariable(uint8_t global);
-  uint8_t parseVariable(const char* errorMessage);
+  void defineVariable(uint16_t global);
+  uint16_t parseVariable(const char* errorMessage);
   void namedVariable(Token name, bool canAssign);
 
   int addUpvalue(uint8_t index, bool isLocal);
@@ -156,8 +184,18 @@ private:
   Local locals[UINT8_COUNT];
   Upvalue upvalues[UINT8_COUNT];
   FunctionType type;
+  Engine _engine = Engine::STACK;  // the backend to compile for
+  OptimizeMode _optimize = OptimizeMode::ON;
+
+  std::vector<size_t> _instructionStarts;
+  size_t _lastJumpTarget = 0;
+
+  // index of every number (by its bits) and string in the constant table
+  std::unordered_map<uint64_t, uint16_t> _numberConstants;
+  std::unordered_map<ObjString*, uint16_t> _stringConstants;
 
   MemoryManager* _mm = nullptr;
+  Globals* _globals = nullptr;
   ClassCompiler* _currentClass = nullptr;
   std::shared_ptr<Parser> parser;
 };
@@ -38,13 +38,21 @@ size_t constantInstruction(const char* name, Chunk* chunk, size_t offset)
   return offset + 2;
 }
 
+size_t longConstantInstruction(const char* name, Chunk* chunk, size_t offset)
+{
+  const auto constant = chunk->shortAt(offset + 1);
+  std::cout << fmt::sprintf("%-16s %4d '", name, constant);
+  std::cout << toString(chunk->constantsAt(constant));
+  std::cout << std::endl;
+  return offset + 3;
+}
+
 size_t jumpInstruction(const char* name,
                        size_t sign,
                        Chunk* chunk,
                        size_t offset)
 {
-  auto jump = (uint16_t)(chunk->codeAt(offset + 1) << 8);
-  jump |= chunk->codeAt(offset + 2);
+  const uint16_t jump = chunk->shortAt(offset + 1);
 
   std::cout << fmt::sprintf(
       "%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
@@ -53,11 +61,57 @@ size_t jumpInstruction(const char* name,
 
 size_t invokeInstruction(const char* name, Chunk* chunk, size_t offset)
 {
-  uint8_t constant = chunk->codeAt(offset + 1);
-  uint8_t argCount = chunk->codeAt(offset + 2);
+  uint16_t constant = chunk->shortAt(offset + 1);
+  uint8_t argCount = chunk->codeAt(offset + 3);
   std::cout << fmt::sprintf("%-16s (%d args) %4d '", name, argCount, constant);
   std::cout << toString(chunk->constantsAt(constant));
   std::cout << fmt::sprintf("'\n");
+  return offset + 4;
+}
+
+size_t globalInstruction(const char* name, Chunk* chunk, size_t offset)
+{
+  uint16_t slot = chunk->shortAt(offset + 1);
+  std::cout << fmt::sprintf("%-16s %4d\n", name, slot);
+  return offset + 3;
+}
+
+size_t propertyInstruction(const char* name, Chunk* chunk, size_t offset)
+{
+  uint16_t constant = chunk->shortAt(offset + 1);
+  uint16_t cache = chunk->shortAt(offset + 3);
+  std::cout << fmt::sprintf("%-16s %4d '", name, constant);
+  std::cout << toString(chunk->constantsAt(constant));
+  std::cout << fmt::sprintf("' ic %d\n", cache);
+  return offset + 5;
+}
+
+size_t cachedInvokeInstruction(const char* name, Chunk* chunk, size_t offset)
+{
+  uint16_t constant = chunk->shortAt(offset + 1);
+  uint8_t argCount = chunk->codeAt(offset + 3);
+  uint16_t cache = chunk->shortAt(offset + 4);
+  std::cout << fmt::sprintf("%-16s (%d args) %4d '", name, argCount, constant);
+  std::cout << toString(chunk->constantsAt(constant));
+  std::cout << fmt::sprintf("' ic %d\n", cache);
+  return offset + 6;
+}
+
+size_t localLocalInstruction(const char* name, Chunk* chunk, size_t offset)
+{
+  uint8_t a = chunk->codeAt(offset + 1);
+  uint8_t b = chunk->codeAt(offset + 2);
+  std::cout << fmt::sprintf("%-16s %4d %4d\n", name, a, b);
+  return offset + 3;
+}
+
+size_t localConstantInstruction(const char* name, Chunk* chunk, size_t offset)
+{
+  uint8_t slot = chunk->codeAt(offset + 1);
+  uint8_t constant = chunk->codeAt(offset + 2);
+  std::cout << fmt::sprintf("%-16s %4d %4d '", name, slot, constant);
+  std::cout << toString(chunk->constantsAt(constant));
+  std::cout << "'\n";
   return offset + 3;
 }
 
@@ -121,11 +175,11 @@ size_t disassembleInstruction(Chunk* chunk, size_t offset)
     case OP_POP:
       return simpleInstruction("OP_POP", offset);
     case OP_DEFINE_GLOBAL:
-      return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+      return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
     case OP_GET_GLOBAL:
-      return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+      return globalInstruction("OP_GET_GLOBAL", chunk, offset);
     case OP_SET_GLOBAL:
-      return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+      return globalInstruction("OP_SET_GLOBAL", chunk, offset);
     case OP_GET_LOCAL:
       return byteInstruction("OP_GET_LOCAL", chunk, offset);
     case OP_SET_LOCAL:
@@ -145,24 +199,55 @@ size_t disassembleInstruction(Chunk* chunk, size_t offset)
     case OP_CLOSE_UPVALUE:
       return simpleInstruction("OP_CLOSE_UPVALUE", offset);
     case OP_CLASS:
-      return constantInstruction("OP_CLASS", chunk, offset);
+      return longConstantInstruction("OP_CLASS", chunk, offset);
     case OP_SET_PROPERTY:
-      return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+      return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
     case OP_GET_PROPERTY:
-      return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+      return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
     case OP_METHOD:
-      return constantInstruction("OP_METHOD", chunk, offset);
+      return longConstantInstruction("OP_METHOD", chunk, offset);
     case OP_INVOKE:
-      return invokeInstruction("OP_INVOKE", chunk, offset);
+      return cachedInvokeInstruction("OP_INVOKE", chunk, offset);
     case OP_INHERIT:
       return simpleInstruction("OP_INHERIT", offset);
     case OP_GET_SUPER:
-      return constantInstruction("OP_GET_SUPER", chunk, offset);
+      return longConstantInstruction("OP_GET_SUPER", chunk, offset);
     case OP_SUPER_INVOKE:
       return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
+    case OP_TAIL_CALL:
+      return byteInstruction("OP_TAIL_CALL", chunk, offset);
+    case OP_CONSTANT_LONG:
+      return longConstantInstruction("OP_CONSTANT_LONG", chunk, offset);
+    case OP_POP_N:
+      return byteInstruction("OP_POP_N", chunk, offset);
+    case OP_POP_JUMP_IF_FALSE:
+      return jumpInstruction("OP_POP_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_JUMP_IF_NOT_LESS:
+      return jumpInstruction("OP_JUMP_IF_NOT_LESS", 1, chunk, offset);
+    case OP_JUMP_IF_NOT_GREATER:
+      return jumpInstruction("OP_JUMP_IF_NOT_GREATER", 1, chunk, offset);
+    case OP_JUMP_IF_NOT_EQUAL:
+      return jumpInstruction("OP_JUMP_IF_NOT_EQUAL", 1, chunk, offset);
+    case OP_ADD_LOCAL_LOCAL:
+      return localLocalInstruction("OP_ADD_LOCAL_LOCAL", chunk, offset);
+    case OP_ADD_LOCAL_CONSTANT:
+      return localConstantInstruction("OP_ADD_LOCAL_CONSTANT", chunk, offset);
+    case OP_SUBTRACT_LOCAL_CONSTANT:
+      return localConstantInstruction(
+          "OP_SUBTRACT_LOCAL_CONSTANT", chunk, offset);
+    case OP_INCREMENT_LOCAL:
+      return localConstantInstruction("OP_INCREMENT_LOCAL", chunk, offset);
+    case OP_ADD_NUMBER:
+      return simpleInstruction("OP_ADD_NUMBER", offset);
+    case OP_ADD_STRING:
+      return simpleInstruction("OP_ADD_STRING", offset);
+    case OP_GET_FIELD:
+      return propertyInstruction("OP_GET_FIELD", chunk, offset);
+    case OP_ADD_GENERIC:
+      return simpleInstruction("OP_ADD_GENERIC", offset);
     case OP_CLOSURE: {
-      offset++;
-      uint8_t constant = chunk->codeAt(offset++);
+      uint16_t constant = chunk->shortAt(offset + 1);
+      offset += 3;
       std::cout << fmt::sprintf("%-16s %4d ", "OP_CLOSURE", constant);
       std::cout << toString(chunk->constantsAt(constant));
       std::cout << fmt::sprintf("\n");
@@ -185,4 +270,274 @@ size_t disassembleInstruction(Chunk* chunk, size_t offset)
       std::cout << fmt::sprintf("Unknown opcode %hhu\n", instruction);
       return offset + 1;
   }
-}
\ No newline at end of file
+}
+
+const char* opcodeName(uint8_t instruction)
+{
+  switch (static_cast<OpCode>(instruction)) {
+    case OP_RETURN:
+      return "OP_RETURN";
+    case OP_CONSTANT:
+      return "OP_CONSTANT";
+    case OP_NEGATE:
+      return "OP_NEGATE";
+    case OP_ADD:
+      return "OP_ADD";
+    case OP_SUBTRACT:
+      return "OP_SUBTRACT";
+    case OP_MULTIPLY:
+      return "OP_MULTIPLY";
+    case OP_DIVIDE:
+      return "OP_DIVIDE";
+    case OP_NIL:
+      return "OP_NIL";
+    case OP_TRUE:
+      return "OP_TRUE";
+    case OP_FALSE:
+      return "OP_FALSE";
+    case OP_NOT:
+      return "OP_NOT";
+    case OP_EQUAL:
+      return "OP_EQUAL";
+    case OP_GREATER:
+      return "OP_GREATER";
+    case OP_LESS:
+      return "OP_LESS";
+    case OP_PRINT:
+      return "OP_PRINT";
+    case OP_POP:
+      return "OP_POP";
+    case OP_DEFINE_GLOBAL:
+      return "OP_DEFINE_GLOBAL";
+    case OP_GET_GLOBAL:
+      return "OP_GET_GLOBAL";
+    case OP_SET_GLOBAL:
+      return "OP_SET_GLOBAL";
+    case OP_GET_LOCAL:
+      return "OP_GET_LOCAL";
+    case OP_SET_LOCAL:
+      return "OP_SET_LOCAL";
+    case OP_JUMP:
+      return "OP_JUMP";
+    case OP_JUMP_IF_FALSE:
+      return "OP_JUMP_IF_FALSE";
+    case OP_LOOP:
+      return "OP_LOOP";
+    case OP_CALL:
+      return "OP_CALL";
+    case OP_GET_UPVALUE:
+      return "OP_GET_UPVALUE";
+    case OP_SET_UPVALUE:
+      return "OP_SET_UPVALUE";
+    case OP_CLOSE_UPVALUE:
+      return "OP_CLOSE_UPVALUE";
+    case OP_CLASS:
+      return "OP_CLASS";
+    case OP_SET_PROPERTY:
+      return "OP_SET_PROPERTY";
+    case OP_GET_PROPERTY:
+      return "OP_GET_PROPERTY";
+    case OP_METHOD:
+      return "OP_METHOD";
+    case OP_INVOKE:
+      return "OP_INVOKE";
+    case OP_INHERIT:
+      return "OP_INHERIT";
+    case OP_GET_SUPER:
+      return "OP_GET_SUPER";
+    case OP_SUPER_INVOKE:
+      return "OP_SUPER_INVOKE";
+    case OP_TAIL_CALL:
+      return "OP_TAIL_CALL";
+    case OP_CONSTANT_LONG:
+      return "OP_CONSTANT_LONG";
+    case OP_CLOSURE:
+      return "OP_CLOSURE";
+    case OP_POP_N:
+      return "OP_POP_N";
+    case OP_POP_JUMP_IF_FALSE:
+      return "OP_POP_JUMP_IF_FALSE";
+    case OP_JUMP_IF_NOT_LESS:
+      return "OP_JUMP_IF_NOT_LESS";
+    case OP_JUMP_IF_NOT_GREATER:
+      return "OP_JUMP_IF_NOT_GREATER";
+    case OP_JUMP_IF_NOT_EQUAL:
+      return "OP_JUMP_IF_NOT_EQUAL";
+    case OP_ADD_LOCAL_LOCAL:
+      return "OP_ADD_LOCAL_LOCAL";
+    case OP_ADD_LOCAL_CONSTANT:
+      return "OP_ADD_LOCAL_CONSTANT";
+    case OP_SUBTRACT_LOCAL_CONSTANT:
+      return "OP_SUBTRACT_LOCAL_CONSTANT";
+    case OP_INCREMENT_LOCAL:
+      return "OP_INCREMENT_LOCAL";
+    case OP_ADD_NUMBER:
+      return "OP_ADD_NUMBER";
+    case OP_ADD_STRING:
+      return "OP_ADD_STRING";
+    case OP_GET_FIELD:
+      return "OP_GET_FIELD";
+    case OP_ADD_GENERIC:
+      return "OP_ADD_GENERIC";
+    case OP_COUNT:
+      break;
+  }
+
+  return "<unknown>";
+}
+
+namespace
+{
+const char* registerOpName(uint16_t op)
+{
+  switch (static_cast<RegisterOp>(op)) {
+    case ROP_MOVE:
+      return "ROP_MOVE";
+    case ROP_NEGATE:
+      return "ROP_NEGATE";
+    case ROP_NOT:
+      return "ROP_NOT";
+    case ROP_ADD:
+      return "ROP_ADD";
+    case ROP_SUBTRACT:
+      return "ROP_SUBTRACT";
+    case ROP_MULTIPLY:
+      return "ROP_MULTIPLY";
+    case ROP_DIVIDE:
+      return "ROP_DIVIDE";
+    case ROP_EQUAL:
+      return "ROP_EQUAL";
+    case ROP_GREATER:
+      return "ROP_GREATER";
+    case ROP_LESS:
+      return "ROP_LESS";
+    case ROP_PRINT:
+      return "ROP_PRINT";
+    case ROP_RETURN:
+      return "ROP_RETURN";
+    case ROP_DEFINE_GLOBAL:
+      return "ROP_DEFINE_GLOBAL";
+    case ROP_GET_GLOBAL:
+      return "ROP_GET_GLOBAL";
+    case ROP_SET_GLOBAL:
+      return "ROP_SET_GLOBAL";
+    case ROP_GET_UPVALUE:
+      return "ROP_GET_UPVALUE";
+    case ROP_SET_UPVALUE:
+      return "ROP_SET_UPVALUE";
+    case ROP_CLOSE_UPVALUE:
+      return "ROP_CLOSE_UPVALUE";
+    case ROP_JUMP:
+      return "ROP_JUMP";
+    case ROP_JUMP_IF_FALSE:
+      return "ROP_JUMP_IF_FALSE";
+    case ROP_JUMP_IF_NOT_LESS:
+      return "ROP_JUMP_IF_NOT_LESS";
+    case ROP_JUMP_IF_NOT_GREATER:
+      return "ROP_JUMP_IF_NOT_GREATER";
+    case ROP_JUMP_IF_NOT_EQUAL:
+      return "ROP_JUMP_IF_NOT_EQUAL";
+    case ROP_LOOP:
+      return "ROP_LOOP";
+    case ROP_CALL:
+      return "ROP_CALL";
+    case ROP_TAIL_CALL:
+      return "ROP_TAIL_CALL";
+    case ROP_INVOKE:
+      return "ROP_INVOKE";
+    case ROP_SUPER_INVOKE:
+      return "ROP_SUPER_INVOKE";
+    case ROP_CLOSURE:
+      return "ROP_CLOSURE";
+    case ROP_CLASS:
+      return "ROP_CLASS";
+    case ROP_GET_PROPERTY:
+      return "ROP_GET_PROPERTY";
+    case ROP_SET_PROPERTY:
+      return "ROP_SET_PROPERTY";
+    case ROP_METHOD:
+      return "ROP_METHOD";
+    case ROP_INHERIT:
+      return "ROP_INHERIT";
+    case ROP_GET_SUPER:
+      return "ROP_GET_SUPER";
+    case ROP_COUNT:
+      break;
+  }
+
+  return "<unknown>";
+}
+
+}  // namespace
+
+void disassembleRegisterChunk(RegisterChunk* chunk, std::string_view name)
+{
+  assert(chunk != nullptr);
+
+  std::cout << fmt::sprintf("== %s (%d registers) ==\n", name, chunk->frameSize());
+
+  for (size_t offset = 0; offset < chunk->count();) {
+    offset = disassembleRegisterInstruction(chunk, offset);
+  }
+}
+
+size_t disassembleRegisterInstruction(RegisterChunk* chunk, size_t offset)
+{
+  assert(chunk != nullptr);
+
+  std::cout << fmt::sprintf("%04d ", offset);
+
+  if (offset > 0 && chunk->linesAt(offset) == chunk->linesAt(offset - 1)) {
+    std::cout << "   | ";
+  } else {
+    std::cout << fmt::sprintf("%4d ", chunk->linesAt(offset));
+  }
+
+  const uint16_t op = chunk->codeAt(offset);
+  const size_t length = registerInstructionLength(*chunk, offset);
+  std::cout << fmt::sprintf("%-24s", registerOpName(op));
+
+  const char* operands = registerOperands(op);
+  for (size_t i = 0; operands[i] != '\0'; i++) {
+    const uint16_t operand = chunk->codeAt(offset + 1 + i);
+    const size_t end = offset + length;
+
+    switch (operands[i]) {
+      case 'r':
+        if (operand & RK_CONSTANT) {
+          std::cout << fmt::sprintf(
+              " '%s'",
+              toString(chunk->constantsAt(operand & REGISTER_MAX)));
+        } else {
+          std::cout << fmt::sprintf(" r%d", operand);
+        }
+        break;
+      case 'd':
+      case 'b':
+        std::cout << fmt::sprintf(" r%d", operand);
+        break;
+      case 'k':
+        std::cout << fmt::sprintf(" '%s'",
+                                  toString(chunk->constantsAt(operand)));
+        break;
+      case 'j':
+        std::cout << fmt::sprintf(" -> %d", end + operand);
+        break;
+      case 'l':
+        std::cout << fmt::sprintf(" -> %d", end - operand);
+        break;
+      case 'c':
+        std::cout << fmt::sprintf(" ic %d", operand);
+        break;
+      case 'g':
+        std::cout << fmt::sprintf(" g%d", operand);
+        break;
+      default:
+        std::cout << fmt::sprintf(" %d", operand);
+        break;
+    }
+  }
+
+  std::cout << "\n";
+  return offset + length;
+}
@@ -1,6 +1,11 @@
 #pragma once
 
 #include "chunk.h"
+#include "registerchunk.h"
 
 void disassembleChunk(Chunk* chunk, std::string_view name);
-size_t disassembleInstruction(Chunk* chunk, size_t offset);
\ No newline at end of file
+size_t disassembleInstruction(Chunk* chunk, size_t offset);
+const char* opcodeName(uint8_t instruction);
+
+void disassembleRegisterChunk(RegisterChunk* chunk, std::string_view name);
+size_t disassembleRegisterInstruction(RegisterChunk* chunk, size_t offset);
@@ -0,0 +1,62 @@
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+#include "gc.h"
+
+void GcPauses::add(Duration pause)
+{
+  _pauses.push_back(pause);
+  _total += pause;
+
+  const auto us = std::chrono::duration_cast<std::chrono::microseconds>(pause);
+  size_t bucket = 0;
+  for (auto below = us.count(); below > 0; below >>= 1) {
+    bucket++;
+  }
+  if (bucket >= _histogram.size()) {
+    _histogram.resize(bucket + 1);
+  }
+  _histogram[bucket]++;
+}
+
+size_t GcPauses::count() const
+{
+  return _pauses.size();
+}
+
+GcPauses::Duration GcPauses::total() const
+{
+  return _total;
+}
+
+GcPauses::Duration GcPauses::max() const
+{
+  if (_pauses.empty()) {
+    return Duration {0};
+  }
+
+  return *std::max_element(_pauses.begin(), _pauses.end());
+}
+
+GcPauses::Duration GcPauses::percentile(double p) const
+{
+  assert(p >= 0 && p <= 100);
+
+  if (_pauses.empty()) {
+    return Duration {0};
+  }
+
+  // nearest rank
+  std::vector<Duration> sorted = _pauses;
+  const auto rank = static_cast<size_t>(
+      std::ceil(p / 100 * static_cast<double>(sorted.size())));
+  const size_t index = rank == 0 ? 0 : rank - 1;
+  std::nth_element(sorted.begin(), sorted.begin() + index, sorted.end());
+  return sorted[index];
+}
+
+const std::vector<size_t>& GcPauses::histogram() const
+{
+  return _histogram;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "obj.h"
+
+// How a major collection marks the heap: all at once, in slices between
+// which the program goes on, or on a background thread while it goes on.
+enum class GcMode
+{
+  STOP_THE_WORLD,
+  INCREMENTAL,
+  CONCURRENT,
+};
+
+struct GcOptions
+{
+  GcMode mode = GcMode::STOP_THE_WORLD;
+  // objects an incremental slice blackens at most before the program goes on
+  size_t sliceBudget = 10000;
+  // threads that mark the heap in a major collection while the program
+  // stands still
+  size_t markThreads = 1;
+  // Whether a full collection that moves the objects together runs once a
+  // major collection left more than compactThreshold of the pages in use to
+  // spare, see Heap::fragmentation
+  bool compact = false;
+  double compactThreshold = 0.25;
+  // Bytes of objects, and of the buffers they own, at which the first major
+  // collection starts. After each one the next starts once the heap grew by
+  // growthFactor, at heapLimit at the latest. A heap that outgrows heapLimit
+  // even after a full collection stops the program with an error.
+  size_t initialThreshold = 1024u * 1024u;
+  double growthFactor = 2.0;
+  size_t heapLimit = SIZE_MAX;
+};
+
+// How long the program stood still for each collection, slice or step of
+// the collector.
+class GcPauses
+{
+public:
+  using Duration = std::chrono::nanoseconds;
+
+  void add(Duration pause);
+  size_t count() const;
+  Duration total() const;
+  Duration max() const;
+  // the pause that p percent of the pauses do not exceed, p is in [0, 100]
+  Duration percentile(double p) const;
+  // the number of pauses by length: bucket 0 holds the ones shorter than
+  // 1 us, bucket i those shorter than 2^i us but not than 2^(i-1) us
+  const std::vector<size_t>& histogram() const;
+
+private:
+  std::vector<Duration> _pauses;
+  Duration _total {0};
+  std::vector<size_t> _histogram;
+};
+
+// Objects of one type and the bytes they take with the buffers they own.
+struct GcCensus
+{
+  size_t objects = 0;
+  size_t bytes = 0;
+};
+
+// What the collector did so far, see MemoryManager::stats.
+struct GcStats
+{
+  size_t minorCollections = 0;
+  // compacting collections count as major ones as well
+  size_t majorCollections = 0;
+  size_t compactions = 0;
+  // bytes of objects and of the buffers they own
+  size_t bytesAllocated = 0;
+  size_t bytesFreed = 0;
+  size_t heapBytes = 0;
+  // by ObjType, after the last collection, the garbage that the lazy sweep
+  // did not get to yet included
+  std::array<GcCensus, OBJ_TYPE_COUNT> live {};
+  size_t internedStrings = 0;
+  // entries of removed strings the intern table did not reuse yet
+  size_t internTombstones = 0;
+};
@@ -0,0 +1,62 @@
+#include <cassert>
+#include <vector>
+
+#include "globals.h"
+
+#include "memory.h"
+#include "objstring.h"
+
+size_t Globals::resolve(ObjString* name)
+{
+  assert(name != nullptr);
+
+  auto slot = _slots.get(name);
+  if (slot.has_value()) {
+    return static_cast<size_t>(AS_NUMBER(slot.value()));
+  }
+
+  _slots.set(name, Value(static_cast<double>(_names.size())));
+  _names.push_back(name);
+  _values.push_back(UNDEFINED_VALUE());
+  return _names.size() - 1;
+}
+
+size_t Globals::count() const
+{
+  return _names.size();
+}
+
+ObjString* Globals::nameAt(size_t slot) const
+{
+  return _names.at(slot);
+}
+
+Value* Globals::values()
+{
+  return _values.data();
+}
+
+void Globals::define(ObjString* name, Value value)
+{
+  _values[resolve(name)] = value;
+}
+
+void Globals::updateReferences()
+{
+  _slots.updateReferences();
+  for (ObjString*& name : _names) {
+    name = forwarded(name);
+  }
+  for (Value& value : _values) {
+    value = forwarded(value);
+  }
+}
+
+void Globals::mark(MemoryManager* mm)
+{
+  assert(mm != nullptr);
+  _slots.mark(mm);
+  for (const auto& value : _values) {
+    mm->markValue(value);
+  }
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <optional>
+#include <vector>
+
+#include "common.h"
+#include "table.h"
+#include "value.h"
+
+class MemoryManager;
+class ObjString;
+
+// Global variables of a VM, stored by slot. The compiler resolves every
+// global name to a slot once, the VM then reads and writes the slot directly.
+// Slots of globals that are not defined yet hold UNDEFINED_VALUE().
+//
+// Slots are never removed, so code compiled by an earlier call to
+// VM::interpret keeps working in the REPL.
+class Globals
+{
+public:
+  // slot of the global name, added as undefined on first use
+  size_t resolve(ObjString* name);
+
+  size_t count() const;
+  ObjString* nameAt(size_t slot) const;
+  Value* values();
+
+  void define(ObjString* name, Value value);
+
+  void mark(MemoryManager* mm);
+  // points the names and values at the objects that moved
+  void updateReferences();
+
+private:
+  Table _slots;  // name -> slot number
+  std::vector<ObjString*> _names;
+  std::vector<Value> _values;
+};
@@ -0,0 +1,113 @@
+#include <cassert>
+
+#include "graydeque.h"
+
+namespace
+{
+
+constexpr size_t INITIAL_CAPACITY = 256;
+
+}  // namespace
+
+GrayDeque::Buffer::Buffer(size_t size)
+    : capacity(size)
+    , slots(new std::atomic<Obj*>[size])
+{
+  // the index is masked, the capacity is a power of two
+  assert((capacity & (capacity - 1)) == 0);
+}
+
+Obj* GrayDeque::Buffer::get(int64_t index) const
+{
+  return slots[static_cast<size_t>(index) & (capacity - 1)].load(
+      std::memory_order_relaxed);
+}
+
+void GrayDeque::Buffer::put(int64_t index, Obj* object)
+{
+  slots[static_cast<size_t>(index) & (capacity - 1)].store(
+      object, std::memory_order_relaxed);
+}
+
+GrayDeque::GrayDeque()
+{
+  _buffers.push_back(std::make_unique<Buffer>(INITIAL_CAPACITY));
+  _buffer.store(_buffers.back().get(), std::memory_order_relaxed);
+}
+
+GrayDeque::Buffer* GrayDeque::grow(Buffer* buffer, int64_t top, int64_t bottom)
+{
+  _buffers.push_back(std::make_unique<Buffer>(buffer->capacity * 2));
+  Buffer* grown = _buffers.back().get();
+  for (int64_t i = top; i < bottom; i++) {
+    grown->put(i, buffer->get(i));
+  }
+  _buffer.store(grown, std::memory_order_release);
+  return grown;
+}
+
+void GrayDeque::push(Obj* object)
+{
+  const int64_t bottom = _bottom.load(std::memory_order_relaxed);
+  const int64_t top = _top.load(std::memory_order_acquire);
+  Buffer* buffer = _buffer.load(std::memory_order_relaxed);
+
+  if (bottom - top >= static_cast<int64_t>(buffer->capacity)) {
+    buffer = grow(buffer, top, bottom);
+  }
+
+  buffer->put(bottom, object);
+  _bottom.store(bottom + 1, std::memory_order_release);
+}
+
+Obj* GrayDeque::pop()
+{
+  const int64_t bottom = _bottom.load(std::memory_order_relaxed) - 1;
+  Buffer* buffer = _buffer.load(std::memory_order_relaxed);
+  _bottom.store(bottom, std::memory_order_seq_cst);
+  int64_t top = _top.load(std::memory_order_seq_cst);
+
+  if (top > bottom) {
+    _bottom.store(bottom + 1, std::memory_order_relaxed);
+    return nullptr;
+  }
+
+  Obj* object = buffer->get(bottom);
+  if (top == bottom) {
+    // the last one, a thief may be after it as well
+    if (!_top.compare_exchange_strong(
+            top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+    {
+      object = nullptr;
+    }
+    _bottom.store(bottom + 1, std::memory_order_relaxed);
+  }
+
+  return object;
+}
+
+Obj* GrayDeque::steal()
+{
+  int64_t top = _top.load(std::memory_order_seq_cst);
+  const int64_t bottom = _bottom.load(std::memory_order_seq_cst);
+
+  if (top >= bottom) {
+    return nullptr;
+  }
+
+  Buffer* buffer = _buffer.load(std::memory_order_acquire);
+  Obj* object = buffer->get(top);
+  if (!_top.compare_exchange_strong(
+          top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+  {
+    return nullptr;
+  }
+
+  return object;
+}
+
+bool GrayDeque::empty() const
+{
+  return _top.load(std::memory_order_acquire)
+      >= _bottom.load(std::memory_order_acquire);
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+class Obj;
+
+// Work-stealing deque of gray objects, after Chase and Lev. Each marker
+// thread owns one: it pushes and pops objects at the bottom while the other
+// threads steal from the top once they ran out of their own. The buffer grows
+// on demand; the old ones are kept until the deque goes away, a thief may
+// still read from them.
+class GrayDeque
+{
+public:
+  GrayDeque();
+
+  // owner only
+  void push(Obj* object);
+  // owner only, null once it is empty
+  Obj* pop();
+  // null if it is empty or another thread took the object first
+  Obj* steal();
+  bool empty() const;
+
+private:
+  struct Buffer
+  {
+    explicit Buffer(size_t size);
+
+    Obj* get(int64_t index) const;
+    void put(int64_t index, Obj* object);
+
+    size_t capacity;
+    std::unique_ptr<std::atomic<Obj*>[]> slots;
+  };
+
+  Buffer* grow(Buffer* buffer, int64_t top, int64_t bottom);
+
+  // apart, the owner and the thieves write them
+  alignas(64) std::atomic<int64_t> _top {0};
+  alignas(64) std::atomic<int64_t> _bottom {0};
+  std::atomic<Buffer*> _buffer;
+  std::vector<std::unique_ptr<Buffer>> _buffers;
+};
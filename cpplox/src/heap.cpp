@@ -0,0 +1,319 @@
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+#include "heap.h"
+
+namespace
+{
+
+// the slots start on the first granule after the bitmaps
+constexpr size_t FIRST_SLOT =
+    (sizeof(Page) + GRANULE_SIZE - 1) / GRANULE_SIZE * GRANULE_SIZE;
+
+static_assert(FIRST_SLOT + MAX_SLOT_SIZE <= HEAP_PAGE_SIZE);
+
+}  // namespace
+
+void Page::format(size_t size)
+{
+  assert(empty());
+  assert(size % GRANULE_SIZE == 0 && size <= MAX_SLOT_SIZE);
+
+  _slotSize = size;
+  for (uint64_t& allocated : _allocated) {
+    allocated = 0;
+  }
+  for (std::atomic<uint64_t>& marks : _marks) {
+    marks.store(0, std::memory_order_relaxed);
+  }
+
+  // the first slot comes first off the free list
+  _freeList = nullptr;
+  const size_t slots = (HEAP_PAGE_SIZE - FIRST_SLOT) / size;
+  _slotCount = slots;
+  for (size_t i = slots; i > 0; i--) {
+    void* slot = reinterpret_cast<char*>(this) + FIRST_SLOT + (i - 1) * size;
+    *static_cast<void**>(slot) = _freeList;
+    _freeList = slot;
+  }
+}
+
+Heap::Heap(Destroy destroy, void* data)
+    : _destroy(destroy)
+    , _data(data)
+{
+}
+
+Heap::~Heap()
+{
+  for (Page* page : _pages) {
+    std::free(page);
+  }
+  for (Page* page : _emptyPages) {
+    std::free(page);
+  }
+}
+
+void Heap::free(void* slot)
+{
+  Page* page = Page::of(slot);
+  page->give(slot);
+
+  const size_t sizeClass = page->slotSize() / GRANULE_SIZE;
+  if (page == _current[sizeClass]) {
+    return;
+  }
+
+  if (page->empty()) {
+    release(page, sizeClass);
+  } else if (!page->_isAvailable) {
+    makeAvailable(page, sizeClass);
+  }
+}
+
+void Heap::startSweeping()
+{
+  assert(!sweeping());
+  for (size_t sizeClass = 0; sizeClass < SIZE_CLASSES; sizeClass++) {
+    _current[sizeClass] = nullptr;
+    while (_available[sizeClass] != nullptr) {
+      makeUnavailable(_available[sizeClass], sizeClass);
+    }
+  }
+
+  for (Page* page : _pages) {
+    _unswept[page->slotSize() / GRANULE_SIZE].push_back(page);
+  }
+  _unsweptPages = _pages.size();
+  for (size_t sizeClass = 0; sizeClass < SIZE_CLASSES; sizeClass++) {
+    _sweptPages[sizeClass] = 0;
+    _sweptObjects[sizeClass] = 0;
+  }
+}
+
+void Heap::sweepPages(size_t count)
+{
+  for (size_t sizeClass = 0; sizeClass < SIZE_CLASSES && count > 0;
+       sizeClass++)
+  {
+    std::vector<Page*>& unswept = _unswept[sizeClass];
+    while (!unswept.empty() && count > 0) {
+      Page* page = unswept.back();
+      unswept.pop_back();
+      sweepPage(page);
+      count--;
+    }
+  }
+}
+
+void Heap::finishSweeping()
+{
+  sweepPages(_unsweptPages);
+}
+
+void Heap::sweepPage(Page* page)
+{
+  page->sweep([this, page](void* slot) {
+    _destroy(slot, _data);
+    page->give(slot);
+  });
+
+  const size_t sizeClass = page->slotSize() / GRANULE_SIZE;
+  if (page->empty()) {
+    release(page, sizeClass);
+  } else {
+    _sweptPages[sizeClass]++;
+    _sweptObjects[sizeClass] += page->_liveCount;
+    if (page->_freeList != nullptr) {
+      makeAvailable(page, sizeClass);
+    }
+  }
+
+  _unsweptPages--;
+  if (_unsweptPages == 0) {
+    trim();
+  }
+}
+
+void Heap::trim()
+{
+  while (_emptyPages.size() > _pages.size()) {
+    std::free(_emptyPages.back());
+    _emptyPages.pop_back();
+  }
+}
+
+double Heap::fragmentation() const
+{
+  const size_t slotArea = HEAP_PAGE_SIZE - FIRST_SLOT;
+  size_t pages = 0;
+  size_t spare = 0;
+  for (size_t sizeClass = 1; sizeClass < SIZE_CLASSES; sizeClass++) {
+    const size_t slots = slotArea / (sizeClass * GRANULE_SIZE);
+    const size_t needed = (_sweptObjects[sizeClass] + slots - 1) / slots;
+    pages += _sweptPages[sizeClass];
+    spare += _sweptPages[sizeClass] - needed;
+  }
+
+  return pages > 0 ? static_cast<double>(spare) / static_cast<double>(pages)
+                   : 0.0;
+}
+
+void Heap::evacuate(Movable movable, Move move)
+{
+  assert(!sweeping());
+  assert(_evacuatedPages.empty());
+
+  // the free slots of the pages that are left get available again once the
+  // evacuation is done
+  std::vector<Page*> classes[SIZE_CLASSES];
+  for (size_t sizeClass = 0; sizeClass < SIZE_CLASSES; sizeClass++) {
+    _current[sizeClass] = nullptr;
+    while (_available[sizeClass] != nullptr) {
+      makeUnavailable(_available[sizeClass], sizeClass);
+    }
+  }
+  for (Page* page : _pages) {
+    classes[page->slotSize() / GRANULE_SIZE].push_back(page);
+  }
+
+  for (std::vector<Page*>& pages : classes) {
+    std::sort(pages.begin(), pages.end(), [](const Page* a, const Page* b) {
+      return a->_liveCount < b->_liveCount;
+    });
+
+    // the sparsest pages move into the densest ones, as long as their
+    // objects fit into the free slots of the denser ones
+    size_t dense = pages.size();
+    size_t room = 0;
+    std::vector<Page*> targets;
+    for (size_t sparse = 0; sparse < dense; sparse++) {
+      Page* page = pages[sparse];
+      bool allMovable = true;
+      page->forEachSlot([&allMovable, movable](void* slot) {
+        allMovable = allMovable && movable(slot);
+      });
+      if (!allMovable) {
+        continue;
+      }
+
+      while (room < page->_liveCount && dense - 1 > sparse) {
+        dense--;
+        if (pages[dense]->freeSlots() > 0) {
+          room += pages[dense]->freeSlots();
+          targets.push_back(pages[dense]);
+        }
+      }
+      if (room < page->_liveCount) {
+        break;
+      }
+
+      page->forEachSlot([this, &targets, move](void* slot) {
+        void* to = targets.back()->take();
+        if (targets.back()->_freeList == nullptr) {
+          targets.pop_back();
+        }
+        move(slot, to, _data);
+        *static_cast<void**>(slot) = to;
+      });
+      room -= page->_liveCount;
+      page->_evacuated = true;
+      _evacuatedPages.push_back(page);
+    }
+  }
+}
+
+void Heap::finishEvacuation()
+{
+  for (Page* page : _evacuatedPages) {
+    // format clears the bitmaps once the page gets used again
+    page->_liveCount = 0;
+    page->_evacuated = false;
+    release(page, page->slotSize() / GRANULE_SIZE);
+  }
+  _evacuatedPages.clear();
+
+  for (Page* page : _pages) {
+    if (page->_freeList != nullptr) {
+      makeAvailable(page, page->slotSize() / GRANULE_SIZE);
+    }
+  }
+  trim();
+}
+
+void* Heap::allocateSlow(size_t sizeClass)
+{
+  // the unswept pages of the size first, rather than growing the heap
+  std::vector<Page*>& unswept = _unswept[sizeClass];
+  while (_available[sizeClass] == nullptr && !unswept.empty()) {
+    Page* page = unswept.back();
+    unswept.pop_back();
+    sweepPage(page);
+  }
+
+  Page* page = _available[sizeClass];
+  if (page != nullptr) {
+    makeUnavailable(page, sizeClass);
+  } else if (!_emptyPages.empty()) {
+    page = _emptyPages.back();
+    _emptyPages.pop_back();
+  } else {
+    void* memory = std::aligned_alloc(HEAP_PAGE_SIZE, HEAP_PAGE_SIZE);
+    if (memory == nullptr) {
+      throw std::bad_alloc();
+    }
+    page = new (memory) Page();
+  }
+
+  if (page->empty()) {
+    page->format(sizeClass * GRANULE_SIZE);
+    page->_index = _pages.size();
+    _pages.push_back(page);
+  }
+
+  // the page it leaves gets available again once a slot of it is freed
+  _current[sizeClass] = page;
+  return page->take();
+}
+
+void Heap::makeAvailable(Page* page, size_t sizeClass)
+{
+  page->_isAvailable = true;
+  page->_previousAvailable = nullptr;
+  page->_nextAvailable = _available[sizeClass];
+  if (_available[sizeClass] != nullptr) {
+    _available[sizeClass]->_previousAvailable = page;
+  }
+  _available[sizeClass] = page;
+}
+
+void Heap::makeUnavailable(Page* page, size_t sizeClass)
+{
+  if (page->_previousAvailable != nullptr) {
+    page->_previousAvailable->_nextAvailable = page->_nextAvailable;
+  } else {
+    _available[sizeClass] = page->_nextAvailable;
+  }
+  if (page->_nextAvailable != nullptr) {
+    page->_nextAvailable->_previousAvailable = page->_previousAvailable;
+  }
+  page->_isAvailable = false;
+  page->_previousAvailable = nullptr;
+  page->_nextAvailable = nullptr;
+}
+
+void Heap::release(Page* page, size_t sizeClass)
+{
+  if (page->_isAvailable) {
+    makeUnavailable(page, sizeClass);
+  }
+
+  Page* last = _pages.back();
+  last->_index = page->_index;
+  _pages[page->_index] = last;
+  _pages.pop_back();
+
+  _emptyPages.push_back(page);
+}
@@ -0,0 +1,331 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+// bytes of a page, pages are aligned to their size so that the page of an
+// object is its address rounded down
+constexpr size_t HEAP_PAGE_SIZE = 64u * 1024u;
+// objects start on a granule and take whole ones
+constexpr size_t GRANULE_SIZE = 16;
+constexpr size_t GRANULES_PER_PAGE = HEAP_PAGE_SIZE / GRANULE_SIZE;
+// the largest object the heap has slots for
+constexpr size_t MAX_SLOT_SIZE = 512;
+
+// A page of slots of one size. Which slots hold an object and the mark state
+// of every object are kept in bitmaps at the start of the page, apart from
+// the objects: sweeping a page reads its bitmaps and touches only the
+// objects it frees.
+class Page
+{
+public:
+  // An object gets gray once it is marked and black once its references
+  // were marked. A thread that scans an object on the marker thread holds it
+  // in between, so that the program never changes an object while the marker
+  // reads it and the other way round.
+  enum MarkState : uint64_t
+  {
+    WHITE,
+    GRAY,
+    SCANNING,
+    BLACK,
+  };
+
+  static Page* of(const void* slot)
+  {
+    return reinterpret_cast<Page*>(reinterpret_cast<uintptr_t>(slot)
+                                   & ~(HEAP_PAGE_SIZE - 1));
+  }
+
+  // takes the page for slots of size bytes, it has to be empty
+  void format(size_t size);
+  size_t slotSize() const { return _slotSize; }
+  bool empty() const { return _liveCount == 0; }
+  size_t freeSlots() const { return _slotCount - _liveCount; }
+
+  // a free slot, null if there is none
+  void* take()
+  {
+    void* slot = _freeList;
+    if (slot != nullptr) {
+      _freeList = *static_cast<void**>(slot);
+      const size_t index = granule(slot);
+      _allocated[index / 64] |= uint64_t {1} << (index % 64);
+      _liveCount++;
+    }
+    return slot;
+  }
+
+  // the object in slot was destroyed
+  void give(void* slot)
+  {
+    const size_t index = granule(slot);
+    assert(_allocated[index / 64] & (uint64_t {1} << (index % 64)));
+    _allocated[index / 64] &= ~(uint64_t {1} << (index % 64));
+    *static_cast<void**>(slot) = _freeList;
+    _freeList = slot;
+    _liveCount--;
+  }
+
+  // calls visit with every slot that holds an object
+  template<typename Visit>
+  void forEachSlot(Visit&& visit)
+  {
+    for (size_t i = 0; i < GRANULES_PER_PAGE / 64; i++) {
+      // visit may give the slot back
+      uint64_t slots = _allocated[i];
+      while (slots != 0) {
+        const size_t index = i * 64 + __builtin_ctzll(slots);
+        slots &= slots - 1;
+        visit(slotAt(index));
+      }
+    }
+  }
+
+  // calls free with every slot that holds an unmarked object, free has to
+  // give it back, and clears the marks of the others
+  template<typename Free>
+  void sweep(Free&& free)
+  {
+    forEachSlot([this, &free](void* slot) {
+      if (markState(slot) == WHITE) {
+        free(slot);
+      }
+    });
+
+    for (std::atomic<uint64_t>& marks : _marks) {
+      marks.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  MarkState markState(const void* slot) const
+  {
+    const size_t index = granule(slot);
+    return static_cast<MarkState>(
+        (_marks[index / 32].load(std::memory_order_relaxed)
+         >> markShift(index))
+        & 3);
+  }
+
+  // Marks gray or white. The marker must not run, this is no atomic
+  // transition of the state.
+  void setMarked(const void* slot, bool marked)
+  {
+    const size_t index = granule(slot);
+    std::atomic<uint64_t>& marks = _marks[index / 32];
+    marks.fetch_and(~(uint64_t {3} << markShift(index)),
+                    std::memory_order_relaxed);
+    if (marked) {
+      marks.fetch_or(uint64_t {GRAY} << markShift(index),
+                     std::memory_order_relaxed);
+    }
+  }
+
+  // marks a white object gray, false if it was marked already
+  bool shade(const void* slot)
+  {
+    const size_t index = granule(slot);
+    std::atomic<uint64_t>& marks = _marks[index / 32];
+    uint64_t word = marks.load(std::memory_order_relaxed);
+    while (true) {
+      if (((word >> markShift(index)) & 3) != WHITE) {
+        return false;
+      }
+
+      if (marks.compare_exchange_weak(
+              word,
+              word | (uint64_t {GRAY} << markShift(index)),
+              std::memory_order_relaxed))
+      {
+        return true;
+      }
+    }
+  }
+
+  // Takes a white or gray object to scan it, waits while another thread
+  // scans it. False once it is black.
+  bool beginScan(const void* slot)
+  {
+    const size_t index = granule(slot);
+    const uint64_t mask = uint64_t {3} << markShift(index);
+    std::atomic<uint64_t>& marks = _marks[index / 32];
+    uint64_t word = marks.load(std::memory_order_acquire);
+    while (true) {
+      const uint64_t state = (word & mask) >> markShift(index);
+      if (state == BLACK) {
+        return false;
+      }
+
+      if (state == SCANNING) {
+        std::this_thread::yield();
+        word = marks.load(std::memory_order_acquire);
+        continue;
+      }
+
+      if (marks.compare_exchange_weak(
+              word,
+              (word & ~mask) | (uint64_t {SCANNING} << markShift(index)),
+              std::memory_order_acquire))
+      {
+        return true;
+      }
+    }
+  }
+
+  void endScan(const void* slot)
+  {
+    const size_t index = granule(slot);
+    _marks[index / 32].fetch_or(uint64_t {BLACK} << markShift(index),
+                                std::memory_order_release);
+  }
+
+private:
+  friend class Heap;
+
+  static size_t granule(const void* slot)
+  {
+    return (reinterpret_cast<uintptr_t>(slot) & (HEAP_PAGE_SIZE - 1))
+        / GRANULE_SIZE;
+  }
+
+  static unsigned markShift(size_t index)
+  {
+    return static_cast<unsigned>(index % 32) * 2;
+  }
+
+  void* slotAt(size_t index)
+  {
+    return reinterpret_cast<char*>(this) + index * GRANULE_SIZE;
+  }
+
+  // a bit for every granule that starts an object
+  uint64_t _allocated[GRANULES_PER_PAGE / 64] = {};
+  // two bits for every granule, its MarkState
+  std::atomic<uint64_t> _marks[GRANULES_PER_PAGE / 32] = {};
+  void* _freeList = nullptr;
+  size_t _slotSize = 0;
+  size_t _slotCount = 0;
+  size_t _liveCount = 0;
+  // where the page is in Heap::_pages
+  size_t _index = 0;
+  // the pages of a size with free slots that allocation goes back to
+  Page* _previousAvailable = nullptr;
+  Page* _nextAvailable = nullptr;
+  bool _isAvailable = false;
+  // the objects moved out, each slot holds the address of its object
+  bool _evacuated = false;
+};
+
+// Segregated heap of pages. Each size, rounded up to whole granules, gets
+// pages of its own and takes slots from their free lists; a page that gets
+// empty goes back to a pool that every size takes pages from.
+//
+// Pages are swept lazily once the marking is done. Allocation sweeps the
+// pages of the size it needs until it finds a free slot, the collector
+// sweeps a few more now and then with sweepPages, and the marks of a page
+// stay until it is swept. New objects only get slots on swept pages.
+//
+// Objects do not move unless the heap is evacuated: the objects on the
+// sparsest pages of each size move to the densest ones, and each slot left
+// behind points at where its object went until the references to it were
+// updated.
+class Heap
+{
+public:
+  // runs the destructor of the unmarked object in slot
+  using Destroy = void (*)(void* slot, void* data);
+  // whether the object in slot may move
+  using Movable = bool (*)(const void* slot);
+  // moves the object in from to the free slot to, from is left destroyed
+  using Move = void (*)(void* from, void* to, void* data);
+
+  Heap(Destroy destroy, void* data);
+  Heap(const Heap&) = delete;
+  Heap& operator=(const Heap&) = delete;
+  ~Heap();
+
+  void* allocate(size_t size)
+  {
+    assert(size > 0 && size <= MAX_SLOT_SIZE);
+    const size_t sizeClass = (size + GRANULE_SIZE - 1) / GRANULE_SIZE;
+    Page* page = _current[sizeClass];
+    void* slot = page != nullptr ? page->take() : nullptr;
+    return slot != nullptr ? slot : allocateSlow(sizeClass);
+  }
+
+  // the object in slot was destroyed, its page has to be swept
+  void free(void* slot);
+
+  // calls visit with every slot that holds an object, visit may free it
+  template<typename Visit>
+  void forEachObject(Visit&& visit)
+  {
+    // backwards, freeing the last object of a page moves another one into
+    // its place
+    for (size_t i = _pages.size(); i > 0; i--) {
+      if (!_pages[i - 1]->_evacuated) {
+        _pages[i - 1]->forEachSlot(visit);
+      }
+    }
+  }
+
+  // once the marking is done, every page has to be swept
+  void startSweeping();
+  // sweeps up to count pages
+  void sweepPages(size_t count);
+  // sweeps the pages that are left, the next marking needs clear marks
+  void finishSweeping();
+  bool sweeping() const { return _unsweptPages > 0; }
+
+  size_t pageCount() const { return _pages.size(); }
+  // The share of the pages that kept objects in the last sweep that packing
+  // those objects as tight as possible would have freed. The pages the
+  // program allocated into since do not count.
+  double fragmentation() const;
+
+  // Moves the objects of the sparse pages whose objects are all movable,
+  // the heap must not be sweeping. Every reference to a moved object has to
+  // be updated through forwarded before finishEvacuation.
+  void evacuate(Movable movable, Move move);
+  // where the object that was in slot is now
+  static void* forwarded(void* slot)
+  {
+    return Page::of(slot)->_evacuated ? *static_cast<void**>(slot) : slot;
+  }
+  // the pages moved out get empty
+  void finishEvacuation();
+
+private:
+  static constexpr size_t SIZE_CLASSES = MAX_SLOT_SIZE / GRANULE_SIZE + 1;
+
+  void* allocateSlow(size_t sizeClass);
+  void sweepPage(Page* page);
+  // gives empty pages back to the system, keeps as many as there are pages
+  // in use: the heap grows back to twice its size until the next major
+  // collection
+  void trim();
+  void makeAvailable(Page* page, size_t sizeClass);
+  void makeUnavailable(Page* page, size_t sizeClass);
+  void release(Page* page, size_t sizeClass);
+
+  Destroy _destroy;
+  void* _data;
+  // every page in use
+  std::vector<Page*> _pages;
+  // the page each size takes slots from
+  Page* _current[SIZE_CLASSES] = {};
+  // the other swept pages of each size with free slots
+  Page* _available[SIZE_CLASSES] = {};
+  // the pages of each size that were not swept since the last marking
+  std::vector<Page*> _unswept[SIZE_CLASSES];
+  size_t _unsweptPages = 0;
+  // the pages of each size that kept objects in the last sweep, and how many
+  size_t _sweptPages[SIZE_CLASSES] = {};
+  size_t _sweptObjects[SIZE_CLASSES] = {};
+  std::vector<Page*> _emptyPages;
+  std::vector<Page*> _evacuatedPages;
+};
@@ -0,0 +1,51 @@
+#include <cassert>
+
+#include "inlinecache.h"
+
+void InlineCache::addField(const Shape* shape, uint64_t epoch, size_t index)
+{
+  add(InlineCacheEntry {shape, epoch, nullptr, nullptr, index});
+}
+
+void InlineCache::addMethod(const Shape* shape,
+                            uint64_t epoch,
+                            ObjClosure* method)
+{
+  assert(method != nullptr);
+  add(InlineCacheEntry {shape, epoch, method, nullptr, 0});
+}
+
+void InlineCache::addTransition(const Shape* shape,
+                                uint64_t epoch,
+                                Shape* transition,
+                                size_t index)
+{
+  assert(transition != nullptr);
+  add(InlineCacheEntry {shape, epoch, nullptr, transition, index});
+}
+
+void InlineCache::add(const InlineCacheEntry& entry)
+{
+  assert(entry.shape != nullptr);
+
+  // reuses the entry of the shape if it is outdated, then any unused one.
+  // Entries of other classes have their own epochs, so a different epoch
+  // does not tell that they are outdated.
+  for (auto& existing : _entries) {
+    if (existing.shape == entry.shape) {
+      existing = entry;
+      return;
+    }
+  }
+
+  // Unused entries have epoch 0, so this is the first unused one if there
+  // is any. Otherwise it evicts the entry of the class declared or changed
+  // the longest ago, entries of dead classes would stay forever else.
+  InlineCacheEntry* oldest = &_entries[0];
+  for (auto& existing : _entries) {
+    if (existing.epoch < oldest->epoch) {
+      oldest = &existing;
+    }
+  }
+  *oldest = entry;
+}
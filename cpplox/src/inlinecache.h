@@ -0,0 +1,70 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include "common.h"
+
+class ObjClosure;
+class Shape;
+
+// Number of receiver shapes an inline cache remembers before it evicts
+// entries for new ones. The first entry makes the cache monomorphic, the
+// others make it polymorphic.
+constexpr size_t INLINE_CACHE_ENTRIES = 4;
+
+// Result of a property lookup for one receiver shape. A shape belongs to a
+// single class and fixes the slot of every field, so it also tells that the
+// instance has no field shadowing a cached method.
+struct InlineCacheEntry
+{
+  const Shape* shape = nullptr;
+  uint64_t epoch = 0;  // 0 marks an unused entry
+  ObjClosure* method = nullptr;  // set for methods
+  Shape* transition = nullptr;  // set for stores adding the field
+  size_t index = 0;  // slot of the field
+};
+
+// Per-instruction cache of OP_GET_PROPERTY, OP_SET_PROPERTY and OP_INVOKE.
+//
+// Entries are only valid for the epoch of the receiver's class they were
+// created in. Every class gets a new epoch when it is created or its methods
+// change (OP_METHOD and OP_INHERIT), which drops the cached methods of that
+// class alone. Epochs are never handed out twice, which also guards against
+// the shapes of a freed class whose address is reused, so the cache does not
+// need to keep anything alive.
+class InlineCache
+{
+public:
+  const InlineCacheEntry* lookup(const Shape* shape, uint64_t epoch) const
+  {
+    for (const auto& entry : _entries) {
+      if (entry.shape == shape && entry.epoch == epoch) {
+        return &entry;
+      }
+    }
+
+    return nullptr;
+  }
+
+  // the only entry, nullptr unless the cache is monomorphic
+  const InlineCacheEntry* monomorphic() const
+  {
+    return _entries[0].epoch != 0 && _entries[1].epoch == 0 ? &_entries[0]
+                                                           : nullptr;
+  }
+
+  void addField(const Shape* shape, uint64_t epoch, size_t index);
+  void addMethod(const Shape* shape, uint64_t epoch, ObjClosure* method);
+  // a store adding a field moves the instance from shape to transition
+  void addTransition(const Shape* shape,
+                     uint64_t epoch,
+                     Shape* transition,
+                     size_t index);
+
+private:
+  void add(const InlineCacheEntry& entry);
+
+  std::array<InlineCacheEntry, INLINE_CACHE_ENTRIES> _entries;
+};
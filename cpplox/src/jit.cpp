@@ -0,0 +1,572 @@
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "jit.h"
+
+#include "chunk.h"
+#include "jitassembler.h"
+#include "value.h"
+#include "x64assembler.h"
+
+#ifdef LOX_JIT
+
+#  include <sys/mman.h>
+#  include <unistd.h>
+
+#  ifndef NAN_BOXING
+#    error "the JIT needs NaN-boxed values"
+#  endif
+
+namespace
+{
+
+constexpr Reg STATE = JitAssembler::STATE;
+constexpr Reg QNAN_MASK = JitAssembler::QNAN_MASK;
+constexpr Reg STACK_TOP = JitAssembler::STACK_TOP;
+
+constexpr uint64_t NIL_BITS = JitAssembler::NIL_BITS;
+constexpr uint64_t FALSE_BITS = JitAssembler::FALSE_BITS;
+constexpr uint64_t TRUE_BITS = JitAssembler::TRUE_BITS;
+
+constexpr int32_t VALUE_SIZE = JitAssembler::VALUE_SIZE;
+
+Mem field(size_t offset)
+{
+  return JitAssembler::field(offset);
+}
+
+Mem local(size_t slot)
+{
+  return JitAssembler::local(slot);
+}
+
+Mem constant(size_t index)
+{
+  return JitAssembler::constant(index);
+}
+
+Mem global(size_t slot)
+{
+  return JitAssembler::global(slot);
+}
+
+// value distance slots below the top of the stack, like VM::peek
+Mem peek(int distance)
+{
+  return Mem {STACK_TOP, -(distance + 1) * VALUE_SIZE};
+}
+
+// Translates a chunk into machine code. The code starts with the entry
+// stub, which saves the registers, loads the interpreter state and jumps to
+// the instruction it is asked to start at. Every instruction is followed by
+// the next one, the exits back to the interpreter are stubs at the end.
+class JitCompiler
+{
+public:
+  JitCompiler(const Chunk& chunk,
+              const JitRuntime& runtime,
+              const std::vector<size_t>& exits)
+      : _chunk(chunk)
+      , _runtime(runtime)
+      , _leave(exits)
+      , _exits(chunk.count(), NO_LABEL)
+  {
+    for (size_t offset = 0; offset < chunk.count(); offset++) {
+      _instructions.push_back(_asm.newLabel());
+    }
+    _exit = _asm.newLabel();
+  }
+
+  std::vector<uint8_t> compile(std::vector<uint32_t>* entries)
+  {
+    entries->assign(_chunk.count(), 0);
+
+    entry();
+    for (size_t offset = 0; offset < _chunk.count();
+         offset += instructionLength(_chunk, offset))
+    {
+      (*entries)[offset] = static_cast<uint32_t>(_asm.size());
+      _asm.bind(_instructions[offset]);
+      if (std::find(_leave.begin(), _leave.end(), offset) != _leave.end()) {
+        _asm.jmp(exitAt(offset));
+      } else {
+        instruction(offset);
+      }
+    }
+
+    exitStubs();
+    return _asm.finish();
+  }
+
+private:
+  static constexpr Label NO_LABEL = SIZE_MAX;
+
+  void entry()
+  {
+    // size_t entry(JitState* state, const void* start)
+    _asm.prologue();
+    _asm.jmp(Reg::RSI);
+  }
+
+  void exitStubs()
+  {
+    for (size_t offset = 0; offset < _exits.size(); offset++) {
+      if (_exits[offset] != NO_LABEL) {
+        _asm.bind(_exits[offset]);
+        _asm.movq(Reg::RAX, static_cast<uint64_t>(offset));
+        _asm.jmp(_exit);
+      }
+    }
+
+    // returns the offset in rax
+    _asm.bind(_exit);
+    _asm.movq(field(offsetof(JitState, stackTop)), STACK_TOP);
+    _asm.epilogue();
+  }
+
+  // leaves to the interpreter, which runs the instruction at offset
+  Label exitAt(size_t offset)
+  {
+    if (_exits[offset] == NO_LABEL) {
+      _exits[offset] = _asm.newLabel();
+    }
+
+    return _exits[offset];
+  }
+
+  Label jumpTarget(size_t offset)
+  {
+    assert(offset < _instructions.size());
+    return _instructions[offset];
+  }
+
+  // calls the runtime function of the instruction at offset if it has one,
+  // leaves to the interpreter otherwise
+  void runtimeCall(size_t offset)
+  {
+    const JitFunction function = _runtime[baseOpcode(_chunk.codeAt(offset))];
+    if (function == nullptr) {
+      _asm.jmp(exitAt(offset));
+      return;
+    }
+
+    _asm.movq(field(offsetof(JitState, stackTop)), STACK_TOP);
+    _asm.callRuntime(function, offset);
+    _asm.movq(STACK_TOP, field(offsetof(JitState, stackTop)));
+    static_assert(JIT_CONTINUE == SIZE_MAX, "compared as -1");
+    _asm.cmpq(Reg::RAX, -1);
+    _asm.j(Condition::NOT_EQUAL, _exit);
+  }
+
+  void push(Reg value)
+  {
+    _asm.movq(Mem {STACK_TOP, 0}, value);
+    _asm.addq(STACK_TOP, VALUE_SIZE);
+  }
+
+  void drop(int count)
+  {
+    if (count == 0) {
+      return;
+    }
+
+    _asm.subq(STACK_TOP, count * VALUE_SIZE);
+  }
+
+  // leaves to the interpreter at offset unless the value is a number,
+  // clobbers rdx
+  void guardNumber(Reg value, size_t offset)
+  {
+    _asm.guardNumber(value, exitAt(offset));
+  }
+
+  void testFalsey(Reg value)
+  {
+    _asm.testFalsey(value);
+  }
+
+  void jumpIfNotEqual(Label notEqual)
+  {
+    _asm.jumpIfNotEqual(notEqual);
+  }
+
+  // loads the operands of a binary instruction into xmm0 and xmm1 and pops
+  // them, leaves to the interpreter if they are not both numbers
+  void numberOperands(Mem a, Mem b, size_t offset, int popCount)
+  {
+    _asm.movq(Reg::RAX, a);
+    _asm.movq(Reg::RCX, b);
+    guardNumber(Reg::RAX, offset);
+    guardNumber(Reg::RCX, offset);
+    drop(popCount);
+    _asm.movq(Xmm::XMM0, Reg::RAX);
+    _asm.movq(Xmm::XMM1, Reg::RCX);
+  }
+
+  void arithmetic(void (X64Assembler::*op)(Xmm, Xmm), size_t offset)
+  {
+    numberOperands(peek(1), peek(0), offset, 2);
+    (_asm.*op)(Xmm::XMM0, Xmm::XMM1);
+    _asm.movq(Reg::RAX, Xmm::XMM0);
+    push(Reg::RAX);
+  }
+
+  // pushes a > b, which is false if either is NaN
+  void greater(Xmm a, Xmm b, size_t offset)
+  {
+    numberOperands(peek(1), peek(0), offset, 2);
+    _asm.ucomisd(a, b);
+    _asm.movq(Reg::RAX, FALSE_BITS);
+    _asm.movq(Reg::RDX, TRUE_BITS);
+    _asm.cmovq(Condition::ABOVE, Reg::RAX, Reg::RDX);
+    push(Reg::RAX);
+  }
+
+  // jumps unless a > b
+  void jumpIfNotGreater(Xmm a, Xmm b, size_t offset)
+  {
+    const size_t next = offset + 3;
+    numberOperands(peek(1), peek(0), offset, 2);
+    _asm.ucomisd(a, b);
+    _asm.j(Condition::BELOW_EQUAL,
+           jumpTarget(next + _chunk.shortAt(offset + 1)));
+  }
+
+  // pushes the sum of a local and another operand, like the ADD they fuse
+  void addLocal(Mem b, size_t offset, void (X64Assembler::*op)(Xmm, Xmm))
+  {
+    numberOperands(local(_chunk.codeAt(offset + 1)), b, offset, 0);
+    (_asm.*op)(Xmm::XMM0, Xmm::XMM1);
+    _asm.movq(Reg::RAX, Xmm::XMM0);
+    push(Reg::RAX);
+  }
+
+  void instruction(size_t offset)
+  {
+    const size_t next = offset + instructionLength(_chunk, offset);
+
+    switch (baseOpcode(_chunk.codeAt(offset))) {
+      case OP_CONSTANT:
+        _asm.movq(Reg::RAX, constant(_chunk.codeAt(offset + 1)));
+        push(Reg::RAX);
+        break;
+
+      case OP_CONSTANT_LONG:
+        _asm.movq(Reg::RAX, constant(_chunk.shortAt(offset + 1)));
+        push(Reg::RAX);
+        break;
+
+      case OP_NIL:
+        _asm.movq(Reg::RAX, NIL_BITS);
+        push(Reg::RAX);
+        break;
+
+      case OP_TRUE:
+        _asm.movq(Reg::RAX, TRUE_BITS);
+        push(Reg::RAX);
+        break;
+
+      case OP_FALSE:
+        _asm.movq(Reg::RAX, FALSE_BITS);
+        push(Reg::RAX);
+        break;
+
+      case OP_NEGATE:
+        _asm.movq(Reg::RAX, peek(0));
+        guardNumber(Reg::RAX, offset);
+        _asm.movq(Reg::RCX, SIGN_BIT);
+        _asm.xorq(Reg::RAX, Reg::RCX);
+        _asm.movq(peek(0), Reg::RAX);
+        break;
+
+      case OP_NOT:
+        _asm.movq(Reg::RAX, peek(0));
+        testFalsey(Reg::RAX);
+        _asm.movq(Reg::RAX, FALSE_BITS);
+        _asm.movq(Reg::RDX, TRUE_BITS);
+        _asm.cmovq(Condition::BELOW_EQUAL, Reg::RAX, Reg::RDX);
+        _asm.movq(peek(0), Reg::RAX);
+        break;
+
+      case OP_ADD:
+        arithmetic(&X64Assembler::addsd, offset);
+        break;
+
+      case OP_SUBTRACT:
+        arithmetic(&X64Assembler::subsd, offset);
+        break;
+
+      case OP_MULTIPLY:
+        arithmetic(&X64Assembler::mulsd, offset);
+        break;
+
+      case OP_DIVIDE:
+        arithmetic(&X64Assembler::divsd, offset);
+        break;
+
+      case OP_EQUAL: {
+        const Label notEqual = _asm.newLabel();
+        const Label done = _asm.newLabel();
+        _asm.movq(Reg::RAX, peek(1));
+        _asm.movq(Reg::RCX, peek(0));
+        drop(2);
+        jumpIfNotEqual(notEqual);
+        _asm.movq(Reg::RAX, TRUE_BITS);
+        _asm.jmp(done);
+        _asm.bind(notEqual);
+        _asm.movq(Reg::RAX, FALSE_BITS);
+        _asm.bind(done);
+        push(Reg::RAX);
+        break;
+      }
+
+      case OP_GREATER:
+        greater(Xmm::XMM0, Xmm::XMM1, offset);
+        break;
+
+      case OP_LESS:
+        greater(Xmm::XMM1, Xmm::XMM0, offset);
+        break;
+
+      case OP_POP:
+        drop(1);
+        break;
+
+      case OP_POP_N:
+        drop(_chunk.codeAt(offset + 1));
+        break;
+
+      case OP_DEFINE_GLOBAL:
+        _asm.movq(Reg::RAX, peek(0));
+        _asm.movq(global(_chunk.shortAt(offset + 1)), Reg::RAX);
+        drop(1);
+        break;
+
+      case OP_GET_GLOBAL:
+        _asm.movq(Reg::RAX, global(_chunk.shortAt(offset + 1)));
+        _asm.movq(Reg::RCX, UNDEFINED_BITS);
+        _asm.cmpq(Reg::RAX, Reg::RCX);
+        _asm.j(Condition::EQUAL, exitAt(offset));
+        push(Reg::RAX);
+        break;
+
+      case OP_SET_GLOBAL: {
+        const Mem slot = global(_chunk.shortAt(offset + 1));
+        _asm.movq(Reg::RAX, slot);
+        _asm.movq(Reg::RCX, UNDEFINED_BITS);
+        _asm.cmpq(Reg::RAX, Reg::RCX);
+        _asm.j(Condition::EQUAL, exitAt(offset));
+        _asm.movq(Reg::RAX, peek(0));
+        _asm.movq(slot, Reg::RAX);
+        break;
+      }
+
+      case OP_GET_LOCAL:
+        _asm.movq(Reg::RAX, local(_chunk.codeAt(offset + 1)));
+        push(Reg::RAX);
+        break;
+
+      case OP_SET_LOCAL:
+        _asm.movq(Reg::RAX, peek(0));
+        _asm.movq(local(_chunk.codeAt(offset + 1)), Reg::RAX);
+        break;
+
+      case OP_JUMP_IF_FALSE:
+        _asm.movq(Reg::RAX, peek(0));
+        testFalsey(Reg::RAX);
+        _asm.j(Condition::BELOW_EQUAL,
+               jumpTarget(next + _chunk.shortAt(offset + 1)));
+        break;
+
+      case OP_POP_JUMP_IF_FALSE:
+        _asm.movq(Reg::RAX, peek(0));
+        drop(1);
+        testFalsey(Reg::RAX);
+        _asm.j(Condition::BELOW_EQUAL,
+               jumpTarget(next + _chunk.shortAt(offset + 1)));
+        break;
+
+      case OP_JUMP:
+        _asm.jmp(jumpTarget(next + _chunk.shortAt(offset + 1)));
+        break;
+
+      case OP_LOOP:
+        _asm.jmp(jumpTarget(next - _chunk.shortAt(offset + 1)));
+        break;
+
+      case OP_JUMP_IF_NOT_LESS:
+        jumpIfNotGreater(Xmm::XMM1, Xmm::XMM0, offset);
+        break;
+
+      case OP_JUMP_IF_NOT_GREATER:
+        jumpIfNotGreater(Xmm::XMM0, Xmm::XMM1, offset);
+        break;
+
+      case OP_JUMP_IF_NOT_EQUAL:
+        _asm.movq(Reg::RAX, peek(1));
+        _asm.movq(Reg::RCX, peek(0));
+        drop(2);
+        jumpIfNotEqual(jumpTarget(next + _chunk.shortAt(offset + 1)));
+        break;
+
+      case OP_ADD_LOCAL_LOCAL:
+        addLocal(
+            local(_chunk.codeAt(offset + 2)), offset, &X64Assembler::addsd);
+        break;
+
+      case OP_ADD_LOCAL_CONSTANT:
+        addLocal(
+            constant(_chunk.codeAt(offset + 2)), offset, &X64Assembler::addsd);
+        break;
+
+      case OP_SUBTRACT_LOCAL_CONSTANT:
+        addLocal(
+            constant(_chunk.codeAt(offset + 2)), offset, &X64Assembler::subsd);
+        break;
+
+      case OP_INCREMENT_LOCAL: {
+        // the compiler only fuses increments by a number
+        const Mem slot = local(_chunk.codeAt(offset + 1));
+        _asm.movq(Reg::RAX, slot);
+        guardNumber(Reg::RAX, offset);
+        _asm.movq(Reg::RCX, constant(_chunk.codeAt(offset + 2)));
+        _asm.movq(Xmm::XMM0, Reg::RAX);
+        _asm.movq(Xmm::XMM1, Reg::RCX);
+        _asm.addsd(Xmm::XMM0, Xmm::XMM1);
+        _asm.movq(Reg::RAX, Xmm::XMM0);
+        _asm.movq(slot, Reg::RAX);
+        break;
+      }
+
+      case OP_RETURN:
+      case OP_PRINT:
+      case OP_CALL:
+      case OP_CLOSURE:
+      case OP_GET_UPVALUE:
+      case OP_SET_UPVALUE:
+      case OP_CLOSE_UPVALUE:
+      case OP_CLASS:
+      case OP_SET_PROPERTY:
+      case OP_GET_PROPERTY:
+      case OP_METHOD:
+      case OP_INVOKE:
+      case OP_INHERIT:
+      case OP_GET_SUPER:
+      case OP_SUPER_INVOKE:
+      case OP_TAIL_CALL:
+        runtimeCall(offset);
+        break;
+
+      case OP_ADD_NUMBER:
+      case OP_ADD_STRING:
+      case OP_GET_FIELD:
+      case OP_ADD_GENERIC:
+      case OP_COUNT:
+        assert(false);
+        break;
+    }
+  }
+
+  const Chunk& _chunk;
+  const JitRuntime& _runtime;
+  const std::vector<size_t>& _leave;  // instructions to always leave at
+  JitAssembler _asm;
+  std::vector<Label> _instructions;  // by bytecode offset
+  std::vector<Label> _exits;  // by bytecode offset, created on first use
+  Label _exit = NO_LABEL;
+};
+
+}  // namespace
+
+#endif
+
+ExecutableMemory::ExecutableMemory(void* memory, size_t size)
+    : _memory(memory)
+    , _size(size)
+{
+}
+
+ExecutableMemory::~ExecutableMemory()
+{
+#ifdef LOX_JIT
+  munmap(_memory, _size);
+#endif
+}
+
+std::unique_ptr<ExecutableMemory> ExecutableMemory::create(
+    const std::vector<uint8_t>& code)
+{
+#ifdef LOX_JIT
+  // written first and only then made executable, the memory is never both
+  const auto pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  const size_t size = (code.size() + pageSize - 1) / pageSize * pageSize;
+  void* memory = mmap(nullptr,
+                      size,
+                      PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS,
+                      -1,
+                      0);
+  if (memory == MAP_FAILED) {
+    return nullptr;
+  }
+
+  std::memcpy(memory, code.data(), code.size());
+  if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(memory, size);
+    return nullptr;
+  }
+
+  return std::unique_ptr<ExecutableMemory>(new ExecutableMemory(memory, size));
+#else
+  static_cast<void>(code);
+  return nullptr;
+#endif
+}
+
+JitCode::JitCode(Chunk* chunk,
+                 std::unique_ptr<ExecutableMemory> memory,
+                 std::vector<uint32_t> entries)
+    : _code(chunk->codeBegin())
+    , _constants(chunk->constantsBegin())
+    , _caches(chunk->cachesBegin())
+    , _memory(std::move(memory))
+    , _entries(std::move(entries))
+{
+}
+
+bool JitCode::available()
+{
+#ifdef LOX_JIT
+  return true;
+#else
+  return false;
+#endif
+}
+
+std::unique_ptr<JitCode> JitCode::compile(Chunk* chunk,
+                                          const JitRuntime& runtime,
+                                          const std::vector<size_t>& exits)
+{
+  assert(chunk != nullptr);
+#ifdef LOX_JIT
+  std::vector<uint32_t> entries;
+  auto memory = ExecutableMemory::create(
+      JitCompiler {*chunk, runtime, exits}.compile(&entries));
+  if (memory == nullptr) {
+    return nullptr;
+  }
+
+  return std::unique_ptr<JitCode>(
+      new JitCode(chunk, std::move(memory), std::move(entries)));
+#else
+  static_cast<void>(chunk);
+  static_cast<void>(runtime);
+  static_cast<void>(exits);
+  return nullptr;
+#endif
+}
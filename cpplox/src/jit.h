@@ -0,0 +1,151 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "chunk.h"
+#include "common.h"
+#include "value.h"
+
+class InlineCache;
+class VM;
+
+// Calls of a function plus iterations of its loops before the baseline JIT
+// compiles it.
+constexpr int JIT_THRESHOLD = 100;
+
+// Machine code that calls a function runs the code of the callee on the
+// native stack. Past this many nested runs, calls leave to the interpreter,
+// which does not use native stack for them.
+constexpr size_t JIT_MAX_NESTING = 256;
+
+// When the stack engine compiles functions to machine code: never, once they
+// got hot or on their first call.
+enum class JitMode
+{
+  OFF,
+  HOT,
+  ALWAYS,
+};
+
+// Returned by JitCode::run and the runtime functions instead of the offset of
+// an instruction to leave to the interpreter at.
+constexpr size_t JIT_CONTINUE = SIZE_MAX;  // runtime functions only
+constexpr size_t JIT_RETURNED = SIZE_MAX - 1;  // the frame returned
+constexpr size_t JIT_ERROR = SIZE_MAX - 2;  // a runtime error was reported
+
+// State of the active frame that the machine code runs on. The machine code
+// keeps the stack top in a register, it writes it back before calling a
+// runtime function and when it returns.
+struct JitState
+{
+  VM* vm;
+  const uint8_t* code;
+  Value* slots;
+  Value* stackTop;
+  const Value* constants;
+  InlineCache* caches;
+  Value* globals;
+};
+
+// Runs the instruction at offset for the machine code. Returns JIT_CONTINUE
+// to go on with the next instruction, anything else is returned by the
+// machine code right away.
+using JitFunction = size_t (*)(JitState* state, size_t offset);
+
+// Runtime functions of the VM by opcode, for the instructions that are too
+// big to compile but too frequent to leave to the interpreter.
+using JitRuntime = std::array<JitFunction, OP_COUNT>;
+
+// Machine code copied into pages of its own, which are made executable and
+// are never writable at the same time.
+class ExecutableMemory
+{
+public:
+  ~ExecutableMemory();
+
+  ExecutableMemory(const ExecutableMemory&) = delete;
+  ExecutableMemory& operator=(const ExecutableMemory&) = delete;
+
+  // nullptr if there is no JIT or no memory could be mapped
+  static std::unique_ptr<ExecutableMemory> create(
+      const std::vector<uint8_t>& code);
+
+  const void* address() const
+  {
+    return _memory;
+  }
+
+private:
+  ExecutableMemory(void* memory, size_t size);
+
+  void* _memory;
+  size_t _size;
+};
+
+// Machine code of a chunk, compiled by the baseline JIT one instruction at a
+// time. The code works on the value stack of the interpreter and keeps the
+// same layout after every instruction, so it can be entered at any
+// instruction and leave to the interpreter at any other.
+//
+// Constants, locals, globals, arithmetic and comparisons of numbers and
+// jumps are compiled. Instructions with a runtime function call it, the
+// others (closures, upvalues, classes, printing and tail calls, which replace
+// the frame the code runs on) leave to the interpreter.
+// So does every operand the fast path does not expect, for example strings
+// to add or an undefined global, the interpreter then runs the instruction
+// again and reports any runtime error. The loops that have a trace leave to
+// the interpreter as well, which runs the trace.
+//
+// The code refers to the instructions, constants and caches of the chunk,
+// which must not move once it is compiled. Only x86-64 builds with NaN
+// boxing have a JIT, compile() returns nullptr everywhere else.
+class JitCode
+{
+public:
+  JitCode(const JitCode&) = delete;
+  JitCode& operator=(const JitCode&) = delete;
+
+  // whether this build has a JIT
+  static bool available();
+
+  // nullptr if there is no JIT or no executable memory, the instructions at
+  // the exits always leave to the interpreter
+  static std::unique_ptr<JitCode> compile(Chunk* chunk,
+                                          const JitRuntime& runtime,
+                                          const std::vector<size_t>& exits);
+
+  // state of a frame of the function with the given slots
+  JitState state(VM* vm, Value* slots, Value* stackTop, Value* globals) const
+  {
+    return JitState {
+        vm, _code, slots, stackTop, _constants, _caches, globals};
+  }
+
+  // Runs from the instruction at offset until the frame returns or up to the
+  // first instruction left to the interpreter, whose offset it returns.
+  size_t run(JitState* state, size_t offset) const
+  {
+    using EntryStub = size_t (*)(JitState*, const void*);
+    const auto entry = reinterpret_cast<EntryStub>(_memory->address());
+    const auto* start =
+        static_cast<const uint8_t*>(_memory->address()) + _entries[offset];
+    return entry(state, start);
+  }
+
+private:
+  JitCode(Chunk* chunk,
+          std::unique_ptr<ExecutableMemory> memory,
+          std::vector<uint32_t> entries);
+
+  const uint8_t* _code;
+  const Value* _constants;
+  InlineCache* _caches;
+
+  std::unique_ptr<ExecutableMemory> _memory;
+  // position in the machine code of each instruction, by bytecode offset
+  std::vector<uint32_t> _entries;
+};
@@ -0,0 +1,122 @@
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+
+#include "jitassembler.h"
+
+#ifdef LOX_JIT
+
+namespace
+{
+
+constexpr Reg SAVED_REGISTERS[] = {JitAssembler::STATE,
+                                   JitAssembler::QNAN_MASK,
+                                   JitAssembler::SLOTS,
+                                   JitAssembler::STACK_TOP,
+                                   JitAssembler::CONSTANTS,
+                                   JitAssembler::GLOBALS};
+
+}  // namespace
+
+Mem JitAssembler::field(size_t offset)
+{
+  return Mem {STATE, static_cast<int32_t>(offset)};
+}
+
+Mem JitAssembler::local(size_t slot)
+{
+  return Mem {SLOTS, static_cast<int32_t>(slot) * VALUE_SIZE};
+}
+
+Mem JitAssembler::constant(size_t index)
+{
+  return Mem {CONSTANTS, static_cast<int32_t>(index) * VALUE_SIZE};
+}
+
+Mem JitAssembler::global(size_t slot)
+{
+  return Mem {GLOBALS, static_cast<int32_t>(slot) * VALUE_SIZE};
+}
+
+void JitAssembler::prologue()
+{
+  for (Reg reg : SAVED_REGISTERS) {
+    push(reg);
+  }
+  // the return address and six registers, calls need 16 byte alignment
+  subq(Reg::RSP, 8);
+
+  movq(STATE, Reg::RDI);
+  movq(SLOTS, field(offsetof(JitState, slots)));
+  movq(STACK_TOP, field(offsetof(JitState, stackTop)));
+  movq(CONSTANTS, field(offsetof(JitState, constants)));
+  movq(GLOBALS, field(offsetof(JitState, globals)));
+  movq(QNAN_MASK, QNAN);
+}
+
+void JitAssembler::epilogue()
+{
+  addq(Reg::RSP, 8);
+  for (auto reg = std::rbegin(SAVED_REGISTERS);
+       reg != std::rend(SAVED_REGISTERS);
+       ++reg)
+  {
+    pop(*reg);
+  }
+  ret();
+}
+
+void JitAssembler::callRuntime(JitFunction function, size_t offset)
+{
+  movq(Reg::RDI, STATE);
+  movq(Reg::RSI, static_cast<uint64_t>(offset));
+  movq(Reg::RAX, reinterpret_cast<uint64_t>(function));
+  call(Reg::RAX);
+  // the stack moves when a call grows it
+  movq(SLOTS, field(offsetof(JitState, slots)));
+}
+
+void JitAssembler::guardNumber(Reg value, Label notNumber)
+{
+  movq(Reg::RDX, value);
+  andq(Reg::RDX, QNAN_MASK);
+  cmpq(Reg::RDX, QNAN_MASK);
+  j(Condition::EQUAL, notNumber);
+}
+
+void JitAssembler::testFalsey(Reg value)
+{
+  static_assert(FALSE_BITS == NIL_BITS + 1, "nil and false are adjacent");
+  movq(Reg::RCX, value);
+  movq(Reg::RDX, NIL_BITS);
+  subq(Reg::RCX, Reg::RDX);
+  cmpq(Reg::RCX, 1);
+}
+
+void JitAssembler::jumpIfNotEqual(Label notEqual)
+{
+  const Label compareBits = newLabel();
+  const Label equal = newLabel();
+
+  for (Reg value : {Reg::RAX, Reg::RCX}) {
+    movq(Reg::RDX, value);
+    andq(Reg::RDX, QNAN_MASK);
+    cmpq(Reg::RDX, QNAN_MASK);
+    j(Condition::EQUAL, compareBits);
+  }
+
+  // unordered, so NaN, sets the parity flag
+  movq(Xmm::XMM0, Reg::RAX);
+  movq(Xmm::XMM1, Reg::RCX);
+  ucomisd(Xmm::XMM0, Xmm::XMM1);
+  j(Condition::PARITY, notEqual);
+  j(Condition::NOT_EQUAL, notEqual);
+  jmp(equal);
+
+  bind(compareBits);
+  cmpq(Reg::RAX, Reg::RCX);
+  j(Condition::NOT_EQUAL, notEqual);
+  bind(equal);
+}
+
+#endif
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "jit.h"
+#include "value.h"
+#include "x64assembler.h"
+
+#ifdef LOX_JIT
+
+// X64Assembler plus the conventions that the machine code of the baseline
+// and the tracing JIT share: the registers the interpreter state lives in,
+// the entry and exit of the code and the tests of NaN-boxed values.
+class JitAssembler : public X64Assembler
+{
+public:
+  // Registers the machine code keeps the interpreter state in, all of them
+  // are preserved across calls by the System V ABI. rax, rcx, rdx, xmm0 and
+  // xmm1 are scratch registers, the runtime functions may change them.
+  static constexpr Reg STATE = Reg::RBX;
+  static constexpr Reg QNAN_MASK = Reg::RBP;
+  static constexpr Reg SLOTS = Reg::R12;
+  static constexpr Reg STACK_TOP = Reg::R13;
+  static constexpr Reg CONSTANTS = Reg::R14;
+  static constexpr Reg GLOBALS = Reg::R15;
+
+  static constexpr uint64_t NIL_BITS = QNAN | TAG_NIL;
+  static constexpr uint64_t FALSE_BITS = QNAN | TAG_FALSE;
+  static constexpr uint64_t TRUE_BITS = QNAN | TAG_TRUE;
+
+  static constexpr int32_t VALUE_SIZE = sizeof(Value);
+
+  static Mem field(size_t offset);
+  static Mem local(size_t slot);
+  static Mem constant(size_t index);
+  static Mem global(size_t slot);
+
+  // Saves the registers and loads the state that rdi points to. The code
+  // that follows runs with the stack aligned for calls.
+  void prologue();
+  // restores the registers and returns rax
+  void epilogue();
+
+  // calls a runtime function for the instruction at offset, the stack top
+  // has to be stored in the state already and the slots are reloaded from it
+  void callRuntime(JitFunction function, size_t offset);
+
+  // jumps to notNumber unless the value is a number, clobbers rdx
+  void guardNumber(Reg value, Label notNumber);
+  // sets the flags to BELOW_EQUAL if the value is nil or false, which are
+  // the two bit patterns right after nil, clobbers rcx and rdx
+  void testFalsey(Reg value);
+  // jumps to notEqual unless rax and rcx hold equal values, see valuesEqual
+  void jumpIfNotEqual(Label notEqual);
+};
+
+#endif
@@ -0,0 +1,41 @@
+#include <algorithm>
+#include <cassert>
+#include <iterator>
+
+#include "linetable.h"
+
+void LineTable::add(size_t line)
+{
+  if (_runs.empty() || _runs.back().line != line) {
+    _runs.push_back(
+        Run {static_cast<uint32_t>(_count), static_cast<uint32_t>(line)});
+  }
+  _count++;
+}
+
+void LineTable::truncate(size_t count)
+{
+  assert(count <= _count);
+  while (!_runs.empty() && _runs.back().start >= count) {
+    _runs.pop_back();
+  }
+  _count = count;
+}
+
+size_t LineTable::count() const
+{
+  return _count;
+}
+
+size_t LineTable::lineAt(size_t offset) const
+{
+  assert(offset < _count);
+
+  // the last run starting at or before offset
+  auto run = std::upper_bound(
+      _runs.begin(),
+      _runs.end(),
+      offset,
+      [](size_t value, const Run& r) { return value < r.start; });
+  return std::prev(run)->line;
+}
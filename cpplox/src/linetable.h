@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Source lines of the code of a chunk. Consecutive code units mostly share a
+// line, so only the offset where a new line starts is stored, along with the
+// line. Looking up the line of an offset is a binary search over these runs.
+class LineTable
+{
+public:
+  // the code unit at count() is from line
+  void add(size_t line);
+  // drops the lines of the code units from count on
+  void truncate(size_t count);
+  size_t count() const;
+  size_t lineAt(size_t offset) const;
+  size_t ownedBytes() const { return _runs.capacity() * sizeof(Run); }
+
+private:
+  struct Run
+  {
+    uint32_t start;  // offset of the first code unit of the run
+    uint32_t line;
+  };
+
+  std::vector<Run> _runs;
+  size_t _count = 0;
+};
@@ -1,10 +1,25 @@
+#include <algorithm>
+#include <chrono>
 #include <fstream>
 #include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
 
 #include <sysexits.h>
 
 #include "vm.h"
 
+struct Options
+{
+  Engine engine = Engine::STACK;
+  JitMode jit = JitMode::HOT;
+  OptimizeMode optimize = OptimizeMode::ON;
+  GcOptions gc;
+  bool gcPauses = false;
+  bool gcStats = false;
+};
+
 std::string readFile(const char* path)
 {
   std::ifstream file(path);
@@ -18,9 +33,100 @@ std::string readFile(const char* path)
                      std::istreambuf_iterator<char>());
 }
 
-static void repl()
+static void usage()
+{
+  std::cerr << "Usage: cpplox [--engine=stack|register] [--jit=on|off|always] "
+               "[--optimize=on|off|report] [--gc=stw|incremental|concurrent] "
+               "[--gc-slice=objects] [--gc-threads=count] "
+               "[--gc-compact[=percent]] [--gc-initial=KiB] "
+               "[--gc-grow=percent] [--gc-max-heap=KiB] [--gc-pauses] "
+               "[--gc-stats] [path]\n";
+  exit(EX_USAGE);
+}
+
+// a positive number of something, up to nine digits
+static size_t parseCount(std::string_view arg)
+{
+  if (arg.empty() || arg.size() > 9
+      || arg.find_first_not_of("0123456789") != std::string_view::npos)
+  {
+    usage();
+  }
+
+  return std::max<size_t>(1, std::stoul(std::string {arg}));
+}
+
+static void setUp(VM& vm, const Options& options)
 {
-  VM vm;
+  vm.setJitMode(options.jit);
+  vm.setOptimizeMode(options.optimize);
+  vm.setGcOptions(options.gc);
+}
+
+static void reportPauses(const GcPauses& pauses)
+{
+  const auto us = [](GcPauses::Duration duration) {
+    return std::chrono::duration<double, std::micro>(duration).count();
+  };
+
+  std::cerr << "gc pauses: " << pauses.count() << ", total "
+            << us(pauses.total()) << " us, p50 " << us(pauses.percentile(50))
+            << " us, p90 " << us(pauses.percentile(90)) << " us, p99 "
+            << us(pauses.percentile(99)) << " us, max " << us(pauses.max())
+            << " us\n";
+}
+
+// as JSON, for tools that tune the collector
+static void reportStats(const GcStats& stats, const GcPauses& pauses)
+{
+  const auto us = [](GcPauses::Duration duration) {
+    return std::chrono::duration<double, std::micro>(duration).count();
+  };
+
+  std::cerr << "{\n  \"collections\": {\"minor\": " << stats.minorCollections
+            << ", \"major\": " << stats.majorCollections
+            << ", \"compactions\": " << stats.compactions << "},\n";
+
+  std::cerr << "  \"pauses\": {\"count\": " << pauses.count()
+            << ", \"total_us\": " << us(pauses.total())
+            << ", \"p50_us\": " << us(pauses.percentile(50))
+            << ", \"p90_us\": " << us(pauses.percentile(90))
+            << ", \"p99_us\": " << us(pauses.percentile(99))
+            << ", \"max_us\": " << us(pauses.max()) << ",\n";
+  // the buckets without pauses are left out
+  std::cerr << "    \"histogram\": [";
+  const std::vector<size_t>& histogram = pauses.histogram();
+  const char* separator = "";
+  for (size_t i = 0; i < histogram.size(); i++) {
+    if (histogram[i] > 0) {
+      std::cerr << separator << "{\"below_us\": " << (size_t {1} << i)
+                << ", \"count\": " << histogram[i] << "}";
+      separator = ", ";
+    }
+  }
+  std::cerr << "]},\n";
+
+  std::cerr << "  \"bytes\": {\"allocated\": " << stats.bytesAllocated
+            << ", \"freed\": " << stats.bytesFreed
+            << ", \"heap\": " << stats.heapBytes << "},\n";
+
+  std::cerr << "  \"live\": {";
+  for (size_t i = 0; i < OBJ_TYPE_COUNT; i++) {
+    std::cerr << (i == 0 ? "\n" : ",\n") << "    \""
+              << typeName(static_cast<ObjType>(i))
+              << "\": {\"objects\": " << stats.live[i].objects
+              << ", \"bytes\": " << stats.live[i].bytes << "}";
+  }
+  std::cerr << "\n  },\n";
+
+  std::cerr << "  \"intern_table\": {\"strings\": " << stats.internedStrings
+            << ", \"tombstones\": " << stats.internTombstones << "}\n}\n";
+}
+
+static void repl(const Options& options)
+{
+  VM vm {options.engine};
+  setUp(vm, options);
 
   while (true) {
     std::cout << "> ";
@@ -32,14 +138,29 @@ static void repl()
 
     vm.interpret(line);
   }
+
+  if (options.gcPauses) {
+    reportPauses(vm.gcPauses());
+  }
+  if (options.gcStats) {
+    reportStats(vm.gcStats(), vm.gcPauses());
+  }
 }
 
-static void runFile(const char* path)
+static void runFile(const char* path, const Options& options)
 {
-  VM vm;
+  VM vm {options.engine};
+  setUp(vm, options);
   const std::string source = readFile(path);
   InterpretResult result = vm.interpret(source);
 
+  if (options.gcPauses) {
+    reportPauses(vm.gcPauses());
+  }
+  if (options.gcStats) {
+    reportStats(vm.gcStats(), vm.gcPauses());
+  }
+
   if (result == InterpretResult::COMPILE_ERROR) {
     exit(EX_DATAERR);
   }
@@ -51,13 +172,69 @@ static void runFile(const char* path)
 
 int main(int argc, const char* argv[])
 {
-  if (argc == 1) {
-    repl();
-  } else if (argc == 2) {
-    runFile(argv[1]);
+  Options options;
+  const char* path = nullptr;
+
+  for (int i = 1; i < argc; i++) {
+    const std::string_view arg {argv[i]};
+
+    if (arg == "--engine=stack") {
+      options.engine = Engine::STACK;
+    } else if (arg == "--engine=register") {
+      options.engine = Engine::REGISTER;
+    } else if (arg == "--jit=on") {
+      options.jit = JitMode::HOT;
+    } else if (arg == "--jit=off") {
+      options.jit = JitMode::OFF;
+    } else if (arg == "--jit=always") {
+      options.jit = JitMode::ALWAYS;
+    } else if (arg == "--optimize=on") {
+      options.optimize = OptimizeMode::ON;
+    } else if (arg == "--optimize=off") {
+      options.optimize = OptimizeMode::OFF;
+    } else if (arg == "--optimize=report") {
+      options.optimize = OptimizeMode::REPORT;
+    } else if (arg == "--gc=stw") {
+      options.gc.mode = GcMode::STOP_THE_WORLD;
+    } else if (arg == "--gc=incremental") {
+      options.gc.mode = GcMode::INCREMENTAL;
+    } else if (arg == "--gc=concurrent") {
+      options.gc.mode = GcMode::CONCURRENT;
+    } else if (arg.substr(0, 11) == "--gc-slice=") {
+      options.gc.sliceBudget = parseCount(arg.substr(11));
+    } else if (arg.substr(0, 13) == "--gc-threads=") {
+      options.gc.markThreads =
+          std::min<size_t>(parseCount(arg.substr(13)), 256);
+    } else if (arg == "--gc-compact") {
+      options.gc.compact = true;
+    } else if (arg.substr(0, 13) == "--gc-compact=") {
+      options.gc.compact = true;
+      options.gc.compactThreshold =
+          static_cast<double>(std::min<size_t>(parseCount(arg.substr(13)), 100))
+          / 100.0;
+    } else if (arg.substr(0, 13) == "--gc-initial=") {
+      options.gc.initialThreshold = parseCount(arg.substr(13)) * 1024u;
+    } else if (arg.substr(0, 10) == "--gc-grow=") {
+      // by how many percent the heap grows until the next major collection
+      options.gc.growthFactor =
+          1.0 + static_cast<double>(parseCount(arg.substr(10))) / 100.0;
+    } else if (arg.substr(0, 14) == "--gc-max-heap=") {
+      options.gc.heapLimit = parseCount(arg.substr(14)) * 1024u;
+    } else if (arg == "--gc-pauses") {
+      options.gcPauses = true;
+    } else if (arg == "--gc-stats") {
+      options.gcStats = true;
+    } else if (arg.substr(0, 2) != "--" && path == nullptr) {
+      path = argv[i];
+    } else {
+      usage();
+    }
+  }
+
+  if (path == nullptr) {
+    repl(options);
   } else {
-    std::cerr << "Usage: cpplox [path]\n";
-    exit(EX_USAGE);
+    runFile(path, options);
   }
 
   return 0;
@@ -1,10 +1,14 @@
 #include <algorithm>
+#include <chrono>
+#include <memory>
+#include <utility>
 #include <vector>
 
 #include "memory.h"
 
 #include "chunk.h"
 #include "compiler.h"
+#include "graydeque.h"
 #include "table.h"
 #include "value.h"
 #include "vm.h"
@@ -13,9 +17,127 @@
 #  include "debug.h"
 #endif
 
-auto constexpr GC_HEAP_GROW_FACTOR = 2;
+namespace
+{
+
+// calls visit with every object that object references, or null
+template<typename Visit>
+void forEachReference(Obj* object, Visit&& visit)
+{
+  const auto visitValue = [&visit](Value value) {
+    if (IS_OBJ(value)) {
+      visit(AS_OBJ(value));
+    }
+  };
+
+  switch (object->type()) {
+    case ObjType::UPVALUE: {
+      visitValue(*static_cast<ObjUpvalue*>(object)->closed());
+      break;
+    }
+
+    case ObjType::CLOSURE: {
+      ObjClosure* closure = static_cast<ObjClosure*>(object);
+      visit(closure->function());
+      for (int i = 0; i < closure->upvalueCount(); i++) {
+        visit(closure->upvalue(i));
+      }
+      break;
+    }
+
+    case ObjType::FUNCTION: {
+      ObjFunction* function = static_cast<ObjFunction*>(object);
+      visit(function->name());
+      for (const Value& constant : function->chunk()->constants()) {
+        visitValue(constant);
+      }
+      for (const Value& constant : function->registerChunk()->constants()) {
+        visitValue(constant);
+      }
+      break;
+    }
+
+    case ObjType::CLASS: {
+      ObjClass* klass = static_cast<ObjClass*>(object);
+      visit(klass->name());
+      klass->methods()->forEach([&](ObjString* key, Value value) {
+        visit(key);
+        visitValue(value);
+      });
+      klass->rootShape()->forEachName(visit);
+      break;
+    }
+
+    case ObjType::INSTANCE: {
+      ObjInstance* instance = static_cast<ObjInstance*>(object);
+      // the class keeps the field names alive through its shapes
+      visit(instance->klass());
+      for (size_t i = 0; i < instance->fieldCount(); i++) {
+        visitValue(*instance->fieldAt(i));
+      }
+      break;
+    }
+
+    case ObjType::BOUND_METHOD: {
+      ObjBoundMethod* bound = static_cast<ObjBoundMethod*>(object);
+      visitValue(bound->receiver());
+      visit(bound->method());
+      break;
+    }
+
+    case ObjType::NATIVE:  // fallthrough
+    case ObjType::STRING:  // fallthrough
+      break;
+  }
+}
+
+// points the references of object at the objects that moved
+void updateObjectReferences(Obj* object)
+{
+  switch (object->type()) {
+    case ObjType::UPVALUE:
+      static_cast<ObjUpvalue*>(object)->updateReferences();
+      break;
+
+    case ObjType::CLOSURE:
+      static_cast<ObjClosure*>(object)->updateReferences();
+      break;
+
+    case ObjType::FUNCTION:
+      static_cast<ObjFunction*>(object)->updateReferences();
+      break;
+
+    case ObjType::CLASS:
+      static_cast<ObjClass*>(object)->updateReferences();
+      break;
+
+    case ObjType::INSTANCE:
+      static_cast<ObjInstance*>(object)->updateReferences();
+      break;
+
+    case ObjType::BOUND_METHOD:
+      static_cast<ObjBoundMethod*>(object)->updateReferences();
+      break;
+
+    case ObjType::NATIVE:  // fallthrough
+    case ObjType::STRING:  // fallthrough
+      break;
+  }
+}
+
+template<typename T>
+T* moveObject(Obj* from, void* to)
+{
+  T* object = static_cast<T*>(from);
+  T* moved = new (to) T(std::move(*object));
+  object->~T();
+  return moved;
+}
 
-static void freeObject(Obj* object, MemoryManager* mm)
+}  // namespace
+
+// runs the destructor, the slot goes back to the heap apart
+static void destroyObject(Obj* object, MemoryManager* mm)
 {
   assert(object != nullptr);
 
@@ -72,22 +194,98 @@ static void freeObject(Obj* object, MemoryManager* mm)
   }
 }
 
-void MemoryManager::freeObjects(Obj* objs)
+void MemoryManager::freeObjects()
+{
+  _heap.forEachObject([this](void* slot) {
+    destroyObject(static_cast<Obj*>(slot), this);
+    _heap.free(slot);
+  });
+}
+
+void MemoryManager::destroy(void* slot, void* memoryManager)
 {
-  Obj* object = objs;
-  while (object != nullptr) {
-    Obj* next = object->nextObj();
-    freeObject(object, this);
-    object = next;
+  // the young objects were swept first, every object is old
+  Obj* object = static_cast<Obj*>(slot);
+  assert(object->isOld());
+  destroyObject(object, static_cast<MemoryManager*>(memoryManager));
+}
+
+bool MemoryManager::movable(const void* slot)
+{
+  // Functions stay where they are, the interpreter and the machine code
+  // point into their chunks, and so do classes, whose instances point at
+  // their shapes. Natives are too few to matter.
+  switch (static_cast<const Obj*>(slot)->type()) {
+    case ObjType::STRING:  // fallthrough
+    case ObjType::UPVALUE:  // fallthrough
+    case ObjType::CLOSURE:  // fallthrough
+    case ObjType::INSTANCE:  // fallthrough
+    case ObjType::BOUND_METHOD:
+      return true;
+
+    case ObjType::FUNCTION:  // fallthrough
+    case ObjType::CLASS:  // fallthrough
+    case ObjType::NATIVE:
+      return false;
+  }
+
+  return false;
+}
+
+void MemoryManager::move(void* from, void* to, void*)
+{
+  Obj* object = static_cast<Obj*>(from);
+  switch (object->type()) {
+    case ObjType::STRING:
+      moveObject<ObjString>(object, to);
+      break;
+
+    case ObjType::UPVALUE: {
+      // a closed upvalue points at its own value
+      ObjUpvalue* upvalue = static_cast<ObjUpvalue*>(object);
+      const bool closed = upvalue->location() == upvalue->closed();
+      ObjUpvalue* moved = moveObject<ObjUpvalue>(object, to);
+      if (closed) {
+        moved->setLocation(moved->closed());
+      }
+      break;
+    }
+
+    case ObjType::CLOSURE:
+      moveObject<ObjClosure>(object, to);
+      break;
+
+    case ObjType::INSTANCE:
+      moveObject<ObjInstance>(object, to);
+      break;
+
+    case ObjType::BOUND_METHOD:
+      moveObject<ObjBoundMethod>(object, to);
+      break;
+
+    case ObjType::FUNCTION:  // fallthrough
+    case ObjType::CLASS:  // fallthrough
+    case ObjType::NATIVE:
+      assert(false);
+      break;
   }
 }
 
 void MemoryManager::markRoots()
 {
-  for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
+  for (Value* slot = vm->stack.data(); slot < vm->stackTop; slot++) {
     markValue(*slot);
   }
 
+  // The register engine keeps stackTop at the end of the registers of the
+  // active frame, some of which may still hold values of earlier frames.
+  // Everything above stackTop is dead, clear it so that no slot ever points
+  // at an object that is about to be freed.
+  if (vm->registersEnd > vm->stackTop) {
+    std::fill(vm->stackTop, vm->registersEnd, Value());
+  }
+  vm->registersEnd = vm->stackTop;
+
   for (int i = 0; i < vm->frameCount; i++) {
     markObject((Obj*)vm->frames[i].closure);
   }
@@ -103,11 +301,25 @@ void MemoryManager::markRoots()
   markObject((Obj*)vm->initString);
 }
 
-void MemoryManager::markArray(const std::vector<Value>& array)
+void MemoryManager::updateReferences()
 {
-  for (const auto& value : array) {
-    markValue(value);
+  _heap.forEachObject(
+      [](void* slot) { updateObjectReferences(static_cast<Obj*>(slot)); });
+
+  // The same roots as markRoots. The compiler of the script that runs is
+  // done, its function stays where it is.
+  for (Value* slot = vm->stack.data(); slot < vm->stackTop; slot++) {
+    *slot = forwarded(*slot);
   }
+
+  for (int i = 0; i < vm->frameCount; i++) {
+    vm->frames[i].closure = forwarded(vm->frames[i].closure);
+  }
+
+  vm->openUpValues = forwarded(vm->openUpValues);
+  vm->globals.updateReferences();
+  vm->strings.updateReferences();
+  vm->initString = forwarded(vm->initString);
 }
 
 void MemoryManager::blackenObject(Obj* object)
@@ -120,114 +332,589 @@ void MemoryManager::blackenObject(Obj* object)
   std::cout << "\n";
 #endif
 
-  switch (object->type()) {
-    case ObjType::UPVALUE: {
-      auto obj = ((ObjUpvalue*)object);
-      markValue(*obj->closed());
-      break;
+  forEachReference(object, [this](Obj* reference) { markObject(reference); });
+}
+
+void MemoryManager::traceReferences()
+{
+  // minor collections and incremental slices mark too little to be worth
+  // the threads
+  if (_markMode == MarkMode::ALL && _options.markThreads > 1) {
+    traceInParallel();
+    return;
+  }
+
+  while (grayStack.size() > 0) {
+    Obj* object = grayStack.back();
+    grayStack.pop_back();
+    blackenObject(object);
+  }
+}
+
+bool MemoryManager::marks(const Obj* object) const
+{
+  // a minor collection keeps every old object, the slices of an incremental
+  // one leave the young objects to the minor collections
+  switch (_markMode) {
+    case MarkMode::ALL:
+      return true;
+
+    case MarkMode::YOUNG:
+      return !object->isOld();
+
+    case MarkMode::OLD:
+      return object->isOld();
+  }
+
+  return true;
+}
+
+void MemoryManager::traceInParallel()
+{
+  const size_t threads = _options.markThreads;
+  std::unique_ptr<GrayDeque[]> deques(new GrayDeque[threads]);
+  for (size_t i = 0; i < grayStack.size(); i++) {
+    deques[i % threads].push(grayStack[i]);
+  }
+  grayStack.clear();
+
+  std::atomic<size_t> idle {0};
+  std::vector<std::thread> helpers;
+  for (size_t i = 1; i < threads; i++) {
+    helpers.emplace_back(
+        &MemoryManager::markInParallel, this, deques.get(), i, &idle);
+  }
+  markInParallel(deques.get(), 0, &idle);
+
+  for (std::thread& helper : helpers) {
+    helper.join();
+  }
+}
+
+void MemoryManager::markInParallel(GrayDeque* deques,
+                                   size_t self,
+                                   std::atomic<size_t>* idle)
+{
+  const size_t threads = _options.markThreads;
+  GrayDeque& own = deques[self];
+
+  while (true) {
+    Obj* object = own.pop();
+    for (size_t i = 1; object == nullptr && i < threads; i++) {
+      object = deques[(self + i) % threads].steal();
     }
-    case ObjType::CLOSURE: {
-      ObjClosure* closure = (ObjClosure*)object;
-      markObject((Obj*)closure->function());
-      for (int i = 0; i < closure->upvalueCount(); i++) {
-        markObject((Obj*)closure->upvalue(i));
+
+    if (object != nullptr) {
+      forEachReference(object, [this, &own](Obj* reference) {
+        if (reference != nullptr && marks(reference) && reference->shade()) {
+          own.push(reference);
+        }
+      });
+      continue;
+    }
+
+    // Out of work. Only a thread that has work makes more, the marking is
+    // done once all of them ran out.
+    idle->fetch_add(1);
+    while (true) {
+      if (idle->load() == threads) {
+        return;
       }
-      break;
+
+      bool found = false;
+      for (size_t i = 0; i < threads && !found; i++) {
+        found = !deques[i].empty();
+      }
+      if (found) {
+        idle->fetch_sub(1);
+        break;
+      }
+
+      std::this_thread::yield();
     }
+  }
+}
 
-    case ObjType::FUNCTION: {
-      ObjFunction* function = (ObjFunction*)object;
-      markObject((Obj*)function->name());
-      markArray(function->chunk()->constants());
-      break;
+void MemoryManager::sweep()
+{
+  // every major collection ends its marking here
+  _stats.majorCollections++;
+  _heap.startSweeping();
+  _sweeping = true;
+}
+
+void MemoryManager::sweepPages()
+{
+  _heap.sweepPages(GC_SWEEP_PAGES);
+  if (!_heap.sweeping()) {
+    // what is left survived, or was allocated since
+    _sweeping = false;
+    nextGC = nextThreshold();
+    _stats.live = _census;
+    if (_options.compact
+        && _heap.fragmentation() > _options.compactThreshold)
+    {
+      _compactionDue = true;
     }
 
-    case ObjType::CLASS: {
-      ObjClass* klass = (ObjClass*)object;
-      markObject(klass->name());
-      klass->methods()->mark(this);
-      break;
+#ifdef DEBUG_LOG_GC
+    std::cout << fmt::sprintf("DBG: -- sweep end, next at %zu\n", nextGC);
+#endif
+  }
+}
+
+void MemoryManager::sweepYoung()
+{
+  for (Obj* object : youngObjects) {
+    if (object->isMarked()) {
+      // A survivor of a minor collection stays gray for the incremental
+      // major collection that is marking. For a concurrent one it is black,
+      // it was not there when the marking began. A major collection sweeps
+      // the pages next, which clears the marks.
+      if (_marking) {
+        grayStack.push_back(object);
+      } else if (_concurrent) {
+        object->endScan();
+      } else if (_markMode == MarkMode::YOUNG) {
+        object->setIsMarked(false);
+      }
+      object->setIsOld(true);
+    } else {
+      if (object->type() == ObjType::STRING) {
+        vm->strings.remove(static_cast<ObjString*>(object));
+      }
+      destroyObject(object, this);
+      _heap.free(object);
     }
+  }
 
-    case ObjType::INSTANCE: {
-      ObjInstance* instance = (ObjInstance*)object;
-      markObject(instance->klass());
-      instance->fields()->mark(this);
-      break;
+  youngObjects.clear();
+  youngBytes = 0;
+}
+
+void MemoryManager::remember(Obj* owner)
+{
+  if (_concurrent) {
+    scanBeforeWrite(owner);
+  }
+
+  if (owner->isOld() && !owner->isRemembered()) {
+    owner->setIsRemembered(true);
+    rememberedSet.push_back(owner);
+  }
+
+  if (_marking && owner->isMarked()) {
+    grayStack.push_back(owner);
+  }
+}
+
+void MemoryManager::step()
+{
+  const auto start = std::chrono::steady_clock::now();
+
+  if (_bytesAllocated > _allocationLimit) {
+    collectFully();
+    if (_bytesAllocated > _options.heapLimit) {
+      // the program may go on allocating until its next safepoint
+      _outOfMemory = true;
+      _allocationLimit = SIZE_MAX;
     }
+  }
 
-    case ObjType::BOUND_METHOD: {
-      ObjBoundMethod* bound = (ObjBoundMethod*)object;
-      markValue(bound->receiver());
-      markObject(bound->method());
-      break;
+  if (youngBytes >= GC_NURSERY_SIZE) {
+    collectYoung();
+    if (_sweeping) {
+      sweepPages();
     }
+    if (!_sweeping && !_marking && !_concurrent
+        && _bytesAllocated > nextGC)
+    {
+      switch (_options.mode) {
+        case GcMode::STOP_THE_WORLD:
+          collectGarbage();
+          break;
+
+        case GcMode::INCREMENTAL:
+          startMarking();
+          break;
+
+        case GcMode::CONCURRENT:
+          startConcurrentMarking();
+          break;
+      }
+    }
+  }
 
-    case ObjType::NATIVE:  // fallthrough
-    case ObjType::STRING:  // fallthrough
-      break;
+  if (_marking) {
+    markSlice();
+  }
+
+  if (_concurrent) {
+    handOffShaded();
+    if (markerDone()) {
+      finishConcurrentMarking();
+    }
   }
+
+  nextStep = _marking || _concurrent
+      ? std::min(youngBytes + GC_SLICE_INTERVAL, GC_NURSERY_SIZE)
+      : GC_NURSERY_SIZE;
+
+  _pauses.add(std::chrono::steady_clock::now() - start);
 }
 
-void MemoryManager::traceReferences()
+void MemoryManager::startMarking()
 {
-  while (grayStack.size() > 0) {
+#ifdef DEBUG_LOG_GC
+  std::cout << "DBG: -- incremental gc begin\n";
+#endif
+
+  _marking = true;
+  _markMode = MarkMode::OLD;
+  markRoots();
+}
+
+void MemoryManager::markSlice()
+{
+  _markMode = MarkMode::OLD;
+  for (size_t i = 0; i < _options.sliceBudget && !grayStack.empty(); i++) {
     Obj* object = grayStack.back();
     grayStack.pop_back();
     blackenObject(object);
   }
+
+  if (grayStack.empty()) {
+    finishMarking();
+  }
 }
 
-void MemoryManager::sweep()
+void MemoryManager::finishMarking()
+{
+  // The roots changed since the marking started and the old objects that
+  // point at young ones were not followed there, mark from both.
+  _marking = false;
+  _markMode = MarkMode::ALL;
+  markRoots();
+  for (Obj* object : rememberedSet) {
+    object->setIsRemembered(false);
+    blackenObject(object);
+  }
+  rememberedSet.clear();
+  traceReferences();
+  vm->strings.removeWhite();
+  sweepYoung();
+  sweep();
+
+#ifdef DEBUG_LOG_GC
+  std::cout << "DBG: -- incremental gc end\n";
+#endif
+}
+
+void MemoryManager::startConcurrentMarking()
 {
-  Obj* previous = nullptr;
-  Obj* object = objects;
+#ifdef DEBUG_LOG_GC
+  std::cout << "DBG: -- concurrent gc begin\n";
+#endif
 
-  while (object != nullptr) {
-    if (object->isMarked()) {
-      object->setIsMarked(false);
-      previous = object;
-      object = object->nextObj();
-    } else {
-      Obj* unreached = object;
-      object = object->nextObj();
+  _concurrent = true;
+  _markerDone = false;
+  _markMode = MarkMode::OLD;
+  markRoots();
+  _markMode = MarkMode::ALL;
+
+  // the compilers go on adding constants to their functions without a
+  // barrier, the marker must not scan them
+  for (Compiler* compiler = currentCompiler(); compiler != nullptr;
+       compiler = compiler->enclosing())
+  {
+    ObjFunction* function = compiler->function();
+    if (function != nullptr && function->isOld()) {
+      scanBeforeWrite(function);
+    }
+  }
+  grayStack.insert(grayStack.end(), _shaded.begin(), _shaded.end());
+  _shaded.clear();
+
+  std::vector<Obj*> gray;
+  std::swap(gray, grayStack);
+  _marker =
+      std::thread(&MemoryManager::markConcurrently, this, std::move(gray));
+}
+
+void MemoryManager::markConcurrently(std::vector<Obj*> gray)
+{
+  while (true) {
+    markGray(gray);
+
+    std::lock_guard<std::mutex> lock(_markerMutex);
+    if (_handoff.empty()) {
+      // the program may be waiting for it to pause
+      _markerDone = true;
+      _markerCondition.notify_all();
+      return;
+    }
+    std::swap(gray, _handoff);
+  }
+}
 
-      if (previous != nullptr) {
-        previous->setNextObj(object);
-      } else {
-        objects = object;
+void MemoryManager::markGray(std::vector<Obj*>& gray)
+{
+  while (!gray.empty()) {
+    if (_pauseRequested.load(std::memory_order_relaxed)) {
+      waitWhilePaused();
+    }
+
+    Obj* object = gray.back();
+    gray.pop_back();
+
+    // the program scanned it already, before it changed it
+    if (!object->beginScan()) {
+      continue;
+    }
+
+    // young objects are left to the minor collections
+    forEachReference(object, [&gray](Obj* reference) {
+      if (reference != nullptr && reference->isOld() && reference->shade()) {
+        gray.push_back(reference);
       }
+    });
+    object->endScan();
+  }
+}
+
+void MemoryManager::scanBeforeWrite(Obj* owner)
+{
+  if (!owner->beginScan()) {
+    return;
+  }
 
-      freeObject(unreached, this);
+  forEachReference(owner, [this](Obj* reference) {
+    if (reference != nullptr && reference->isOld() && reference->shade()) {
+      _shaded.push_back(reference);
     }
+  });
+  owner->endScan();
+}
+
+void MemoryManager::handOffShaded()
+{
+  if (_shaded.empty()) {
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(_markerMutex);
+    _handoff.insert(_handoff.end(), _shaded.begin(), _shaded.end());
+  }
+  _shaded.clear();
+}
+
+bool MemoryManager::markerDone()
+{
+  std::lock_guard<std::mutex> lock(_markerMutex);
+  return _markerDone;
+}
+
+void MemoryManager::pauseMarker()
+{
+  std::unique_lock<std::mutex> lock(_markerMutex);
+  _pauseRequested = true;
+  _markerCondition.wait(lock, [this] { return _markerPaused || _markerDone; });
+}
+
+void MemoryManager::resumeMarker()
+{
+  {
+    std::lock_guard<std::mutex> lock(_markerMutex);
+    _pauseRequested = false;
+  }
+  _markerCondition.notify_all();
+}
+
+void MemoryManager::waitWhilePaused()
+{
+  std::unique_lock<std::mutex> lock(_markerMutex);
+  _markerPaused = true;
+  _markerCondition.notify_all();
+  _markerCondition.wait(lock, [this] { return !_pauseRequested; });
+  _markerPaused = false;
+}
+
+void MemoryManager::finishConcurrentMarking()
+{
+  _marker.join();
+
+  // what is young now was not there when the marking began, it gets
+  // promoted black
+  collectYoung();
+
+  handOffShaded();
+  std::vector<Obj*> gray;
+  std::swap(gray, _handoff);
+  markGray(gray);
+  _concurrent = false;
+
+  vm->strings.removeWhite();
+  sweep();
+
+#ifdef DEBUG_LOG_GC
+  std::cout << "DBG: -- concurrent gc end\n";
+#endif
+}
+
+void MemoryManager::collectYoung()
+{
+#ifdef DEBUG_LOG_GC
+  std::cout << "DBG: -- minor gc begin\n";
+  size_t before = _bytesAllocated;
+#endif
+
+  // the gray objects of an incremental major collection wait, and so does
+  // the marker of a concurrent one
+  std::vector<Obj*> majorGray;
+  std::swap(majorGray, grayStack);
+  const bool markerRuns = _concurrent && _marker.joinable();
+  if (markerRuns) {
+    pauseMarker();
+  }
+
+  _markMode = MarkMode::YOUNG;
+  markRoots();
+  for (Obj* object : rememberedSet) {
+    object->setIsRemembered(false);
+    blackenObject(object);
+  }
+  rememberedSet.clear();
+  traceReferences();
+
+  std::swap(majorGray, grayStack);
+  sweepYoung();
+  _markMode = MarkMode::ALL;
+
+  if (markerRuns) {
+    resumeMarker();
   }
+
+  _stats.minorCollections++;
+  _stats.live = _census;
+
+#ifdef DEBUG_LOG_GC
+  std::cout << "DBG: -- minor gc end\n";
+  std::cout << fmt::sprintf("DBG:   collected %zu bytes (from %zu to %zu)\n",
+                            before - _bytesAllocated,
+                            before,
+                            _bytesAllocated);
+#endif
 }
 
 void MemoryManager::collectGarbage()
 {
 #ifdef DEBUG_LOG_GC
   std::cout << "DBG: -- gc begin\n";
-  size_t before = bytesAllocated;
 #endif
 
   markRoots();
   traceReferences();
   vm->strings.removeWhite();
+  sweepYoung();
   sweep();
 
-  nextGC = bytesAllocated * GC_HEAP_GROW_FACTOR;
+  // every object is old now
+  for (Obj* object : rememberedSet) {
+    object->setIsRemembered(false);
+  }
+  rememberedSet.clear();
 
 #ifdef DEBUG_LOG_GC
   std::cout << "DBG: -- gc end\n";
-  std::cout << fmt::sprintf(
-      "DBG:   collected %zu bytes (from %zu to %zu) next at %zu\n",
-      before - bytesAllocated,
-      before,
-      bytesAllocated,
-      nextGC);
 #endif
 }
 
+void MemoryManager::compact()
+{
+  assert(compactionDue());
+
+#ifdef DEBUG_LOG_GC
+  std::cout << "DBG: -- compact begin\n";
+#endif
+
+  const auto start = std::chrono::steady_clock::now();
+  _compactionDue = false;
+
+  // every object that is left is live and every page swept
+  collectFully();
+
+  _heap.evacuate(&MemoryManager::movable, &MemoryManager::move);
+  updateReferences();
+  _heap.finishEvacuation();
+
+  // the inline caches may hold methods that moved
+  _heap.forEachObject([this](void* slot) {
+    auto* object = static_cast<Obj*>(slot);
+    if (object->type() == ObjType::CLASS) {
+      vm->renewEpoch(static_cast<ObjClass*>(object));
+    }
+  });
+  _stats.compactions++;
+
+  _pauses.add(std::chrono::steady_clock::now() - start);
+
+#ifdef DEBUG_LOG_GC
+  std::cout << "DBG: -- compact end\n";
+#endif
+}
+
+void MemoryManager::collectFully()
+{
+  if (_marking) {
+    finishMarking();
+  }
+  if (_concurrent) {
+    finishConcurrentMarking();
+  }
+  if (_sweeping) {
+    _heap.finishSweeping();
+  }
+  collectGarbage();
+  _heap.finishSweeping();
+  _sweeping = false;
+  nextGC = nextThreshold();
+  _stats.live = _census;
+}
+
+size_t MemoryManager::nextThreshold() const
+{
+  const auto grown =
+      static_cast<size_t>(_bytesAllocated * _options.growthFactor);
+  return std::min(grown, _options.heapLimit);
+}
+
+GcStats MemoryManager::stats() const
+{
+  GcStats stats = _stats;
+  stats.bytesAllocated = _bytesAllocated + _bytesFreed;
+  stats.bytesFreed = _bytesFreed;
+  stats.heapBytes = _bytesAllocated;
+  stats.internTombstones = vm->strings.tombstones();
+  stats.internedStrings = vm->strings.count() - stats.internTombstones;
+  return stats;
+}
+
+bool MemoryManager::safepoint(bool objectsMayMove)
+{
+  if (_outOfMemory) {
+    // the program stops, what it held is garbage now
+    _outOfMemory = false;
+    _allocationLimit = _options.heapLimit;
+    return false;
+  }
+
+  if (objectsMayMove && compactionDue()) {
+    compact();
+  }
+  return true;
+}
+
 void MemoryManager::markValue(Value value)
 {
   if (IS_OBJ(value)) {
@@ -241,6 +928,10 @@ void MemoryManager::markObject(Obj* object)
     return;
   }
 
+  if (!marks(object)) {
+    return;
+  }
+
 #ifdef DEBUG_LOG_GC
   std::cout << fmt::sprintf("DBG: %p mark ", (void*)object);
   std::cout << toString(Value(object));
@@ -265,7 +956,11 @@ ObjInstance* MemoryManager::newInstance(ObjClass* klass)
 
 ObjClass* MemoryManager::newClass(ObjString* name)
 {
-  return ALLOCATE_OBJ<ObjClass>(name);
+  ObjClass* klass = ALLOCATE_OBJ<ObjClass>(name);
+  // entries left by a freed class whose shapes had the same addresses never
+  // match the new epoch
+  vm->renewEpoch(klass);
+  return klass;
 }
 
 ObjUpvalue* MemoryManager::newUpvalue(Value* slot)
@@ -1,11 +1,22 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
 #include <iostream>
+#include <mutex>
+#include <new>
+#include <thread>
 #include <variant>
+#include <vector>
 
 #include <fmt/printf.h>
 
 #include "common.h"
+#include "gc.h"
+#include "heap.h"
 #include "obj.h"
 #include "objboundmethod.h"
 #include "objclass.h"
@@ -18,6 +29,7 @@
 #include "vm.h"
 
 class Compiler;
+class GrayDeque;
 // TODO: Clean up this whole mess!! Jesus
 
 template<typename T>
@@ -26,30 +38,96 @@ constexpr auto GROW_CAPACITY(T capacity)
   return ((capacity) < 8 ? 8 : (capacity)*2);
 }
 
+// bytes of new objects that fill the nursery and start a minor collection
+constexpr size_t GC_NURSERY_SIZE = 256u * 1024u;
+// bytes of new objects between two slices of an incremental major collection
+constexpr size_t GC_SLICE_INTERVAL = 32u * 1024u;
+// pages a minor collection sweeps while the pages are swept lazily, the
+// nursery fills only four
+constexpr size_t GC_SWEEP_PAGES = 16;
+
+// Generational collector. New objects are young, the ones that survive a
+// collection are promoted and get old. They live in the pages of a
+// segregated Heap, which keeps their marks in bitmaps.
+//
+// A minor collection runs whenever the nursery is full. It only marks young
+// objects, from the roots and from the old objects in the remembered set,
+// and frees the unmarked ones. Old objects get into the remembered set
+// through the write barrier once they point at a young object, so every
+// store of a reference into an object has to go through writeBarrier. A
+// major collection marks and sweeps the whole heap, it runs once the heap
+// outgrew nextGC after a minor collection.
+//
+// In GcMode::INCREMENTAL a major collection marks the old objects in slices
+// of at most sliceBudget objects, one per GC_SLICE_INTERVAL bytes allocated,
+// with minor collections in between. Marked objects are black once they are
+// blackened and gray while they wait on the gray stack. The write barrier
+// keeps black objects from pointing at white ones: it marks an old object
+// stored into an old object gray. Young objects get marked by the minor
+// collections, which push their survivors onto the gray stack, or by the
+// last step, which marks from the roots once more, finishes the marking and
+// sweeps.
+//
+// In GcMode::CONCURRENT a major collection marks the old objects on a
+// background thread while the program goes on. It marks what was reachable
+// when it began: the program stands still while the roots are marked, and
+// the write barrier scans an old object before the program changes it, so
+// no reference that was there at the beginning gets lost. The objects the
+// program allocates in the meantime are young and get promoted black. The
+// marker stops while a minor collection runs, and once it ran out of gray
+// objects the program stands still once more to finish the marking and to
+// sweep.
+//
+// Objects only move in a compacting collection, which runs once the lazy
+// sweep of a major collection left the pages too sparse and
+// GcOptions::compact is on. It marks and sweeps the whole heap, evacuates
+// the sparse pages and points every reference at where its object went. The
+// references the VM holds outside the roots would go stale, so the VM runs
+// it with compact where it holds none: on the back-edge of a loop or where
+// machine code left to the interpreter, while no other machine code runs.
+//
+// The heap counts the objects and the buffers they own, see account. Once it
+// outgrows GcOptions::heapLimit a full collection runs at the next
+// allocation. If the heap is still too large then, the program goes on until
+// it reaches the next safepoint, which stops it with an error.
 class MemoryManager
 {
 public:
-  virtual ~MemoryManager() { freeObjects(objects); }
+  virtual ~MemoryManager()
+  {
+    if (_marker.joinable()) {
+      _marker.join();
+    }
 
+    freeObjects();
+  }
+
+  // runs the destructor, the slot of pointer goes back to the heap apart
   template<typename T>
   inline void FREE(T* pointer)
   {
-    bytesAllocated = bytesAllocated - sizeof(T);
-    delete pointer;
+    GcCensus& census = _census[static_cast<size_t>(pointer->type())];
+    census.objects--;
+    census.bytes -= pointer->accountedBytes();
+    _bytesAllocated = _bytesAllocated - pointer->accountedBytes();
+    _bytesFreed += pointer->accountedBytes();
+    pointer->~T();
   }
 
   template<typename T, typename... Args>
   inline T* ALLOCATE_OBJ(Args... args)
   {
     const auto size = sizeof(T);
-
-    bytesAllocated = bytesAllocated + size;
+    // the heap has no size class for bigger objects
+    static_assert(sizeof(T) <= MAX_SLOT_SIZE, "object too big for a heap slot");
 
     maybeGC();
 
-    T* object = new T(std::forward<Args>(args)...);
-    object->setNextObj(objects);
-    objects = object;
+    T* object = new (_heap.allocate(size)) T(std::forward<Args>(args)...);
+    _census[static_cast<size_t>(object->type())].objects++;
+    account(object);
+    youngBytes = youngBytes + object->accountedBytes();
+    youngObjects.push_back(object);
 
 #ifdef DEBUG_LOG_GC
     std::cout << fmt::sprintf("%p allocate %zu for %d\n",
@@ -63,11 +141,60 @@ public:
 
   inline void maybeGC()
   {
-    if (bytesAllocated > nextGC) {
-      collectGarbage();
+    if (youngBytes >= nextStep || _bytesAllocated > _allocationLimit) {
+      step();
     }
   }
 
+  // counts the object and the buffers it owns again, has to come after
+  // they grew
+  template<typename T>
+  inline void account(T* object)
+  {
+    // the buffers never shrink
+    const size_t bytes = sizeof(T) + object->ownedBytes();
+    assert(bytes >= object->accountedBytes());
+    const size_t grown = bytes - object->accountedBytes();
+    _census[static_cast<size_t>(object->type())].bytes += grown;
+    _bytesAllocated = _bytesAllocated + grown;
+    object->setAccountedBytes(bytes);
+  }
+
+  // has to come right before every store of value into a field of owner
+  inline void writeBarrier(Obj* owner, Value value)
+  {
+    if (owner->isOld()) {
+      writeBarrier(owner, IS_OBJ(value) ? AS_OBJ(value) : nullptr);
+    }
+  }
+
+  inline void writeBarrier(Obj* owner, Obj* object)
+  {
+    if (!owner->isOld()) {
+      return;
+    }
+
+    if (_concurrent) {
+      scanBeforeWrite(owner);
+    }
+
+    if (object != nullptr) {
+      if (!object->isOld()) {
+        if (!owner->isRemembered()) {
+          owner->setIsRemembered(true);
+          rememberedSet.push_back(owner);
+        }
+      } else if (_marking && !object->isMarked()) {
+        object->setIsMarked(true);
+        grayStack.push_back(object);
+      }
+    }
+  }
+
+  // for stores of many references at once, remembers owner if it is old and
+  // marks it gray again if it is black, has to come before them as well
+  void remember(Obj* owner);
+
   inline ObjString* allocateString(std::string chars, uint32_t hash)
   {
     ObjString* string = ALLOCATE_OBJ<ObjString>(chars, hash);
@@ -99,6 +226,7 @@ public:
 
     ObjString* interned = vm->strings.findString(string, hash);
     if (interned != nullptr) {
+      keepInterned(interned);
       return interned;
     }
 
@@ -111,24 +239,66 @@ public:
 
     ObjString* interned = vm->strings.findString(chars, hash);
     if (interned != nullptr) {
+      keepInterned(interned);
       return interned;
     }
 
     return allocateString(chars, hash);
   }
 
+  // A concurrent marking does not follow the intern table. A string found
+  // there may have been unreachable when it began, and is reachable again.
+  inline void keepInterned(ObjString* string)
+  {
+    if (_concurrent && string->isOld()) {
+      string->shade();
+    }
+  }
+
   inline ObjString* copyString(std::string_view chars)
   {
     return copyString(std::string {chars});
   }
 
-  void freeObjects(Obj* objects);
+  void freeObjects();
   void markValue(Value value);
   void markObject(Obj* object);
   void markCompilerRoots();
+  // major collection
   void collectGarbage();
+  // minor collection
+  void collectYoung();
+  // compacting collection, it waits for the marking of a major one
+  bool compactionDue() const
+  {
+    return _compactionDue && !_marking && !_concurrent;
+  }
+  void compact();
+
+  // whether the VM has to call safepoint where it holds no references
+  // outside the roots
+  bool safepointDue() const { return _outOfMemory || compactionDue(); }
+  // compacts if it is due and objectsMayMove, false once the heap outgrew
+  // GcOptions::heapLimit, the program has to stop with an error then
+  bool safepoint(bool objectsMayMove);
+  bool outOfMemory() const { return _outOfMemory; }
+
+  // what the collector did so far, the pauses are kept apart
+  GcStats stats() const;
 
   inline void setVm(VM* _vm) { vm = _vm; }
+  const GcOptions& options() const { return _options; }
+  inline void setOptions(const GcOptions& options)
+  {
+    assert(options.sliceBudget > 0);
+    assert(options.markThreads > 0);
+    assert(options.compactThreshold >= 0.0 && options.compactThreshold <= 1.0);
+    assert(options.growthFactor >= 1.0);
+    _options = options;
+    nextGC = std::min(options.initialThreshold, options.heapLimit);
+    _allocationLimit = options.heapLimit;
+  }
+  const GcPauses& pauses() const { return _pauses; }
 
   ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method);
   ObjInstance* newInstance(ObjClass* klass);
@@ -142,18 +312,108 @@ public:
   Compiler* currentCompiler();
 
 private:
+  // Which objects a collection marks. An incremental major collection only
+  // marks old objects until its last step.
+  enum class MarkMode
+  {
+    ALL,
+    YOUNG,
+    OLD,
+  };
+
+  // runs whatever collection or slice is due and records the pause
+  void step();
+  void startMarking();
+  // blackens up to sliceBudget gray objects, finishes the collection once
+  // there are none left
+  void markSlice();
+  void finishMarking();
+  void startConcurrentMarking();
+  // runs on the marker thread
+  void markConcurrently(std::vector<Obj*> gray);
+  // scans the gray objects and the ones they shade until there are none
+  // left, on either thread
+  void markGray(std::vector<Obj*>& gray);
+  void scanBeforeWrite(Obj* owner);
+  void handOffShaded();
+  bool markerDone();
+  // the marker stops while a minor collection runs
+  void pauseMarker();
+  void resumeMarker();
+  void waitWhilePaused();
+  void finishConcurrentMarking();
   void markRoots();
-  void markArray(const std::vector<Value>& array);
   void blackenObject(Obj* object);
   void traceReferences();
+  // whether the collection that runs marks object at all
+  bool marks(const Obj* object) const;
+  // traces with markThreads threads that steal each other's gray objects
+  void traceInParallel();
+  void markInParallel(GrayDeque* deques,
+                      size_t self,
+                      std::atomic<size_t>* idle);
+  // Heap::Destroy
+  static void destroy(void* slot, void* memoryManager);
+  // starts sweeping the pages lazily
   void sweep();
+  void sweepPages();
+  // frees the unmarked young objects and promotes the others
+  void sweepYoung();
+  // Heap::Movable and Heap::Move
+  static bool movable(const void* slot);
+  static void move(void* from, void* to, void* memoryManager);
+  // points the roots and the objects at the objects that moved
+  void updateReferences();
+  // finishes the major collection that runs and collects the whole heap
+  // once more, with every page swept
+  void collectFully();
+  // nextGC after a major collection
+  size_t nextThreshold() const;
 
 private:
-  size_t bytesAllocated;
-  static inline size_t nextGC = 1024u * 1024u;  // 1024*1024
-  Obj* objects = nullptr;
+  // the objects and the buffers they own, see account
+  size_t _bytesAllocated = 0;
+  size_t _bytesFreed = 0;
+  // by ObjType, up to date with every allocation and free
+  std::array<GcCensus, OBJ_TYPE_COUNT> _census {};
+  // the collection counts and the census after the last collection
+  GcStats _stats;
+  // per VM, the threshold of one VM must not start collections of another
+  size_t nextGC = GcOptions {}.initialThreshold;
+  // bytes allocated at which maybeGC collects the whole heap, GcOptions::
+  // heapLimit unless the heap outgrew it
+  size_t _allocationLimit = SIZE_MAX;
+  // the heap outgrew GcOptions::heapLimit, the next safepoint reports it
+  bool _outOfMemory = false;
+  Heap _heap {&MemoryManager::destroy, this};
+  // whether the heap sweeps the pages of the last major collection
+  bool _sweeping = false;
+  bool _compactionDue = false;
+  std::vector<Obj*> youngObjects;
+  size_t youngBytes = 0;
+  // youngBytes at which maybeGC has something to do
+  size_t nextStep = GC_NURSERY_SIZE;
+  MarkMode _markMode = MarkMode::ALL;
+  // whether an incremental major collection is marking
+  bool _marking = false;
+  GcOptions _options;
+  GcPauses _pauses;
+
+  // whether a concurrent major collection is marking
+  bool _concurrent = false;
+  std::thread _marker;
+  // objects the write barrier shaded, handed to the marker in batches
+  std::vector<Obj*> _shaded;
+  std::atomic<bool> _pauseRequested {false};
+  // guards the fields below
+  std::mutex _markerMutex;
+  std::condition_variable _markerCondition;
+  std::vector<Obj*> _handoff;
+  bool _markerPaused = false;
+  bool _markerDone = false;
 
   std::vector<Obj*> grayStack;
+  std::vector<Obj*> rememberedSet;
 
   VM* vm = nullptr;
   Compiler* _currentCompiler = nullptr;
@@ -1,21 +1,60 @@
+#include <string>
+
 #include "obj.h"
 
-void Obj::setNextObj(Obj* next)
-{
-  _nextObj = next;
-}
+#include "objboundmethod.h"
+#include "objclass.h"
+#include "objclosure.h"
+#include "objfunction.h"
+#include "objinstance.h"
+#include "objnative.h"
+#include "objstring.h"
+#include "objupvalue.h"
 
-void Obj::setIsMarked(bool marked)
+const char* typeName(ObjType type)
 {
-  _isMarked = marked;
-}
+  switch (type) {
+    case ObjType::CLOSURE:
+      return "closure";
+    case ObjType::FUNCTION:
+      return "function";
+    case ObjType::NATIVE:
+      return "native";
+    case ObjType::STRING:
+      return "string";
+    case ObjType::UPVALUE:
+      return "upvalue";
+    case ObjType::CLASS:
+      return "class";
+    case ObjType::INSTANCE:
+      return "instance";
+    case ObjType::BOUND_METHOD:
+      return "bound_method";
+  }
 
-Obj* Obj::nextObj() const
-{
-  return _nextObj;
+  return "unknown";
 }
 
-bool Obj::isMarked() const
+std::string Obj::toString() const
 {
-  return _isMarked;
+  switch (type()) {
+    case ObjType::CLOSURE:
+      return static_cast<const ObjClosure*>(this)->toString();
+    case ObjType::FUNCTION:
+      return static_cast<const ObjFunction*>(this)->toString();
+    case ObjType::NATIVE:
+      return static_cast<const ObjNative*>(this)->toString();
+    case ObjType::STRING:
+      return static_cast<const ObjString*>(this)->toString();
+    case ObjType::UPVALUE:
+      return static_cast<const ObjUpvalue*>(this)->toString();
+    case ObjType::CLASS:
+      return static_cast<const ObjClass*>(this)->toString();
+    case ObjType::INSTANCE:
+      return static_cast<const ObjInstance*>(this)->toString();
+    case ObjType::BOUND_METHOD:
+      return static_cast<const ObjBoundMethod*>(this)->toString();
+  }
+
+  return std::string {};
 }
@@ -1,8 +1,11 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
 
-enum class ObjType
+#include "heap.h"
+
+enum class ObjType : uint8_t
 {
   CLOSURE,
   FUNCTION,
@@ -14,22 +17,72 @@ enum class ObjType
   BOUND_METHOD,
 };
 
+constexpr size_t OBJ_TYPE_COUNT =
+    static_cast<size_t>(ObjType::BOUND_METHOD) + 1;
+
+// the name of type in snake case, for reports
+const char* typeName(ObjType type);
+
+// Header of every heap object. The type is a plain field, so objects carry
+// no vtable: code that needs the concrete class switches on type() and
+// static_casts, and objects are freed through their concrete type. Objects
+// live in the pages of the Heap.
 class Obj
 {
 public:
-  Obj() = default;
-  virtual ~Obj() = default;
+  explicit Obj(ObjType type)
+      : _type(type)
+  {
+  }
+
+  ObjType type() const { return _type; }
+
+  std::string toString() const;
 
-  virtual std::string toString() const = 0;
-  virtual ObjType type() const = 0;
+  // the mark state is kept in the mark bitmap of the page of the object
+  bool isMarked() const
+  {
+    return Page::of(this)->markState(this) != Page::WHITE;
+  }
+  void setIsMarked(bool marked) { Page::of(this)->setMarked(this, marked); }
 
-  bool isMarked() const;
-  void setIsMarked(bool marked);
+  // for marking on a background thread, see Page
+  bool shade() { return Page::of(this)->shade(this); }
+  bool beginScan() { return Page::of(this)->beginScan(this); }
+  void endScan() { Page::of(this)->endScan(this); }
 
-  Obj* nextObj() const;
-  void setNextObj(Obj* next);
+  // objects start out young and get old once they survived a collection
+  bool isOld() const { return _isOld; }
+  void setIsOld(bool old) { _isOld = old; }
+  // old objects in the remembered set of the collector
+  bool isRemembered() const { return _isRemembered; }
+  void setIsRemembered(bool remembered) { _isRemembered = remembered; }
+
+  // bytes of the buffers the object owns, the classes that own any hide it
+  size_t ownedBytes() const { return 0; }
+  // bytes the collector counts for the object and the buffers it owns, as
+  // of the last time it counted them
+  size_t accountedBytes() const { return _accountedBytes; }
+  void setAccountedBytes(size_t bytes)
+  {
+    _accountedBytes = static_cast<uint32_t>(bytes);
+  }
+
+protected:
+  ~Obj() = default;
 
 private:
-  bool _isMarked = false;
-  Obj* _nextObj = nullptr;
+  ObjType _type;
+  bool _isOld = false;
+  bool _isRemembered = false;
+  // fits into the padding before the fields of the objects
+  uint32_t _accountedBytes = 0;
 };
+
+// where object is now, it may have moved while the heap is evacuated
+template<typename T>
+T* forwarded(T* object)
+{
+  return object != nullptr ? static_cast<T*>(Heap::forwarded(object))
+                           : nullptr;
+}
@@ -1,7 +1,8 @@
 #include "objboundmethod.h"
 
 ObjBoundMethod::ObjBoundMethod(Value receiver, ObjClosure* method)
-    : _receiver(receiver)
+    : Obj(ObjType::BOUND_METHOD)
+    , _receiver(receiver)
     , _method(method)
 {
 }
@@ -16,12 +17,13 @@ ObjClosure* ObjBoundMethod::method() const
   return _method;
 }
 
-std::string ObjBoundMethod::toString() const
+void ObjBoundMethod::updateReferences()
 {
-  return method()->function()->toString();
+  _receiver = forwarded(_receiver);
+  _method = forwarded(_method);
 }
 
-ObjType ObjBoundMethod::type() const
+std::string ObjBoundMethod::toString() const
 {
-  return ObjType::BOUND_METHOD;
+  return method()->function()->toString();
 }
@@ -13,8 +13,10 @@ public:
 
   ObjClosure* method() const;
 
-  std::string toString() const override;
-  ObjType type() const override;
+  // points the references at the objects that moved
+  void updateReferences();
+
+  std::string toString() const;
 
 private:
   Value _receiver;
@@ -23,7 +25,7 @@ private:
 
 inline auto AS_BOUND_METHOD(Value value)
 {
-  return dynamic_cast<ObjBoundMethod*>(AS_OBJ(value));
+  return static_cast<ObjBoundMethod*>(AS_OBJ(value, ObjType::BOUND_METHOD));
 }
 
 inline auto IS_BOUND_METHOD(Value value)
@@ -3,7 +3,8 @@
 #include "objclass.h"
 
 ObjClass::ObjClass(ObjString* name)
-    : _name(name)
+    : Obj(ObjType::CLASS)
+    , _name(name)
 {
   assert(_name != nullptr);
 }
@@ -18,12 +19,24 @@ Table* ObjClass::methods()
   return &_methods;
 }
 
-std::string ObjClass::toString() const
+Shape* ObjClass::rootShape()
 {
-  return name()->string();
+  return &_rootShape;
+}
+
+size_t ObjClass::ownedBytes() const
+{
+  return _methods.ownedBytes() + _rootShape.ownedBytes();
 }
 
-ObjType ObjClass::type() const
+void ObjClass::updateReferences()
 {
-  return ObjType::CLASS;
+  _name = forwarded(_name);
+  _methods.updateReferences();
+  _rootShape.updateReferences();
+}
+
+std::string ObjClass::toString() const
+{
+  return name()->string();
 }
@@ -2,6 +2,7 @@
 
 #include "obj.h"
 #include "objstring.h"
+#include "shape.h"
 #include "table.h"
 
 class ObjClass final : public Obj
@@ -13,18 +14,31 @@ public:
 
   Table* methods();
 
-  std::string toString() const override;
+  // shape of new instances, the root of the shape tree of the class
+  Shape* rootShape();
+  // bytes of its methods and shapes
+  size_t ownedBytes() const;
+
+  // inline cache entries of its instances are only valid for this epoch
+  uint64_t epoch() const { return _epoch; }
+  void setEpoch(uint64_t epoch) { _epoch = epoch; }
+
+  // points the references at the objects that moved
+  void updateReferences();
+
+  std::string toString() const;
 
-  ObjType type() const override;
 
 private:
   ObjString* _name = nullptr;
   Table _methods;
+  Shape _rootShape;
+  uint64_t _epoch = 0;
 };
 
 inline auto AS_CLASS(Value value)
 {
-  return dynamic_cast<ObjClass*>(AS_OBJ(value));
+  return static_cast<ObjClass*>(AS_OBJ(value, ObjType::CLASS));
 }
 
 inline auto IS_CLASS(Value value)
@@ -1,7 +1,8 @@
 #include "objclosure.h"
 
 ObjClosure::ObjClosure(ObjFunction* function, std::vector<ObjUpvalue*> upvalues)
-    : _function(function)
+    : Obj(ObjType::CLOSURE)
+    , _function(function)
     , _upvalues(upvalues)
 {
 }
@@ -16,11 +17,6 @@ std::string ObjClosure::toString() const
   return function()->toString();
 }
 
-ObjType ObjClosure::type() const
-{
-  return ObjType::CLOSURE;
-}
-
 int ObjClosure::upvalueCount() const
 {
   return _upvalues.size();
@@ -31,6 +27,14 @@ ObjUpvalue* ObjClosure::upvalue(int index)
   return _upvalues.at(index);
 }
 
+void ObjClosure::updateReferences()
+{
+  _function = forwarded(_function);
+  for (ObjUpvalue*& upvalue : _upvalues) {
+    upvalue = forwarded(upvalue);
+  }
+}
+
 void ObjClosure::setUpvalue(ObjUpvalue* upvalue, int index)
 {
   _upvalues[index] = upvalue;
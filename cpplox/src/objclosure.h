@@ -15,10 +15,17 @@ public:
   void setUpvalue(ObjUpvalue* upvalue, int index);
 
   int upvalueCount() const;
+  // bytes of the buffers it owns
+  size_t ownedBytes() const
+  {
+    return _upvalues.capacity() * sizeof(ObjUpvalue*);
+  }
 
-  std::string toString() const override;
+  // points the references at the objects that moved
+  void updateReferences();
+
+  std::string toString() const;
 
-  ObjType type() const override;
 
 private:
   ObjFunction* _function = nullptr;
@@ -27,7 +34,7 @@ private:
 
 inline auto AS_CLOSURE(Value value)
 {
-  return dynamic_cast<ObjClosure*>(AS_OBJ(value));
+  return static_cast<ObjClosure*>(AS_OBJ(value, ObjType::CLOSURE));
 }
 
 inline auto IS_CLOSURE(Value value)
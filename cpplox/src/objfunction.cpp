@@ -1,7 +1,11 @@
+#include <memory>
+#include <vector>
+
 #include "objfunction.h"
 
 ObjFunction::ObjFunction(int arity, int upvalueCount, ObjString* name)
-    : _arity(arity)
+    : Obj(ObjType::FUNCTION)
+    , _arity(arity)
     , _upvalueCount(upvalueCount)
     , _name(name)
 {
@@ -17,19 +21,34 @@ int ObjFunction::upvalueCount() const
   return _upvalueCount;
 }
 
+size_t ObjFunction::maxStackDepth() const
+{
+  return _maxStackDepth;
+}
+
+void ObjFunction::setMaxStackDepth(size_t depth)
+{
+  _maxStackDepth = depth;
+}
+
 Chunk* ObjFunction::chunk()
 {
   return &_chunk;
 }
 
-ObjString* ObjFunction::name() const
+RegisterChunk* ObjFunction::registerChunk()
 {
-  return _name;
+  return &_registerChunk;
 }
 
-ObjType ObjFunction::type() const
+size_t ObjFunction::ownedBytes() const
 {
-  return ObjType::FUNCTION;
+  return _chunk.ownedBytes() + _registerChunk.ownedBytes();
+}
+
+ObjString* ObjFunction::name() const
+{
+  return _name;
 }
 
 std::string ObjFunction::toString() const
@@ -45,6 +64,13 @@ void ObjFunction::setName(ObjString* name)
   _name = name;
 }
 
+void ObjFunction::updateReferences()
+{
+  _name = forwarded(_name);
+  _chunk.updateReferences();
+  _registerChunk.updateReferences();
+}
+
 void ObjFunction::setArity(int arity)
 {
   _arity = arity;
@@ -64,3 +90,48 @@ void ObjFunction::incrementUpvalueCount()
 {
   setUpvalueCount(upvalueCount() + 1);
 }
+
+bool ObjFunction::warmUp(int threshold)
+{
+  if (_calls >= threshold) {
+    return false;
+  }
+
+  _calls++;
+  return _calls == threshold;
+}
+
+const JitCode* ObjFunction::jitCode() const
+{
+  return _jitCode.get();
+}
+
+void ObjFunction::setJitCode(std::unique_ptr<JitCode> code)
+{
+  _jitCode = std::move(code);
+}
+
+LoopProfile* ObjFunction::loopProfile(size_t offset)
+{
+  // a function has few loops
+  for (auto& loop : _loops) {
+    if (loop.offset == offset) {
+      return &loop;
+    }
+  }
+
+  _loops.push_back(LoopProfile {offset, 0, 0, nullptr});
+  return &_loops.back();
+}
+
+std::vector<size_t> ObjFunction::tracedLoops() const
+{
+  std::vector<size_t> offsets;
+  for (const auto& loop : _loops) {
+    if (loop.trace != nullptr) {
+      offsets.push_back(loop.offset);
+    }
+  }
+
+  return offsets;
+}
@@ -1,10 +1,14 @@
 #pragma once
 
 #include <memory>
+#include <vector>
 
 #include "chunk.h"
+#include "jit.h"
 #include "obj.h"
 #include "objstring.h"
+#include "registerchunk.h"
+#include "tracejit.h"
 
 class ObjFunction final : public Obj
 {
@@ -19,24 +23,48 @@ public:
   void setUpvalueCount(int count);
   void incrementUpvalueCount();
 
+  // values a frame of the function needs above its slot 0 at most, slot 0
+  // and the parameters included
+  size_t maxStackDepth() const;
+  void setMaxStackDepth(size_t depth);
+
   Chunk* chunk();
+  RegisterChunk* registerChunk();
+  // bytes of its chunks, not of the machine code
+  size_t ownedBytes() const;
   ObjString* name() const;
   void setName(ObjString* name);
+  // points the references at the objects that moved
+  void updateReferences();
+
+  // counts a call or loop iteration, true for the one that reaches threshold
+  bool warmUp(int threshold);
+  // machine code of the chunk, nullptr until the JIT compiled it
+  const JitCode* jitCode() const;
+  void setJitCode(std::unique_ptr<JitCode> code);
+  // the loop whose OP_LOOP is at offset, profiled from its first iteration
+  LoopProfile* loopProfile(size_t offset);
+  // offsets of the OP_LOOPs of the loops that have a trace
+  std::vector<size_t> tracedLoops() const;
 
-  std::string toString() const override;
-  ObjType type() const override;
+  std::string toString() const;
 
 private:
   int _arity = 0;
   int _upvalueCount = 0;
+  size_t _maxStackDepth = 0;
 
   Chunk _chunk;
+  RegisterChunk _registerChunk;
   ObjString* _name = nullptr;  // non-owning
+  int _calls = 0;
+  std::unique_ptr<JitCode> _jitCode;
+  std::vector<LoopProfile> _loops;
 };
 
 inline auto AS_FUNCTION(Value value)
 {
-  return dynamic_cast<ObjFunction*>(AS_OBJ(value));
+  return static_cast<ObjFunction*>(AS_OBJ(value, ObjType::FUNCTION));
 }
 
 inline auto IS_FUNCTION(Value value)
@@ -1,7 +1,12 @@
+#include <cassert>
+#include <vector>
+
 #include "objinstance.h"
 
 ObjInstance::ObjInstance(ObjClass* klass)
-    : _klass(klass)
+    : Obj(ObjType::INSTANCE)
+    , _klass(klass)
+    , _shape(klass->rootShape())
 {
 }
 
@@ -10,17 +15,67 @@ std::string ObjInstance::toString() const
   return std::string {klass()->name()->string()} + " instance";
 }
 
-Table* ObjInstance::fields()
+ObjClass* ObjInstance::klass() const
 {
-  return &_fields;
+  return _klass;
 }
 
-ObjClass* ObjInstance::klass() const
+Shape* ObjInstance::shape() const
 {
-  return _klass;
+  return _shape;
+}
+
+size_t ObjInstance::fieldCount() const
+{
+  return _shape->fieldCount();
+}
+
+Value* ObjInstance::fieldAt(size_t index)
+{
+  assert(index < fieldCount());
+  if (index < INLINE_FIELDS) {
+    return &_inlineFields[index];
+  }
+
+  return &_extraFields[index - INLINE_FIELDS];
+}
+
+Value* ObjInstance::field(const ObjString* name)
+{
+  auto index = _shape->indexOf(name);
+  if (!index.has_value()) {
+    return nullptr;
+  }
+
+  return fieldAt(index.value());
+}
+
+void ObjInstance::setField(ObjString* name, Value value)
+{
+  if (Value* slot = field(name)) {
+    *slot = value;
+    return;
+  }
+
+  addField(_shape->addField(name), value);
+}
+
+void ObjInstance::addField(Shape* shape, Value value)
+{
+  assert(shape->fieldCount() == fieldCount() + 1);
+  const size_t index = fieldCount();
+  if (index >= INLINE_FIELDS) {
+    _extraFields.push_back(value);
+  }
+
+  _shape = shape;
+  *fieldAt(index) = value;
 }
 
-ObjType ObjInstance::type() const
+void ObjInstance::updateReferences()
 {
-  return ObjType::INSTANCE;
+  _klass = forwarded(_klass);
+  for (size_t i = 0; i < fieldCount(); i++) {
+    *fieldAt(i) = forwarded(*fieldAt(i));
+  }
 }
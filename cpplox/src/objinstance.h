@@ -1,32 +1,53 @@
 #pragma once
 
+#include <vector>
+
 #include "obj.h"
 #include "objclass.h"
+#include "shape.h"
 
+// Fields are stored by slot, the shape of the instance maps their names to
+// slots. The first few fields live inside the object itself.
 class ObjInstance final : public Obj
 {
 public:
   explicit ObjInstance(ObjClass* klass);
 
   ObjClass* klass() const;
+  Shape* shape() const;
+
+  size_t fieldCount() const;
+  Value* fieldAt(size_t index);
+  // the field named name, nullptr if the instance does not have it
+  Value* field(const ObjString* name);
+  void setField(ObjString* name, Value value);
+  // appends a field, shape has to be the successor of the current shape
+  // adding it
+  void addField(Shape* shape, Value value);
+  // bytes of the buffers it owns
+  size_t ownedBytes() const { return _extraFields.capacity() * sizeof(Value); }
 
-  Table* fields();
+  // points the references at the objects that moved
+  void updateReferences();
 
-  std::string toString() const override;
+  std::string toString() const;
 
-  ObjType type() const override;
 
 private:
+  static constexpr size_t INLINE_FIELDS = 4;
+
   ObjClass* _klass = nullptr;
-  Table _fields;
+  Shape* _shape = nullptr;
+  Value _inlineFields[INLINE_FIELDS];
+  std::vector<Value> _extraFields;
 };
 
 inline auto AS_INSTANCE(Value value)
 {
-  return dynamic_cast<ObjInstance*>(AS_OBJ(value));
+  return static_cast<ObjInstance*>(AS_OBJ(value, ObjType::INSTANCE));
 }
 
 inline auto IS_INSTANCE(Value value)
 {
   return isObjType(value, ObjType::INSTANCE);
-}
\ No newline at end of file
+}
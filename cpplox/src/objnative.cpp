@@ -1,7 +1,8 @@
 #include "objnative.h"
 
 ObjNative::ObjNative(NativeFn fn)
-    : _function(fn)
+    : Obj(ObjType::NATIVE)
+    , _function(fn)
 {
 }
 
@@ -10,11 +11,6 @@ NativeFn ObjNative::function() const
   return _function;
 }
 
-ObjType ObjNative::type() const
-{
-  return ObjType::NATIVE;
-}
-
 std::string ObjNative::toString() const
 {
   return "<native fn>";
@@ -10,8 +10,7 @@ class ObjNative final : public Obj
 public:
   explicit ObjNative(NativeFn fn);
 
-  std::string toString() const override;
-  ObjType type() const override;
+  std::string toString() const;
 
   NativeFn function() const;
 
@@ -21,7 +20,7 @@ private:
 
 inline auto AS_NATIVE(Value value)
 {
-  return dynamic_cast<ObjNative*>(AS_OBJ(value))->function();
+  return static_cast<ObjNative*>(AS_OBJ(value, ObjType::NATIVE))->function();
 }
 
 inline auto IS_NATIVE(Value value)
@@ -1,16 +1,12 @@
 #include "objstring.h"
 
 ObjString::ObjString(std::string chars, uint32_t hash)
-    : _string(std::move(chars))
+    : Obj(ObjType::STRING)
+    , _string(std::move(chars))
     , _hash {hash}
 {
 }
 
-ObjType ObjString::type() const
-{
-  return ObjType::STRING;
-}
-
 std::string ObjString::toString() const
 {
   return _string;
@@ -26,6 +22,18 @@ std::string ObjString::string() const
   return toString();
 }
 
+size_t ObjString::ownedBytes() const
+{
+  // short strings are stored inside the object
+  const char* data = _string.data();
+  const char* object = reinterpret_cast<const char*>(this);
+  if (data >= object && data < object + sizeof(ObjString)) {
+    return 0;
+  }
+
+  return _string.capacity() + 1;
+}
+
 size_t ObjString::length() const
 {
   return _string.size();
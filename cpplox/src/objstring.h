@@ -14,9 +14,10 @@ public:
   uint32_t hash() const;
   size_t length() const;
   std::string string() const;
+  // bytes of the buffers it owns
+  size_t ownedBytes() const;
 
-  std::string toString() const override;
-  ObjType type() const override;
+  std::string toString() const;
 
 private:
   std::string _string;
@@ -25,7 +26,7 @@ private:
 
 inline auto AS_STRING(Value value)
 {
-  return dynamic_cast<ObjString*>(AS_OBJ(value));
+  return static_cast<ObjString*>(AS_OBJ(value, ObjType::STRING));
 }
 
 inline auto IS_STRING(Value value)
@@ -3,17 +3,13 @@
 #include "obj.h"
 
 ObjUpvalue::ObjUpvalue(Value* location, ObjUpvalue* nextUpvalue, Value closed)
-    : _location {location}
+    : Obj(ObjType::UPVALUE)
+    , _location {location}
     , _nextUpvalue {nextUpvalue}
     , _closed(closed)
 {
 }
 
-ObjType ObjUpvalue::type() const
-{
-  return ObjType::UPVALUE;
-}
-
 std::string ObjUpvalue::toString() const
 {
   return "upvalue";
@@ -48,3 +44,9 @@ void ObjUpvalue::setLocation(Value* newlocation)
 {
   _location = newlocation;
 }
+
+void ObjUpvalue::updateReferences()
+{
+  _nextUpvalue = forwarded(_nextUpvalue);
+  _closed = forwarded(_closed);
+}
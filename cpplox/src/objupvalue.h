@@ -17,8 +17,10 @@ public:
   Value* closed();
   void setClosed(Value v);
 
-  std::string toString() const override;
-  ObjType type() const override;
+  // points the references at the objects that moved
+  void updateReferences();
+
+  std::string toString() const;
 
 private:
   Value* _location = nullptr;  // non-owning, do not delete -> multiple closures
@@ -0,0 +1,588 @@
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "optimizer.h"
+
+#include "chunk.h"
+#include "value.h"
+
+namespace
+{
+bool isJump(uint8_t op)
+{
+  switch (op) {
+    case OP_JUMP:
+    case OP_LOOP:
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_EQUAL:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// whether the instruction after this one only runs if something jumps to it
+bool endsFlow(uint8_t op)
+{
+  return op == OP_JUMP || op == OP_LOOP || op == OP_RETURN;
+}
+
+// whether the instruction only pushes a value, which it is fine not to push
+bool isPurePush(uint8_t op)
+{
+  switch (op) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+    case OP_GET_UPVALUE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool isFalsey(Value value)
+{
+  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+}  // namespace
+
+ChunkOptimizer::ChunkOptimizer(Chunk* chunk)
+    : _chunk(chunk)
+{
+}
+
+size_t ChunkOptimizer::optimize()
+{
+  const size_t before = _chunk->count();
+  decode();
+
+  bool optimized = false;
+  while (true) {
+    bool changed = threadJumps();
+    changed = removeUnreachable() || changed;
+    changed = peephole() || changed;
+    if (!changed) {
+      break;
+    }
+    optimized = true;
+  }
+
+  if (optimized) {
+    encode();
+  }
+
+  assert(_chunk->count() <= before);
+  return before - _chunk->count();
+}
+
+void ChunkOptimizer::decode()
+{
+  std::vector<size_t> indices(_chunk->count() + 1, NO_TARGET);
+  for (size_t offset = 0; offset < _chunk->count();
+       offset += instructionLength(*_chunk, offset))
+  {
+    const size_t length = instructionLength(*_chunk, offset);
+    Instruction instruction {{}, _chunk->linesAt(offset), NO_TARGET};
+    for (size_t i = 0; i < length; i++) {
+      instruction.bytes.push_back(_chunk->codeAt(offset + i));
+    }
+
+    // the offset of the target for now
+    const uint8_t op = instruction.bytes[0];
+    if (op == OP_LOOP) {
+      instruction.target = offset + 3 - _chunk->shortAt(offset + 1);
+    } else if (isJump(op)) {
+      instruction.target = offset + 3 + _chunk->shortAt(offset + 1);
+    }
+
+    indices[offset] = _code.size();
+    _code.push_back(std::move(instruction));
+  }
+
+  for (auto& instruction : _code) {
+    if (instruction.target != NO_TARGET) {
+      instruction.target = indices[instruction.target];
+      assert(instruction.target != NO_TARGET);
+    }
+  }
+}
+
+void ChunkOptimizer::encode()
+{
+  const std::vector<size_t> starts = offsets();
+
+  _chunk->truncate(0);
+  for (size_t i = 0; i < _code.size(); i++) {
+    Instruction& instruction = _code[i];
+    if (instruction.target != NO_TARGET) {
+      // both offsets are relative to the end of the jump instruction
+      const size_t end = starts[i] + 3;
+      const size_t destination = starts[instruction.target];
+      const bool forward = destination >= end;
+      if (instruction.bytes[0] == OP_JUMP || instruction.bytes[0] == OP_LOOP) {
+        instruction.bytes[0] = forward ? OP_JUMP : OP_LOOP;
+      }
+      assert(forward || instruction.bytes[0] == OP_LOOP);
+
+      const size_t jump = forward ? destination - end : end - destination;
+      assert(jump <= UINT16_MAX);
+      instruction.bytes[1] = (jump >> 8) & 0xff;
+      instruction.bytes[2] = jump & 0xff;
+    }
+
+    for (uint8_t byte : instruction.bytes) {
+      _chunk->write(byte, instruction.line);
+    }
+  }
+}
+
+std::vector<size_t> ChunkOptimizer::offsets() const
+{
+  std::vector<size_t> starts;
+  starts.reserve(_code.size() + 1);
+
+  size_t offset = 0;
+  for (const auto& instruction : _code) {
+    starts.push_back(offset);
+    offset += instruction.bytes.size();
+  }
+  starts.push_back(offset);
+
+  return starts;
+}
+
+bool ChunkOptimizer::threadJumps()
+{
+  const std::vector<size_t> starts = offsets();
+  bool changed = false;
+
+  for (size_t i = 0; i < _code.size(); i++) {
+    Instruction& jump = _code[i];
+    if (jump.target == NO_TARGET) {
+      continue;
+    }
+
+    const uint8_t op = jump.bytes[0];
+    const bool unconditional = op == OP_JUMP || op == OP_LOOP;
+    size_t target = jump.target;
+    // a cycle of jumps ends after as many steps as there are instructions
+    for (size_t step = 0; step < _code.size(); step++) {
+      const Instruction& next = _code[target];
+      const uint8_t nextOp = next.bytes[0];
+      // a value that was falsey for one OP_JUMP_IF_FALSE is for the next
+      const bool follow = nextOp == OP_JUMP || nextOp == OP_LOOP
+          || (op == OP_JUMP_IF_FALSE && nextOp == OP_JUMP_IF_FALSE);
+      if (!follow) {
+        break;
+      }
+
+      // only unconditional jumps can go backwards, and any jump only so far
+      const size_t end = starts[i] + 3;
+      const size_t destination = starts[next.target];
+      const bool forward = destination >= end;
+      const size_t distance = forward ? destination - end : end - destination;
+      if ((!forward && !unconditional) || distance > UINT16_MAX) {
+        break;
+      }
+
+      target = next.target;
+    }
+
+    if (target != jump.target) {
+      jump.target = target;
+      changed = true;
+    }
+  }
+
+  return changed;
+}
+
+bool ChunkOptimizer::removeUnreachable()
+{
+  std::vector<bool> reachable(_code.size(), false);
+  std::vector<size_t> pending {0};
+  while (!pending.empty()) {
+    const size_t i = pending.back();
+    pending.pop_back();
+    if (i >= _code.size() || reachable[i]) {
+      continue;
+    }
+
+    reachable[i] = true;
+    if (!endsFlow(_code[i].bytes[0])) {
+      pending.push_back(i + 1);
+    }
+    if (_code[i].target != NO_TARGET) {
+      pending.push_back(_code[i].target);
+    }
+  }
+
+  std::vector<size_t> indices(_code.size(), NO_TARGET);
+  std::vector<Instruction> code;
+  for (size_t i = 0; i < _code.size(); i++) {
+    if (reachable[i]) {
+      indices[i] = code.size();
+      code.push_back(std::move(_code[i]));
+    }
+  }
+
+  if (code.size() == _code.size()) {
+    _code = std::move(code);
+    return false;
+  }
+
+  // only reachable instructions jump, and only to reachable ones
+  for (auto& instruction : code) {
+    if (instruction.target != NO_TARGET) {
+      instruction.target = indices[instruction.target];
+    }
+  }
+  _code = std::move(code);
+  return true;
+}
+
+bool ChunkOptimizer::peephole()
+{
+  std::vector<bool> isJumpTarget(_code.size(), false);
+  for (const auto& instruction : _code) {
+    if (instruction.target != NO_TARGET) {
+      isJumpTarget[instruction.target] = true;
+    }
+  }
+
+  _output.clear();
+  _barrier = 0;
+  _folded = false;
+
+  // index of the instruction in the output that each one became, or of the
+  // one that follows it if it was folded away
+  std::vector<size_t> indices(_code.size(), NO_TARGET);
+  for (size_t i = 0; i < _code.size(); i++) {
+    if (isJumpTarget[i]) {
+      _barrier = _output.size();
+    }
+    indices[i] = _output.size();
+
+    Instruction& instruction = _code[i];
+    if (instruction.target == i + 1) {
+      // a jump to the next instruction
+      const uint8_t op = instruction.bytes[0];
+      if (op == OP_JUMP || op == OP_LOOP || op == OP_JUMP_IF_FALSE) {
+        _folded = true;
+        continue;
+      }
+      if (op == OP_POP_JUMP_IF_FALSE) {
+        _folded = true;
+        append(Instruction {{OP_POP}, instruction.line, NO_TARGET});
+        continue;
+      }
+    }
+
+    append(std::move(instruction));
+  }
+
+  for (auto& instruction : _output) {
+    if (instruction.target != NO_TARGET) {
+      instruction.target = indices[instruction.target];
+      assert(instruction.target < _output.size());
+    }
+  }
+
+  _code = std::move(_output);
+  _output.clear();
+  return _folded;
+}
+
+void ChunkOptimizer::append(Instruction instruction)
+{
+  _output.push_back(std::move(instruction));
+  while (fold()) {
+    _folded = true;
+  }
+}
+
+bool ChunkOptimizer::fold()
+{
+  const Instruction* const a = last(0);
+  const Instruction* const b = last(1);
+  const Instruction* const c = last(2);
+  if (a == nullptr || b == nullptr) {
+    return false;
+  }
+
+  const uint8_t op = a->bytes[0];
+  const size_t line = a->line;
+  Value x;
+  Value y;
+
+  switch (op) {
+    case OP_NEGATE:
+      if (!literal(b, &x) || !IS_NUMBER(x)
+          || _chunk->constantCount() > UINT16_MAX)
+      {
+        return false;
+      }
+      drop(2);
+      return emitLiteral(Value(-AS_NUMBER(x)), line);
+
+    case OP_NOT:
+      if (literal(b, &x)) {
+        drop(2);
+        return emitLiteral(Value(isFalsey(x)), line);
+      }
+      if (b->bytes[0] == OP_NOT && c != nullptr && c->bytes[0] == OP_NOT) {
+        // !!!x is !x
+        drop(3);
+        emit(OP_NOT, line);
+        return true;
+      }
+      return false;
+
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_EQUAL: {
+      if (c == nullptr) {
+        return false;
+      }
+
+      if (literal(c, &x) && literal(b, &y)) {
+        if (op == OP_EQUAL) {
+          drop(3);
+          return emitLiteral(Value(valuesEqual(x, y)), line);
+        }
+        if (!IS_NUMBER(x) || !IS_NUMBER(y)) {
+          return false;  // fails, or concatenates strings at runtime
+        }
+
+        const double left = AS_NUMBER(x);
+        const double right = AS_NUMBER(y);
+        Value result;
+        switch (op) {
+          case OP_ADD:
+            result = Value(left + right);
+            break;
+          case OP_SUBTRACT:
+            result = Value(left - right);
+            break;
+          case OP_MULTIPLY:
+            result = Value(left * right);
+            break;
+          case OP_DIVIDE:
+            result = Value(left / right);
+            break;
+          case OP_GREATER:
+            result = Value(left > right);
+            break;
+          default:
+            result = Value(left < right);
+            break;
+        }
+
+        if (IS_NUMBER(result) && _chunk->constantCount() > UINT16_MAX) {
+          return false;
+        }
+        drop(3);
+        return emitLiteral(result, line);
+      }
+
+      // the superinstructions of the compiler, for operands that were folded
+      if (c->bytes[0] != OP_GET_LOCAL || (op != OP_ADD && op != OP_SUBTRACT)) {
+        return false;
+      }
+
+      uint8_t fused = OP_COUNT;
+      if (b->bytes[0] == OP_CONSTANT) {
+        fused = op == OP_ADD ? OP_ADD_LOCAL_CONSTANT : OP_SUBTRACT_LOCAL_CONSTANT;
+      } else if (b->bytes[0] == OP_GET_LOCAL && op == OP_ADD) {
+        fused = OP_ADD_LOCAL_LOCAL;
+      } else {
+        return false;
+      }
+
+      Instruction instruction {
+          {fused, c->bytes[1], b->bytes[1]}, line, NO_TARGET};
+      drop(3);
+      _output.push_back(std::move(instruction));
+      return true;
+    }
+
+    case OP_POP_JUMP_IF_FALSE: {
+      if (literal(b, &x)) {
+        Instruction jump = *a;
+        drop(2);
+        if (isFalsey(x)) {
+          jump.bytes[0] = OP_JUMP;
+          _output.push_back(std::move(jump));
+        }
+        return true;
+      }
+
+      // !!x is as falsey as x
+      if (b->bytes[0] != OP_NOT || c == nullptr || c->bytes[0] != OP_NOT) {
+        return false;
+      }
+      Instruction jump = *a;
+      drop(3);
+      _output.push_back(std::move(jump));
+      return true;
+    }
+
+    case OP_JUMP_IF_FALSE: {
+      // the value stays on the stack either way
+      if (!literal(b, &x)) {
+        return false;
+      }
+      Instruction jump = *a;
+      drop(1);
+      if (isFalsey(x)) {
+        jump.bytes[0] = OP_JUMP;
+        _output.push_back(std::move(jump));
+      }
+      return true;
+    }
+
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_EQUAL: {
+      if (c == nullptr || !literal(c, &x) || !literal(b, &y)) {
+        return false;
+      }
+
+      bool taken = false;
+      if (op == OP_JUMP_IF_NOT_EQUAL) {
+        taken = !valuesEqual(x, y);
+      } else if (IS_NUMBER(x) && IS_NUMBER(y)) {
+        taken = op == OP_JUMP_IF_NOT_LESS ? !(AS_NUMBER(x) < AS_NUMBER(y))
+                                          : !(AS_NUMBER(x) > AS_NUMBER(y));
+      } else {
+        return false;  // a runtime error
+      }
+
+      Instruction jump = *a;
+      drop(3);
+      if (taken) {
+        jump.bytes[0] = OP_JUMP;
+        _output.push_back(std::move(jump));
+      }
+      return true;
+    }
+
+    case OP_POP:
+    case OP_POP_N: {
+      const size_t count = op == OP_POP ? 1 : a->bytes[1];
+      if (isPurePush(b->bytes[0])) {
+        drop(2);
+        if (count == 2) {
+          emit(OP_POP, line);
+        } else if (count > 2) {
+          _output.push_back(Instruction {
+              {OP_POP_N, static_cast<uint8_t>(count - 1)}, line, NO_TARGET});
+        }
+        return true;
+      }
+
+      size_t before = 0;
+      if (b->bytes[0] == OP_POP) {
+        before = 1;
+      } else if (b->bytes[0] == OP_POP_N) {
+        before = b->bytes[1];
+      }
+      if (before == 0 || before + count > UINT8_MAX) {
+        return false;
+      }
+
+      const size_t popLine = b->line;
+      drop(2);
+      _output.push_back(Instruction {
+          {OP_POP_N, static_cast<uint8_t>(before + count)}, popLine, NO_TARGET});
+      return true;
+    }
+
+    default:
+      return false;
+  }
+}
+
+const ChunkOptimizer::Instruction* ChunkOptimizer::last(size_t n) const
+{
+  if (_output.size() <= n || _output.size() - 1 - n < _barrier) {
+    return nullptr;
+  }
+
+  return &_output[_output.size() - 1 - n];
+}
+
+void ChunkOptimizer::drop(size_t n)
+{
+  assert(_output.size() >= _barrier + n);
+  _output.resize(_output.size() - n);
+}
+
+void ChunkOptimizer::emit(uint8_t op, size_t line)
+{
+  _output.push_back(Instruction {{op}, line, NO_TARGET});
+}
+
+bool ChunkOptimizer::emitLiteral(Value value, size_t line)
+{
+  if (IS_NIL(value)) {
+    emit(OP_NIL, line);
+  } else if (IS_BOOL(value)) {
+    emit(AS_BOOL(value) ? OP_TRUE : OP_FALSE, line);
+  } else {
+    const size_t constant = _chunk->addConstant(value);
+    assert(constant <= UINT16_MAX);
+    if (constant <= UINT8_MAX) {
+      _output.push_back(Instruction {
+          {OP_CONSTANT, static_cast<uint8_t>(constant)}, line, NO_TARGET});
+    } else {
+      _output.push_back(Instruction {{OP_CONSTANT_LONG,
+                                      static_cast<uint8_t>(constant >> 8),
+                                      static_cast<uint8_t>(constant & 0xff)},
+                                     line,
+                                     NO_TARGET});
+    }
+  }
+
+  return true;
+}
+
+bool ChunkOptimizer::literal(const Instruction* instruction, Value* value) const
+{
+  switch (instruction->bytes[0]) {
+    case OP_NIL:
+      *value = Value();
+      return true;
+    case OP_TRUE:
+      *value = Value(true);
+      return true;
+    case OP_FALSE:
+      *value = Value(false);
+      return true;
+    case OP_CONSTANT:
+      *value = _chunk->constantsAt(instruction->bytes[1]);
+      return true;
+    case OP_CONSTANT_LONG:
+      *value = _chunk->constantsAt(
+          static_cast<size_t>((instruction->bytes[1] << 8)
+                              | instruction->bytes[2]));
+      return true;
+    default:
+      return false;
+  }
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "chunk.h"
+
+// Whether the compiler runs the ChunkOptimizer on every function, and whether
+// it reports how many bytes of code it saved.
+enum class OptimizeMode
+{
+  OFF,
+  ON,
+  REPORT,
+};
+
+// Optimization pass over the bytecode of a function, after the compiler is
+// done with it. The compiler only fuses the last few instructions it emitted,
+// this pass sees the whole chunk:
+//
+// - arithmetic, negation, `!` and comparisons of literals are folded, and so
+//   are branches on them
+// - code that no path reaches, like the code after a return or an
+//   unconditional jump, is removed
+// - pops are merged, and values that are pushed only to be popped again are
+//   not pushed at all
+// - jumps to jumps go to the final target right away, jumps to the next
+//   instruction are removed
+//
+// The chunk is rebuilt from the instructions that are left, each keeping its
+// line. The constants and inline caches of removed instructions stay unused.
+class ChunkOptimizer
+{
+public:
+  explicit ChunkOptimizer(Chunk* chunk);
+
+  // returns the number of bytes saved
+  size_t optimize();
+
+private:
+  static constexpr size_t NO_TARGET = SIZE_MAX;
+
+  struct Instruction
+  {
+    std::vector<uint8_t> bytes;  // the opcode and its operands
+    size_t line;
+    size_t target;  // index of the instruction a jump goes to
+  };
+
+  void decode();
+  void encode();
+  // byte offset of every instruction, plus the end of the code
+  std::vector<size_t> offsets() const;
+
+  // each pass returns whether it changed anything
+  bool threadJumps();
+  bool removeUnreachable();
+  bool peephole();
+
+  // appends the instruction and folds it into the ones before it
+  void append(Instruction instruction);
+  bool fold();
+
+  // the n-th last instruction of the output, nullptr if it does not exist or
+  // may not be folded because something jumps behind it
+  const Instruction* last(size_t n) const;
+  void drop(size_t n);
+  // emits an instruction without operands, or a literal
+  void emit(uint8_t op, size_t line);
+  bool emitLiteral(Value value, size_t line);
+  // the value an instruction pushes, if it only pushes a literal
+  bool literal(const Instruction* instruction, Value* value) const;
+
+  Chunk* _chunk = nullptr;
+  std::vector<Instruction> _code;
+
+  // state of the peephole pass
+  std::vector<Instruction> _output;
+  size_t _barrier = 0;
+  bool _folded = false;
+};
@@ -0,0 +1,163 @@
+#include <cassert>
+#include <cstring>
+#include <vector>
+
+#include "registerchunk.h"
+
+#include "objfunction.h"
+#include "value.h"
+
+size_t RegisterChunk::count() const
+{
+  return _code.size();
+}
+
+void RegisterChunk::write(uint16_t unit, size_t line)
+{
+  _code.push_back(unit);
+  _lines.add(line);
+}
+
+void RegisterChunk::writeAt(size_t idx, uint16_t unit)
+{
+  assert(count() > idx);
+  _code[idx] = unit;
+}
+
+uint16_t RegisterChunk::codeAt(size_t idx) const
+{
+  return _code.at(idx);
+}
+
+const uint16_t* RegisterChunk::codeBegin() const
+{
+  return _code.data();
+}
+
+size_t RegisterChunk::addConstant(Value value)
+{
+  _constants.push_back(std::move(value));
+  return _constants.size() - 1;
+}
+
+const std::vector<Value>& RegisterChunk::constants() const
+{
+  return _constants;
+}
+
+Value RegisterChunk::constantsAt(size_t idx) const
+{
+  return _constants.at(idx);
+}
+
+const Value* RegisterChunk::constantsBegin() const
+{
+  return _constants.data();
+}
+
+size_t RegisterChunk::ownedBytes() const
+{
+  return _code.capacity() * sizeof(uint16_t)
+      + _constants.capacity() * sizeof(Value) + _lines.ownedBytes();
+}
+
+void RegisterChunk::updateReferences()
+{
+  for (Value& constant : _constants) {
+    constant = forwarded(constant);
+  }
+}
+
+size_t RegisterChunk::linesAt(size_t idx) const
+{
+  return _lines.lineAt(idx);
+}
+
+size_t RegisterChunk::frameSize() const
+{
+  return _frameSize;
+}
+
+void RegisterChunk::setFrameSize(size_t size)
+{
+  _frameSize = size;
+}
+
+const char* registerOperands(uint16_t op)
+{
+  switch (static_cast<RegisterOp>(op)) {
+    case ROP_MOVE:
+    case ROP_NEGATE:
+    case ROP_NOT:
+      return "dr";
+    case ROP_ADD:
+    case ROP_SUBTRACT:
+    case ROP_MULTIPLY:
+    case ROP_DIVIDE:
+    case ROP_EQUAL:
+    case ROP_GREATER:
+    case ROP_LESS:
+      return "drr";
+    case ROP_PRINT:
+    case ROP_RETURN:
+      return "r";
+    case ROP_DEFINE_GLOBAL:
+    case ROP_SET_GLOBAL:
+      return "gr";
+    case ROP_GET_GLOBAL:
+      return "dg";
+    case ROP_CLASS:
+    case ROP_CLOSURE:
+      return "dk";
+    case ROP_GET_UPVALUE:
+      return "dn";
+    case ROP_SET_UPVALUE:
+      return "nr";
+    case ROP_CLOSE_UPVALUE:
+      return "d";
+    case ROP_JUMP:
+      return "j";
+    case ROP_JUMP_IF_FALSE:
+      return "rj";
+    case ROP_JUMP_IF_NOT_LESS:
+    case ROP_JUMP_IF_NOT_GREATER:
+    case ROP_JUMP_IF_NOT_EQUAL:
+      return "rrj";
+    case ROP_LOOP:
+      return "l";
+    case ROP_CALL:
+    case ROP_TAIL_CALL:
+      return "bn";
+    case ROP_INVOKE:
+      return "bknc";
+    case ROP_SUPER_INVOKE:
+      return "bkn";
+    case ROP_GET_PROPERTY:
+      return "drkc";
+    case ROP_SET_PROPERTY:
+      return "rkrc";
+    case ROP_METHOD:
+      return "rkr";
+    case ROP_INHERIT:
+      return "rr";
+    case ROP_GET_SUPER:
+      return "drrk";
+    case ROP_COUNT:
+      break;
+  }
+
+  return "";
+}
+
+size_t registerInstructionLength(const RegisterChunk& chunk, size_t offset)
+{
+  const uint16_t op = chunk.codeAt(offset);
+  size_t length = 1 + std::strlen(registerOperands(op));
+
+  if (op == ROP_CLOSURE) {
+    auto* function = AS_FUNCTION(chunk.constantsAt(chunk.codeAt(offset + 2)));
+    length += 2 * static_cast<size_t>(function->upvalueCount());
+  }
+
+  return length;
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "common.h"
+#include "linetable.h"
+#include "value.h"
+
+// Instructions of the register engine. Registers are the slots of the call
+// frame: slot 0 holds the callee, followed by the arguments, the locals and
+// the temporaries of the function. Every instruction and operand is one
+// 16 bit code unit. Operands are
+//   dst   register the result is stored in
+//   rk    register, or constant if RK_CONSTANT is set
+//   base  register holding the callee, the arguments follow it
+//   k     index into the constant table
+//   n     plain number
+//   g     global slot
+//   ic    inline cache of the function's stack chunk, shared by both engines
+//   jump  forward jump offset, loop backward jump offset
+enum RegisterOp : uint16_t
+{
+  ROP_MOVE,  // dst rk
+  ROP_NEGATE,  // dst rk
+  ROP_NOT,  // dst rk
+  ROP_ADD,  // dst rk rk
+  ROP_SUBTRACT,  // dst rk rk
+  ROP_MULTIPLY,  // dst rk rk
+  ROP_DIVIDE,  // dst rk rk
+  ROP_EQUAL,  // dst rk rk
+  ROP_GREATER,  // dst rk rk
+  ROP_LESS,  // dst rk rk
+  ROP_PRINT,  // rk
+  ROP_RETURN,  // rk
+  ROP_DEFINE_GLOBAL,  // g rk
+  ROP_GET_GLOBAL,  // dst g
+  ROP_SET_GLOBAL,  // g rk
+  ROP_GET_UPVALUE,  // dst n
+  ROP_SET_UPVALUE,  // n rk
+  ROP_CLOSE_UPVALUE,  // dst
+  ROP_JUMP,  // jump
+  ROP_JUMP_IF_FALSE,  // rk jump
+  ROP_JUMP_IF_NOT_LESS,  // rk rk jump
+  ROP_JUMP_IF_NOT_GREATER,  // rk rk jump
+  ROP_JUMP_IF_NOT_EQUAL,  // rk rk jump
+  ROP_LOOP,  // loop
+  ROP_CALL,  // base n
+  ROP_TAIL_CALL,  // base n, the ROP_RETURN of base follows it
+  ROP_INVOKE,  // base k n ic
+  ROP_SUPER_INVOKE,  // base k n, the superclass follows the arguments
+  ROP_CLOSURE,  // dst k, followed by an (isLocal, index) pair per upvalue
+  ROP_CLASS,  // dst k
+  ROP_GET_PROPERTY,  // dst rk k ic
+  ROP_SET_PROPERTY,  // rk k rk ic
+  ROP_METHOD,  // rk k rk
+  ROP_INHERIT,  // rk rk
+  ROP_GET_SUPER,  // dst rk rk k
+
+  ROP_COUNT,  // number of opcodes, not an instruction
+};
+
+constexpr uint16_t RK_CONSTANT = 0x8000u;
+constexpr uint16_t REGISTER_MAX = RK_CONSTANT - 1;
+
+class RegisterChunk
+{
+public:
+  // code
+  size_t count() const;
+  void write(uint16_t unit, size_t line);
+  void writeAt(size_t idx, uint16_t unit);
+  uint16_t codeAt(size_t idx) const;
+  const uint16_t* codeBegin() const;
+
+  // constants
+  size_t addConstant(Value value);
+  const std::vector<Value>& constants() const;
+  Value constantsAt(size_t idx) const;
+  const Value* constantsBegin() const;
+  // points the constants at the objects that moved
+  void updateReferences();
+
+  // bytes of the code, constants and lines
+  size_t ownedBytes() const;
+
+  // lines
+  size_t linesAt(size_t idx) const;
+
+  // number of registers a call frame of this function needs, 0 as long as
+  // the function has not been compiled for the register engine
+  size_t frameSize() const;
+  void setFrameSize(size_t size);
+
+private:
+  std::vector<uint16_t> _code;
+  std::vector<Value> _constants;
+  LineTable _lines;
+  size_t _frameSize = 0;
+};
+
+// names of the operands of op, one character per operand as documented above
+// (d = dst, r = rk, b = base, k, n, g, j = jump, l = loop, c = ic)
+const char* registerOperands(uint16_t op);
+size_t registerInstructionLength(const RegisterChunk& chunk, size_t offset);
@@ -0,0 +1,482 @@
+#include <cassert>
+#include <cstdint>
+#include <vector>
+
+#include "registercompiler.h"
+
+#include "chunk.h"
+#include "objfunction.h"
+#include "registerchunk.h"
+#include "value.h"
+
+RegisterCompiler::RegisterCompiler(ObjFunction* function)
+    : _function(function)
+    , _chunk(function->chunk())
+    , _code(function->registerChunk())
+{
+}
+
+bool RegisterCompiler::compile()
+{
+  for (const Value& constant : _chunk->constants()) {
+    _code->addConstant(constant);
+  }
+
+  // jump targets have to be known up front, as the operand stack has to be
+  // materialized at every one of them
+  _isJumpTarget.assign(_chunk->count() + 1, false);
+  _targetDepths.assign(_chunk->count() + 1, SIZE_MAX);
+  for (size_t offset = 0; offset < _chunk->count();
+       offset += instructionLength(*_chunk, offset))
+  {
+    switch (_chunk->codeAt(offset)) {
+      case OP_JUMP:
+      case OP_JUMP_IF_FALSE:
+      case OP_POP_JUMP_IF_FALSE:
+      case OP_JUMP_IF_NOT_LESS:
+      case OP_JUMP_IF_NOT_GREATER:
+      case OP_JUMP_IF_NOT_EQUAL:
+        _isJumpTarget[offset + 3 + _chunk->shortAt(offset + 1)] = true;
+        break;
+      case OP_LOOP:
+        _isJumpTarget[offset + 3 - _chunk->shortAt(offset + 1)] = true;
+        break;
+      default:
+        break;
+    }
+  }
+
+  // slot 0 and the arguments are in place when the function is called
+  for (int i = 0; i <= _function->arity(); i++) {
+    push(Operand {false, static_cast<uint16_t>(i)});
+  }
+
+  _offsets.assign(_chunk->count() + 1, 0);
+  for (size_t offset = 0; offset < _chunk->count();
+       offset += instructionLength(*_chunk, offset))
+  {
+    _line = _chunk->linesAt(offset);
+    if (_isJumpTarget[offset]) {
+      materializeAll();
+      _resultEnd = SIZE_MAX;  // the result may come from another path
+
+      // the code before may not reach it, the jumps to it know the depth
+      if (_targetDepths[offset] != SIZE_MAX) {
+        while (_stack.size() > _targetDepths[offset]) {
+          pop();
+        }
+        while (_stack.size() < _targetDepths[offset]) {
+          push(Operand {false, static_cast<uint16_t>(_stack.size())});
+        }
+      }
+    }
+
+    _offsets[offset] = _code->count();
+    translate(offset);
+  }
+  _offsets[_chunk->count()] = _code->count();
+
+  for (const auto& [operand, target] : _jumps) {
+    // both offsets are relative to the end of the jump instruction
+    const size_t end = operand + 1;
+    const size_t destination = _offsets[target];
+    const size_t jump =
+        destination >= end ? destination - end : end - destination;
+
+    if (jump > UINT16_MAX) {
+      return false;
+    }
+
+    _code->writeAt(operand, static_cast<uint16_t>(jump));
+  }
+
+  // rk operands address constants with 15 bits
+  _tooLarge |= _code->constants().size() > size_t {REGISTER_MAX} + 1;
+
+  _code->setFrameSize(_frameSize);
+  return !_tooLarge;
+}
+
+void RegisterCompiler::translate(size_t offset)
+{
+  const auto byte = [this, offset](size_t n) -> uint16_t
+  { return _chunk->codeAt(offset + n); };
+  const auto constant = [](uint16_t index) -> Operand
+  { return Operand {true, index}; };
+  const auto registerOf = [](size_t slot) -> Operand
+  { return Operand {false, static_cast<uint16_t>(slot)}; };
+
+  switch (_chunk->codeAt(offset)) {
+    case OP_CONSTANT:
+      push(constant(byte(1)));
+      break;
+    case OP_CONSTANT_LONG:
+      push(constant(_chunk->shortAt(offset + 1)));
+      break;
+    case OP_NIL:
+      push(literal(Value()));
+      break;
+    case OP_TRUE:
+      push(literal(Value(true)));
+      break;
+    case OP_FALSE:
+      push(literal(Value(false)));
+      break;
+
+    case OP_NEGATE:
+      emitResult(ROP_NEGATE, {rk(pop())});
+      break;
+    case OP_NOT:
+      emitResult(ROP_NOT, {rk(pop())});
+      break;
+
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS: {
+      static_assert(OP_SUBTRACT - OP_ADD == ROP_SUBTRACT - ROP_ADD
+                        && OP_LESS - OP_ADD == ROP_LESS - ROP_ADD,
+                    "binary operators have to be in the same order");
+      const Operand b = pop();
+      const Operand a = pop();
+      emitResult(ROP_ADD + (_chunk->codeAt(offset) - OP_ADD), {rk(a), rk(b)});
+      break;
+    }
+
+    case OP_RETURN:
+      emit(ROP_RETURN, {rk(pop())});
+      break;
+    case OP_PRINT:
+      emit(ROP_PRINT, {rk(pop())});
+      break;
+    case OP_POP:
+      pop();
+      break;
+    case OP_POP_N:
+      for (int i = 0; i < byte(1); i++) {
+        pop();
+      }
+      break;
+
+    case OP_DEFINE_GLOBAL:
+      emit(ROP_DEFINE_GLOBAL, {_chunk->shortAt(offset + 1), rk(pop())});
+      break;
+    case OP_GET_GLOBAL:
+      emitResult(ROP_GET_GLOBAL, {_chunk->shortAt(offset + 1)});
+      break;
+    case OP_SET_GLOBAL:
+      emit(ROP_SET_GLOBAL,
+           {_chunk->shortAt(offset + 1), rk(_stack.back())});
+      break;
+
+    case OP_GET_LOCAL:
+      materialize(byte(1));
+      push(registerOf(byte(1)));
+      break;
+    case OP_SET_LOCAL:
+      setLocal(byte(1));
+      break;
+
+    case OP_GET_UPVALUE:
+      emitResult(ROP_GET_UPVALUE, {byte(1)});
+      break;
+    case OP_SET_UPVALUE:
+      emit(ROP_SET_UPVALUE, {byte(1), rk(_stack.back())});
+      break;
+    case OP_CLOSE_UPVALUE:
+      materialize(_stack.size() - 1);
+      pop();
+      emit(ROP_CLOSE_UPVALUE, {static_cast<uint16_t>(_stack.size())});
+      break;
+
+    case OP_JUMP:
+      materializeAll();
+      emitJump(ROP_JUMP, {}, offset + 3 + _chunk->shortAt(offset + 1));
+      break;
+    case OP_LOOP:
+      materializeAll();
+      emitJump(ROP_LOOP, {}, offset + 3 - _chunk->shortAt(offset + 1));
+      break;
+    case OP_JUMP_IF_FALSE:
+      materializeAll();
+      emitJump(ROP_JUMP_IF_FALSE,
+               {rk(_stack.back())},
+               offset + 3 + _chunk->shortAt(offset + 1));
+      break;
+    case OP_POP_JUMP_IF_FALSE: {
+      const Operand condition = pop();
+      materializeAll();
+      emitJump(ROP_JUMP_IF_FALSE,
+               {rk(condition)},
+               offset + 3 + _chunk->shortAt(offset + 1));
+      break;
+    }
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_EQUAL: {
+      static_assert(OP_JUMP_IF_NOT_EQUAL - OP_JUMP_IF_NOT_LESS
+                        == ROP_JUMP_IF_NOT_EQUAL - ROP_JUMP_IF_NOT_LESS,
+                    "compare and branch has to be in the same order");
+      const Operand b = pop();
+      const Operand a = pop();
+      materializeAll();
+      emitJump(ROP_JUMP_IF_NOT_LESS
+                   + (_chunk->codeAt(offset) - OP_JUMP_IF_NOT_LESS),
+               {rk(a), rk(b)},
+               offset + 3 + _chunk->shortAt(offset + 1));
+      break;
+    }
+
+    case OP_CALL:
+    case OP_TAIL_CALL: {
+      // the callee and its arguments have to be in consecutive registers, and
+      // the callee may change any captured local
+      materializeAll();
+      const auto base = static_cast<uint16_t>(_stack.size() - byte(1) - 1);
+      emit(byte(0) == OP_CALL ? ROP_CALL : ROP_TAIL_CALL, {base, byte(1)});
+      _stack.resize(base);
+      push(registerOf(base));
+      break;
+    }
+    case OP_INVOKE: {
+      materializeAll();
+      const auto base = static_cast<uint16_t>(_stack.size() - byte(3) - 1);
+      emit(ROP_INVOKE,
+           {base,
+            _chunk->shortAt(offset + 1),
+            byte(3),
+            _chunk->shortAt(offset + 4)});
+      _stack.resize(base);
+      push(registerOf(base));
+      break;
+    }
+    case OP_SUPER_INVOKE: {
+      materializeAll();
+      const auto base = static_cast<uint16_t>(_stack.size() - byte(3) - 2);
+      emit(ROP_SUPER_INVOKE, {base, _chunk->shortAt(offset + 1), byte(3)});
+      _stack.resize(base);
+      push(registerOf(base));
+      break;
+    }
+
+    case OP_CLOSURE: {
+      const uint16_t index = _chunk->shortAt(offset + 1);
+      auto* function = AS_FUNCTION(_chunk->constantsAt(index));
+      for (int i = 0; i < function->upvalueCount(); i++) {
+        // captured locals have to live in their registers, a local function
+        // may capture the slot the closure itself is stored in
+        if (byte(3 + 2 * i) != 0 && byte(4 + 2 * i) < _stack.size()) {
+          materialize(byte(4 + 2 * i));
+        }
+      }
+
+      emitResult(ROP_CLOSURE, {index});
+      for (int i = 0; i < function->upvalueCount(); i++) {
+        _code->write(byte(3 + 2 * i), _line);
+        _code->write(byte(4 + 2 * i), _line);
+      }
+      break;
+    }
+
+    case OP_CLASS:
+      emitResult(ROP_CLASS, {_chunk->shortAt(offset + 1)});
+      break;
+    case OP_GET_PROPERTY:
+      emitResult(ROP_GET_PROPERTY,
+                 {rk(pop()),
+                  _chunk->shortAt(offset + 1),
+                  _chunk->shortAt(offset + 3)});
+      break;
+    case OP_SET_PROPERTY: {
+      const Operand value = pop();
+      const Operand instance = pop();
+      emit(ROP_SET_PROPERTY,
+           {rk(instance),
+            _chunk->shortAt(offset + 1),
+            rk(value),
+            _chunk->shortAt(offset + 3)});
+
+      // the value is the result of the assignment, but may live above the
+      // new top of the stack
+      const size_t next = offset + instructionLength(*_chunk, offset);
+      if (value.isConstant || value.index < _stack.size()) {
+        push(value);
+      } else if (!_isJumpTarget[next]
+                 && (_chunk->codeAt(next) == OP_POP
+                     || _chunk->codeAt(next) == OP_POP_N))
+      {
+        push(literal(Value()));  // discarded right away
+      } else {
+        emitResult(ROP_MOVE, {rk(value)});
+      }
+      break;
+    }
+    case OP_METHOD: {
+      const Operand method = pop();
+      emit(ROP_METHOD,
+           {rk(_stack.back()), _chunk->shortAt(offset + 1), rk(method)});
+      break;
+    }
+    case OP_INHERIT: {
+      const Operand subclass = pop();
+      emit(ROP_INHERIT, {rk(_stack.back()), rk(subclass)});
+      break;
+    }
+    case OP_GET_SUPER: {
+      const Operand superclass = pop();
+      const Operand instance = pop();
+      emitResult(ROP_GET_SUPER,
+                 {rk(instance), rk(superclass), _chunk->shortAt(offset + 1)});
+      break;
+    }
+
+    case OP_ADD_LOCAL_LOCAL:
+      materialize(byte(1));
+      materialize(byte(2));
+      emitResult(ROP_ADD, {byte(1), byte(2)});
+      break;
+    case OP_ADD_LOCAL_CONSTANT:
+      materialize(byte(1));
+      emitResult(ROP_ADD, {byte(1), rk(constant(byte(2)))});
+      break;
+    case OP_SUBTRACT_LOCAL_CONSTANT:
+      materialize(byte(1));
+      emitResult(ROP_SUBTRACT, {byte(1), rk(constant(byte(2)))});
+      break;
+    case OP_INCREMENT_LOCAL:
+      materializeReferences(byte(1));
+      materialize(byte(1));
+      emit(ROP_ADD, {byte(1), byte(1), rk(constant(byte(2)))});
+      break;
+
+    default:
+      assert(false);
+      break;
+  }
+}
+
+RegisterCompiler::Operand RegisterCompiler::pop()
+{
+  assert(!_stack.empty());
+  const Operand operand = _stack.back();
+  _stack.pop_back();
+  return operand;
+}
+
+void RegisterCompiler::push(Operand operand)
+{
+  _stack.push_back(operand);
+  if (_stack.size() > _frameSize) {
+    _frameSize = _stack.size();
+    _tooLarge |= _frameSize > REGISTER_MAX;
+  }
+}
+
+uint16_t RegisterCompiler::rk(Operand operand) const
+{
+  return operand.isConstant ? (RK_CONSTANT | operand.index) : operand.index;
+}
+
+RegisterCompiler::Operand RegisterCompiler::literal(Value value)
+{
+  // nil, true and false are appended to the constants of the stack bytecode
+  const auto& constants = _code->constants();
+  for (size_t i = _chunk->constants().size(); i < constants.size(); i++) {
+    if (valuesEqual(constants[i], value)) {
+      return Operand {true, static_cast<uint16_t>(i)};
+    }
+  }
+
+  return Operand {true, static_cast<uint16_t>(_code->addConstant(value))};
+}
+
+void RegisterCompiler::materialize(size_t slot)
+{
+  assert(slot < _stack.size());
+  const Operand operand = _stack[slot];
+  if (!operand.isConstant && operand.index == slot) {
+    return;
+  }
+
+  const auto target = static_cast<uint16_t>(slot);
+  emit(ROP_MOVE, {target, rk(operand)});
+  _stack[slot] = Operand {false, target};
+}
+
+void RegisterCompiler::materializeAll()
+{
+  for (size_t slot = 0; slot < _stack.size(); slot++) {
+    materialize(slot);
+  }
+}
+
+void RegisterCompiler::materializeReferences(size_t local)
+{
+  for (size_t slot = 0; slot < _stack.size(); slot++) {
+    const Operand operand = _stack[slot];
+    if (slot != local && !operand.isConstant && operand.index == local) {
+      materialize(slot);
+    }
+  }
+}
+
+void RegisterCompiler::setLocal(size_t local)
+{
+  const Operand value = _stack.back();
+  const auto target = static_cast<uint16_t>(local);
+
+  if (value.isConstant || value.index != local) {
+    // the value stays on the stack, it must not be materialized to the old
+    // value of the local
+    _stack.pop_back();
+    materializeReferences(local);
+    _stack.push_back(value);
+
+    if (!value.isConstant && value.index == _stack.size() - 1
+        && _resultEnd == _code->count())
+    {
+      _code->writeAt(_resultOperand, target);
+    } else {
+      emit(ROP_MOVE, {target, rk(value)});
+    }
+  }
+
+  _stack[local] = Operand {false, target};
+  _stack.back() = Operand {false, target};
+}
+
+void RegisterCompiler::emit(uint16_t op, std::initializer_list<uint16_t> operands)
+{
+  _code->write(op, _line);
+  for (uint16_t operand : operands) {
+    _code->write(operand, _line);
+  }
+}
+
+void RegisterCompiler::emitResult(uint16_t op,
+                                  std::initializer_list<uint16_t> operands)
+{
+  const auto target = static_cast<uint16_t>(_stack.size());
+  _code->write(op, _line);
+  _resultOperand = _code->count();
+  _code->write(target, _line);
+  for (uint16_t operand : operands) {
+    _code->write(operand, _line);
+  }
+  _resultEnd = _code->count();
+
+  push(Operand {false, target});
+}
+
+void RegisterCompiler::emitJump(uint16_t op,
+                                std::initializer_list<uint16_t> operands,
+                                size_t target)
+{
+  emit(op, operands);
+  _targetDepths[target] = _stack.size();
+  _jumps.emplace_back(_code->count(), target);
+  _code->write(0xffff, _line);
+}
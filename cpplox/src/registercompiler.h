@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstdint>
+#include <initializer_list>
+#include <vector>
+
+#include "chunk.h"
+#include "objfunction.h"
+#include "registerchunk.h"
+
+// Backend of the compiler for the register engine. Translates the stack
+// bytecode of a function into register bytecode.
+//
+// The stack depth at every instruction is known statically, so stack slot n
+// becomes register n. Values are not copied into their slot right away: an
+// operand stays a reference to the local or constant it came from as long as
+// possible, so that `a + 1` reads `a` and the constant directly instead of
+// pushing copies of both. Pending operands are written into their slots at
+// jumps, jump targets and calls, and before the local they refer to is
+// overwritten.
+class RegisterCompiler
+{
+public:
+  explicit RegisterCompiler(ObjFunction* function);
+
+  // returns false if the function does not fit into the register bytecode
+  bool compile();
+
+private:
+  struct Operand
+  {
+    bool isConstant;
+    uint16_t index;
+  };
+
+  void translate(size_t offset);
+
+  Operand pop();
+  void push(Operand operand);
+  uint16_t rk(Operand operand) const;
+  Operand literal(Value value);
+
+  // writes the pending operand of the slot into its register
+  void materialize(size_t slot);
+  void materializeAll();
+  // materializes all operands referring to the local
+  void materializeReferences(size_t local);
+  void setLocal(size_t local);
+
+  void emit(uint16_t op, std::initializer_list<uint16_t> operands);
+  // emits an instruction storing its result in a new temporary
+  void emitResult(uint16_t op, std::initializer_list<uint16_t> operands);
+  // emits a jump to the stack bytecode offset target
+  void emitJump(uint16_t op,
+                std::initializer_list<uint16_t> operands,
+                size_t target);
+
+  ObjFunction* _function = nullptr;
+  const Chunk* _chunk = nullptr;
+  RegisterChunk* _code = nullptr;
+
+  std::vector<Operand> _stack;
+  size_t _frameSize = 0;
+  size_t _line = 0;
+
+  // the last instruction stored its result into a temporary through the
+  // operand at _resultOperand, it may be redirected to a local instead
+  size_t _resultOperand = 0;
+  size_t _resultEnd = SIZE_MAX;
+
+  std::vector<bool> _isJumpTarget;
+  // stack depth at every jump target, as far as the jumps to it are known
+  std::vector<size_t> _targetDepths;
+  // register bytecode offset of every stack bytecode offset
+  std::vector<size_t> _offsets;
+  // (operand offset, stack bytecode target) of every jump
+  std::vector<std::pair<size_t, size_t>> _jumps;
+  bool _tooLarge = false;
+};
@@ -0,0 +1,92 @@
+#include <cassert>
+#include <memory>
+#include <optional>
+#include <vector>
+
+#include "shape.h"
+
+#include "objstring.h"
+
+Shape::Shape(Shape* parent, ObjString* name)
+    : _parent(parent)
+    , _name(name)
+    , _fieldCount(parent->_fieldCount + 1)
+{
+}
+
+Shape::~Shape()
+{
+  // frees the successors without recursion
+  std::vector<std::unique_ptr<Shape>> pending = std::move(_transitions);
+  while (!pending.empty()) {
+    std::unique_ptr<Shape> shape = std::move(pending.back());
+    pending.pop_back();
+    for (auto& transition : shape->_transitions) {
+      pending.push_back(std::move(transition));
+    }
+    shape->_transitions.clear();
+  }
+}
+
+size_t Shape::fieldCount() const
+{
+  return _fieldCount;
+}
+
+std::optional<size_t> Shape::indexOf(const ObjString* name) const
+{
+  // strings are interned, so comparing pointers is enough
+  for (const Shape* shape = this; shape->_parent != nullptr;
+       shape = shape->_parent)
+  {
+    if (shape->_name == name) {
+      return std::make_optional(shape->_fieldCount - 1);
+    }
+  }
+
+  return std::nullopt;
+}
+
+size_t Shape::ownedBytes() const
+{
+  return _successorBytes;
+}
+
+void Shape::updateReferences()
+{
+  std::vector<Shape*> pending {this};
+  while (!pending.empty()) {
+    Shape* shape = pending.back();
+    pending.pop_back();
+
+    shape->_name = forwarded(shape->_name);
+
+    for (const auto& transition : shape->_transitions) {
+      pending.push_back(transition.get());
+    }
+  }
+}
+
+Shape* Shape::addField(ObjString* name)
+{
+  assert(name != nullptr);
+  assert(!indexOf(name).has_value());
+
+  for (const auto& transition : _transitions) {
+    if (transition->_name == name) {
+      return transition.get();
+    }
+  }
+
+  const size_t capacity = _transitions.capacity();
+  _transitions.push_back(std::unique_ptr<Shape>(new Shape(this, name)));
+
+  // the new shape and the room for it count for each of its predecessors
+  const size_t bytes = sizeof(Shape)
+      + (_transitions.capacity() - capacity) * sizeof(std::unique_ptr<Shape>);
+  for (Shape* shape = this; shape != nullptr; shape = shape->_parent) {
+    shape->_successorBytes += bytes;
+  }
+
+  return _transitions.back().get();
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <memory>
+#include <optional>
+#include <vector>
+
+#include "common.h"
+
+class ObjString;
+
+// Hidden class of an instance: the names of its fields and the slot each of
+// them is stored in. Instances that got the same fields in the same order
+// share a shape.
+//
+// The shapes of a class form a transition tree. The root is the shape of a
+// new instance without fields, adding a field moves an instance to the child
+// shape for that name. The tree is owned by the class, so a shape lives as
+// long as every instance using it.
+class Shape
+{
+public:
+  Shape() = default;
+  ~Shape();
+
+  size_t fieldCount() const;
+  std::optional<size_t> indexOf(const ObjString* name) const;
+
+  // shape after adding the field name, created on first use
+  Shape* addField(ObjString* name);
+
+  // bytes of all the successors of this shape
+  size_t ownedBytes() const;
+
+  // points the field names of this shape and all its successors at the
+  // strings that moved
+  void updateReferences();
+
+  // calls visit with the field names of this shape and all its successors
+  template<typename Visit>
+  void forEachName(Visit&& visit) const
+  {
+    // walks the tree without recursion, instances may have lots of fields
+    std::vector<const Shape*> pending {this};
+    while (!pending.empty()) {
+      const Shape* shape = pending.back();
+      pending.pop_back();
+
+      visit(shape->_name);
+
+      for (const auto& transition : shape->_transitions) {
+        pending.push_back(transition.get());
+      }
+    }
+  }
+
+private:
+  Shape(Shape* parent, ObjString* name);
+
+  // the shape this one was created from and the field it added, the fields
+  // of a shape are found by walking up to the root
+  Shape* _parent = nullptr;
+  ObjString* _name = nullptr;
+  size_t _fieldCount = 0;
+  // kept up to date as successors get created
+  size_t _successorBytes = 0;
+
+  std::vector<std::unique_ptr<Shape>> _transitions;
+};
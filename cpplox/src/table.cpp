@@ -19,6 +19,18 @@ size_t Table::count() const
   return _count;
 }
 
+size_t Table::tombstones() const
+{
+  size_t tombstones = 0;
+  for (const Entry& entry : _entries) {
+    if (entry.key == nullptr && !IS_NIL(entry.value)) {
+      tombstones++;
+    }
+  }
+
+  return tombstones;
+}
+
 std::optional<Value> Table::get(ObjString* key)
 {
   if (count() == 0) {
@@ -84,7 +96,7 @@ void Table::adjustCapacity(size_t newcapacity)
     _count++;
   }
 
-  _entries = entries;
+  _entries = std::move(entries);
   _capacity = newcapacity;
 }
 
@@ -127,6 +139,15 @@ void Table::mark(MemoryManager* mm)
   }
 }
 
+void Table::updateReferences()
+{
+  for (size_t i = 0; i < capacity(); i++) {
+    Entry* entry = &_entries[i];
+    entry->key = forwarded(entry->key);
+    entry->value = forwarded(entry->value);
+  }
+}
+
 ObjString* Table::findString(std::string string, uint32_t hash)
 {
   if (count() == 0) {
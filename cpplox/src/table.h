@@ -19,8 +19,11 @@ struct Entry
 class Table
 {
 public:
+  // entries in use, tombstones included
   size_t count() const;
+  size_t tombstones() const;
   size_t capacity() const;
+  size_t ownedBytes() const { return _entries.capacity() * sizeof(Entry); }
 
   std::optional<Value> get(ObjString* key);
   bool set(ObjString* key, Value value);
@@ -31,6 +34,18 @@ public:
 
   void removeWhite();
   void mark(MemoryManager* mm);
+  // points the keys and values at the objects that moved, the keys hash by
+  // their characters and stay where they are
+  void updateReferences();
+
+  // calls visit with the key and the value of every entry
+  template<typename Visit>
+  void forEach(Visit&& visit) const
+  {
+    for (size_t i = 0; i < _capacity; i++) {
+      visit(_entries[i].key, _entries[i].value);
+    }
+  }
 
   ObjString* findString(std::string string, uint32_t hash);
 
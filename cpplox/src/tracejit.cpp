@@ -0,0 +1,1030 @@
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "tracejit.h"
+
+#include "chunk.h"
+#include "jitassembler.h"
+#include "objfunction.h"
+#include "value.h"
+#include "x64assembler.h"
+
+#ifdef LOX_JIT
+
+namespace
+{
+
+constexpr Reg STACK_TOP = JitAssembler::STACK_TOP;
+
+constexpr uint64_t NIL_BITS = JitAssembler::NIL_BITS;
+constexpr uint64_t FALSE_BITS = JitAssembler::FALSE_BITS;
+constexpr uint64_t TRUE_BITS = JitAssembler::TRUE_BITS;
+
+constexpr int32_t VALUE_SIZE = JitAssembler::VALUE_SIZE;
+
+// what the trace knows about a variable at some point of the iteration
+constexpr uint8_t KNOWN_NUMBER = 1;
+constexpr uint8_t KNOWN_DEFINED = 2;  // globals only
+
+double numberOf(uint64_t bits)
+{
+  double number;
+  std::memcpy(&number, &bits, sizeof(double));
+  return number;
+}
+
+// the stack slot at position, counted from the stack top on entry
+Mem stackSlot(size_t position)
+{
+  return Mem {STACK_TOP, static_cast<int32_t>(position) * VALUE_SIZE};
+}
+
+// Where the compiler keeps a value of the stack. Constants and variables are
+// only written to their stack slot once something needs them there, values
+// the code computes are stored right away.
+struct StackValue
+{
+  enum class Kind : uint8_t
+  {
+    CONSTANT,
+    LOCAL,
+    GLOBAL,
+    STACK,
+  };
+
+  Kind kind;
+  // the bits of a constant, the slot of a variable or the position of a
+  // value on the stack
+  uint64_t payload;
+  bool number;  // known to be a number
+
+  bool is(Kind otherKind, uint64_t otherPayload) const
+  {
+    return kind == otherKind && payload == otherPayload;
+  }
+};
+
+// Leaves to the interpreter at offset, after writing the stack as it was
+// before the instruction whose guard failed.
+struct SideExit
+{
+  Label label;
+  size_t offset;
+  std::vector<StackValue> stack;
+};
+
+// Translates a trace into a loop of machine code. The stack of values the
+// code works on is followed at compile time, relative to the stack top on
+// entry, which the code keeps in its register.
+class TraceCompiler
+{
+public:
+  TraceCompiler(const Chunk& chunk,
+                const std::vector<TraceStep>& steps,
+                const JitRuntime& runtime)
+      : _chunk(chunk)
+      , _steps(steps)
+      , _runtime(runtime)
+      , _locals(UINT8_MAX + 1, 0)
+      , _globals(UINT16_MAX + 1, 0)
+  {
+  }
+
+  // empty if the trace has an instruction that cannot be compiled
+  std::vector<uint8_t> compile()
+  {
+    assert(!_steps.empty());
+    _exit = _asm.newLabel();
+    _loop = _asm.newLabel();
+    _headExit = newExit(_steps.front().offset);
+
+    // size_t entry(JitState* state)
+    _asm.prologue();
+    variables();
+    entryGuards();
+
+    _asm.bind(_loop);
+    for (_step = 0; _step < _steps.size(); _step++) {
+      if (!instruction()) {
+        return {};
+      }
+    }
+
+    exitStubs();
+    return _asm.finish();
+  }
+
+private:
+  // Finds the variables the iteration reads before it writes them. Those
+  // that were numbers are assumed to be numbers on every iteration.
+  void variables()
+  {
+    std::vector<bool> seenLocals(_locals.size(), false);
+    std::vector<bool> seenGlobals(_globals.size(), false);
+    const auto read = [](std::vector<bool>* seen,
+                         std::vector<size_t>* numbers,
+                         size_t slot,
+                         TraceType type)
+    {
+      if (!(*seen)[slot] && type == TraceType::NUMBER) {
+        numbers->push_back(slot);
+      }
+      (*seen)[slot] = true;
+    };
+
+    for (const auto& step : _steps) {
+      const size_t offset = step.offset;
+      switch (baseOpcode(_chunk.codeAt(offset))) {
+        case OP_GET_LOCAL:
+        case OP_ADD_LOCAL_CONSTANT:
+        case OP_SUBTRACT_LOCAL_CONSTANT:
+        case OP_INCREMENT_LOCAL:
+          read(&seenLocals,
+               &_loopLocals,
+               _chunk.codeAt(offset + 1),
+               step.types[0]);
+          break;
+
+        case OP_ADD_LOCAL_LOCAL:
+          read(&seenLocals,
+               &_loopLocals,
+               _chunk.codeAt(offset + 1),
+               step.types[0]);
+          read(&seenLocals,
+               &_loopLocals,
+               _chunk.codeAt(offset + 2),
+               step.types[1]);
+          break;
+
+        case OP_SET_LOCAL:
+          seenLocals[_chunk.codeAt(offset + 1)] = true;
+          break;
+
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL: {
+          const uint16_t slot = _chunk.shortAt(offset + 1);
+          if (!seenGlobals[slot]) {
+            _usedGlobals.push_back(slot);
+          }
+          if (baseOpcode(_chunk.codeAt(offset)) == OP_GET_GLOBAL) {
+            read(&seenGlobals, &_loopGlobals, slot, step.types[0]);
+          }
+          seenGlobals[slot] = true;
+          break;
+        }
+
+        default:
+          break;
+      }
+    }
+  }
+
+  // checks what the iteration assumes about the variables, the interpreter
+  // runs the iteration if it does not hold
+  void entryGuards()
+  {
+    for (size_t slot : _loopLocals) {
+      _asm.movq(Reg::RAX, JitAssembler::local(slot));
+      _asm.guardNumber(Reg::RAX, _headExit);
+      _locals[slot] = KNOWN_NUMBER;
+    }
+
+    // a global that is defined stays defined
+    _asm.movq(Reg::RCX, UNDEFINED_BITS);
+    for (size_t slot : _usedGlobals) {
+      _asm.movq(Reg::RAX, JitAssembler::global(slot));
+      _asm.cmpq(Reg::RAX, Reg::RCX);
+      _asm.j(Condition::EQUAL, _headExit);
+      _globals[slot] = KNOWN_DEFINED;
+    }
+
+    for (size_t slot : _loopGlobals) {
+      _asm.movq(Reg::RAX, JitAssembler::global(slot));
+      _asm.guardNumber(Reg::RAX, _headExit);
+      _globals[slot] |= KNOWN_NUMBER;
+    }
+  }
+
+  // makes sure that the entry guards hold again for the next iteration
+  void backEdgeGuards()
+  {
+    for (size_t slot : _loopLocals) {
+      if ((_locals[slot] & KNOWN_NUMBER) == 0) {
+        _asm.movq(Reg::RAX, JitAssembler::local(slot));
+        _asm.guardNumber(Reg::RAX, _headExit);
+      }
+    }
+
+    for (size_t slot : _loopGlobals) {
+      if ((_globals[slot] & KNOWN_NUMBER) == 0) {
+        _asm.movq(Reg::RAX, JitAssembler::global(slot));
+        _asm.guardNumber(Reg::RAX, _headExit);
+      }
+    }
+  }
+
+  void exitStubs()
+  {
+    for (const auto& exit : _exits) {
+      _asm.bind(exit.label);
+      for (size_t position = 0; position < exit.stack.size(); position++) {
+        const StackValue& value = exit.stack[position];
+        if (value.kind != StackValue::Kind::STACK) {
+          load(Reg::RAX, value);
+          _asm.movq(stackSlot(position), Reg::RAX);
+        }
+      }
+      storeStackTop(exit.stack.size());
+      _asm.movq(Reg::RAX, static_cast<uint64_t>(exit.offset));
+      _asm.jmp(_exit);
+    }
+
+    // returns the offset in rax, the stack top is in the state already
+    _asm.bind(_exit);
+    _asm.epilogue();
+  }
+
+  Label newExit(size_t offset)
+  {
+    _exits.push_back(SideExit {_asm.newLabel(), offset, _stack});
+    return _exits.back().label;
+  }
+
+  // leaves to the interpreter at the current instruction, has to be used
+  // before the instruction changes the stack
+  Label exitHere()
+  {
+    if (_exitStep != _step) {
+      _exitStep = _step;
+      _exitLabel = newExit(_steps[_step].offset);
+    }
+
+    return _exitLabel;
+  }
+
+  void storeStackTop(size_t size)
+  {
+    _asm.movq(Reg::RAX, STACK_TOP);
+    _asm.addq(Reg::RAX, static_cast<int32_t>(size) * VALUE_SIZE);
+    _asm.movq(JitAssembler::field(offsetof(JitState, stackTop)), Reg::RAX);
+  }
+
+  static Mem variable(const StackValue& value)
+  {
+    assert(value.kind == StackValue::Kind::LOCAL
+           || value.kind == StackValue::Kind::GLOBAL);
+    return value.kind == StackValue::Kind::LOCAL
+        ? JitAssembler::local(value.payload)
+        : JitAssembler::global(value.payload);
+  }
+
+  void load(Reg reg, const StackValue& value)
+  {
+    switch (value.kind) {
+      case StackValue::Kind::CONSTANT:
+        _asm.movq(reg, value.payload);
+        break;
+      case StackValue::Kind::LOCAL:
+      case StackValue::Kind::GLOBAL:
+        _asm.movq(reg, variable(value));
+        break;
+      case StackValue::Kind::STACK:
+        _asm.movq(reg, stackSlot(value.payload));
+        break;
+    }
+  }
+
+  // writes the value at position to its stack slot
+  void materialize(size_t position)
+  {
+    StackValue* value = &_stack[position];
+    if (value->kind == StackValue::Kind::STACK) {
+      return;
+    }
+
+    load(Reg::RAX, *value);
+    _asm.movq(stackSlot(position), Reg::RAX);
+    *value = StackValue {StackValue::Kind::STACK, position, value->number};
+  }
+
+  void push(StackValue value)
+  {
+    _stack.push_back(value);
+  }
+
+  // pushes the value in reg, which the code computed
+  void push(Reg reg, bool number)
+  {
+    const size_t position = _stack.size();
+    _asm.movq(stackSlot(position), reg);
+    _stack.push_back(StackValue {StackValue::Kind::STACK, position, number});
+  }
+
+  void pushConstant(uint64_t bits)
+  {
+    push(StackValue {StackValue::Kind::CONSTANT, bits, (bits & QNAN) != QNAN});
+  }
+
+  void drop(size_t count)
+  {
+    assert(count <= _stack.size());
+    _stack.resize(_stack.size() - count);
+  }
+
+  StackValue peek(size_t distance) const
+  {
+    return _stack[_stack.size() - 1 - distance];
+  }
+
+  StackValue local(size_t slot) const
+  {
+    return StackValue {StackValue::Kind::LOCAL,
+                       slot,
+                       (_locals[slot] & KNOWN_NUMBER) != 0};
+  }
+
+  StackValue global(size_t slot) const
+  {
+    return StackValue {StackValue::Kind::GLOBAL,
+                       slot,
+                       (_globals[slot] & KNOWN_NUMBER) != 0};
+  }
+
+  uint8_t* facts(const StackValue& value)
+  {
+    return value.kind == StackValue::Kind::LOCAL ? &_locals[value.payload]
+                                                 : &_globals[value.payload];
+  }
+
+  // leaves to the interpreter unless the value is a number, which is known
+  // from then on
+  void guardNumber(StackValue* value)
+  {
+    if (value->number) {
+      return;
+    }
+
+    load(Reg::RAX, *value);
+    _asm.guardNumber(Reg::RAX, exitHere());
+    value->number = true;
+    if (value->kind != StackValue::Kind::LOCAL
+        && value->kind != StackValue::Kind::GLOBAL)
+    {
+      return;
+    }
+
+    *facts(*value) |= KNOWN_NUMBER;
+    for (auto& other : _stack) {
+      if (other.is(value->kind, value->payload)) {
+        other.number = true;
+      }
+    }
+  }
+
+  // leaves to the interpreter if the global is not defined yet
+  void guardDefined(size_t slot)
+  {
+    if ((_globals[slot] & KNOWN_DEFINED) != 0) {
+      return;
+    }
+
+    _asm.movq(Reg::RAX, JitAssembler::global(slot));
+    _asm.movq(Reg::RCX, UNDEFINED_BITS);
+    _asm.cmpq(Reg::RAX, Reg::RCX);
+    _asm.j(Condition::EQUAL, exitHere());
+    _globals[slot] |= KNOWN_DEFINED;
+  }
+
+  // assigns the stack top to a variable, which then stands for it
+  void assign(StackValue target)
+  {
+    const StackValue value = peek(0);
+    if (value.is(target.kind, target.payload)) {
+      return;
+    }
+
+    // the values that still read the variable need the old value
+    for (size_t position = 0; position < _stack.size(); position++) {
+      if (_stack[position].is(target.kind, target.payload)) {
+        materialize(position);
+      }
+    }
+
+    load(Reg::RAX, value);
+    _asm.movq(variable(target), Reg::RAX);
+    _stack.back() = StackValue {target.kind, target.payload, value.number};
+
+    uint8_t* known = facts(target);
+    *known = static_cast<uint8_t>((*known & KNOWN_DEFINED)
+                                  | (value.number ? KNOWN_NUMBER : 0));
+  }
+
+  // pushes a op b, after popping count values
+  void arithmetic(OpCode op, StackValue a, StackValue b, size_t count)
+  {
+    guardNumber(&a);
+    guardNumber(&b);
+    drop(count);
+
+    if (a.kind == StackValue::Kind::CONSTANT
+        && b.kind == StackValue::Kind::CONSTANT)
+    {
+      const double x = numberOf(a.payload);
+      const double y = numberOf(b.payload);
+      double result = 0;
+      switch (op) {
+        case OP_ADD:
+          result = x + y;
+          break;
+        case OP_SUBTRACT:
+          result = x - y;
+          break;
+        case OP_MULTIPLY:
+          result = x * y;
+          break;
+        default:
+          assert(op == OP_DIVIDE);
+          result = x / y;
+          break;
+      }
+      pushConstant(Value(result).bits());
+      return;
+    }
+
+    load(Reg::RAX, a);
+    load(Reg::RCX, b);
+    _asm.movq(Xmm::XMM0, Reg::RAX);
+    _asm.movq(Xmm::XMM1, Reg::RCX);
+    switch (op) {
+      case OP_ADD:
+        _asm.addsd(Xmm::XMM0, Xmm::XMM1);
+        break;
+      case OP_SUBTRACT:
+        _asm.subsd(Xmm::XMM0, Xmm::XMM1);
+        break;
+      case OP_MULTIPLY:
+        _asm.mulsd(Xmm::XMM0, Xmm::XMM1);
+        break;
+      default:
+        assert(op == OP_DIVIDE);
+        _asm.divsd(Xmm::XMM0, Xmm::XMM1);
+        break;
+    }
+    _asm.movq(Reg::RAX, Xmm::XMM0);
+    push(Reg::RAX, true);
+  }
+
+  // Pops two numbers and sets the flags to ABOVE if the first one is the
+  // greater, or the less if asked to. Returns true instead if both are
+  // constants and sets greater to the result.
+  bool compareNumbers(bool less, bool* greater)
+  {
+    StackValue a = peek(1);
+    StackValue b = peek(0);
+    if (less) {
+      std::swap(a, b);
+    }
+    guardNumber(&a);
+    guardNumber(&b);
+    drop(2);
+
+    if (a.kind == StackValue::Kind::CONSTANT
+        && b.kind == StackValue::Kind::CONSTANT)
+    {
+      *greater = numberOf(a.payload) > numberOf(b.payload);
+      return true;
+    }
+
+    load(Reg::RAX, a);
+    load(Reg::RCX, b);
+    _asm.movq(Xmm::XMM0, Reg::RAX);
+    _asm.movq(Xmm::XMM1, Reg::RCX);
+    _asm.ucomisd(Xmm::XMM0, Xmm::XMM1);
+    return false;
+  }
+
+  // pushes whether the flags meet the condition
+  void pushCondition(Condition condition)
+  {
+    _asm.movq(Reg::RAX, FALSE_BITS);
+    _asm.movq(Reg::RDX, TRUE_BITS);
+    _asm.cmovq(condition, Reg::RAX, Reg::RDX);
+    push(Reg::RAX, false);
+  }
+
+  // leaves to the interpreter unless the stack top is as falsey as it was
+  // when the trace was recorded
+  void guardFalsey(bool falsey)
+  {
+    const StackValue value = peek(0);
+    if (value.kind == StackValue::Kind::CONSTANT || value.number) {
+      // known already, the recording could only go one way
+      return;
+    }
+
+    load(Reg::RAX, value);
+    _asm.testFalsey(Reg::RAX);
+    _asm.j(falsey ? Condition::ABOVE : Condition::BELOW_EQUAL, exitHere());
+  }
+
+  // calls the runtime function of the instruction, which pops and pushes
+  // values on the stack
+  bool runtimeCall(size_t offset, size_t pops, size_t pushes)
+  {
+    const JitFunction function = _runtime[baseOpcode(_chunk.codeAt(offset))];
+    if (function == nullptr) {
+      return false;
+    }
+
+    for (size_t position = 0; position < _stack.size(); position++) {
+      materialize(position);
+    }
+    storeStackTop(_stack.size());
+    _asm.callRuntime(function, offset);
+    static_assert(JIT_CONTINUE == SIZE_MAX, "compared as -1");
+    _asm.cmpq(Reg::RAX, -1);
+    _asm.j(Condition::NOT_EQUAL, _exit);
+
+    // the stack top on entry, the stack may have moved
+    _asm.movq(STACK_TOP, JitAssembler::field(offsetof(JitState, stackTop)));
+    _asm.subq(STACK_TOP,
+              static_cast<int32_t>(_stack.size() - pops + pushes) * VALUE_SIZE);
+
+    // the call may have run any code, including closures that assign the
+    // locals of this frame
+    for (auto& known : _locals) {
+      known = 0;
+    }
+    for (size_t slot : _usedGlobals) {
+      _globals[slot] &= KNOWN_DEFINED;
+    }
+
+    drop(pops);
+    for (size_t i = 0; i < pushes; i++) {
+      push(StackValue {StackValue::Kind::STACK, _stack.size(), false});
+    }
+    return true;
+  }
+
+  bool instruction()
+  {
+    const size_t offset = _steps[_step].offset;
+    const OpCode op = baseOpcode(_chunk.codeAt(offset));
+    const bool last = _step + 1 == _steps.size();
+    const size_t following =
+        last ? _steps.front().offset : _steps[_step + 1].offset;
+    // whether the recording took the jump at offset
+    const auto jumped = [&]()
+    {
+      const size_t next = offset + instructionLength(_chunk, offset);
+      return following == next + _chunk.shortAt(offset + 1);
+    };
+
+    switch (op) {
+      case OP_CONSTANT:
+      case OP_CONSTANT_LONG: {
+        const uint16_t index = op == OP_CONSTANT
+            ? _chunk.codeAt(offset + 1)
+            : _chunk.shortAt(offset + 1);
+        const Value value = _chunk.constantsAt(index);
+        if (IS_OBJ(value)) {
+          // objects stay in the constant table, where the collector sees them
+          _asm.movq(Reg::RAX, JitAssembler::constant(index));
+          push(Reg::RAX, false);
+        } else {
+          pushConstant(value.bits());
+        }
+        break;
+      }
+
+      case OP_NIL:
+        pushConstant(NIL_BITS);
+        break;
+
+      case OP_TRUE:
+        pushConstant(TRUE_BITS);
+        break;
+
+      case OP_FALSE:
+        pushConstant(FALSE_BITS);
+        break;
+
+      case OP_NEGATE: {
+        StackValue value = peek(0);
+        guardNumber(&value);
+        drop(1);
+        if (value.kind == StackValue::Kind::CONSTANT) {
+          pushConstant(value.payload ^ SIGN_BIT);
+        } else {
+          load(Reg::RAX, value);
+          _asm.movq(Reg::RCX, SIGN_BIT);
+          _asm.xorq(Reg::RAX, Reg::RCX);
+          push(Reg::RAX, true);
+        }
+        break;
+      }
+
+      case OP_NOT: {
+        const StackValue value = peek(0);
+        drop(1);
+        if (value.kind == StackValue::Kind::CONSTANT) {
+          const bool falsey =
+              value.payload == NIL_BITS || value.payload == FALSE_BITS;
+          pushConstant(falsey ? TRUE_BITS : FALSE_BITS);
+        } else if (value.number) {
+          pushConstant(FALSE_BITS);
+        } else {
+          load(Reg::RAX, value);
+          _asm.testFalsey(Reg::RAX);
+          pushCondition(Condition::BELOW_EQUAL);
+        }
+        break;
+      }
+
+      case OP_ADD:
+      case OP_SUBTRACT:
+      case OP_MULTIPLY:
+      case OP_DIVIDE:
+        arithmetic(op, peek(1), peek(0), 2);
+        break;
+
+      case OP_EQUAL: {
+        const Label notEqual = _asm.newLabel();
+        const Label done = _asm.newLabel();
+        load(Reg::RAX, peek(1));
+        load(Reg::RCX, peek(0));
+        drop(2);
+        _asm.jumpIfNotEqual(notEqual);
+        _asm.movq(Reg::RAX, TRUE_BITS);
+        _asm.jmp(done);
+        _asm.bind(notEqual);
+        _asm.movq(Reg::RAX, FALSE_BITS);
+        _asm.bind(done);
+        push(Reg::RAX, false);
+        break;
+      }
+
+      case OP_GREATER:
+      case OP_LESS: {
+        bool greater = false;
+        if (compareNumbers(op == OP_LESS, &greater)) {
+          pushConstant(greater ? TRUE_BITS : FALSE_BITS);
+        } else {
+          pushCondition(Condition::ABOVE);
+        }
+        break;
+      }
+
+      case OP_POP:
+        drop(1);
+        break;
+
+      case OP_POP_N:
+        drop(_chunk.codeAt(offset + 1));
+        break;
+
+      case OP_GET_GLOBAL: {
+        const uint16_t slot = _chunk.shortAt(offset + 1);
+        guardDefined(slot);
+        push(global(slot));
+        break;
+      }
+
+      case OP_SET_GLOBAL: {
+        const uint16_t slot = _chunk.shortAt(offset + 1);
+        guardDefined(slot);
+        assign(global(slot));
+        break;
+      }
+
+      case OP_GET_LOCAL:
+        push(local(_chunk.codeAt(offset + 1)));
+        break;
+
+      case OP_SET_LOCAL:
+        assign(local(_chunk.codeAt(offset + 1)));
+        break;
+
+      case OP_JUMP_IF_FALSE:
+        guardFalsey(jumped());
+        break;
+
+      case OP_POP_JUMP_IF_FALSE:
+        guardFalsey(jumped());
+        drop(1);
+        break;
+
+      case OP_JUMP:
+        return jumped();
+
+      case OP_LOOP:
+        if (!last || !_stack.empty()) {
+          return false;
+        }
+        backEdgeGuards();
+        _asm.jmp(_loop);
+        break;
+
+      case OP_JUMP_IF_NOT_LESS:
+      case OP_JUMP_IF_NOT_GREATER: {
+        // jumps unless the first operand is the less or the greater one
+        const Label exit = exitHere();
+        const bool taken = jumped();
+        bool greater = false;
+        if (!compareNumbers(op == OP_JUMP_IF_NOT_LESS, &greater)) {
+          _asm.j(taken ? Condition::ABOVE : Condition::BELOW_EQUAL, exit);
+        }
+        break;
+      }
+
+      case OP_JUMP_IF_NOT_EQUAL: {
+        const Label exit = exitHere();
+        load(Reg::RAX, peek(1));
+        load(Reg::RCX, peek(0));
+        drop(2);
+        if (jumped()) {
+          const Label notEqual = _asm.newLabel();
+          _asm.jumpIfNotEqual(notEqual);
+          _asm.jmp(exit);
+          _asm.bind(notEqual);
+        } else {
+          _asm.jumpIfNotEqual(exit);
+        }
+        break;
+      }
+
+      case OP_ADD_LOCAL_LOCAL:
+        arithmetic(OP_ADD,
+                   local(_chunk.codeAt(offset + 1)),
+                   local(_chunk.codeAt(offset + 2)),
+                   0);
+        break;
+
+      case OP_ADD_LOCAL_CONSTANT:
+      case OP_SUBTRACT_LOCAL_CONSTANT:
+      case OP_INCREMENT_LOCAL: {
+        const Value constant = _chunk.constantsAt(_chunk.codeAt(offset + 2));
+        if (!IS_NUMBER(constant)) {
+          return false;
+        }
+
+        const StackValue slot = local(_chunk.codeAt(offset + 1));
+        arithmetic(op == OP_SUBTRACT_LOCAL_CONSTANT ? OP_SUBTRACT : OP_ADD,
+                   slot,
+                   StackValue {StackValue::Kind::CONSTANT,
+                               constant.bits(),
+                               true},
+                   0);
+        if (op == OP_INCREMENT_LOCAL) {
+          assign(slot);
+          drop(1);
+        }
+        break;
+      }
+
+      case OP_PRINT:
+        return runtimeCall(offset, 1, 0);
+
+      case OP_CALL:
+        return runtimeCall(offset, _chunk.codeAt(offset + 1) + 1u, 1);
+
+      case OP_INVOKE:
+        return runtimeCall(offset, _chunk.codeAt(offset + 3) + 1u, 1);
+
+      case OP_GET_PROPERTY:
+        return runtimeCall(offset, 1, 1);
+
+      case OP_SET_PROPERTY:
+        return runtimeCall(offset, 2, 1);
+
+      default:
+        return false;
+    }
+
+    return true;
+  }
+
+  const Chunk& _chunk;
+  const std::vector<TraceStep>& _steps;
+  const JitRuntime& _runtime;
+  JitAssembler _asm;
+
+  std::vector<StackValue> _stack;
+  std::vector<uint8_t> _locals;  // what is known, by slot
+  std::vector<uint8_t> _globals;
+  std::vector<size_t> _loopLocals;  // numbers on every iteration
+  std::vector<size_t> _loopGlobals;
+  std::vector<size_t> _usedGlobals;
+
+  size_t _step = 0;
+  std::vector<SideExit> _exits;
+  size_t _exitStep = SIZE_MAX;
+  Label _exitLabel = 0;
+  Label _headExit = 0;  // runs the whole iteration in the interpreter
+  Label _exit = 0;
+  Label _loop = 0;
+};
+
+}  // namespace
+
+#endif
+
+JitTrace::JitTrace(Chunk* chunk, std::unique_ptr<ExecutableMemory> memory)
+    : _code(chunk->codeBegin())
+    , _constants(chunk->constantsBegin())
+    , _caches(chunk->cachesBegin())
+    , _memory(std::move(memory))
+{
+}
+
+std::unique_ptr<JitTrace> JitTrace::compile(Chunk* chunk,
+                                            const std::vector<TraceStep>& steps,
+                                            const JitRuntime& runtime)
+{
+  assert(chunk != nullptr);
+#ifdef LOX_JIT
+  auto memory =
+      ExecutableMemory::create(TraceCompiler {*chunk, steps, runtime}.compile());
+  if (memory == nullptr) {
+    return nullptr;
+  }
+
+  return std::unique_ptr<JitTrace>(new JitTrace(chunk, std::move(memory)));
+#else
+  static_cast<void>(steps);
+  static_cast<void>(runtime);
+  return nullptr;
+#endif
+}
+
+bool TraceRecorder::active() const
+{
+  return _active;
+}
+
+bool TraceRecorder::complete() const
+{
+  return _complete;
+}
+
+ObjFunction* TraceRecorder::function() const
+{
+  return _function;
+}
+
+size_t TraceRecorder::loopOffset() const
+{
+  return _loopOffset;
+}
+
+const std::vector<TraceStep>& TraceRecorder::steps() const
+{
+  return _steps;
+}
+
+void TraceRecorder::start(ObjFunction* function,
+                          int frameCount,
+                          size_t loopOffset)
+{
+  assert(function != nullptr);
+  _function = function;
+  _frameCount = frameCount;
+  _loopOffset = loopOffset;
+  _active = true;
+  _complete = false;
+  _steps.clear();
+}
+
+void TraceRecorder::abort()
+{
+  if (_active) {
+    finish(false);
+  }
+}
+
+bool TraceRecorder::record(const uint8_t* ip,
+                           int frameCount,
+                           const Value* stackTop,
+                           const Value* slots,
+                           const Value* globals)
+{
+  assert(_active);
+  if (frameCount > _frameCount) {
+    return true;
+  }
+  if (frameCount < _frameCount) {
+    finish(false);
+    return false;
+  }
+
+  const auto typeOf = [](Value value)
+  {
+    return IS_NUMBER(value) && !IS_UNDEFINED(value) ? TraceType::NUMBER
+                                                    : TraceType::OTHER;
+  };
+
+  const uint8_t* code = _function->chunk()->codeBegin();
+  const OpCode op = baseOpcode(*ip);
+  TraceStep step {static_cast<uint32_t>(ip - code),
+                  {TraceType::OTHER, TraceType::OTHER}};
+  switch (op) {
+    case OP_GET_LOCAL:
+    case OP_ADD_LOCAL_CONSTANT:
+    case OP_SUBTRACT_LOCAL_CONSTANT:
+    case OP_INCREMENT_LOCAL:
+      step.types[0] = typeOf(slots[ip[1]]);
+      break;
+
+    case OP_ADD_LOCAL_LOCAL:
+      step.types[0] = typeOf(slots[ip[1]]);
+      step.types[1] = typeOf(slots[ip[2]]);
+      break;
+
+    case OP_GET_GLOBAL:
+      step.types[0] = typeOf(globals[(ip[1] << 8) | ip[2]]);
+      break;
+
+    default:
+      // the top two values, as far as they belong to the frame
+      for (ptrdiff_t i = 0; i < 2 && stackTop - i > slots; i++) {
+        step.types[i] = typeOf(stackTop[-1 - i]);
+      }
+      break;
+  }
+
+  bool numbers = true;  // whether the instruction got the operands it needs
+  switch (op) {
+    case OP_NEGATE:
+    case OP_ADD_LOCAL_CONSTANT:
+    case OP_SUBTRACT_LOCAL_CONSTANT:
+    case OP_INCREMENT_LOCAL:
+      numbers = step.types[0] == TraceType::NUMBER;
+      break;
+
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_ADD_LOCAL_LOCAL:
+      numbers = step.types[0] == TraceType::NUMBER
+          && step.types[1] == TraceType::NUMBER;
+      break;
+
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_NOT:
+    case OP_EQUAL:
+    case OP_PRINT:
+    case OP_POP:
+    case OP_POP_N:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_JUMP:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_CALL:
+    case OP_INVOKE:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+      break;
+
+    case OP_LOOP:
+      // done, unless it is an inner loop
+      _steps.push_back(step);
+      finish(step.offset == _loopOffset);
+      return false;
+
+    default:
+      finish(false);
+      return false;
+  }
+
+  if (!numbers || _steps.size() == TRACE_MAX_LENGTH) {
+    finish(false);
+    return false;
+  }
+
+  _steps.push_back(step);
+  return true;
+}
+
+void TraceRecorder::finish(bool complete)
+{
+  _active = false;
+  _complete = complete;
+}
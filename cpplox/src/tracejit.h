@@ -0,0 +1,146 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "jit.h"
+#include "value.h"
+
+class Chunk;
+class ObjFunction;
+
+// Iterations of a loop before the tracing JIT records one of them. It comes
+// before the baseline JIT, which only compiles the functions of the loops
+// that could not be traced.
+constexpr int TRACE_THRESHOLD = 50;
+
+// Instructions of one iteration that can be traced at most.
+constexpr size_t TRACE_MAX_LENGTH = 1000;
+
+// Recordings of a loop that may fail before it is left to the baseline JIT.
+constexpr int TRACE_MAX_ATTEMPTS = 3;
+
+// What the recorder saw of an operand.
+enum class TraceType : uint8_t
+{
+  NUMBER,
+  OTHER,
+};
+
+// An instruction of a trace with the types of its operands as recorded: the
+// variables it reads, or else the top two values of the stack.
+struct TraceStep
+{
+  uint32_t offset;
+  TraceType types[2];
+};
+
+// Machine code of the path one iteration of a loop took, from the
+// instruction the loop jumps back to up to its OP_LOOP. It loops on its own
+// until a guard fails: a branch goes the other way, a value has another type
+// or a call or property access does not return to it. It then writes back
+// the stack and leaves to the interpreter at the instruction of the guard,
+// which runs it again.
+//
+// The trace follows the values on the stack at compile time, so pushing a
+// constant or local that gets popped again costs nothing and arithmetic and
+// comparisons only check operands that are not known to be numbers. The
+// locals and globals the loop reads as numbers are checked once on entry
+// and again at the end of the iteration only if the loop may have changed
+// their type.
+//
+// Like JitCode it refers to the chunk, which must not move once the trace is
+// compiled.
+class JitTrace
+{
+public:
+  JitTrace(const JitTrace&) = delete;
+  JitTrace& operator=(const JitTrace&) = delete;
+
+  // nullptr if there is no JIT, no executable memory or the trace has an
+  // instruction that cannot be compiled
+  static std::unique_ptr<JitTrace> compile(Chunk* chunk,
+                                           const std::vector<TraceStep>& steps,
+                                           const JitRuntime& runtime);
+
+  // state of a frame of the function with the given slots
+  JitState state(VM* vm, Value* slots, Value* stackTop, Value* globals) const
+  {
+    return JitState {
+        vm, _code, slots, stackTop, _constants, _caches, globals};
+  }
+
+  // Runs the loop, returns the offset of the instruction to go on with or
+  // JIT_ERROR.
+  size_t run(JitState* state) const
+  {
+    using EntryStub = size_t (*)(JitState*);
+    return reinterpret_cast<EntryStub>(_memory->address())(state);
+  }
+
+private:
+  JitTrace(Chunk* chunk, std::unique_ptr<ExecutableMemory> memory);
+
+  const uint8_t* _code;
+  const Value* _constants;
+  InlineCache* _caches;
+
+  std::unique_ptr<ExecutableMemory> _memory;
+};
+
+// The back-edge of a loop, by the offset of its OP_LOOP.
+struct LoopProfile
+{
+  size_t offset;
+  int iterations = 0;
+  int attempts = 0;  // failed recordings
+  std::unique_ptr<JitTrace> trace;
+
+  // whether the tracing JIT gave up on the loop
+  bool abandoned() const
+  {
+    return attempts >= TRACE_MAX_ATTEMPTS;
+  }
+};
+
+// Records one iteration of a loop for the tracing JIT. The interpreter hands
+// it every instruction it is about to run, those of the functions called
+// from the loop are not part of the trace. The recording is aborted by
+// instructions that the trace cannot compile, by operands that would fail
+// anyway, by an inner loop and by leaving the frame.
+class TraceRecorder
+{
+public:
+  bool active() const;
+  // whether the last recording ended with the OP_LOOP of its loop
+  bool complete() const;
+
+  ObjFunction* function() const;
+  size_t loopOffset() const;
+  const std::vector<TraceStep>& steps() const;
+
+  // records the loop of function whose OP_LOOP is at loopOffset, in the frame
+  // at depth frameCount
+  void start(ObjFunction* function, int frameCount, size_t loopOffset);
+  void abort();
+
+  // Records the instruction at ip, which the frame at depth frameCount is
+  // about to run. Returns false once the recording is over.
+  bool record(const uint8_t* ip,
+              int frameCount,
+              const Value* stackTop,
+              const Value* slots,
+              const Value* globals);
+
+private:
+  void finish(bool complete);
+
+  ObjFunction* _function = nullptr;
+  int _frameCount = 0;
+  size_t _loopOffset = 0;
+  bool _active = false;
+  bool _complete = false;
+  std::vector<TraceStep> _steps;
+};
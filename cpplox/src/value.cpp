@@ -1,4 +1,3 @@
-
 #include <iostream>
 #include <string>
 #include <type_traits>
@@ -9,6 +8,28 @@
 #include <fmt/format.h>
 #include <fmt/printf.h>
 
+#ifdef NAN_BOXING
+
+std::string toString(const Value& value)
+{
+  if (IS_BOOL(value)) {
+    return AS_BOOL(value) ? std::string {"true"} : std::string {"false"};
+  }
+
+  if (IS_NIL(value)) {
+    return std::string {"nil"};
+  }
+
+  if (IS_NUMBER(value)) {
+    return fmt::sprintf("%g", AS_NUMBER(value));
+  }
+
+  assert(IS_OBJ(value));
+  return AS_OBJ(value)->toString();
+}
+
+#else
+
 template<class>
 inline constexpr bool always_false_v = false;
 
@@ -34,3 +55,5 @@ std::string toString(const Value& value)
 
   return std::visit(visitor, value);
 }
+
+#endif
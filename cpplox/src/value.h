@@ -1,6 +1,9 @@
 #pragma once
 
 #include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <functional>
 #include <string>
 #include <variant>
 #include <vector>
@@ -8,6 +11,104 @@
 #include "common.h"
 #include "obj.h"
 
+#ifdef NAN_BOXING
+
+// A value is a single 64 bit word. Numbers are stored as plain IEEE 754
+// doubles, every other value hides inside the unused payload bits of a quiet
+// NaN. Objects additionally set the sign bit and keep their pointer in the
+// lower 48 bits.
+constexpr uint64_t SIGN_BIT = 0x8000000000000000u;
+constexpr uint64_t QNAN = 0x7ffc000000000000u;
+
+constexpr uint64_t TAG_NIL = 1u;  // 01
+constexpr uint64_t TAG_FALSE = 2u;  // 10
+constexpr uint64_t TAG_TRUE = 3u;  // 11
+
+class Value
+{
+public:
+  constexpr Value()
+      : _bits(QNAN | TAG_NIL)
+  {
+  }
+
+  explicit constexpr Value(bool b)
+      : _bits(b ? (QNAN | TAG_TRUE) : (QNAN | TAG_FALSE))
+  {
+  }
+
+  explicit Value(double number) { std::memcpy(&_bits, &number, sizeof(double)); }
+
+  explicit Value(Obj* obj)
+      : _bits(SIGN_BIT | QNAN | static_cast<uint64_t>(uintptr_t(obj)))
+  {
+  }
+
+  constexpr uint64_t bits() const { return _bits; }
+
+private:
+  uint64_t _bits;
+};
+
+static_assert(sizeof(Value) == sizeof(uint64_t),
+              "NaN-boxed values must fit into a single word");
+
+inline constexpr bool IS_BOOL(const Value& value)
+{
+  return (value.bits() | 1u) == (QNAN | TAG_TRUE);
+}
+
+inline constexpr bool IS_NIL(const Value& value)
+{
+  return value.bits() == (QNAN | TAG_NIL);
+}
+
+inline constexpr bool IS_NUMBER(const Value& value)
+{
+  return (value.bits() & QNAN) != QNAN;
+}
+
+inline constexpr bool IS_OBJ(const Value& value)
+{
+  return (value.bits() & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT);
+}
+
+inline constexpr bool AS_BOOL(const Value& value)
+{
+  assert(IS_BOOL(value));
+  return value.bits() == (QNAN | TAG_TRUE);
+}
+
+inline double AS_NUMBER(const Value& value)
+{
+  assert(IS_NUMBER(value));
+  double number;
+  const uint64_t bits = value.bits();
+  std::memcpy(&number, &bits, sizeof(double));
+  return number;
+}
+
+inline Obj* AS_OBJ(const Value& value)
+{
+  assert(IS_OBJ(value));
+  const auto res =
+      reinterpret_cast<Obj*>(uintptr_t(value.bits() & ~(SIGN_BIT | QNAN)));
+  assert(res != nullptr);
+  return res;
+}
+
+inline bool valuesEqual(const Value& a, const Value& b)
+{
+  // numbers have to be compared as doubles, so that NaN != NaN
+  if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    return std::equal_to<double> {}(AS_NUMBER(a), AS_NUMBER(b));
+  }
+
+  return a.bits() == b.bits();
+}
+
+#else
+
 using Value = std::variant<std::monostate, bool, double, Obj*>;
 
 inline constexpr bool IS_BOOL(const Value& value)
@@ -50,12 +151,42 @@ inline constexpr Obj* AS_OBJ(const Value& value)
   return res;
 }
 
-std::string toString(const Value& value);
 inline constexpr bool valuesEqual(const Value& a, const Value& b)
 {
   return a == b;
 }
 
+#endif
+
+// Marks a global slot that is declared but not defined yet. It is a
+// signaling NaN, which no arithmetic produces, so no Lox value has its bits.
+constexpr uint64_t UNDEFINED_BITS = 0x7ff0000000000001u;
+
+inline Value UNDEFINED_VALUE()
+{
+  double number;
+  std::memcpy(&number, &UNDEFINED_BITS, sizeof(double));
+  return Value(number);
+}
+
+inline bool IS_UNDEFINED(const Value& value)
+{
+#ifdef NAN_BOXING
+  return value.bits() == UNDEFINED_BITS;
+#else
+  if (!IS_NUMBER(value)) {
+    return false;
+  }
+
+  uint64_t bits;
+  const double number = AS_NUMBER(value);
+  std::memcpy(&bits, &number, sizeof(double));
+  return bits == UNDEFINED_BITS;
+#endif
+}
+
+std::string toString(const Value& value);
+
 inline ObjType OBJ_TYPE(const Value& value)
 {
   return AS_OBJ(value)->type();
@@ -64,4 +195,18 @@ inline ObjType OBJ_TYPE(const Value& value)
 inline bool isObjType(const Value& value, ObjType type)
 {
   return IS_OBJ(value) && AS_OBJ(value)->type() == type;
-}
\ No newline at end of file
+}
+
+// the object of value, which has to be of the given type
+inline Obj* AS_OBJ(const Value& value, ObjType type)
+{
+  assert(isObjType(value, type));
+  static_cast<void>(type);
+  return AS_OBJ(value);
+}
+
+// value with its object where it is now, see forwarded(Obj*)
+inline Value forwarded(Value value)
+{
+  return IS_OBJ(value) ? Value(forwarded(AS_OBJ(value))) : value;
+}
@@ -1,6 +1,8 @@
+#include <algorithm>
 #include <cassert>
 #include <chrono>
 #include <iostream>
+#include <iterator>
 #include <string>
 #include <string_view>
 #include <vector>
@@ -21,6 +23,10 @@
 
 namespace
 {
+// A stack trace shows this many of the innermost and of the outermost frames,
+// the ones in between are only counted. Deep recursion can fill FRAMES_MAX.
+constexpr int TRACE_FRAMES_SHOWN = 16;
+
 Value clockNative(int, Value*)
 {
   auto now = std::chrono::system_clock::now().time_since_epoch();
@@ -37,12 +43,17 @@ bool isFalsey(Value value)
 
 }  // namespace
 
-VM::VM()
+VM::VM(Engine engine)
+    : _engine(engine)
+    , _jitMode(JitCode::available() ? JitMode::HOT : JitMode::OFF)
 {
   mm = new MemoryManager();
   mm->setVm(this);
 
+  frames.resize(FRAMES_INITIAL);
+  stack.resize(STACK_INITIAL);
   resetStack();
+  registersEnd = stackTop;
 
   initString = nullptr;
   initString = mm->copyString(std::string {"init"});
@@ -52,29 +63,86 @@ VM::VM()
 
 VM::~VM()
 {
+#ifdef DEBUG_PROFILE_OPCODES
+  printOpcodeProfile();
+#endif
+
   delete mm;
   mm = nullptr;
 
   initString = nullptr;
 }
 
+#ifdef DEBUG_PROFILE_OPCODES
+void VM::printOpcodeProfile() const
+{
+  struct Pair
+  {
+    uint8_t first;
+    uint8_t second;
+    uint64_t count;
+  };
+
+  std::vector<Pair> pairs;
+  uint64_t total = 0;
+  for (size_t i = 0; i < OP_COUNT; i++) {
+    for (size_t j = 0; j < OP_COUNT; j++) {
+      if (opcodePairs[i][j] > 0) {
+        pairs.push_back({static_cast<uint8_t>(i),
+                         static_cast<uint8_t>(j),
+                         opcodePairs[i][j]});
+        total += opcodePairs[i][j];
+      }
+    }
+  }
+
+  std::sort(pairs.begin(),
+            pairs.end(),
+            [](const Pair& a, const Pair& b) { return a.count > b.count; });
+
+  std::cout << "DBG: opcode pairs executed: " << total << "\n";
+  for (size_t i = 0; i < pairs.size() && i < 20; i++) {
+    std::cout << fmt::sprintf("DBG: %-24s %-24s %12d %5.1f%%\n",
+                              opcodeName(pairs[i].first),
+                              opcodeName(pairs[i].second),
+                              pairs[i].count,
+                              100.0 * static_cast<double>(pairs[i].count)
+                                  / static_cast<double>(total));
+  }
+}
+#endif
+
 void VM::resetStack()
 {
-  stackTop = stack;
+  stackTop = stack.data();
   frameCount = 0;
   openUpValues = nullptr;
+  _recorder.abort();
 }
 
 void VM::runtimeError(std::string msg)
 {
   std::cerr << msg << "\n";
 
+  const int hidden = frameCount - 2 * TRACE_FRAMES_SHOWN;
   for (int i = frameCount - 1; i >= 0; i--) {
+    if (hidden > 0 && i == frameCount - 1 - TRACE_FRAMES_SHOWN) {
+      std::cerr << fmt::sprintf("... %d more frames\n", hidden);
+      i -= hidden - 1;
+      continue;
+    }
+
     auto* frame = &frames[i];
     auto* function = frame->closure->function();
-    size_t instruction = frame->ip - function->chunk()->codeBegin() - 1;
-    std::cerr << fmt::sprintf("[line %d] in ",
-                              function->chunk()->linesAt(instruction));
+    size_t line = 0;
+    if (_engine == Engine::REGISTER) {
+      auto* code = function->registerChunk();
+      line = code->linesAt(frame->registerIp - code->codeBegin() - 1);
+    } else {
+      line = function->chunk()->linesAt(frame->ip
+                                        - function->chunk()->codeBegin() - 1);
+    }
+    std::cerr << fmt::sprintf("[line %d] in ", line);
     if (function->name() == nullptr) {
       std::cerr << fmt::sprintf("script\n");
     } else {
@@ -89,16 +157,11 @@ void VM::defineNative(std::string name, NativeFn function)
 {
   push(Value(mm->copyString(name)));
   push(Value(mm->newNative(function)));
-  globals.set(AS_STRING(stack[0]), stack[1]);
+  globals.define(AS_STRING(stack[0]), stack[1]);
   pop();
   pop();
 }
 
-Value VM::peek(int distance)
-{
-  return stackTop[-1 - distance];
-}
-
 bool VM::call(ObjClosure* closure, int argCount)
 {
   if (argCount != closure->function()->arity()) {
@@ -108,14 +171,39 @@ bool VM::call(ObjClosure* closure, int argCount)
     return false;
   }
 
-  if (frameCount == FRAMES_MAX) {
+  // The only bounds check of the call, the compiler made sure that the frame
+  // never needs more values than that.
+  ObjFunction* function = closure->function();
+  const size_t depth = _engine == Engine::REGISTER
+      ? function->registerChunk()->frameSize()
+      : function->maxStackDepth();
+  const size_t end =
+      static_cast<size_t>(stackTop - stack.data() - argCount - 1) + depth;
+  if ((static_cast<size_t>(frameCount) == frames.size() && !growFrames())
+      || (end > stack.size() && !growStack(end)))
+  {
     runtimeError("Stack overflow.");
     return false;
   }
 
-  auto* frame = &frames[frameCount++];
+  // recursion may outgrow the heap without reaching a loop
+  if (mm->outOfMemory() && !mm->safepoint(false)) {
+    runtimeError("Out of memory.");
+    return false;
+  }
+
+  auto* frame = &frames[frameCount];
+  if (_engine == Engine::REGISTER) {
+    frame->registerIp = function->registerChunk()->codeBegin();
+  } else {
+    if (_jitMode != JitMode::OFF) {
+      warmUp(function);
+    }
+    frame->ip = function->chunk()->codeBegin();
+  }
+
+  frameCount++;
   frame->closure = closure;
-  frame->ip = closure->function()->chunk()->codeBegin();
 
   // -1 for stack slot 0, which is needed for methods
   frame->slots = stackTop - argCount - 1;
@@ -123,6 +211,105 @@ bool VM::call(ObjClosure* closure, int argCount)
   return true;
 }
 
+bool VM::growFrames()
+{
+  if (frames.size() == FRAMES_MAX) {
+    return false;
+  }
+
+  frames.resize(std::min(2 * frames.size(), FRAMES_MAX));
+  return true;
+}
+
+bool VM::growStack(size_t size)
+{
+  if (size > STACK_MAX) {
+    return false;
+  }
+
+  size_t capacity = stack.size();
+  while (capacity < size) {
+    capacity *= 2;
+  }
+
+  std::vector<Value> grown(std::min(capacity, STACK_MAX));
+  std::copy(stack.begin(), stack.end(), grown.begin());
+  const auto move = [&](Value* pointer)
+  { return grown.data() + (pointer - stack.data()); };
+
+  stackTop = move(stackTop);
+  registersEnd = move(registersEnd);
+  for (int i = 0; i < frameCount; i++) {
+    frames[i].slots = move(frames[i].slots);
+  }
+  for (JitState* state : _jitStates) {
+    state->slots = move(state->slots);
+    state->stackTop = move(state->stackTop);
+  }
+  for (ObjUpvalue* upvalue = openUpValues; upvalue != nullptr;
+       upvalue = upvalue->nextUpvalue())
+  {
+    upvalue->setLocation(move(upvalue->location()));
+  }
+
+  stack.swap(grown);
+  return true;
+}
+
+void VM::warmUp(ObjFunction* function)
+{
+  const int threshold = _jitMode == JitMode::ALWAYS ? 1 : JIT_THRESHOLD;
+  if (function->warmUp(threshold)) {
+    function->setJitCode(JitCode::compile(
+        function->chunk(), jitRuntime(), function->tracedLoops()));
+  }
+}
+
+const JitTrace* VM::hotLoop(ObjFunction* function, size_t loopOffset)
+{
+  LoopProfile* loop = function->loopProfile(loopOffset);
+  if (loop->trace != nullptr) {
+    return loop->trace.get();
+  }
+
+  if (loop->abandoned()) {
+    // left to the baseline JIT
+    warmUp(function);
+    return nullptr;
+  }
+
+  const int threshold = _jitMode == JitMode::ALWAYS ? 1 : TRACE_THRESHOLD;
+  loop->iterations++;
+  if (loop->iterations >= threshold) {
+    loop->iterations = 0;
+    _recorder.start(function, frameCount, loopOffset);
+  }
+
+  return nullptr;
+}
+
+bool VM::recordInstruction(const uint8_t* ip)
+{
+  const CallFrame* frame = &frames[frameCount - 1];
+  if (_recorder.record(
+          ip, frameCount, stackTop, frame->slots, globals.values()))
+  {
+    return true;
+  }
+
+  ObjFunction* function = _recorder.function();
+  LoopProfile* loop = function->loopProfile(_recorder.loopOffset());
+  if (_recorder.complete()) {
+    loop->trace =
+        JitTrace::compile(function->chunk(), _recorder.steps(), jitRuntime());
+  }
+  if (loop->trace == nullptr) {
+    loop->attempts++;
+  }
+
+  return false;
+}
+
 bool VM::callValue(Value callee, int argCount)
 {
   if (IS_OBJ(callee)) {
@@ -173,6 +360,23 @@ bool VM::callValue(Value callee, int argCount)
   return false;
 }
 
+bool VM::tailCall(Value callee, int argCount)
+{
+  // a wrong argument count is reported from the caller's frame
+  if (!IS_CLOSURE(callee)
+      || argCount != AS_CLOSURE(callee)->function()->arity())
+  {
+    return callValue(callee, argCount);
+  }
+
+  Value* slots = frames[frameCount - 1].slots;
+  closeUpvalues(slots);
+  std::copy(stackTop - argCount - 1, stackTop, slots);
+  stackTop = slots + argCount + 1;
+  frameCount--;
+  return call(AS_CLOSURE(callee), argCount);
+}
+
 bool VM::invokeFromClass(ObjClass* klass, ObjString* name, int argCount)
 {
   auto method = klass->methods()->get(name);
@@ -184,7 +388,7 @@ bool VM::invokeFromClass(ObjClass* klass, ObjString* name, int argCount)
   return call(AS_CLOSURE(method.value()), argCount);
 }
 
-bool VM::invoke(ObjString* name, int argCount)
+bool VM::invoke(ObjString* name, int argCount, InlineCache* cache)
 {
   assert(name != nullptr);
   Value receiver = peek(argCount);
@@ -195,14 +399,285 @@ bool VM::invoke(ObjString* name, int argCount)
   }
 
   ObjInstance* instance = AS_INSTANCE(receiver);
+  Shape* shape = instance->shape();
+  const uint64_t epoch = instance->klass()->epoch();
+
+  const InlineCacheEntry* entry = cache->lookup(shape, epoch);
+  if (entry != nullptr) {
+    if (entry->method != nullptr) {
+      return call(entry->method, argCount);
+    }
+
+    Value value = *instance->fieldAt(entry->index);
+    stackTop[-argCount - 1] = value;
+    return callValue(value, argCount);
+  }
+
+  auto index = shape->indexOf(name);
+  if (index.has_value()) {
+    cache->addField(shape, epoch, index.value());
+    Value value = *instance->fieldAt(index.value());
+    stackTop[-argCount - 1] = value;
+    return callValue(value, argCount);
+  }
+
+  auto method = instance->klass()->methods()->get(name);
+  if (!method.has_value()) {
+    runtimeError(fmt::sprintf("Undefined property '%s'.", name->string()));
+    return false;
+  }
+
+  ObjClosure* closure = AS_CLOSURE(method.value());
+  cache->addMethod(shape, epoch, closure);
+  return call(closure, argCount);
+}
+
+bool VM::getProperty(Value receiver,
+                     ObjString* name,
+                     InlineCache* cache,
+                     Value* result)
+{
+  assert(name != nullptr);
+  if (!IS_INSTANCE(receiver)) {
+    runtimeError("Only instances have properties.");
+    return false;
+  }
+
+  ObjInstance* instance = AS_INSTANCE(receiver);
+  Shape* shape = instance->shape();
+  const uint64_t epoch = instance->klass()->epoch();
+
+  const InlineCacheEntry* entry = cache->lookup(shape, epoch);
+  if (entry != nullptr) {
+    if (entry->method == nullptr) {
+      *result = *instance->fieldAt(entry->index);
+    } else {
+      // the receiver is still reachable by the caller while allocating
+      *result = Value(mm->newBoundMethod(receiver, entry->method));
+    }
+    return true;
+  }
+
+  auto index = shape->indexOf(name);
+  if (index.has_value()) {
+    cache->addField(shape, epoch, index.value());
+    *result = *instance->fieldAt(index.value());
+    return true;
+  }
+
+  auto method = instance->klass()->methods()->get(name);
+  if (!method.has_value()) {
+    runtimeError(fmt::sprintf("Undefined property '%s'.", name->string()));
+    return false;
+  }
+
+  ObjClosure* closure = AS_CLOSURE(method.value());
+  cache->addMethod(shape, epoch, closure);
+  *result = Value(mm->newBoundMethod(receiver, closure));
+  return true;
+}
+
+void VM::setProperty(ObjInstance* instance,
+                     ObjString* name,
+                     Value value,
+                     InlineCache* cache)
+{
+  assert(instance != nullptr);
+  assert(name != nullptr);
+  Shape* shape = instance->shape();
+  const uint64_t epoch = instance->klass()->epoch();
+
+  mm->writeBarrier(instance, value);
+
+  const InlineCacheEntry* entry = cache->lookup(shape, epoch);
+  if (entry != nullptr) {
+    if (entry->transition == nullptr) {
+      *instance->fieldAt(entry->index) = value;
+    } else {
+      instance->addField(entry->transition, value);
+      mm->account(instance);
+    }
+    return;
+  }
+
+  auto index = shape->indexOf(name);
+  if (index.has_value()) {
+    cache->addField(shape, epoch, index.value());
+    *instance->fieldAt(index.value()) = value;
+    return;
+  }
+
+  // the new shape holds on to the name, the class owns the shapes
+  mm->writeBarrier(instance->klass(), name);
+  Shape* transition = shape->addField(name);
+  cache->addTransition(shape, epoch, transition, shape->fieldCount());
+  instance->addField(transition, value);
+  mm->account(instance);
+  mm->account(instance->klass());
+}
+
+const JitRuntime& VM::jitRuntime()
+{
+  static const JitRuntime runtime = []() {
+    JitRuntime functions {};
+    functions[OP_RETURN] = jitReturn;
+    functions[OP_PRINT] = jitPrint;
+    functions[OP_CALL] = jitCall;
+    functions[OP_INVOKE] = jitInvoke;
+    functions[OP_GET_PROPERTY] = jitGetProperty;
+    functions[OP_SET_PROPERTY] = jitSetProperty;
+    return functions;
+  }();
+
+  return runtime;
+}
+
+size_t VM::jitReturn(JitState* state, size_t /*offset*/)
+{
+  VM* vm = state->vm;
+  vm->stackTop = state->stackTop;
+
+  Value result = vm->pop();
+  vm->closeUpvalues(state->slots);
+  vm->frameCount--;
+  if (vm->frameCount == 0) {
+    vm->pop();
+  } else {
+    vm->stackTop = state->slots;
+    vm->push(result);
+  }
+
+  state->stackTop = vm->stackTop;
+  return JIT_RETURNED;
+}
+
+size_t VM::jitPrint(JitState* state, size_t /*offset*/)
+{
+  state->stackTop--;
+  std::cout << toString(*state->stackTop) << "\n";
+  return JIT_CONTINUE;
+}
+
+inline bool VM::leavesJit() const
+{
+  // the outermost machine code leaves to run(), which runs the safepoint
+  return _jitStates.size() >= JIT_MAX_NESTING
+      || (_jitStates.size() == 1 && mm->safepointDue());
+}
+
+size_t VM::jitCall(JitState* state, size_t offset)
+{
+  VM* vm = state->vm;
+  if (vm->leavesJit()) {
+    return offset;
+  }
+
+  const int argCount = state->code[offset + 1];
+  vm->stackTop = state->stackTop;
+  vm->frames[vm->frameCount - 1].ip = state->code + offset + 2;
+
+  const int depth = vm->frameCount;
+  if (!vm->callValue(vm->peek(argCount), argCount)) {
+    return JIT_ERROR;
+  }
+
+  return vm->jitFinishCall(state, depth);
+}
+
+size_t VM::jitInvoke(JitState* state, size_t offset)
+{
+  VM* vm = state->vm;
+  if (vm->leavesJit()) {
+    return offset;
+  }
+
+  const uint8_t* operands = state->code + offset + 1;
+  ObjString* name = AS_STRING(state->constants[(operands[0] << 8) | operands[1]]);
+  const int argCount = operands[2];
+  InlineCache* cache = &state->caches[(operands[3] << 8) | operands[4]];
+  vm->stackTop = state->stackTop;
+  vm->frames[vm->frameCount - 1].ip = state->code + offset + 6;
+
+  const int depth = vm->frameCount;
+  if (!vm->invoke(name, argCount, cache)) {
+    return JIT_ERROR;
+  }
+
+  return vm->jitFinishCall(state, depth);
+}
+
+size_t VM::jitFinishCall(JitState* state, int depth)
+{
+  // natives and classes without initializer have returned already
+  if (frameCount == depth) {
+    state->stackTop = stackTop;
+    return JIT_CONTINUE;
+  }
+
+  // goes straight into the machine code of the callee, without the detour
+  // through run()
+  const CallFrame* frame = &frames[frameCount - 1];
+  const JitCode* jit = frame->closure->function()->jitCode();
+  size_t result = JIT_ERROR;
+  if (jit != nullptr) {
+    JitState callee = jit->state(this, frame->slots, stackTop, state->globals);
+    _jitStates.push_back(&callee);
+    result = jit->run(&callee, 0);
+    _jitStates.pop_back();
+    if (result == JIT_ERROR) {
+      // the error reset the stack
+      return JIT_ERROR;
+    }
+    stackTop = callee.stackTop;
+
+    // the frames may have moved
+    frames[frameCount - 1].ip = callee.code + result;
+  }
+
+  if (result != JIT_RETURNED && run(depth) != InterpretResult::OK) {
+    return JIT_ERROR;
+  }
+
+  state->stackTop = stackTop;
+  return JIT_CONTINUE;
+}
+
+size_t VM::jitGetProperty(JitState* state, size_t offset)
+{
+  VM* vm = state->vm;
+  const uint8_t* operands = state->code + offset + 1;
+  ObjString* name = AS_STRING(state->constants[(operands[0] << 8) | operands[1]]);
+  InlineCache* cache = &state->caches[(operands[2] << 8) | operands[3]];
+  vm->stackTop = state->stackTop;
+  vm->frames[vm->frameCount - 1].ip = state->code + offset + 5;
+
+  Value value;
+  if (!vm->getProperty(vm->peek(0), name, cache, &value)) {
+    return JIT_ERROR;
+  }
 
-  auto value = instance->fields()->get(name);
-  if (value.has_value()) {
-    stackTop[-argCount - 1] = value.value();
-    return callValue(value.value(), argCount);
+  vm->stackTop[-1] = value;
+  return JIT_CONTINUE;
+}
+
+size_t VM::jitSetProperty(JitState* state, size_t offset)
+{
+  VM* vm = state->vm;
+  Value* top = state->stackTop;
+  if (!IS_INSTANCE(top[-2])) {
+    // the interpreter reports the error
+    return offset;
   }
 
-  return invokeFromClass(instance->klass(), name, argCount);
+  const uint8_t* operands = state->code + offset + 1;
+  ObjString* name = AS_STRING(state->constants[(operands[0] << 8) | operands[1]]);
+  InlineCache* cache = &state->caches[(operands[2] << 8) | operands[3]];
+  vm->setProperty(AS_INSTANCE(top[-2]), name, top[-1], cache);
+
+  // leaves the value on the stack in place of the instance
+  top[-2] = top[-1];
+  state->stackTop--;
+  return JIT_CONTINUE;
 }
 
 bool VM::bindMethod(ObjClass* klass, ObjString* name)
@@ -253,6 +728,7 @@ void VM::closeUpvalues(Value* last)
 {
   while (openUpValues != nullptr && openUpValues->location() >= last) {
     ObjUpvalue* upvalue = openUpValues;
+    mm->writeBarrier(upvalue, *upvalue->location());
     upvalue->setClosed(*upvalue->location());
     upvalue->setLocation(upvalue->closed());
     openUpValues = upvalue->nextUpvalue();
@@ -264,10 +740,20 @@ void VM::defineMethod(ObjString* name)
   assert(name != nullptr);
   Value method = peek(0);
   ObjClass* klass = AS_CLASS(peek(1));
+  mm->writeBarrier(klass, name);
+  mm->writeBarrier(klass, method);
   klass->methods()->set(name, method);
+  mm->account(klass);
+  renewEpoch(klass);
   pop();
 }
 
+void VM::renewEpoch(ObjClass* klass)
+{
+  assert(klass != nullptr);
+  klass->setEpoch(++_classEpoch);
+}
+
 void VM::concatenate()
 {
   assert(IS_STRING(peek(0)));
@@ -285,107 +771,315 @@ void VM::concatenate()
   push(Value(result));
 }
 
-void VM::push(Value value)
-{
-  *stackTop = value;
-  stackTop++;
-}
+#if defined(COMPUTED_GOTO) && defined(__GNUC__)
+#  define USE_COMPUTED_GOTO
+// taking the address of a label and jumping to it is a GNU extension
+#  pragma GCC diagnostic push
+#  pragma GCC diagnostic ignored "-Wpedantic"
+#endif
 
-Value VM::pop()
+InterpretResult VM::run(int baseFrame)
 {
-  stackTop--;
-  return *stackTop;
-}
+  // The state of the active frame is cached in locals, so that the hot
+  // instructions do not have to go through the frame and the chunk. It has
+  // to be written back with STORE_FRAME() before anything that looks at
+  // frame->ip (calls, runtime errors) and reloaded with LOAD_FRAME() whenever
+  // the active frame changes.
+  CallFrame* frame = nullptr;
+  const uint8_t* ip = nullptr;
+  Value* slots = nullptr;
+  const Value* constants = nullptr;
+  InlineCache* caches = nullptr;
+  const JitCode* jit = nullptr;
+  // whether the instructions go through the trace recorder first
+  bool recording = _recorder.active();
+  // the compiler adds all global slots before the code runs
+  Value* const globalValues = globals.values();
+
+#define STORE_FRAME() (frame->ip = ip)
+
+// Rewrites the opcode of the instruction starting at instruction, to quicken
+// it or to undo that.
+#define REWRITE(instruction, op) \
+  do { \
+    Chunk* chunk = frame->closure->function()->chunk(); \
+    chunk->writeAt(static_cast<size_t>((instruction) - chunk->codeBegin()), \
+                   (op)); \
+  } while (false)
 
-InterpretResult VM::run()
-{
-  CallFrame* frame = &frames[frameCount - 1];
+#define LOAD_FRAME() \
+  do { \
+    frame = &frames[frameCount - 1]; \
+    ip = frame->ip; \
+    slots = frame->slots; \
+    ObjFunction* function = frame->closure->function(); \
+    auto* chunk = function->chunk(); \
+    constants = chunk->constantsBegin(); \
+    caches = chunk->cachesBegin(); \
+    jit = _jitMode != JitMode::OFF ? function->jitCode() : nullptr; \
+  } while (false)
 
-  const auto READ_BYTE = [](auto* f) -> uint8_t { return (*f->ip++); };
-  const auto READ_SHORT = [](auto* f) -> uint16_t {
-    f->ip += 2;
-    return static_cast<uint16_t>((f->ip[-2] << 8) | f->ip[-1]);
-  };
+// Continues in the machine code of the active function, if it has any.
+// Done whenever a frame becomes active and on loops, so that a function which
+// had to leave to the interpreter gets back into its machine code. Not while
+// a loop is recorded, the recorder has to see every instruction.
+#define ENTER_JIT() \
+  do { \
+    if (jit != nullptr && !recording) { \
+      goto enter_jit; \
+    } \
+  } while (false)
 
-  const auto READ_CONSTANT = [&]() -> Value {
-    return (frame->closure->function()->chunk()->constantsAt(READ_BYTE(frame)));
-  };
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, static_cast<uint16_t>((ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (constants[READ_BYTE()])
+#define READ_CONSTANT_LONG() (constants[READ_SHORT()])
+#define READ_STRING() AS_STRING(READ_CONSTANT_LONG())
+
+#define RUNTIME_ERROR(...) \
+  do { \
+    STORE_FRAME(); \
+    runtimeError(__VA_ARGS__); \
+    return InterpretResult::RUNTIME_ERROR; \
+  } while (false)
 
 #define BINARY_OP(valueType, op) \
   do { \
     if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-      runtimeError("Operands must be numbers."); \
-      return InterpretResult::RUNTIME_ERROR; \
+      RUNTIME_ERROR("Operands must be numbers."); \
     } \
     double b = AS_NUMBER(pop()); \
     double a = AS_NUMBER(pop()); \
     push(valueType(a op b)); \
   } while (false)
 
-  while (true) {
 #ifdef DEBUG_TRACE_EXECUTION
-    std::cout << "          ";
-    for (Value* slot = stack; slot < stackTop; slot++) {
-      std::cout << "[ ";
-      std::cout << toString(*slot);
-      std::cout << " ]";
-    }
-    std::cout << "\n";
-    disassembleInstruction(
-        frame->closure->function()->chunk(),
-        (frame->ip - frame->closure->function()->chunk()->codeBegin()));
+#  define TRACE_INSTRUCTION() \
+    do { \
+      std::cout << "          "; \
+      for (Value* slot = stack.data(); slot < stackTop; slot++) { \
+        std::cout << "[ "; \
+        std::cout << toString(*slot); \
+        std::cout << " ]"; \
+      } \
+      std::cout << "\n"; \
+      disassembleInstruction( \
+          frame->closure->function()->chunk(), \
+          (ip - frame->closure->function()->chunk()->codeBegin())); \
+    } while (false)
+#else
+#  define TRACE_INSTRUCTION() \
+    do { \
+    } while (false)
+#endif
+
+#ifdef DEBUG_PROFILE_OPCODES
+#  define PROFILE_INSTRUCTION() \
+    do { \
+      opcodePairs[lastOpcode][*ip]++; \
+      lastOpcode = *ip; \
+    } while (false)
+#else
+#  define PROFILE_INSTRUCTION() \
+    do { \
+    } while (false)
+#endif
+
+// Compare-and-branch: pops both operands, jumps if the comparison is false
+#define COMPARE_JUMP(op) \
+  do { \
+    uint16_t offset = READ_SHORT(); \
+    if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
+      RUNTIME_ERROR("Operands must be numbers."); \
+    } \
+    double b = AS_NUMBER(pop()); \
+    double a = AS_NUMBER(pop()); \
+    if (!(a op b)) { \
+      ip += offset; \
+    } \
+  } while (false)
+
+#ifdef USE_COMPUTED_GOTO
+  // Direct threaded dispatch: every handler jumps straight to the handler of
+  // the next instruction, which gives each opcode its own indirect branch.
+  // Has to list the labels in the exact order of OpCode.
+  static void* const dispatchTable[] = {
+      &&L_OP_CONSTANT,     &&L_OP_NIL,           &&L_OP_TRUE,
+      &&L_OP_FALSE,        &&L_OP_NEGATE,        &&L_OP_NOT,
+      &&L_OP_ADD,          &&L_OP_SUBTRACT,      &&L_OP_MULTIPLY,
+      &&L_OP_DIVIDE,       &&L_OP_EQUAL,         &&L_OP_GREATER,
+      &&L_OP_LESS,         &&L_OP_RETURN,        &&L_OP_PRINT,
+      &&L_OP_POP,          &&L_OP_DEFINE_GLOBAL, &&L_OP_GET_GLOBAL,
+      &&L_OP_SET_GLOBAL,   &&L_OP_GET_LOCAL,     &&L_OP_SET_LOCAL,
+      &&L_OP_JUMP_IF_FALSE, &&L_OP_JUMP,         &&L_OP_LOOP,
+      &&L_OP_CALL,         &&L_OP_CLOSURE,       &&L_OP_GET_UPVALUE,
+      &&L_OP_SET_UPVALUE,  &&L_OP_CLOSE_UPVALUE, &&L_OP_CLASS,
+      &&L_OP_SET_PROPERTY, &&L_OP_GET_PROPERTY,  &&L_OP_METHOD,
+      &&L_OP_INVOKE,       &&L_OP_INHERIT,       &&L_OP_GET_SUPER,
+      &&L_OP_SUPER_INVOKE, &&L_OP_TAIL_CALL,     &&L_OP_CONSTANT_LONG,
+      &&L_OP_POP_N,
+      &&L_OP_POP_JUMP_IF_FALSE, &&L_OP_JUMP_IF_NOT_LESS,
+      &&L_OP_JUMP_IF_NOT_GREATER,
+      &&L_OP_JUMP_IF_NOT_EQUAL, &&L_OP_ADD_LOCAL_LOCAL,
+      &&L_OP_ADD_LOCAL_CONSTANT, &&L_OP_SUBTRACT_LOCAL_CONSTANT,
+      &&L_OP_INCREMENT_LOCAL, &&L_OP_ADD_NUMBER, &&L_OP_ADD_STRING,
+      &&L_OP_GET_FIELD,    &&L_OP_ADD_GENERIC,
+  };
 
+  static_assert(sizeof(dispatchTable) / sizeof(dispatchTable[0]) == OP_COUNT,
+                "dispatch table does not cover all opcodes");
+
+  // While a loop is recorded, every opcode dispatches to the recorder first.
+  // Constant as well, VMs on other threads share it.
+#  define RECORD_1 &&record_instruction
+#  define RECORD_4 RECORD_1, RECORD_1, RECORD_1, RECORD_1
+#  define RECORD_16 RECORD_4, RECORD_4, RECORD_4, RECORD_4
+  static void* const recordTable[] = {
+      RECORD_16, RECORD_16, RECORD_16, RECORD_4,
+  };
+#  undef RECORD_16
+#  undef RECORD_4
+#  undef RECORD_1
+
+  static_assert(sizeof(recordTable) / sizeof(recordTable[0]) == OP_COUNT,
+                "record table does not cover all opcodes");
+  void* const* table = recording ? recordTable : dispatchTable;
+
+#  define CASE(op) L_##op
+#  define DISPATCH() \
+    do { \
+      TRACE_INSTRUCTION(); \
+      PROFILE_INSTRUCTION(); \
+      goto* table[READ_BYTE()]; \
+    } while (false)
+#  define SET_RECORDING(on) \
+    do { \
+      recording = (on); \
+      table = recording ? recordTable : dispatchTable; \
+    } while (false)
+#else
+#  define CASE(op) case op
+#  define DISPATCH() break
+#  define SET_RECORDING(on) (recording = (on))
 #endif
 
-    uint8_t instruction;
-    switch (instruction = READ_BYTE(frame)) {
-      case OP_CONSTANT: {
+  LOAD_FRAME();
+
+  if (jit != nullptr) {
+  enter_jit:
+    JitState state = jit->state(this, slots, stackTop, globalValues);
+    const uint8_t* code = state.code;
+    _jitStates.push_back(&state);
+    const size_t result = jit->run(&state, static_cast<size_t>(ip - code));
+    _jitStates.pop_back();
+    if (result == JIT_ERROR) {
+      // the error reset the stack
+      return InterpretResult::RUNTIME_ERROR;
+    }
+    stackTop = state.stackTop;
+
+    if (result == JIT_RETURNED) {
+      if (frameCount == baseFrame) {
+        return InterpretResult::OK;
+      }
+
+      LOAD_FRAME();
+      ENTER_JIT();
+    } else {
+      // the calls of the machine code may have moved the frames and the stack
+      frame = &frames[frameCount - 1];
+      slots = frame->slots;
+      ip = code + result;
+      if (mm->safepointDue() && !mm->safepoint(_jitStates.empty())) {
+        RUNTIME_ERROR("Out of memory.");
+      }
+    }
+  }
+
+#ifdef USE_COMPUTED_GOTO
+  DISPATCH();
+
+record_instruction:
+  if (!recordInstruction(ip - 1)) {
+    SET_RECORDING(false);
+  }
+  goto* dispatchTable[ip[-1]];
+#else
+  while (true) {
+    TRACE_INSTRUCTION();
+    PROFILE_INSTRUCTION();
+    if (recording && !recordInstruction(ip)) {
+      SET_RECORDING(false);
+    }
+
+    switch (READ_BYTE()) {
+#endif
+      CASE(OP_CONSTANT): {
         Value constant = READ_CONSTANT();
         push(constant);
-        break;
+        DISPATCH();
+      }
+
+      CASE(OP_CONSTANT_LONG): {
+        Value constant = READ_CONSTANT_LONG();
+        push(constant);
+        DISPATCH();
       }
 
-      case OP_RETURN: {
+      CASE(OP_RETURN): {
         Value result = pop();
-        closeUpvalues(frame->slots);
+        closeUpvalues(slots);
         frameCount--;
         if (frameCount == 0) {
           pop();
           return InterpretResult::OK;
         }
 
-        stackTop = frame->slots;
+        stackTop = slots;
         push(result);
-        frame = &frames[frameCount - 1];
-        break;
+        if (frameCount == baseFrame) {
+          return InterpretResult::OK;
+        }
+
+        LOAD_FRAME();
+        ENTER_JIT();
+        DISPATCH();
       }
 
-      case OP_NEGATE: {
+      CASE(OP_NEGATE): {
         if (!IS_NUMBER(peek(0))) {
-          runtimeError("Operand must be a number.");
-          return InterpretResult::RUNTIME_ERROR;
+          RUNTIME_ERROR("Operand must be a number.");
         }
 
         push(Value(-(AS_NUMBER(pop()))));
-        break;
+        DISPATCH();
       }
 
-      case OP_EQUAL: {
+      CASE(OP_EQUAL): {
         const Value b = pop();
         const Value a = pop();
         push(Value(valuesEqual(a, b)));
-        break;
+        DISPATCH();
       }
 
-      case OP_GREATER:
+      CASE(OP_GREATER): {
         BINARY_OP(Value, >);
-        break;
+        DISPATCH();
+      }
 
-      case OP_LESS:
+      CASE(OP_LESS): {
         BINARY_OP(Value, <);
-        break;
+        DISPATCH();
+      }
 
-      case OP_ADD: {
+      CASE(OP_ADD): {
+        if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+          REWRITE(ip - 1, OP_ADD_NUMBER);
+        } else if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+          REWRITE(ip - 1, OP_ADD_STRING);
+        }
+
+      add_values:
         if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
           concatenate();
         } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
@@ -393,260 +1087,970 @@ InterpretResult VM::run()
           double a = AS_NUMBER(pop());
           push(Value(a + b));
         } else {
-          runtimeError("Operands must be two numbers or two strings.");
-          return InterpretResult::RUNTIME_ERROR;
+          RUNTIME_ERROR("Operands must be two numbers or two strings.");
         }
-        break;
+        DISPATCH();
       }
 
-      case OP_SUBTRACT:
+      CASE(OP_SUBTRACT): {
         BINARY_OP(Value, -);
-        break;
+        DISPATCH();
+      }
 
-      case OP_MULTIPLY:
+      CASE(OP_MULTIPLY): {
         BINARY_OP(Value, *);
-        break;
+        DISPATCH();
+      }
 
-      case OP_DIVIDE:
+      CASE(OP_DIVIDE): {
         BINARY_OP(Value, /);
-        break;
+        DISPATCH();
+      }
 
-      case OP_NOT:
+      CASE(OP_NOT): {
         push(Value(isFalsey(pop())));
-        break;
+        DISPATCH();
+      }
 
-      case OP_NIL:
+      CASE(OP_NIL): {
         push(Value());
-        break;
+        DISPATCH();
+      }
 
-      case OP_TRUE:
+      CASE(OP_TRUE): {
         push(Value(true));
-        break;
+        DISPATCH();
+      }
 
-      case OP_FALSE:
+      CASE(OP_FALSE): {
         push(Value(false));
-        break;
+        DISPATCH();
+      }
 
-      case OP_PRINT: {
+      CASE(OP_PRINT): {
         std::cout << toString(pop()) << "\n";
-        break;
+        DISPATCH();
       }
 
-      case OP_POP:
+      CASE(OP_POP): {
         pop();
-        break;
+        DISPATCH();
+      }
 
-      case OP_DEFINE_GLOBAL: {
-        ObjString* name = AS_STRING(READ_CONSTANT());
-        globals.set(name, peek(0));
-        pop();
-        break;
+      CASE(OP_DEFINE_GLOBAL): {
+        globalValues[READ_SHORT()] = pop();
+        DISPATCH();
       }
 
-      case OP_GET_GLOBAL: {
-        ObjString* name = AS_STRING(READ_CONSTANT());
-        auto value = globals.get(name);
-        if (!value.has_value()) {
-          runtimeError(
-              fmt::sprintf("Undefined variable '%s'.", name->string()));
-          return InterpretResult::RUNTIME_ERROR;
+      CASE(OP_GET_GLOBAL): {
+        const uint16_t slot = READ_SHORT();
+        Value value = globalValues[slot];
+        if (IS_UNDEFINED(value)) {
+          RUNTIME_ERROR(fmt::sprintf("Undefined variable '%s'.",
+                                     globals.nameAt(slot)->string()));
         }
 
-        push(value.value());
-        break;
+        push(value);
+        DISPATCH();
       }
 
-      case OP_SET_GLOBAL: {
-        ObjString* name = AS_STRING(READ_CONSTANT());
-        if (globals.set(name, peek(0))) {
-          globals.remove(name);
-          runtimeError(
-              fmt::sprintf("Undefined variable '%s'.", name->string()));
-          return InterpretResult::RUNTIME_ERROR;
+      CASE(OP_SET_GLOBAL): {
+        const uint16_t slot = READ_SHORT();
+        if (IS_UNDEFINED(globalValues[slot])) {
+          RUNTIME_ERROR(fmt::sprintf("Undefined variable '%s'.",
+                                     globals.nameAt(slot)->string()));
         }
-        break;
+
+        globalValues[slot] = peek(0);
+        DISPATCH();
       }
 
-      case OP_GET_LOCAL: {
-        uint8_t slot = READ_BYTE(frame);
-        push(frame->slots[slot]);
-        break;
+      CASE(OP_GET_LOCAL): {
+        uint8_t slot = READ_BYTE();
+        push(slots[slot]);
+        DISPATCH();
       }
 
-      case OP_SET_LOCAL: {
-        uint8_t slot = READ_BYTE(frame);
-        frame->slots[slot] = peek(0);
-        break;
+      CASE(OP_SET_LOCAL): {
+        uint8_t slot = READ_BYTE();
+        slots[slot] = peek(0);
+        DISPATCH();
       }
 
-      case OP_JUMP_IF_FALSE: {
-        uint16_t offset = READ_SHORT(frame);
+      CASE(OP_JUMP_IF_FALSE): {
+        uint16_t offset = READ_SHORT();
         if (isFalsey(peek(0))) {
-          frame->ip += offset;
+          ip += offset;
         }
-        break;
+        DISPATCH();
       }
 
-      case OP_JUMP: {
-        uint16_t offset = READ_SHORT(frame);
-        frame->ip += offset;
-        break;
+      CASE(OP_JUMP): {
+        uint16_t offset = READ_SHORT();
+        ip += offset;
+        DISPATCH();
       }
 
-      case OP_LOOP: {
-        uint16_t offset = READ_SHORT(frame);
-        frame->ip -= offset;
-        break;
+      CASE(OP_LOOP): {
+        uint16_t offset = READ_SHORT();
+        ip -= offset;
+        // unless machine code runs, the objects may move
+        if (mm->safepointDue() && !mm->safepoint(_jitStates.empty())) {
+          RUNTIME_ERROR("Out of memory.");
+        }
+        if (_jitMode != JitMode::OFF && !recording) {
+          // hot loops get traced, the script included
+          ObjFunction* function = frame->closure->function();
+          const uint8_t* code = function->chunk()->codeBegin();
+          const auto loopOffset = static_cast<size_t>(ip + offset - code) - 3;
+          const JitTrace* trace = hotLoop(function, loopOffset);
+          if (trace != nullptr) {
+            JitState state = trace->state(this, slots, stackTop, globalValues);
+            _jitStates.push_back(&state);
+            const size_t result = trace->run(&state);
+            _jitStates.pop_back();
+            if (result == JIT_ERROR) {
+              // the error reset the stack
+              return InterpretResult::RUNTIME_ERROR;
+            }
+            stackTop = state.stackTop;
+
+            frame = &frames[frameCount - 1];
+            slots = frame->slots;
+            ip = code + result;
+          } else if (_recorder.active()) {
+            SET_RECORDING(true);
+          } else {
+            jit = function->jitCode();
+          }
+        }
+        ENTER_JIT();
+        DISPATCH();
       }
 
-      case OP_CALL: {
-        int argCount = READ_BYTE(frame);
+      CASE(OP_CALL): {
+        int argCount = READ_BYTE();
+        STORE_FRAME();
         if (!callValue(peek(argCount), argCount)) {
           return InterpretResult::RUNTIME_ERROR;
         }
-        frame = &frames[frameCount - 1];
-        break;
+        LOAD_FRAME();
+        ENTER_JIT();
+        DISPATCH();
       }
 
-      case OP_CLOSURE: {
-        ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+      CASE(OP_CLOSURE): {
+        ObjFunction* function = AS_FUNCTION(READ_CONSTANT_LONG());
         ObjClosure* closure = mm->newClosure(function);
         push(Value(closure));
 
         for (int i = 0; i < closure->upvalueCount(); i++) {
-          uint8_t isLocal = READ_BYTE(frame);
-          uint8_t index = READ_BYTE(frame);
-          if (isLocal) {
-            closure->setUpvalue(captureUpvalue(frame->slots + index), i);
-          } else {
-            closure->setUpvalue(frame->closure->upvalue(index), i);
-          }
+          uint8_t isLocal = READ_BYTE();
+          uint8_t index = READ_BYTE();
+          ObjUpvalue* upvalue = isLocal ? captureUpvalue(slots + index)
+                                        : frame->closure->upvalue(index);
+          // capturing may have collected garbage and promoted the closure
+          mm->writeBarrier(closure, upvalue);
+          closure->setUpvalue(upvalue, i);
         }
 
-        break;
+        DISPATCH();
       }
 
-      case OP_GET_UPVALUE: {
-        uint8_t slot = READ_BYTE(frame);
+      CASE(OP_GET_UPVALUE): {
+        uint8_t slot = READ_BYTE();
         push(*frame->closure->upvalue(slot)->location());
-        break;
+        DISPATCH();
       }
 
-      case OP_SET_UPVALUE: {
-        uint8_t slot = READ_BYTE(frame);
-        *frame->closure->upvalue(slot)->location() = peek(0);
-        break;
+      CASE(OP_SET_UPVALUE): {
+        ObjUpvalue* upvalue = frame->closure->upvalue(READ_BYTE());
+        mm->writeBarrier(upvalue, peek(0));
+        *upvalue->location() = peek(0);
+        DISPATCH();
       }
 
-      case OP_CLOSE_UPVALUE: {
+      CASE(OP_CLOSE_UPVALUE): {
         closeUpvalues(stackTop - 1);
         pop();
-        break;
+        DISPATCH();
       }
 
-      case OP_CLASS: {
-        push(Value(mm->newClass(AS_STRING(READ_CONSTANT()))));
-        break;
+      CASE(OP_CLASS): {
+        push(Value(mm->newClass(READ_STRING())));
+        DISPATCH();
       }
 
-      case OP_GET_PROPERTY: {
-        if (!IS_INSTANCE(peek(0))) {
-          runtimeError("Only instances have properties.");
+      CASE(OP_GET_PROPERTY): {
+        ObjString* name = READ_STRING();
+        InlineCache* cache = &caches[READ_SHORT()];
+        const Value receiver = peek(0);
+        STORE_FRAME();
+        Value value;
+        if (!getProperty(receiver, name, cache, &value)) {
           return InterpretResult::RUNTIME_ERROR;
         }
+        stackTop[-1] = value;
 
-        ObjInstance* instance = AS_INSTANCE(peek(0));
-        ObjString* name = AS_STRING(READ_CONSTANT());
-
-        auto value = instance->fields()->get(name);
-        if (value.has_value()) {
-          pop();  // pop instance
-          push(value.value());
-          break;
+        const InlineCacheEntry* entry = cache->monomorphic();
+        if (entry != nullptr && entry->method == nullptr
+            && entry->epoch == AS_INSTANCE(receiver)->klass()->epoch())
+        {
+          REWRITE(ip - 5, OP_GET_FIELD);
         }
-
-        if (!bindMethod(instance->klass(), name)) {
-          return InterpretResult::RUNTIME_ERROR;
-        }
-        break;
+        DISPATCH();
       }
 
-      case OP_SET_PROPERTY: {
+      CASE(OP_SET_PROPERTY): {
         if (!IS_INSTANCE(peek(1))) {
-          runtimeError("Only instances have fields.");
-          return InterpretResult::RUNTIME_ERROR;
+          RUNTIME_ERROR("Only instances have fields.");
         }
 
         ObjInstance* instance = AS_INSTANCE(peek(1));
-        instance->fields()->set(AS_STRING(READ_CONSTANT()), peek(0));
+        ObjString* name = READ_STRING();
+        setProperty(instance, name, peek(0), &caches[READ_SHORT()]);
         Value value = pop();
         pop();
         push(value);
-        break;
+        DISPATCH();
       }
 
-      case OP_METHOD: {
-        defineMethod(AS_STRING(READ_CONSTANT()));
-        break;
+      CASE(OP_METHOD): {
+        defineMethod(READ_STRING());
+        DISPATCH();
       }
 
-      case OP_INVOKE: {
-        ObjString* method = AS_STRING(READ_CONSTANT());
-        int argCount = READ_BYTE(frame);
-        if (!invoke(method, argCount)) {
+      CASE(OP_INVOKE): {
+        ObjString* method = READ_STRING();
+        int argCount = READ_BYTE();
+        InlineCache* cache = &caches[READ_SHORT()];
+        STORE_FRAME();
+        if (!invoke(method, argCount, cache)) {
           return InterpretResult::RUNTIME_ERROR;
         }
-        frame = &frames[frameCount - 1];
-        break;
+        LOAD_FRAME();
+        ENTER_JIT();
+        DISPATCH();
       }
 
-      case OP_INHERIT: {
+      CASE(OP_INHERIT): {
         Value superclass = peek(1);
 
         if (!IS_CLASS(superclass)) {
-          runtimeError("Superclass must be a class.");
-          return InterpretResult::RUNTIME_ERROR;
+          RUNTIME_ERROR("Superclass must be a class.");
         }
 
         ObjClass* subclass = AS_CLASS(peek(0));
+        mm->remember(subclass);
         subclass->methods()->addAll(AS_CLASS(superclass)->methods());
+        mm->account(subclass);
+        renewEpoch(subclass);
         pop();  // subclass
-        break;
+        DISPATCH();
       }
 
-      case OP_GET_SUPER: {
-        ObjString* name = AS_STRING(READ_CONSTANT());
+      CASE(OP_GET_SUPER): {
+        ObjString* name = READ_STRING();
         ObjClass* superclass = AS_CLASS(pop());
 
+        STORE_FRAME();
         if (!bindMethod(superclass, name)) {
           return InterpretResult::RUNTIME_ERROR;
         }
-        break;
+        DISPATCH();
       }
 
-      case OP_SUPER_INVOKE: {
-        ObjString* method = AS_STRING(READ_CONSTANT());
-        int argCount = READ_BYTE(frame);
+      CASE(OP_SUPER_INVOKE): {
+        ObjString* method = READ_STRING();
+        int argCount = READ_BYTE();
         ObjClass* superclass = AS_CLASS(pop());
+        STORE_FRAME();
         if (!invokeFromClass(superclass, method, argCount)) {
           return InterpretResult::RUNTIME_ERROR;
         }
+        LOAD_FRAME();
+        ENTER_JIT();
+        DISPATCH();
+      }
 
-        frame = &frames[frameCount - 1];
-        break;
+      CASE(OP_TAIL_CALL): {
+        int argCount = READ_BYTE();
+        STORE_FRAME();
+        if (!tailCall(peek(argCount), argCount)) {
+          return InterpretResult::RUNTIME_ERROR;
+        }
+        LOAD_FRAME();
+        ENTER_JIT();
+        DISPATCH();
+      }
+
+      CASE(OP_POP_N): {
+        stackTop -= READ_BYTE();
+        DISPATCH();
+      }
+
+      CASE(OP_POP_JUMP_IF_FALSE): {
+        uint16_t offset = READ_SHORT();
+        if (isFalsey(pop())) {
+          ip += offset;
+        }
+        DISPATCH();
+      }
+
+      CASE(OP_JUMP_IF_NOT_LESS): {
+        COMPARE_JUMP(<);
+        DISPATCH();
+      }
+
+      CASE(OP_JUMP_IF_NOT_GREATER): {
+        COMPARE_JUMP(>);
+        DISPATCH();
       }
+
+      CASE(OP_JUMP_IF_NOT_EQUAL): {
+        uint16_t offset = READ_SHORT();
+        const Value b = pop();
+        const Value a = pop();
+        if (!valuesEqual(a, b)) {
+          ip += offset;
+        }
+        DISPATCH();
+      }
+
+      CASE(OP_ADD_LOCAL_LOCAL): {
+        const Value a = slots[READ_BYTE()];
+        const Value b = slots[READ_BYTE()];
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+          push(a);
+          push(b);
+          goto add_values;
+        }
+
+        push(Value(AS_NUMBER(a) + AS_NUMBER(b)));
+        DISPATCH();
+      }
+
+      CASE(OP_ADD_LOCAL_CONSTANT): {
+        const Value a = slots[READ_BYTE()];
+        const Value b = READ_CONSTANT();
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+          push(a);
+          push(b);
+          goto add_values;
+        }
+
+        push(Value(AS_NUMBER(a) + AS_NUMBER(b)));
+        DISPATCH();
+      }
+
+      CASE(OP_SUBTRACT_LOCAL_CONSTANT): {
+        const Value a = slots[READ_BYTE()];
+        const Value b = READ_CONSTANT();
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+          RUNTIME_ERROR("Operands must be numbers.");
+        }
+
+        push(Value(AS_NUMBER(a) - AS_NUMBER(b)));
+        DISPATCH();
+      }
+
+      CASE(OP_INCREMENT_LOCAL): {
+        // the compiler only fuses increments by a number
+        Value* local = &slots[READ_BYTE()];
+        const Value b = READ_CONSTANT();
+        if (!IS_NUMBER(*local)) {
+          RUNTIME_ERROR("Operands must be two numbers or two strings.");
+        }
+
+        *local = Value(AS_NUMBER(*local) + AS_NUMBER(b));
+        DISPATCH();
+      }
+
+      CASE(OP_ADD_NUMBER): {
+        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+          REWRITE(ip - 1, OP_ADD_GENERIC);
+          goto add_values;
+        }
+
+        const double b = AS_NUMBER(pop());
+        stackTop[-1] = Value(AS_NUMBER(stackTop[-1]) + b);
+        DISPATCH();
+      }
+
+      CASE(OP_ADD_STRING): {
+        if (!IS_STRING(peek(0)) || !IS_STRING(peek(1))) {
+          REWRITE(ip - 1, OP_ADD_GENERIC);
+          goto add_values;
+        }
+
+        concatenate();
+        DISPATCH();
+      }
+
+      CASE(OP_ADD_GENERIC): {
+        goto add_values;
+      }
+
+      CASE(OP_GET_FIELD): {
+        ObjString* name = READ_STRING();
+        InlineCache* cache = &caches[READ_SHORT()];
+        const InlineCacheEntry* entry = cache->monomorphic();
+        const Value receiver = peek(0);
+        if (IS_INSTANCE(receiver) && entry != nullptr
+            && entry->shape == AS_INSTANCE(receiver)->shape()
+            && entry->epoch == AS_INSTANCE(receiver)->klass()->epoch()
+            && entry->method == nullptr)
+        {
+          stackTop[-1] = *AS_INSTANCE(receiver)->fieldAt(entry->index);
+          DISPATCH();
+        }
+
+        REWRITE(ip - 5, OP_GET_PROPERTY);
+        STORE_FRAME();
+        Value value;
+        if (!getProperty(receiver, name, cache, &value)) {
+          return InterpretResult::RUNTIME_ERROR;
+        }
+        stackTop[-1] = value;
+        DISPATCH();
+      }
+
+#ifndef USE_COMPUTED_GOTO
     }
   }
+#endif
 
+#undef CASE
+#undef DISPATCH
+#undef SET_RECORDING
+#undef COMPARE_JUMP
+#undef PROFILE_INSTRUCTION
+#undef TRACE_INSTRUCTION
 #undef BINARY_OP
+#undef RUNTIME_ERROR
+#undef READ_STRING
+#undef READ_CONSTANT_LONG
+#undef READ_CONSTANT
+#undef READ_SHORT
+#undef READ_BYTE
+#undef ENTER_JIT
+#undef LOAD_FRAME
+#undef STORE_FRAME
+#undef REWRITE
 }
 
+InterpretResult VM::runRegisters()
+{
+  // Same caching of the active frame as in run(). stackTop is kept at the end
+  // of the registers of the active frame, so that the garbage collector sees
+  // all of them, and is only moved to the end of the arguments for calls.
+  CallFrame* frame = nullptr;
+  const uint16_t* ip = nullptr;
+  Value* slots = nullptr;
+  const Value* constants = nullptr;
+  InlineCache* caches = nullptr;
+  // the compiler adds all global slots before the code runs
+  Value* const globalValues = globals.values();
+
+#define STORE_FRAME() (frame->registerIp = ip)
+
+#define LOAD_FRAME() \
+  do { \
+    frame = &frames[frameCount - 1]; \
+    ip = frame->registerIp; \
+    slots = frame->slots; \
+    auto* function = frame->closure->function(); \
+    auto* code = function->registerChunk(); \
+    constants = code->constantsBegin(); \
+    caches = function->chunk()->cachesBegin(); \
+    stackTop = slots + code->frameSize(); \
+    registersEnd = std::max(registersEnd, stackTop); \
+  } while (false)
+
+#define READ() (*ip++)
+#define READ_RK() \
+  ([&](uint16_t operand) \
+   { \
+     return (operand & RK_CONSTANT) ? constants[operand & REGISTER_MAX] \
+                                    : slots[operand]; \
+   }(READ()))
+#define READ_STRING() AS_STRING(constants[READ()])
+
+#define RUNTIME_ERROR(...) \
+  do { \
+    STORE_FRAME(); \
+    runtimeError(__VA_ARGS__); \
+    return InterpretResult::RUNTIME_ERROR; \
+  } while (false)
+
+#define BINARY_OP(op) \
+  do { \
+    Value* dst = &slots[READ()]; \
+    const Value a = READ_RK(); \
+    const Value b = READ_RK(); \
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+      RUNTIME_ERROR("Operands must be numbers."); \
+    } \
+    *dst = Value(AS_NUMBER(a) op AS_NUMBER(b)); \
+  } while (false)
+
+#define COMPARE_JUMP(op) \
+  do { \
+    const Value a = READ_RK(); \
+    const Value b = READ_RK(); \
+    uint16_t offset = READ(); \
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+      RUNTIME_ERROR("Operands must be numbers."); \
+    } \
+    if (!(AS_NUMBER(a) op AS_NUMBER(b))) { \
+      ip += offset; \
+    } \
+  } while (false)
+
+#ifdef DEBUG_TRACE_EXECUTION
+#  define TRACE_INSTRUCTION() \
+    do { \
+      std::cout << "          "; \
+      for (Value* slot = slots; slot < stackTop; slot++) { \
+        std::cout << "[ "; \
+        std::cout << toString(*slot); \
+        std::cout << " ]"; \
+      } \
+      std::cout << "\n"; \
+      disassembleRegisterInstruction( \
+          frame->closure->function()->registerChunk(), \
+          (ip - frame->closure->function()->registerChunk()->codeBegin())); \
+    } while (false)
+#else
+#  define TRACE_INSTRUCTION() \
+    do { \
+    } while (false)
+#endif
+
+#ifdef USE_COMPUTED_GOTO
+  // Has to list the labels in the exact order of RegisterOp.
+  static void* const dispatchTable[] = {
+      &&L_ROP_MOVE,
+      &&L_ROP_NEGATE,
+      &&L_ROP_NOT,
+      &&L_ROP_ADD,
+      &&L_ROP_SUBTRACT,
+      &&L_ROP_MULTIPLY,
+      &&L_ROP_DIVIDE,
+      &&L_ROP_EQUAL,
+      &&L_ROP_GREATER,
+      &&L_ROP_LESS,
+      &&L_ROP_PRINT,
+      &&L_ROP_RETURN,
+      &&L_ROP_DEFINE_GLOBAL,
+      &&L_ROP_GET_GLOBAL,
+      &&L_ROP_SET_GLOBAL,
+      &&L_ROP_GET_UPVALUE,
+      &&L_ROP_SET_UPVALUE,
+      &&L_ROP_CLOSE_UPVALUE,
+      &&L_ROP_JUMP,
+      &&L_ROP_JUMP_IF_FALSE,
+      &&L_ROP_JUMP_IF_NOT_LESS,
+      &&L_ROP_JUMP_IF_NOT_GREATER,
+      &&L_ROP_JUMP_IF_NOT_EQUAL,
+      &&L_ROP_LOOP,
+      &&L_ROP_CALL,
+      &&L_ROP_TAIL_CALL,
+      &&L_ROP_INVOKE,
+      &&L_ROP_SUPER_INVOKE,
+      &&L_ROP_CLOSURE,
+      &&L_ROP_CLASS,
+      &&L_ROP_GET_PROPERTY,
+      &&L_ROP_SET_PROPERTY,
+      &&L_ROP_METHOD,
+      &&L_ROP_INHERIT,
+      &&L_ROP_GET_SUPER,
+  };
+
+  static_assert(sizeof(dispatchTable) / sizeof(dispatchTable[0]) == ROP_COUNT,
+                "dispatch table does not cover all opcodes");
+
+#  define CASE(op) L_##op
+#  define DISPATCH() \
+    do { \
+      TRACE_INSTRUCTION(); \
+      goto* dispatchTable[READ()]; \
+    } while (false)
+#else
+#  define CASE(op) case op
+#  define DISPATCH() break
+#endif
+
+  LOAD_FRAME();
+
+#ifdef USE_COMPUTED_GOTO
+  DISPATCH();
+#else
+  while (true) {
+    TRACE_INSTRUCTION();
+
+    switch (READ()) {
+#endif
+      CASE(ROP_MOVE): {
+        Value* dst = &slots[READ()];
+        *dst = READ_RK();
+        DISPATCH();
+      }
+
+      CASE(ROP_NEGATE): {
+        Value* dst = &slots[READ()];
+        const Value value = READ_RK();
+        if (!IS_NUMBER(value)) {
+          RUNTIME_ERROR("Operand must be a number.");
+        }
+
+        *dst = Value(-AS_NUMBER(value));
+        DISPATCH();
+      }
+
+      CASE(ROP_NOT): {
+        Value* dst = &slots[READ()];
+        *dst = Value(isFalsey(READ_RK()));
+        DISPATCH();
+      }
+
+      CASE(ROP_ADD): {
+        Value* dst = &slots[READ()];
+        const Value a = READ_RK();
+        const Value b = READ_RK();
+        if (IS_NUMBER(a) && IS_NUMBER(b)) {
+          *dst = Value(AS_NUMBER(a) + AS_NUMBER(b));
+        } else if (IS_STRING(a) && IS_STRING(b)) {
+          // both operands stay reachable through their registers or the
+          // constants while the result is allocated
+          *dst = Value(
+              mm->takeString(AS_STRING(a)->string() + AS_STRING(b)->string()));
+        } else {
+          RUNTIME_ERROR("Operands must be two numbers or two strings.");
+        }
+        DISPATCH();
+      }
+
+      CASE(ROP_SUBTRACT): {
+        BINARY_OP(-);
+        DISPATCH();
+      }
+
+      CASE(ROP_MULTIPLY): {
+        BINARY_OP(*);
+        DISPATCH();
+      }
+
+      CASE(ROP_DIVIDE): {
+        BINARY_OP(/);
+        DISPATCH();
+      }
+
+      CASE(ROP_EQUAL): {
+        Value* dst = &slots[READ()];
+        const Value a = READ_RK();
+        const Value b = READ_RK();
+        *dst = Value(valuesEqual(a, b));
+        DISPATCH();
+      }
+
+      CASE(ROP_GREATER): {
+        BINARY_OP(>);
+        DISPATCH();
+      }
+
+      CASE(ROP_LESS): {
+        BINARY_OP(<);
+        DISPATCH();
+      }
+
+      CASE(ROP_PRINT): {
+        std::cout << toString(READ_RK()) << "\n";
+        DISPATCH();
+      }
+
+      CASE(ROP_RETURN): {
+        const Value result = READ_RK();
+        closeUpvalues(slots);
+        frameCount--;
+        if (frameCount == 0) {
+          stackTop = slots;
+          return InterpretResult::OK;
+        }
+
+        slots[0] = result;
+        LOAD_FRAME();
+        DISPATCH();
+      }
+
+      CASE(ROP_DEFINE_GLOBAL): {
+        const uint16_t slot = READ();
+        globalValues[slot] = READ_RK();
+        DISPATCH();
+      }
+
+      CASE(ROP_GET_GLOBAL): {
+        Value* dst = &slots[READ()];
+        const uint16_t slot = READ();
+        Value value = globalValues[slot];
+        if (IS_UNDEFINED(value)) {
+          RUNTIME_ERROR(fmt::sprintf("Undefined variable '%s'.",
+                                     globals.nameAt(slot)->string()));
+        }
+
+        *dst = value;
+        DISPATCH();
+      }
+
+      CASE(ROP_SET_GLOBAL): {
+        const uint16_t slot = READ();
+        if (IS_UNDEFINED(globalValues[slot])) {
+          RUNTIME_ERROR(fmt::sprintf("Undefined variable '%s'.",
+                                     globals.nameAt(slot)->string()));
+        }
+
+        globalValues[slot] = READ_RK();
+        DISPATCH();
+      }
+
+      CASE(ROP_GET_UPVALUE): {
+        Value* dst = &slots[READ()];
+        *dst = *frame->closure->upvalue(READ())->location();
+        DISPATCH();
+      }
+
+      CASE(ROP_SET_UPVALUE): {
+        ObjUpvalue* upvalue = frame->closure->upvalue(READ());
+        const Value value = READ_RK();
+        mm->writeBarrier(upvalue, value);
+        *upvalue->location() = value;
+        DISPATCH();
+      }
+
+      CASE(ROP_CLOSE_UPVALUE): {
+        closeUpvalues(&slots[READ()]);
+        DISPATCH();
+      }
+
+      CASE(ROP_JUMP): {
+        uint16_t offset = READ();
+        ip += offset;
+        DISPATCH();
+      }
+
+      CASE(ROP_JUMP_IF_FALSE): {
+        const Value condition = READ_RK();
+        uint16_t offset = READ();
+        if (isFalsey(condition)) {
+          ip += offset;
+        }
+        DISPATCH();
+      }
+
+      CASE(ROP_JUMP_IF_NOT_LESS): {
+        COMPARE_JUMP(<);
+        DISPATCH();
+      }
+
+      CASE(ROP_JUMP_IF_NOT_GREATER): {
+        COMPARE_JUMP(>);
+        DISPATCH();
+      }
+
+      CASE(ROP_JUMP_IF_NOT_EQUAL): {
+        const Value a = READ_RK();
+        const Value b = READ_RK();
+        uint16_t offset = READ();
+        if (!valuesEqual(a, b)) {
+          ip += offset;
+        }
+        DISPATCH();
+      }
+
+      CASE(ROP_LOOP): {
+        uint16_t offset = READ();
+        ip -= offset;
+        if (mm->safepointDue() && !mm->safepoint(true)) {
+          RUNTIME_ERROR("Out of memory.");
+        }
+        DISPATCH();
+      }
+
+      CASE(ROP_CALL): {
+        Value* base = &slots[READ()];
+        int argCount = READ();
+        stackTop = base + argCount + 1;
+        STORE_FRAME();
+        if (!callValue(*base, argCount)) {
+          return InterpretResult::RUNTIME_ERROR;
+        }
+        LOAD_FRAME();
+        DISPATCH();
+      }
+
+      CASE(ROP_TAIL_CALL): {
+        Value* base = &slots[READ()];
+        int argCount = READ();
+        stackTop = base + argCount + 1;
+        STORE_FRAME();
+        if (!tailCall(*base, argCount)) {
+          return InterpretResult::RUNTIME_ERROR;
+        }
+        LOAD_FRAME();
+        DISPATCH();
+      }
+
+      CASE(ROP_INVOKE): {
+        Value* base = &slots[READ()];
+        ObjString* method = READ_STRING();
+        int argCount = READ();
+        InlineCache* cache = &caches[READ()];
+        stackTop = base + argCount + 1;
+        STORE_FRAME();
+        if (!invoke(method, argCount, cache)) {
+          return InterpretResult::RUNTIME_ERROR;
+        }
+        LOAD_FRAME();
+        DISPATCH();
+      }
+
+      CASE(ROP_SUPER_INVOKE): {
+        Value* base = &slots[READ()];
+        ObjString* method = READ_STRING();
+        int argCount = READ();
+        ObjClass* superclass = AS_CLASS(base[argCount + 1]);
+        stackTop = base + argCount + 1;
+        STORE_FRAME();
+        if (!invokeFromClass(superclass, method, argCount)) {
+          return InterpretResult::RUNTIME_ERROR;
+        }
+        LOAD_FRAME();
+        DISPATCH();
+      }
+
+      CASE(ROP_CLOSURE): {
+        Value* dst = &slots[READ()];
+        ObjFunction* function = AS_FUNCTION(constants[READ()]);
+        ObjClosure* closure = mm->newClosure(function);
+        *dst = Value(closure);  // keeps the closure reachable
+
+        for (int i = 0; i < closure->upvalueCount(); i++) {
+          uint16_t isLocal = READ();
+          uint16_t index = READ();
+          ObjUpvalue* upvalue = isLocal ? captureUpvalue(slots + index)
+                                        : frame->closure->upvalue(index);
+          // capturing may have collected garbage and promoted the closure
+          mm->writeBarrier(closure, upvalue);
+          closure->setUpvalue(upvalue, i);
+        }
+
+        DISPATCH();
+      }
+
+      CASE(ROP_CLASS): {
+        Value* dst = &slots[READ()];
+        *dst = Value(mm->newClass(READ_STRING()));
+        DISPATCH();
+      }
+
+      CASE(ROP_GET_PROPERTY): {
+        Value* dst = &slots[READ()];
+        const Value receiver = READ_RK();
+        ObjString* name = READ_STRING();
+        InlineCache* cache = &caches[READ()];
+        STORE_FRAME();
+        Value value;
+        if (!getProperty(receiver, name, cache, &value)) {
+          return InterpretResult::RUNTIME_ERROR;
+        }
+        *dst = value;
+        DISPATCH();
+      }
+
+      CASE(ROP_SET_PROPERTY): {
+        const Value receiver = READ_RK();
+        if (!IS_INSTANCE(receiver)) {
+          RUNTIME_ERROR("Only instances have fields.");
+        }
+
+        ObjString* name = READ_STRING();
+        const Value value = READ_RK();
+        setProperty(AS_INSTANCE(receiver), name, value, &caches[READ()]);
+        DISPATCH();
+      }
+
+      CASE(ROP_METHOD): {
+        ObjClass* klass = AS_CLASS(READ_RK());
+        ObjString* name = READ_STRING();
+        const Value method = READ_RK();
+        mm->writeBarrier(klass, name);
+        mm->writeBarrier(klass, method);
+        klass->methods()->set(name, method);
+        mm->account(klass);
+        renewEpoch(klass);
+        DISPATCH();
+      }
+
+      CASE(ROP_INHERIT): {
+        const Value superclass = READ_RK();
+        if (!IS_CLASS(superclass)) {
+          RUNTIME_ERROR("Superclass must be a class.");
+        }
+
+        ObjClass* subclass = AS_CLASS(READ_RK());
+        mm->remember(subclass);
+        subclass->methods()->addAll(AS_CLASS(superclass)->methods());
+        mm->account(subclass);
+        renewEpoch(subclass);
+        DISPATCH();
+      }
+
+      CASE(ROP_GET_SUPER): {
+        Value* dst = &slots[READ()];
+        const Value receiver = READ_RK();
+        ObjClass* superclass = AS_CLASS(READ_RK());
+        ObjString* name = READ_STRING();
+
+        auto method = superclass->methods()->get(name);
+        if (!method.has_value()) {
+          RUNTIME_ERROR(
+              fmt::sprintf("Undefined property '%s'.", name->string()));
+        }
+
+        *dst = Value(mm->newBoundMethod(receiver, AS_CLOSURE(method.value())));
+        DISPATCH();
+      }
+
+#ifndef USE_COMPUTED_GOTO
+    }
+  }
+#endif
+
+#undef CASE
+#undef DISPATCH
+#undef TRACE_INSTRUCTION
+#undef COMPARE_JUMP
+#undef BINARY_OP
+#undef RUNTIME_ERROR
+#undef READ_STRING
+#undef READ_RK
+#undef READ
+#undef LOAD_FRAME
+#undef STORE_FRAME
+}
+
+#ifdef USE_COMPUTED_GOTO
+#  pragma GCC diagnostic pop
+#endif
+
 InterpretResult VM::interpret(std::string_view source)
 {
   auto scanner = std::make_unique<Scanner>(source);
   auto parser = std::make_shared<Parser>(std::move(scanner));
 
-  Compiler compiler {nullptr, mm, parser, FunctionType::SCRIPT};
+  Compiler compiler {
+      nullptr, mm, &globals, parser, FunctionType::SCRIPT, _engine,
+      _optimizeMode};
   auto* function = compiler.compile();
   if (function == nullptr) {
     return InterpretResult::COMPILE_ERROR;
@@ -656,7 +2060,55 @@ InterpretResult VM::interpret(std::string_view source)
   ObjClosure* closure = mm->newClosure(function);
   pop();
   push(Value(closure));
-  call(closure, 0);  // initialize "function" which houses top level code
+  // initialize "function" which houses top level code
+  if (!call(closure, 0)) {
+    return InterpretResult::RUNTIME_ERROR;
+  }
+
+  return _engine == Engine::REGISTER ? runRegisters() : run();
+}
+
+Engine VM::engine() const
+{
+  return _engine;
+}
+
+JitMode VM::jitMode() const
+{
+  return _jitMode;
+}
+
+void VM::setJitMode(JitMode mode)
+{
+  _jitMode = JitCode::available() ? mode : JitMode::OFF;
+}
 
-  return run();
-}
\ No newline at end of file
+OptimizeMode VM::optimizeMode() const
+{
+  return _optimizeMode;
+}
+
+void VM::setOptimizeMode(OptimizeMode mode)
+{
+  _optimizeMode = mode;
+}
+
+const GcOptions& VM::gcOptions() const
+{
+  return mm->options();
+}
+
+void VM::setGcOptions(const GcOptions& options)
+{
+  mm->setOptions(options);
+}
+
+const GcPauses& VM::gcPauses() const
+{
+  return mm->pauses();
+}
+
+GcStats VM::gcStats() const
+{
+  return mm->stats();
+}
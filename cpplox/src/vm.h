@@ -4,18 +4,29 @@
 #include <ostream>
 #include <string>
 #include <string_view>
+#include <vector>
 
 #include "chunk.h"
+#include "gc.h"
+#include "globals.h"
+#include "jit.h"
 #include "objclass.h"
 #include "objclosure.h"
 #include "objnative.h"
+#include "optimizer.h"
 #include "table.h"
+#include "tracejit.h"
 #include "value.h"
 
-constexpr size_t FRAMES_MAX = 64u;
-constexpr size_t STACK_MAX = (FRAMES_MAX * UINT8_COUNT);
+// The frames and the value stack start small and grow as calls need them,
+// up to the limits.
+constexpr size_t FRAMES_INITIAL = 16u;
+constexpr size_t FRAMES_MAX = 1u << 16;
+constexpr size_t STACK_INITIAL = 256u;
+constexpr size_t STACK_MAX = 1u << 20;
 
 class MemoryManager;
+class ObjInstance;
 
 enum class InterpretResult
 {
@@ -40,10 +51,20 @@ inline std::ostream& operator<<(std::ostream& os, InterpretResult result)
   return os;
 }
 
+// The stack engine runs the bytecode of Chunk on the value stack, the
+// register engine runs the bytecode of RegisterChunk with the slots of each
+// call frame as registers.
+enum class Engine
+{
+  STACK,
+  REGISTER,
+};
+
 struct CallFrame
 {
   ObjClosure* closure = nullptr;
   const uint8_t* ip;
+  const uint16_t* registerIp = nullptr;
   Value* slots = nullptr;
 };
 
@@ -52,40 +73,132 @@ class VM
   friend class MemoryManager;
 
 public:
-  explicit VM();
+  explicit VM(Engine engine = Engine::STACK);
   virtual ~VM();
 
   InterpretResult interpret(std::string_view source);
-  void push(Value value);
-  Value pop();
+  Engine engine() const;
+  // only the stack engine has a JIT, the mode stays off without one
+  JitMode jitMode() const;
+  void setJitMode(JitMode mode);
+  // applies to the code interpreted from then on
+  OptimizeMode optimizeMode() const;
+  void setOptimizeMode(OptimizeMode mode);
+  const GcOptions& gcOptions() const;
+  void setGcOptions(const GcOptions& options);
+  // the pauses of the collector so far
+  const GcPauses& gcPauses() const;
+  GcStats gcStats() const;
+
+  inline void push(Value value)
+  {
+    *stackTop = value;
+    stackTop++;
+  }
+
+  inline Value pop()
+  {
+    stackTop--;
+    return *stackTop;
+  }
 
 private:
   void resetStack();
   void runtimeError(std::string msg);
   void defineNative(std::string name, NativeFn function);
-  Value peek(int distance);
+  inline Value peek(int distance) const { return stackTop[-1 - distance]; }
   bool call(ObjClosure* closure, int argCount);
+  // Double the frames, or the value stack until it holds size values. False
+  // once they would exceed their limit. The value stack moves, every pointer
+  // into it is moved along: the stack top, the slots of the frames and of the
+  // machine code that runs and the open upvalues.
+  bool growFrames();
+  bool growStack(size_t size);
+  // compiles the function once it got hot
+  void warmUp(ObjFunction* function);
+  // Counts an iteration of the loop of function whose OP_LOOP is at
+  // loopOffset and starts recording it once it got hot. Returns the trace
+  // of the loop once it has one.
+  const JitTrace* hotLoop(ObjFunction* function, size_t loopOffset);
+  // hands the instruction at ip to the recorder, false once the recording
+  // is over
+  bool recordInstruction(const uint8_t* ip);
   bool callValue(Value callee, int argCount);
+  // Calls a closure in place of the frame on top, whose slots its callee and
+  // arguments move down to. Other callees get a frame of their own.
+  bool tailCall(Value callee, int argCount);
   bool invokeFromClass(ObjClass* klass, ObjString* name, int argCount);
-  bool invoke(ObjString* name, int argCount);
   bool bindMethod(ObjClass* klass, ObjString* name);
-  InterpretResult run();
+  // Property accesses and invokes through the inline cache of the
+  // instruction. A miss does the full lookup and updates the cache.
+  bool invoke(ObjString* name, int argCount, InlineCache* cache);
+  bool getProperty(Value receiver,
+                   ObjString* name,
+                   InlineCache* cache,
+                   Value* result);
+  void setProperty(ObjInstance* instance,
+                   ObjString* name,
+                   Value value,
+                   InlineCache* cache);
+  // runs until the frame count drops back to baseFrame
+  InterpretResult run(int baseFrame = 0);
+  // Runtime functions of the JIT, they do what the instruction at offset
+  // does in run(). A call from machine code runs the callee right away, on
+  // a nested run() up to its return.
+  static const JitRuntime& jitRuntime();
+  static size_t jitReturn(JitState* state, size_t offset);
+  static size_t jitPrint(JitState* state, size_t offset);
+  static size_t jitCall(JitState* state, size_t offset);
+  static size_t jitInvoke(JitState* state, size_t offset);
+  size_t jitFinishCall(JitState* state, int depth);
+  // Whether a call from machine code leaves to the interpreter: past
+  // JIT_MAX_NESTING, and once a compaction is due, which must not run while
+  // machine code does.
+  bool leavesJit() const;
+  static size_t jitGetProperty(JitState* state, size_t offset);
+  static size_t jitSetProperty(JitState* state, size_t offset);
+  InterpretResult runRegisters();
   void concatenate();
   ObjUpvalue* captureUpvalue(Value* local);
   void closeUpvalues(Value* last);
   void defineMethod(ObjString* name);
+  // hands the class a new epoch, outdating the cache entries of its instances
+  void renewEpoch(ObjClass* klass);
+#ifdef DEBUG_PROFILE_OPCODES
+  void printOpcodeProfile() const;
+#endif
 
-  CallFrame frames[FRAMES_MAX];
+  std::vector<CallFrame> frames;
   int frameCount;
 
-  Value stack[STACK_MAX];
+  std::vector<Value> stack;
   Value* stackTop = nullptr;
+  // highest end of the registers of any frame since the last collection,
+  // the register engine may have left stale values up to there
+  Value* registersEnd = nullptr;
   Table strings;
 
   ObjString* initString = nullptr;
 
-  Table globals;
+  Globals globals;
   ObjUpvalue* openUpValues = nullptr;
 
   MemoryManager* mm = nullptr;
+  Engine _engine = Engine::STACK;
+  JitMode _jitMode = JitMode::HOT;
+  OptimizeMode _optimizeMode = OptimizeMode::ON;
+  TraceRecorder _recorder;
+  // states of the machine code that runs, the innermost last
+  std::vector<JitState*> _jitStates;
+  // the last epoch handed to a class, a class gets a new one when it is
+  // created or its methods change, which outdates the inline cache entries
+  // of its instances only
+  uint64_t _classEpoch = 0;
+
+#ifdef DEBUG_PROFILE_OPCODES
+  // how often each opcode was directly followed by another one, used to pick
+  // the superinstructions
+  uint64_t opcodePairs[OP_COUNT][OP_COUNT] = {};
+  uint8_t lastOpcode = OP_RETURN;
+#endif
 };
@@ -0,0 +1,300 @@
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "x64assembler.h"
+
+namespace
+{
+
+uint8_t code(Reg reg)
+{
+  return static_cast<uint8_t>(reg);
+}
+
+uint8_t code(Xmm reg)
+{
+  return static_cast<uint8_t>(reg);
+}
+
+bool isInt8(int32_t value)
+{
+  return value >= std::numeric_limits<int8_t>::min()
+      && value <= std::numeric_limits<int8_t>::max();
+}
+
+}  // namespace
+
+Label X64Assembler::newLabel()
+{
+  _labels.push_back(UNBOUND);
+  return _labels.size() - 1;
+}
+
+void X64Assembler::bind(Label label)
+{
+  assert(_labels[label] == UNBOUND);
+  _labels[label] = _code.size();
+}
+
+void X64Assembler::push(Reg reg)
+{
+  rex(false, 0, code(reg));
+  emit(0x50 + (code(reg) & 7));
+}
+
+void X64Assembler::pop(Reg reg)
+{
+  rex(false, 0, code(reg));
+  emit(0x58 + (code(reg) & 7));
+}
+
+void X64Assembler::ret()
+{
+  emit(0xc3);
+}
+
+void X64Assembler::movq(Reg dst, Reg src)
+{
+  rex(true, code(src), code(dst));
+  emit(0x89);
+  modrm(code(src), code(dst));
+}
+
+void X64Assembler::movq(Reg dst, Mem src)
+{
+  rex(true, code(dst), code(src.base));
+  emit(0x8b);
+  modrm(code(dst), src);
+}
+
+void X64Assembler::movq(Mem dst, Reg src)
+{
+  rex(true, code(src), code(dst.base));
+  emit(0x89);
+  modrm(code(src), dst);
+}
+
+void X64Assembler::movq(Reg dst, uint64_t imm)
+{
+  rex(true, 0, code(dst));
+  emit(0xb8 + (code(dst) & 7));
+  emit32(static_cast<uint32_t>(imm));
+  emit32(static_cast<uint32_t>(imm >> 32));
+}
+
+void X64Assembler::movq(Xmm dst, Reg src)
+{
+  emit(0x66);
+  rex(true, code(dst), code(src));
+  emit(0x0f);
+  emit(0x6e);
+  modrm(code(dst), code(src));
+}
+
+void X64Assembler::movq(Reg dst, Xmm src)
+{
+  emit(0x66);
+  rex(true, code(src), code(dst));
+  emit(0x0f);
+  emit(0x7e);
+  modrm(code(src), code(dst));
+}
+
+void X64Assembler::addq(Reg dst, int32_t imm)
+{
+  aluImm(0, dst, imm);
+}
+
+void X64Assembler::subq(Reg dst, int32_t imm)
+{
+  aluImm(5, dst, imm);
+}
+
+void X64Assembler::subq(Reg dst, Reg src)
+{
+  rex(true, code(src), code(dst));
+  emit(0x29);
+  modrm(code(src), code(dst));
+}
+
+void X64Assembler::andq(Reg dst, Reg src)
+{
+  rex(true, code(src), code(dst));
+  emit(0x21);
+  modrm(code(src), code(dst));
+}
+
+void X64Assembler::xorq(Reg dst, Reg src)
+{
+  rex(true, code(src), code(dst));
+  emit(0x31);
+  modrm(code(src), code(dst));
+}
+
+void X64Assembler::cmpq(Reg a, Reg b)
+{
+  rex(true, code(b), code(a));
+  emit(0x39);
+  modrm(code(b), code(a));
+}
+
+void X64Assembler::cmpq(Reg a, int32_t imm)
+{
+  aluImm(7, a, imm);
+}
+
+void X64Assembler::cmovq(Condition cond, Reg dst, Reg src)
+{
+  rex(true, code(dst), code(src));
+  emit(0x0f);
+  emit(0x40 + static_cast<uint8_t>(cond));
+  modrm(code(dst), code(src));
+}
+
+void X64Assembler::addsd(Xmm dst, Xmm src)
+{
+  sse(0xf2, 0x58, dst, src);
+}
+
+void X64Assembler::subsd(Xmm dst, Xmm src)
+{
+  sse(0xf2, 0x5c, dst, src);
+}
+
+void X64Assembler::mulsd(Xmm dst, Xmm src)
+{
+  sse(0xf2, 0x59, dst, src);
+}
+
+void X64Assembler::divsd(Xmm dst, Xmm src)
+{
+  sse(0xf2, 0x5e, dst, src);
+}
+
+void X64Assembler::ucomisd(Xmm a, Xmm b)
+{
+  sse(0x66, 0x2e, a, b);
+}
+
+void X64Assembler::jmp(Label target)
+{
+  emit(0xe9);
+  jumpTo(target);
+}
+
+void X64Assembler::jmp(Reg target)
+{
+  rex(false, 0, code(target));
+  emit(0xff);
+  modrm(4, code(target));
+}
+
+void X64Assembler::call(Reg target)
+{
+  rex(false, 0, code(target));
+  emit(0xff);
+  modrm(2, code(target));
+}
+
+void X64Assembler::j(Condition cond, Label target)
+{
+  emit(0x0f);
+  emit(0x80 + static_cast<uint8_t>(cond));
+  jumpTo(target);
+}
+
+std::vector<uint8_t> X64Assembler::finish()
+{
+  for (const auto& fixup : _fixups) {
+    assert(_labels[fixup.target] != UNBOUND);
+    const auto displacement = static_cast<uint32_t>(
+        static_cast<int64_t>(_labels[fixup.target])
+        - static_cast<int64_t>(fixup.position + 4));
+    for (size_t i = 0; i < 4; i++) {
+      _code[fixup.position + i] =
+          static_cast<uint8_t>(displacement >> (8 * i));
+    }
+  }
+  _fixups.clear();
+
+  return _code;
+}
+
+size_t X64Assembler::size() const
+{
+  return _code.size();
+}
+
+void X64Assembler::emit(uint8_t byte)
+{
+  _code.push_back(byte);
+}
+
+void X64Assembler::emit32(uint32_t value)
+{
+  for (size_t i = 0; i < 4; i++) {
+    emit(static_cast<uint8_t>(value >> (8 * i)));
+  }
+}
+
+void X64Assembler::rex(bool wide, uint8_t reg, uint8_t rm)
+{
+  const uint8_t prefix = static_cast<uint8_t>(
+      0x40 | (wide ? 0x08 : 0) | ((reg >> 3) << 2) | (rm >> 3));
+  if (prefix != 0x40) {
+    emit(prefix);
+  }
+}
+
+void X64Assembler::modrm(uint8_t reg, uint8_t rm)
+{
+  emit(static_cast<uint8_t>(0xc0 | ((reg & 7) << 3) | (rm & 7)));
+}
+
+void X64Assembler::modrm(uint8_t reg, Mem mem)
+{
+  // always with a displacement, so that rbp and r13 need no special case
+  const uint8_t base = code(mem.base) & 7;
+  const uint8_t mod = isInt8(mem.disp) ? 0x40 : 0x80;
+  emit(static_cast<uint8_t>(mod | ((reg & 7) << 3) | base));
+  if (base == code(Reg::RSP)) {
+    emit(0x24);  // SIB without index, needed for rsp and r12
+  }
+
+  if (isInt8(mem.disp)) {
+    emit(static_cast<uint8_t>(mem.disp));
+  } else {
+    emit32(static_cast<uint32_t>(mem.disp));
+  }
+}
+
+void X64Assembler::aluImm(uint8_t ext, Reg dst, int32_t imm)
+{
+  rex(true, 0, code(dst));
+  if (isInt8(imm)) {
+    emit(0x83);
+    modrm(ext, code(dst));
+    emit(static_cast<uint8_t>(imm));
+  } else {
+    emit(0x81);
+    modrm(ext, code(dst));
+    emit32(static_cast<uint32_t>(imm));
+  }
+}
+
+void X64Assembler::sse(uint8_t prefix, uint8_t opcode, Xmm dst, Xmm src)
+{
+  emit(prefix);
+  rex(false, code(dst), code(src));
+  emit(0x0f);
+  emit(opcode);
+  modrm(code(dst), code(src));
+}
+
+void X64Assembler::jumpTo(Label target)
+{
+  _fixups.push_back(Fixup {_code.size(), target});
+  emit32(0);
+}
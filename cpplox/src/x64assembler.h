@@ -0,0 +1,123 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "common.h"
+
+// General purpose registers, numbered as in the instruction encoding.
+enum class Reg : uint8_t
+{
+  RAX,
+  RCX,
+  RDX,
+  RBX,
+  RSP,
+  RBP,
+  RSI,
+  RDI,
+  R8,
+  R9,
+  R10,
+  R11,
+  R12,
+  R13,
+  R14,
+  R15,
+};
+
+enum class Xmm : uint8_t
+{
+  XMM0,
+  XMM1,
+};
+
+// Condition codes of jcc and cmovcc, after a cmp or ucomisd.
+enum class Condition : uint8_t
+{
+  BELOW = 0x2,
+  EQUAL = 0x4,
+  NOT_EQUAL = 0x5,
+  BELOW_EQUAL = 0x6,
+  ABOVE = 0x7,
+  PARITY = 0xa,
+};
+
+// 64 bit memory operand [base + disp].
+struct Mem
+{
+  Reg base;
+  int32_t disp;
+};
+
+// Position in the code that jumps can target before it is bound.
+using Label = size_t;
+
+// Encodes the handful of x86-64 instructions the JIT needs into a byte
+// buffer. Register operands are 64 bit, jumps always take a 32 bit
+// displacement and are patched by finish().
+class X64Assembler
+{
+public:
+  Label newLabel();
+  void bind(Label label);
+
+  void push(Reg reg);
+  void pop(Reg reg);
+  void ret();
+
+  void movq(Reg dst, Reg src);
+  void movq(Reg dst, Mem src);
+  void movq(Mem dst, Reg src);
+  void movq(Reg dst, uint64_t imm);
+  void movq(Xmm dst, Reg src);
+  void movq(Reg dst, Xmm src);
+
+  void addq(Reg dst, int32_t imm);
+  void subq(Reg dst, int32_t imm);
+  void subq(Reg dst, Reg src);
+  void andq(Reg dst, Reg src);
+  void xorq(Reg dst, Reg src);
+  void cmpq(Reg a, Reg b);
+  void cmpq(Reg a, int32_t imm);
+  void cmovq(Condition cond, Reg dst, Reg src);
+
+  void addsd(Xmm dst, Xmm src);
+  void subsd(Xmm dst, Xmm src);
+  void mulsd(Xmm dst, Xmm src);
+  void divsd(Xmm dst, Xmm src);
+  void ucomisd(Xmm a, Xmm b);
+
+  void jmp(Label target);
+  void jmp(Reg target);
+  void call(Reg target);
+  void j(Condition cond, Label target);
+
+  // patches the jumps, all labels they target have to be bound
+  std::vector<uint8_t> finish();
+
+  size_t size() const;
+
+private:
+  void emit(uint8_t byte);
+  void emit32(uint32_t value);
+  void rex(bool wide, uint8_t reg, uint8_t rm);
+  void modrm(uint8_t reg, uint8_t rm);
+  void modrm(uint8_t reg, Mem mem);
+  void aluImm(uint8_t ext, Reg dst, int32_t imm);
+  void sse(uint8_t prefix, uint8_t opcode, Xmm dst, Xmm src);
+  void jumpTo(Label target);
+
+  static constexpr size_t UNBOUND = SIZE_MAX;
+
+  std::vector<uint8_t> _code;
+  std::vector<size_t> _labels;  // label -> position, UNBOUND until bound
+
+  struct Fixup
+  {
+    size_t position;  // of the 32 bit displacement
+    Label target;
+  };
+  std::vector<Fixup> _fixups;
+};
@@ -46,6 +46,41 @@ foo.bar();  // expect runtime error: Can only call functions and classes.
 );-]");
 }
 
+TEST_F(Field, field_order)
+{
+  run(R";-](
+class Point {}
+
+fun describe(p)
+{
+  print p.x + p.y;
+}
+
+// both orders end up with different shapes of the same class
+var a = Point();
+a.x = 1;
+a.y = 2;
+
+var b = Point();
+b.y = 20;
+b.x = 10;
+
+describe(a);  // expect: 3
+describe(b);  // expect: 30
+describe(a);  // expect: 3
+
+// more fields than fit into the instance itself
+b.a = "a";
+b.b = "b";
+b.c = "c";
+b.d = "d";
+b.x = 100;
+print b.a + b.b + b.c + b.d;  // expect: abcd
+describe(b);  // expect: 120
+print a.x;  // expect: 1
+);-]");
+}
+
 TEST_F(Field, get_and_set_method)
 {
   run(R";-](
@@ -126,6 +161,72 @@ TEST_F(Field, get_on_string)
 );-]");
 }
 
+TEST_F(Field, inline_cache)
+{
+  run(R";-](
+class A
+{
+  init() { this.x = "a"; }
+  name() { return "A"; }
+}
+
+class B
+{
+  init()
+  {
+    this.y = 0;
+    this.x = "b";
+  }
+  name() { return "B"; }
+}
+
+fun show(obj)
+{
+  print obj.x;
+  print obj.name();
+}
+
+// the same instructions see different classes
+show(A());
+// expect: a
+// expect: A
+show(B());
+// expect: b
+// expect: B
+show(A());
+// expect: a
+// expect: A
+
+// a field shadows the cached method
+var a = A();
+show(a);
+// expect: a
+// expect: A
+fun shadow() { return "field"; }
+a.name = shadow;
+show(a);
+// expect: a
+// expect: field
+
+// a new class at every iteration
+for (var i = 0; i < 3; i = i + 1) {
+  class C
+  {
+    name() { return i; }
+  }
+  var c = C();
+  c.x = "c";
+  show(c);
+}
+// expect: c
+// expect: 0
+// expect: c
+// expect: 1
+// expect: c
+// expect: 2
+);-]");
+}
+
 TEST_F(Field, many)
 {
   run(R";-](
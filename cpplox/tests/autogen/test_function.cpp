@@ -17,6 +17,21 @@ fun f() 123;
 );-]");
 }
 
+TEST_F(Function, deep_recursion)
+{
+  run(R";-](
+// the stack grows and moves while frames and open upvalues point into it
+fun sum(n)
+{
+  if (n == 0) return 0;
+  fun get() { return n; }
+  var result = sum(n - 1) + get();
+  return result;
+}
+print sum(10000) == 50005000;  // expect: true
+);-]");
+}
+
 TEST_F(Function, empty_body)
 {
   run(R";-](
@@ -32,6 +32,39 @@ if (true)
 );-]");
 }
 
+TEST_F(If, constant_condition)
+{
+  run(R";-](
+// Branches on literals, and branches that end in other branches.
+if (true) print "true"; else print "not true"; // expect: true
+if (nil) print "nil"; else print "not nil"; // expect: not nil
+if (1 < 2) print "less"; // expect: less
+if (!!0) print "zero"; // expect: zero
+while (false) print "never";
+print true and 1 and "and"; // expect: and
+print nil or false or "or"; // expect: or
+
+fun size(n) {
+  if (n > 1) {
+    if (n > 2) {
+      return "big";
+    } else {
+      print "mid";
+    }
+  } else {
+    return "small";
+  }
+  return "not big";
+  print "unreachable";
+}
+print size(3); // expect: big
+print size(2);
+// expect: mid
+// expect: not big
+print size(1); // expect: small
+);-]");
+}
+
 TEST_F(If, dangling_else)
 {
   run(R";-](
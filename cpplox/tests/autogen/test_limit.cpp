@@ -30,9 +30,325 @@ while (false) {
   run(source.c_str());
 }
 
-TEST_F(Limit, no_reuse_constants)
+TEST_F(Limit, many_constants)
 {
   run(R";-](
+class A
+{
+  init(x) { this.x = x; }
+  get() { return this.x; }
+}
+
+class B < A
+{
+  get()
+  {
+    0;
+    1;
+    2;
+    3;
+    4;
+    5;
+    6;
+    7;
+    8;
+    9;
+    10;
+    11;
+    12;
+    13;
+    14;
+    15;
+    16;
+    17;
+    18;
+    19;
+    20;
+    21;
+    22;
+    23;
+    24;
+    25;
+    26;
+    27;
+    28;
+    29;
+    30;
+    31;
+    32;
+    33;
+    34;
+    35;
+    36;
+    37;
+    38;
+    39;
+    40;
+    41;
+    42;
+    43;
+    44;
+    45;
+    46;
+    47;
+    48;
+    49;
+    50;
+    51;
+    52;
+    53;
+    54;
+    55;
+    56;
+    57;
+    58;
+    59;
+    60;
+    61;
+    62;
+    63;
+    64;
+    65;
+    66;
+    67;
+    68;
+    69;
+    70;
+    71;
+    72;
+    73;
+    74;
+    75;
+    76;
+    77;
+    78;
+    79;
+    80;
+    81;
+    82;
+    83;
+    84;
+    85;
+    86;
+    87;
+    88;
+    89;
+    90;
+    91;
+    92;
+    93;
+    94;
+    95;
+    96;
+    97;
+    98;
+    99;
+    100;
+    101;
+    102;
+    103;
+    104;
+    105;
+    106;
+    107;
+    108;
+    109;
+    110;
+    111;
+    112;
+    113;
+    114;
+    115;
+    116;
+    117;
+    118;
+    119;
+    120;
+    121;
+    122;
+    123;
+    124;
+    125;
+    126;
+    127;
+    128;
+    129;
+    130;
+    131;
+    132;
+    133;
+    134;
+    135;
+    136;
+    137;
+    138;
+    139;
+    140;
+    141;
+    142;
+    143;
+    144;
+    145;
+    146;
+    147;
+    148;
+    149;
+    150;
+    151;
+    152;
+    153;
+    154;
+    155;
+    156;
+    157;
+    158;
+    159;
+    160;
+    161;
+    162;
+    163;
+    164;
+    165;
+    166;
+    167;
+    168;
+    169;
+    170;
+    171;
+    172;
+    173;
+    174;
+    175;
+    176;
+    177;
+    178;
+    179;
+    180;
+    181;
+    182;
+    183;
+    184;
+    185;
+    186;
+    187;
+    188;
+    189;
+    190;
+    191;
+    192;
+    193;
+    194;
+    195;
+    196;
+    197;
+    198;
+    199;
+    200;
+    201;
+    202;
+    203;
+    204;
+    205;
+    206;
+    207;
+    208;
+    209;
+    210;
+    211;
+    212;
+    213;
+    214;
+    215;
+    216;
+    217;
+    218;
+    219;
+    220;
+    221;
+    222;
+    223;
+    224;
+    225;
+    226;
+    227;
+    228;
+    229;
+    230;
+    231;
+    232;
+    233;
+    234;
+    235;
+    236;
+    237;
+    238;
+    239;
+    240;
+    241;
+    242;
+    243;
+    244;
+    245;
+    246;
+    247;
+    248;
+    249;
+    250;
+    251;
+    252;
+    253;
+    254;
+    255;
+    256;
+    257;
+    258;
+    259;
+    260;
+    261;
+    262;
+    263;
+    264;
+    265;
+    266;
+    267;
+    268;
+    269;
+    270;
+    271;
+    272;
+    273;
+    274;
+    275;
+    276;
+    277;
+    278;
+    279;
+    280;
+    281;
+    282;
+    283;
+    284;
+    285;
+    286;
+    287;
+    288;
+    289;
+    290;
+    291;
+    292;
+    293;
+    294;
+    295;
+    296;
+    297;
+    298;
+    299;
+
+    var method = super.get;
+    return method() + super.get();
+  }
+}
+
 fun f()
 {
   0;
@@ -291,41 +607,67 @@ fun f()
   253;
   254;
   255;
-
-  1;  // Error at '1': Too many constants in one chunk.
-}
-);-]");
-}
-
-TEST_F(Limit, stack_overflow)
-{
-  run(R";-](
-fun foo()
-{
-  var a1;
-  var a2;
-  var a3;
-  var a4;
-  var a5;
-  var a6;
-  var a7;
-  var a8;
-  var a9;
-  var a10;
-  var a11;
-  var a12;
-  var a13;
-  var a14;
-  var a15;
-  var a16;
-  foo();  // expect runtime error: Stack overflow.
+  256;
+  257;
+  258;
+  259;
+  260;
+  261;
+  262;
+  263;
+  264;
+  265;
+  266;
+  267;
+  268;
+  269;
+  270;
+  271;
+  272;
+  273;
+  274;
+  275;
+  276;
+  277;
+  278;
+  279;
+  280;
+  281;
+  282;
+  283;
+  284;
+  285;
+  286;
+  287;
+  288;
+  289;
+  290;
+  291;
+  292;
+  293;
+  294;
+  295;
+  296;
+  297;
+  298;
+  299;
+
+  class C < B {}
+  var c = C(300);
+  c.y = 301;
+  fun g() { return c.y; }
+
+  print c.x;  // expect: 300
+  print g();  // expect: 301
+  print c.get();  // expect: 600
+  print "wide";  // expect: wide
 }
 
-foo();
+f();
 );-]");
 }
 
-TEST_F(Limit, too_many_constants)
+TEST_F(Limit, reuse_constants)
 {
   run(R";-](
 fun f()
@@ -587,11 +929,64 @@ fun f()
   254;
   255;
 
-  "oops";  // Error at '"oops"': Too many constants in one chunk.
+  return 1;  // reuses the constant of the first 1
+}
+
+print f();  // expect: 1
+);-]");
+}
+
+TEST_F(Limit, stack_overflow)
+{
+  run(R";-](
+fun foo()
+{
+  var a1;
+  var a2;
+  var a3;
+  var a4;
+  var a5;
+  var a6;
+  var a7;
+  var a8;
+  var a9;
+  var a10;
+  var a11;
+  var a12;
+  var a13;
+  var a14;
+  var a15;
+  var a16;
+  foo();  // expect runtime error: Stack overflow.
 }
+
+foo();
 );-]");
 }
 
+TEST_F(Limit, too_many_constants)
+{
+  const std::string source_part_1 = R";-](
+fun f()
+{
+);-]";
+
+  const std::string source_part_2 = R";-](
+  "oops";  // Error at '"oops"': Too many constants in one chunk.
+}
+);-]";
+
+  std::string source = source_part_1;
+
+  for (int i = 0; i < 65536; i++) {
+    source.append(std::to_string(i) + ";");
+  }
+
+  source.append(source_part_2);
+
+  run(source.c_str());
+}
+
 TEST_F(Limit, too_many_locals)
 {
   run(R";-](
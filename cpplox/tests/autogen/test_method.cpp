@@ -64,6 +64,66 @@ print foo.method8(1, 2, 3, 4, 5, 6, 7, 8);  // expect: 36
 );-]");
 }
 
+TEST_F(Method, cached_across_classes)
+{
+  run(R";-](
+class A
+{
+  name()
+  {
+    return "A";
+  }
+}
+
+fun callName(object) { return object.name(); }
+
+// the call caches A.name, declaring other classes keeps it
+print callName(A());  // expect: A
+
+class B
+{
+  name()
+  {
+    return "B";
+  }
+}
+
+print callName(A());  // expect: A
+print callName(B());  // expect: B
+print callName(A());  // expect: A
+
+// a new class every time through the same call
+var names = "";
+for (var i = 0; i < 100; i = i + 1) {
+  class C
+  {
+    name()
+    {
+      return "C";
+    }
+  }
+  names = callName(C());
+}
+print names;          // expect: C
+print callName(B());  // expect: B
+
+// the entries of the dead classes make room for a class declared after them
+class D
+{
+  name()
+  {
+    return "D";
+  }
+}
+
+names = "";
+for (var i = 0; i < 100; i = i + 1) {
+  names = callName(D());
+}
+print names;          // expect: D
+);-]");
+}
+
 TEST_F(Method, empty_block)
 {
   run(R";-](
@@ -37,6 +37,19 @@ print "str" + "ing";  // expect: string
 );-]");
 }
 
+TEST_F(Operator, add_local_negate)
+{
+  run(R";-](
+{
+  var a = 1;
+  var b = 2;
+  print a + -b;  // expect: -1
+  print b - -a;  // expect: 3
+  print a + !b;  // expect runtime error: Operands must be two numbers or two strings.
+}
+);-]");
+}
+
 TEST_F(Operator, add_nil_nil)
 {
   run(R";-](
@@ -51,6 +64,24 @@ TEST_F(Operator, add_num_nil)
 );-]");
 }
 
+TEST_F(Operator, add_polymorphic_loop)
+{
+  run(R";-](
+fun add(a, b) { return a + b; }
+
+// the same instruction adds numbers and strings in turn, over and over
+var total = 0;
+var text = "";
+for (var i = 0; i < 1000; i = i + 1) {
+  total = add(total, 1);
+  text = add("a", "b");
+}
+print total;        // expect: 1000
+print text;         // expect: ab
+print add(1, "a");  // expect runtime error: Operands must be two numbers or two strings.
+);-]");
+}
+
 TEST_F(Operator, add_string_nil)
 {
   run(R";-](
@@ -58,6 +89,21 @@ TEST_F(Operator, add_string_nil)
 );-]");
 }
 
+TEST_F(Operator, add_type_change)
+{
+  run(R";-](
+fun add(a, b) { return a + b; }
+
+// the same instruction adds numbers, then strings, then numbers again
+print add(1, 2);      // expect: 3
+print add(3, 4);      // expect: 7
+print add("a", "b");  // expect: ab
+print add("c", "d");  // expect: cd
+print add(5, 6);      // expect: 11
+print add(1, "a");    // expect runtime error: Operands must be two numbers or two strings.
+);-]");
+}
+
 TEST_F(Operator, comparison)
 {
   run(R";-](
@@ -89,6 +135,25 @@ print - 0 >= 0;  // expect: true
 );-]");
 }
 
+TEST_F(Operator, constant_folding)
+{
+  run(R";-](
+// Operators on literals give the same results as on variables.
+print -1 + 2 * 3; // expect: 5
+print (1 - 4) / 2; // expect: -1.5
+print -0; // expect: -0
+print 1 / 0; // expect: inf
+print 0 / 0 == 0 / 0; // expect: false
+print !!nil; // expect: false
+print !!!0; // expect: false
+print 1 < 2 == 2 > 1; // expect: true
+print "a" == "a"; // expect: true
+print nil == false; // expect: false
+print "a" + "b"; // expect: ab
+print 1 + "a"; // expect runtime error: Operands must be two numbers or two strings.
+);-]");
+}
+
 TEST_F(Operator, divide)
 {
   run(R";-](
@@ -97,3 +97,46 @@ fun f()
 print f();  // expect: nil
 );-]");
 }
+
+TEST_F(Return, tail_call)
+{
+  run(R";-](
+// tail calls reuse the frame of the caller
+fun count(n, total)
+{
+  if (n == 0) return total;
+  return count(n - 1, total + 1);
+}
+print count(100000, 0);  // expect: 100000
+
+fun isEven(n)
+{
+  if (n == 0) return true;
+  return isOdd(n - 1);
+}
+fun isOdd(n)
+{
+  if (n == 0) return false;
+  return isEven(n - 1);
+}
+print isEven(10001);  // expect: false
+
+// the caller's locals are closed over before the callee takes its slots
+fun apply(f) { return f(); }
+fun capture(n)
+{
+  var captured = n;
+  fun get() { return captured; }
+  return apply(get);
+}
+print capture("captured");  // expect: captured
+
+// callees that are not closures return as usual
+class Foo {}
+fun make() { return Foo(); }
+print make();  // expect: Foo instance
+
+fun wrongArity() { return count(1); }
+wrongArity();  // expect runtime error: Expected 2 arguments but got 1.
+);-]");
+}
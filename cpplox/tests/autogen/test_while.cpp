@@ -131,6 +131,38 @@ while (false)
 );-]");
 }
 
+TEST_F(While, type_change)
+{
+  run(R";-](
+// Variables and branches that change while the loop runs.
+var i = 0;
+var total = 0;
+var label = "none";
+while (i < 6) {
+  if (i == 3) total = "three";
+  else if (i < 3) total = total + i;
+  else total = total + "!";
+  if (i > 4) label = i;
+  i = i + 1;
+}
+print total; // expect: three!!
+print label; // expect: 5
+
+fun count(n) {
+  var sum = 0;
+  var j = 0;
+  while (j < n) {
+    sum = sum + j; // expect runtime error: Operands must be two numbers or two strings.
+    j = j + 1;
+    if (j == 4) sum = nil;
+  }
+  return sum;
+}
+print count(3); // expect: 3
+print count(5);
+);-]");
+}
+
 TEST_F(While, var_in_body)
 {
   run(R";-](
@@ -1,4 +1,5 @@
 #include <algorithm>
+#include <cstdlib>
 #include <iostream>
 #include <iterator>
 #include <optional>
@@ -54,6 +55,28 @@ struct Result
   std::string stderrOutput;
 };
 
+// the whole suite runs once per engine, see tests/CMakeLists.txt
+Engine engine()
+{
+  const char* name = std::getenv("LOX_ENGINE");
+  if (name != nullptr && std::string_view {name} == "register") {
+    return Engine::REGISTER;
+  }
+
+  return Engine::STACK;
+}
+
+// and once more with every function compiled by the JIT on its first call
+JitMode jitMode()
+{
+  const char* mode = std::getenv("LOX_JIT");
+  if (mode != nullptr && std::string_view {mode} == "always") {
+    return JitMode::ALWAYS;
+  }
+
+  return JitMode::HOT;
+}
+
 Result run_impl(const char* source)
 {
   std::stringstream stderrstream, stdoutstream;
@@ -64,7 +87,8 @@ Result run_impl(const char* source)
   std::cout.rdbuf(stdoutstream.rdbuf());
   std::cerr.rdbuf(stderrstream.rdbuf());
 
-  VM vm;
+  VM vm {engine()};
+  vm.setJitMode(jitMode());
 
   auto res = vm.interpret(source);
 
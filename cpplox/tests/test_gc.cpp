@@ -0,0 +1,453 @@
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "gc.h"
+#include "graydeque.h"
+#include "heap.h"
+#include "objinstance.h"
+#include "objnative.h"
+#include "vm.h"
+
+namespace
+{
+
+// Builds a list that outgrows the first major collection, with garbage made
+// along the way, and checks that every node survived.
+const char* LIST_PROGRAM = R";-](
+class Node {
+  init(value, next) {
+    this.value = value;
+    this.next = next;
+  }
+}
+
+var head = nil;
+for (var i = 0; i < 60000; i = i + 1) {
+  head = Node(i, head);
+  Node("garbage", nil);
+  head.label = "node" + "s";
+}
+
+var sum = 0;
+var count = 0;
+while (head != nil) {
+  sum = sum + head.value;
+  if (head.label == "nodes") count = count + 1;
+  head = head.next;
+}
+print sum == 1799970000;
+print count;
+);-]";
+
+// Builds a list of which every tenth node stays alive, with a bound method,
+// a closure and a string, and makes garbage until the list got collected.
+// The pages of the list are left sparse.
+const char* SPARSE_PROGRAM = R";-](
+class Node {
+  init(value, next) {
+    this.value = value;
+    this.next = next;
+  }
+
+  get() { return this.value; }
+}
+
+fun counter(start) {
+  var count = start;
+  fun next() {
+    count = count + 1;
+    return count;
+  }
+  return next;
+}
+
+var list = nil;
+var kept = nil;
+var k = 0;
+for (var i = 0; i < 60000; i = i + 1) {
+  list = Node(i, list);
+  k = k + 1;
+  if (k == 10) {
+    k = 0;
+    kept = Node(Node(i, nil).get, kept);
+    kept.next2 = counter(i);
+    kept.label = "node " + "kept";
+  }
+}
+list = nil;
+
+for (var round = 0; round < 30; round = round + 1) {
+  var garbage = nil;
+  for (var i = 0; i < 5000; i = i + 1) {
+    garbage = Node(i, garbage);
+  }
+}
+
+var sum = 0;
+var count = 0;
+while (kept != nil) {
+  sum = sum + kept.value() + kept.next2();
+  if (kept.label == "node kept") count = count + 1;
+  kept = kept.next;
+}
+print sum;
+print count;
+);-]";
+
+// Holds on to more and more objects until the heap runs out, in a local
+// that is gone once the program stopped.
+const char* GROWING_PROGRAM = R";-](
+class Node {
+  init(next) {
+    this.next = next;
+  }
+}
+
+{
+  var list = nil;
+  while (true) {
+    list = Node(list);
+  }
+}
+);-]";
+
+struct GcRun
+{
+  InterpretResult result;
+  std::string output;
+  size_t pauses;
+};
+
+GcRun run(const char* source, const GcOptions& options)
+{
+  std::stringstream output;
+  auto oldstdout = std::cout.rdbuf(output.rdbuf());
+
+  VM vm;
+  vm.setGcOptions(options);
+  const InterpretResult result = vm.interpret(source);
+
+  std::cout.rdbuf(oldstdout);
+  return GcRun {result, output.str(), vm.gcPauses().count()};
+}
+
+}  // namespace
+
+TEST(Gc, stop_the_world_keeps_reachable_objects)
+{
+  const GcRun result = run(LIST_PROGRAM, GcOptions {});
+
+  EXPECT_EQ(result.result, InterpretResult::OK);
+  EXPECT_EQ(result.output, "true\n60000\n");
+  EXPECT_GT(result.pauses, 0u);
+}
+
+TEST(Gc, incremental_keeps_reachable_objects)
+{
+  GcOptions options;
+  options.mode = GcMode::INCREMENTAL;
+  options.sliceBudget = 16;
+  const GcRun incremental = run(LIST_PROGRAM, options);
+
+  EXPECT_EQ(incremental.result, InterpretResult::OK);
+  EXPECT_EQ(incremental.output, "true\n60000\n");
+  // the marking is spread over slices
+  EXPECT_GT(incremental.pauses, run(LIST_PROGRAM, GcOptions {}).pauses);
+}
+
+TEST(Gc, concurrent_keeps_reachable_objects)
+{
+  GcOptions options;
+  options.mode = GcMode::CONCURRENT;
+  const GcRun concurrent = run(LIST_PROGRAM, options);
+
+  EXPECT_EQ(concurrent.result, InterpretResult::OK);
+  EXPECT_EQ(concurrent.output, "true\n60000\n");
+}
+
+TEST(Gc, compaction_keeps_reachable_objects)
+{
+  const GcRun plain = run(SPARSE_PROGRAM, GcOptions {});
+  EXPECT_EQ(plain.result, InterpretResult::OK);
+  EXPECT_EQ(plain.output, "3.60054e+08\n6000\n");
+
+  GcOptions options;
+  options.compact = true;
+  const GcRun compacted = run(SPARSE_PROGRAM, options);
+
+  EXPECT_EQ(compacted.result, InterpretResult::OK);
+  EXPECT_EQ(compacted.output, plain.output);
+  // the compaction is a pause of its own
+  EXPECT_GT(compacted.pauses, plain.pauses);
+}
+
+TEST(Gc, heap_limit_stops_the_program_and_the_vm_goes_on)
+{
+  for (const GcMode mode :
+       {GcMode::STOP_THE_WORLD, GcMode::INCREMENTAL, GcMode::CONCURRENT})
+  {
+    GcOptions options;
+    options.mode = mode;
+    options.heapLimit = 16u * 1024u * 1024u;
+
+    std::stringstream output;
+    auto oldstdout = std::cout.rdbuf(output.rdbuf());
+    VM vm;
+    vm.setGcOptions(options);
+    const InterpretResult grown = vm.interpret(GROWING_PROGRAM);
+    const InterpretResult list = vm.interpret(LIST_PROGRAM);
+    std::cout.rdbuf(oldstdout);
+
+    EXPECT_EQ(grown, InterpretResult::RUNTIME_ERROR);
+    EXPECT_EQ(list, InterpretResult::OK);
+    EXPECT_EQ(output.str(), "true\n60000\n");
+  }
+}
+
+TEST(Gc, heap_limit_counts_the_buffers_of_objects)
+{
+  // a few objects, but their characters take 16 MiB
+  const char* source = R";-](
+var s = "x";
+for (var i = 0; i < 24; i = i + 1) {
+  s = s + s;
+}
+print "done";
+);-]";
+
+  GcOptions options;
+  EXPECT_EQ(run(source, options).output, "done\n");
+  options.heapLimit = 4u * 1024u * 1024u;
+  EXPECT_EQ(run(source, options).result, InterpretResult::RUNTIME_ERROR);
+}
+
+TEST(Gc, stats_count_collections_bytes_and_live_objects)
+{
+  // keeps 60000 nodes and their labels, which were not interned, and makes
+  // garbage until a few major collections ran
+  const char* source = R";-](
+class Node {
+  init(next) {
+    this.next = next;
+  }
+}
+
+var kept = nil;
+for (var i = 0; i < 60000; i = i + 1) {
+  kept = Node(kept);
+  kept.label = "node" + "s";
+}
+for (var i = 0; i < 500000; i = i + 1) {
+  Node(nil);
+}
+);-]";
+
+  for (const GcMode mode :
+       {GcMode::STOP_THE_WORLD, GcMode::INCREMENTAL, GcMode::CONCURRENT})
+  {
+    GcOptions options;
+    options.mode = mode;
+    VM vm;
+    vm.setGcOptions(options);
+    ASSERT_EQ(vm.interpret(source), InterpretResult::OK);
+    const GcStats stats = vm.gcStats();
+
+    EXPECT_GT(stats.minorCollections, stats.majorCollections);
+    EXPECT_GT(stats.majorCollections, 0u);
+    EXPECT_EQ(stats.compactions, 0u);
+    EXPECT_EQ(stats.bytesAllocated, stats.bytesFreed + stats.heapBytes);
+    // the garbage left in the nursery is not freed yet
+    EXPECT_GT(stats.bytesFreed, 400000u * sizeof(ObjInstance));
+
+    const GcCensus& instances =
+        stats.live[static_cast<size_t>(ObjType::INSTANCE)];
+    EXPECT_GE(instances.objects, 60000u);
+    EXPECT_EQ(instances.bytes, instances.objects * sizeof(ObjInstance));
+    const GcCensus& strings =
+        stats.live[static_cast<size_t>(ObjType::STRING)];
+    EXPECT_GE(strings.objects, 1u);
+    EXPECT_GE(stats.internedStrings, strings.objects);
+
+    size_t bucketed = 0;
+    for (size_t count : vm.gcPauses().histogram()) {
+      bucketed += count;
+    }
+    EXPECT_EQ(bucketed, vm.gcPauses().count());
+  }
+}
+
+TEST(Gc, intern_table_counts_tombstones)
+{
+  // every minor collection starts a major one
+  GcOptions options;
+  options.initialThreshold = 1;
+  options.growthFactor = 1.0;
+  VM vm;
+  vm.setGcOptions(options);
+  ASSERT_EQ(vm.interpret("var s = \"a\" + \"b\"; s = nil;"),
+            InterpretResult::OK);
+  EXPECT_EQ(vm.gcStats().internTombstones, 0u);
+
+  // a major collection frees "ab", which leaves a tombstone
+  ASSERT_EQ(vm.interpret(
+                "class A {} for (var i = 0; i < 300000; i = i + 1) A();"),
+            InterpretResult::OK);
+  const GcStats stats = vm.gcStats();
+  EXPECT_GT(stats.majorCollections, 0u);
+  EXPECT_GT(stats.internTombstones, 0u);
+}
+
+TEST(Gc, pause_percentiles)
+{
+  GcPauses pauses;
+  EXPECT_EQ(pauses.percentile(50), GcPauses::Duration {0});
+
+  for (int i = 100; i > 0; i--) {
+    pauses.add(GcPauses::Duration {i});
+  }
+
+  EXPECT_EQ(pauses.count(), 100u);
+  EXPECT_EQ(pauses.total(), GcPauses::Duration {5050});
+  EXPECT_EQ(pauses.max(), GcPauses::Duration {100});
+  EXPECT_EQ(pauses.percentile(0), GcPauses::Duration {1});
+  EXPECT_EQ(pauses.percentile(50), GcPauses::Duration {50});
+  EXPECT_EQ(pauses.percentile(99), GcPauses::Duration {99});
+  EXPECT_EQ(pauses.percentile(100), GcPauses::Duration {100});
+}
+
+TEST(Gc, parallel_marking_keeps_reachable_objects)
+{
+  GcOptions options;
+  options.markThreads = 4;
+  const GcRun parallel = run(LIST_PROGRAM, options);
+
+  EXPECT_EQ(parallel.result, InterpretResult::OK);
+  EXPECT_EQ(parallel.output, "true\n60000\n");
+}
+
+TEST(Gc, gray_deque_steals_what_the_owner_does_not_pop)
+{
+  constexpr int COUNT = 100000;
+  std::deque<ObjNative> objects;
+  for (int i = 0; i < COUNT; i++) {
+    objects.emplace_back(nullptr);
+  }
+
+  GrayDeque deque;
+  std::atomic<bool> pushed {false};
+  std::atomic<int> stolen {0};
+  std::thread thief([&]() {
+    while (!pushed || !deque.empty()) {
+      if (deque.steal() != nullptr) {
+        stolen++;
+      }
+    }
+  });
+
+  // pushes all of them, it grows the deque, and pops every other one
+  int popped = 0;
+  for (int i = 0; i < COUNT; i++) {
+    deque.push(&objects[i]);
+    if (i % 2 == 0 && deque.pop() != nullptr) {
+      popped++;
+    }
+  }
+  pushed = true;
+  while (deque.pop() != nullptr) {
+    popped++;
+  }
+  thief.join();
+
+  EXPECT_EQ(popped + stolen, COUNT);
+}
+
+TEST(Gc, heap_sweeps_unmarked_slots_and_reuses_empty_pages)
+{
+  size_t destroyed = 0;
+  Heap heap(
+      [](void*, void* count) { (*static_cast<size_t*>(count))++; },
+      &destroyed);
+  std::vector<void*> slots;
+  for (int i = 0; i < 10000; i++) {
+    slots.push_back(heap.allocate(40));
+  }
+  const size_t pages = heap.pageCount();
+  EXPECT_GT(pages, 1u);
+  // rounded up to whole granules
+  EXPECT_EQ(Page::of(slots[0])->slotSize(), 48u);
+
+  for (size_t i = 0; i < slots.size(); i += 2) {
+    Page::of(slots[i])->setMarked(slots[i], true);
+  }
+  heap.startSweeping();
+  EXPECT_TRUE(heap.sweeping());
+
+  // allocation sweeps as it needs free slots, and the freed ones get used
+  // again before the heap grows
+  heap.allocate(48);
+  EXPECT_GT(destroyed, 0u);
+  EXPECT_LT(destroyed, slots.size() / 2);
+  for (size_t i = 1; i < slots.size() / 2; i++) {
+    heap.allocate(48);
+  }
+  EXPECT_EQ(heap.pageCount(), pages);
+  heap.finishSweeping();
+  EXPECT_FALSE(heap.sweeping());
+  EXPECT_EQ(destroyed, slots.size() / 2);
+  EXPECT_EQ(Page::of(slots[0])->markState(slots[0]), Page::WHITE);
+
+  // a page that gets empty is used for another size
+  heap.startSweeping();
+  heap.finishSweeping();
+  EXPECT_EQ(heap.pageCount(), 0u);
+  void* other = heap.allocate(200);
+  EXPECT_EQ(Page::of(other)->slotSize(), 208u);
+  EXPECT_EQ(heap.pageCount(), 1u);
+}
+
+TEST(Gc, heap_evacuates_sparse_pages)
+{
+  Heap heap([](void*, void*) {}, nullptr);
+  std::vector<void*> slots;
+  for (size_t i = 0; i < 10000; i++) {
+    slots.push_back(heap.allocate(32));
+    *static_cast<size_t*>(slots.back()) = i;
+  }
+
+  // every tenth slot survives, the first ones pin their page
+  const Page* pinned = Page::of(slots[0]);
+  for (size_t i = 0; i < slots.size(); i += 10) {
+    Page::of(slots[i])->setMarked(slots[i], true);
+  }
+  heap.startSweeping();
+  heap.finishSweeping();
+  const size_t pages = heap.pageCount();
+  EXPECT_GT(heap.fragmentation(), 0.5);
+
+  heap.evacuate(
+      [](const void* slot) { return *static_cast<const size_t*>(slot) >= 100; },
+      [](void* from, void* to, void*) {
+        *static_cast<size_t*>(to) = *static_cast<size_t*>(from);
+      });
+  for (size_t i = 0; i < slots.size(); i += 10) {
+    void* slot = Heap::forwarded(slots[i]);
+    EXPECT_EQ(*static_cast<size_t*>(slot), i);
+    EXPECT_EQ(Page::of(slot) == pinned, Page::of(slots[i]) == pinned);
+  }
+  heap.finishEvacuation();
+
+  // the thousand survivors fill two pages, the pinned one stays
+  EXPECT_LT(heap.pageCount(), pages);
+  EXPECT_LE(heap.pageCount(), 3u);
+  size_t objects = 0;
+  heap.forEachObject([&objects](void*) { objects++; });
+  EXPECT_EQ(objects, slots.size() / 10);
+}
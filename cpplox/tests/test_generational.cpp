@@ -0,0 +1,124 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "vm.h"
+
+namespace
+{
+
+struct LoxRun
+{
+  InterpretResult result;
+  std::string output;
+};
+
+LoxRun run(const char* source)
+{
+  std::stringstream output;
+  auto oldstdout = std::cout.rdbuf(output.rdbuf());
+
+  VM vm;
+  const InterpretResult result = vm.interpret(source);
+
+  std::cout.rdbuf(oldstdout);
+  return LoxRun {result, output.str()};
+}
+
+}  // namespace
+
+TEST(Generational, old_object_keeps_young_field)
+{
+  // the garbage fills the nursery, the first loop promotes the box and the
+  // second one runs minor collections while it points at a young string
+  const LoxRun result = run(R";-](
+class Box {
+  init() {
+    this.value = nil;
+  }
+}
+
+fun join(a, b) { return a + b; }
+
+var box = Box();
+for (var i = 0; i < 20000; i = i + 1) {
+  Box();
+}
+
+box.value = join("young", "string");
+box.other = Box();
+box.other.value = join("young", "box");
+for (var i = 0; i < 20000; i = i + 1) {
+  Box();
+}
+
+print box.value;
+print box.other.value;
+);-]");
+
+  EXPECT_EQ(result.result, InterpretResult::OK);
+  EXPECT_EQ(result.output, "youngstring\nyoungbox\n");
+}
+
+TEST(Generational, closure_promoted_while_capturing_keeps_upvalues)
+{
+  // Every capture allocates an upvalue, so some minor collections run in
+  // the middle of OP_CLOSURE. They promote the closure while the upvalues it
+  // captures next are young.
+  const LoxRun result = run(R";-](
+class Node {
+  init(fn, next) {
+    this.fn = fn;
+    this.next = next;
+  }
+}
+
+fun make(n) {
+  var a = n;
+  var b = n + 1;
+  var c = n + 2;
+  var d = n + 3;
+  fun sum() { return a + b + c + d; }
+  return sum;
+}
+
+var head = nil;
+for (var i = 0; i < 20000; i = i + 1) {
+  head = Node(make(i), head);
+}
+
+var sum = 0;
+while (head != nil) {
+  sum = sum + head.fn();
+  head = head.next;
+}
+print sum == 800080000;
+);-]");
+
+  EXPECT_EQ(result.result, InterpretResult::OK);
+  EXPECT_EQ(result.output, "true\n");
+}
+
+TEST(Generational, dead_young_strings_leave_the_intern_table)
+{
+  // The same strings are made over and over. Minor collections free them in
+  // between, the next round must not find them interned any more.
+  const LoxRun result = run(R";-](
+class Garbage {}
+
+var text;
+for (var i = 0; i < 2000; i = i + 1) {
+  text = "";
+  for (var j = 0; j < 100; j = j + 1) {
+    text = text + "x";
+    Garbage();
+  }
+}
+print text;
+);-]");
+
+  EXPECT_EQ(result.result, InterpretResult::OK);
+  EXPECT_EQ(result.output, std::string(100, 'x') + "\n");
+}